@@ -4,11 +4,16 @@
 #include "serial.h"
 #include "utils.h"
 
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +40,18 @@
 #define SLEEP_TIME 20
 #define FREQ_MULT 25.0
 
+// PLL0 feedback divider limits and the range kept in the lookup table
+#define PLL_FBDIV_MIN 0xa0
+#define PLL_FBDIV_MAX 0xef
+#define PLL_TABLE_MIN_FREQ 50.0
+#define PLL_TABLE_MAX_FREQ 1000.0
+
+// frequency ramp, one PLL step per tick
+#define RAMP_STEP 6.25
+#define RAMP_STEP_MS 100
+// PLL frequency the chips come out of reset with
+#define RESET_FREQUENCY 56.25
+
 #define CLOCK_ORDER_CONTROL_0 0x80
 #define CLOCK_ORDER_CONTROL_1 0x84
 #define ORDERED_CLOCK_ENABLE 0x20
@@ -43,6 +60,12 @@
 #define FAST_UART_CONFIGURATION 0x28
 #define TICKET_MASK 0x14
 #define MISC_CONTROL 0x18
+#define PLL0_PARAMETER 0x08
+#define ERROR_COUNTER 0x4C
+#define TOTAL_HASH_COUNTER 0x8C
+
+// the hash counter ticks once per difficulty 1 share, 2^32 hashes
+#define HASH_COUNTER_LSB 4294967296.0
 
 typedef struct __attribute__((__packed__))
 {
@@ -56,24 +79,178 @@ typedef struct __attribute__((__packed__))
 
 static const char * TAG = "bm1366Module";
 
+#define BM1366_RESPONSE_SIZE 11
+#define BM1366_RX_TIMEOUT_MS 1000
+
+// baud negotiation
+#define BAUD_TEST_ROUNDS 8
+#define BAUD_TEST_TIMEOUT_MS 100
+#define BAUD_MAX_ERROR_RATE 0.02
+#define BAUD_SETTLE_MS 10
+#define BAUD_STEP_DOWN_REPEAT 3
+
+// chip enumeration, the first reply can take a while after reset, the rest follow back to back
+#define CHIP_ID_FIRST_TIMEOUT_MS 1000
+#define CHIP_ID_GAP_MS 50
+// per chip bring-up writes, the address plus five register writes
+#define CHIP_INIT_CMDS 5
+#define CHIP_INIT_BURST_SIZE (7 + CHIP_INIT_CMDS * BM1366_CMD_FRAME_SIZE)
+
+// warm restart, a chain is only resumed if every chip reads back its PLL in time
+#define WARM_STATE_MAGIC 0x13660040
+#define WARM_VERIFY_TIMEOUT_MS 100
+
 static uint8_t asic_response_buffer[SERIAL_BUF_SIZE];
-static task_result result;
 
-static float current_frequency = 56.25;
+// read in turn by BM1366_poll_registers
+static const uint8_t polled_registers[] = {TOTAL_HASH_COUNTER, ERROR_COUNTER, PLL0_PARAMETER};
 
-/// @brief
-/// @param ftdi
+// Per chip PLL override, a frequency of 0 means the chip runs at the chain frequency
+typedef struct
+{
+    float frequency;
+    // what the PLL actually produces for the requested frequency
+    float actual_frequency;
+    uint32_t pll_parameter;
+} bm1366_chip;
+
+// Driver state for one chain, each chain has its own UART (same index), reset line and job ids
+typedef struct
+{
+    gpio_num_t reset_pin;
+    // holds one batch of raw responses plus the tail of a frame split across reads
+    uint8_t rx_buffer[BM1366_RESPONSE_SIZE * BM1366_RX_BATCH_SIZE];
+    int rx_len;
+    asic_rx_stats rx_stats;
+    float current_frequency;
+    float actual_frequency;
+    int baud_rung_index;
+    int chip_count;
+    uint8_t job_id;
+    // one entry per chip, filled from register readbacks
+    asic_chip_telemetry * telemetry;
+    // PLL0 value last written to the whole chain
+    uint32_t pll_parameter;
+    bm1366_chip * chips;
+    int poll_index;
+    // frequency ramp, idle when ramp_target equals current_frequency. The timer only marks a
+    // step due and wakes ASIC_task through ramp_wake, which takes it so the UART keeps a single writer
+    esp_timer_handle_t ramp_timer;
+    volatile bool ramp_step_due;
+    SemaphoreHandle_t ramp_wake;
+    float ramp_target;
+    // current_frequency, ramp_target and the chip frequencies, set from the power management
+    // and http tasks as well
+    pthread_mutex_t ramp_lock;
+    // ticket difficulty last written to the chain
+    uint32_t ticket_difficulty;
+    // taken over from before a restart, the link doesn't need probing again
+    bool resumed;
+} bm1366_chain;
+
+typedef struct
+{
+    float frequency;
+    uint32_t pll_parameter;
+} bm1366_warm_chip;
+
+// Last known-good chain configuration. The chips keep hashing through a software restart
+// of the ESP, so this lets BM1366_init pick the chain up without reset, enumeration and ramp.
+// Chip addresses are not stored, they are always assigned in order.
+typedef struct
+{
+    uint32_t magic;
+    uint16_t chip_count;
+    uint8_t baud_rung_index;
+    float frequency;
+    uint32_t pll_parameter;
+    uint32_t ticket_difficulty;
+    bm1366_warm_chip chips[ASIC_MAX_CHIPS];
+    // crc16 over everything above
+    uint16_t crc;
+} bm1366_warm_state;
+
+// left alone by the bootloader and startup code, garbage after a power cycle
+static RTC_NOINIT_ATTR bm1366_warm_state warm_state[ASIC_MAX_CHAINS];
+
+static bm1366_chain chains[ASIC_MAX_CHAINS] = {
+    {.reset_pin = BM1366_RST_PIN, .current_frequency = RESET_FREQUENCY, .ramp_target = RESET_FREQUENCY,
+     .ramp_lock = PTHREAD_MUTEX_INITIALIZER},
+    {.reset_pin = CONFIG_ASIC_CHAIN2_RST_PIN, .current_frequency = RESET_FREQUENCY, .ramp_target = RESET_FREQUENCY,
+     .ramp_lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+#define BM1366_MAX_PACKET_SIZE (sizeof(BM1366_job) + 6)
+
+// Constant command frames with their CRC5 precomputed:
+// preamble, header, length, data, crc
+static const uint8_t chain_inactive_frame[] = {0x55, 0xAA, 0x53, 0x05, 0x00, 0x00, 0x03};
+static const uint8_t read_chip_id_frame[] = {0x55, 0xAA, 0x52, 0x05, 0x00, 0x00, 0x0A};
+static const uint8_t init_frame[] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0xA4, 0x90, 0x00, 0xFF, 0xFF, 0x1C};
+static const uint8_t init_frames[][11] = {
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0xA8, 0x00, 0x07, 0x00, 0x00, 0x03},
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0x18, 0xFF, 0x0F, 0xC1, 0x00, 0x00},
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0x3C, 0x80, 0x00, 0x8B, 0x00, 0x12},
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0x3C, 0x80, 0x00, 0x80, 0x18, 0x1F},
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0x14, 0x00, 0x00, 0x00, 0xFF, 0x08},
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0x54, 0x00, 0x00, 0x00, 0x03, 0x1D},
+    {0x55, 0xAA, 0x51, 0x09, 0x00, 0x58, 0x02, 0x11, 0x11, 0x11, 0x06}
+};
+static const uint8_t hash_counting_frame[] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0x10, 0x00, 0x00, 0x15, 0xA4, 0x0A};
+// misc_control with a baud divider of 26 (11010) for 115,749
+static const uint8_t default_baud_frame[] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0x18, 0x00, 0x00, 0x7A, 0x31, 0x15};
+// fast uart configuration for 1M
+static const uint8_t max_baud_frame[] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0x28, 0x11, 0x30, 0x02, 0x00, 0x03};
+// misc_control with a baud divider of 1 for 1,562,500 and 0 for 3,125,000
+static const uint8_t baud_1562500_frame[] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0x18, 0x00, 0x00, 0x61, 0x31, 0x1C};
+static const uint8_t baud_3125000_frame[] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0x18, 0x00, 0x00, 0x60, 0x31, 0x00};
+
+#define BM1366_CMD_FRAME_SIZE 11
+
+typedef struct
+{
+    int baud;
+    const uint8_t * frame;
+} baud_rung;
+
+// Baud rates probed by BM1366_set_max_baud, slowest first. Each rung is only kept
+// if every chip answers a register readback cleanly at that rate.
+static const baud_rung baud_ladder[] = {
+    {115749, default_baud_frame},
+    {1000000, max_baud_frame},
+    {1562500, baud_1562500_frame},
+    {3125000, baud_3125000_frame},
+};
+
+#define BM1366_JOB_FRAME_SIZE (sizeof(BM1366_job) + 6)
+// the job id is the first data byte after preamble, header and length
+#define BM1366_JOB_ID_OFFSET 4
+
+// CRC16 is linear: the crc of a frame with job id n differs from the one with job id 0
+// by the crc (zero init) of an all zero frame holding just n. One entry per job id.
+static uint16_t job_id_crc_delta[128 / 8];
+
+static void _init_job_id_crc_delta(void)
+{
+    uint8_t zeros[BM1366_JOB_FRAME_SIZE - 4] = {0};
+
+    for (int i = 0; i < sizeof(job_id_crc_delta) / sizeof(job_id_crc_delta[0]); i++) {
+        zeros[BM1366_JOB_ID_OFFSET - 2] = i * 8;
+        job_id_crc_delta[i] = crc16(zeros, sizeof(zeros));
+    }
+}
+
+/// @brief assembles a framed packet into buf
+/// @param buf destination, at least data_len + 6 bytes
 /// @param header
 /// @param data
-/// @param len
-static void _send_BM1366(uint8_t header, uint8_t * data, uint8_t data_len, bool debug)
+/// @param data_len
+/// @return length of the frame
+static uint8_t _build_BM1366(uint8_t * buf, uint8_t header, const uint8_t * data, uint8_t data_len)
 {
     packet_type_t packet_type = (header & TYPE_JOB) ? JOB_PACKET : CMD_PACKET;
     uint8_t total_length = (packet_type == JOB_PACKET) ? (data_len + 6) : (data_len + 5);
 
-    // allocate memory for buffer
-    unsigned char * buf = malloc(total_length);
-
     // add the preamble
     buf[0] = 0x55;
     buf[1] = 0xAA;
@@ -96,254 +273,830 @@ static void _send_BM1366(uint8_t header, uint8_t * data, uint8_t data_len, bool
         buf[4 + data_len] = crc5(buf + 2, data_len + 2);
     }
 
+    return total_length;
+}
+
+/// @brief
+/// @param chain
+/// @param header
+/// @param data
+/// @param len
+static void _send_BM1366(uint8_t chain, uint8_t header, uint8_t * data, uint8_t data_len, bool debug)
+{
+    // assembled on the stack, a job packet is the largest at 88 bytes
+    uint8_t buf[BM1366_MAX_PACKET_SIZE];
+    uint8_t total_length = _build_BM1366(buf, header, data, data_len);
+
     // send serial data
-    SERIAL_send(buf, total_length, debug);
+    SERIAL_send(chain, buf, total_length, debug);
+}
 
-    free(buf);
+// send a complete prebuilt frame as is
+static void _send_simple(uint8_t chain, const uint8_t * data, uint8_t total_length)
+{
+    SERIAL_send(chain, data, total_length, BM1366_SERIALTX_DEBUG);
 }
 
-static void _send_simple(uint8_t * data, uint8_t total_length)
+static void _send_chain_inactive(uint8_t chain)
 {
-    unsigned char * buf = malloc(total_length);
-    memcpy(buf, data, total_length);
-    SERIAL_send(buf, total_length, BM1366_SERIALTX_DEBUG);
+    _send_simple(chain, chain_inactive_frame, sizeof(chain_inactive_frame));
+}
+
+// Addresses every chip and writes its core and misc registers, built up front and
+// sent as a single UART burst rather than a handful of writes per chip.
+static bool _init_chips(uint8_t chain, int chip_count)
+{
+    uint8_t * burst = malloc(chip_count * CHIP_INIT_BURST_SIZE);
+    if (burst == NULL) {
+        ESP_LOGE(TAG, "Unable to allocate %d byte chip init burst", chip_count * CHIP_INIT_BURST_SIZE);
+        return false;
+    }
+
+    int len = 0;
+    for (int i = 0; i < chip_count; i++) {
+        uint8_t address[2] = {i * BM1366_CHIP_ADDRESS_INTERVAL, 0x00};
+        len += _build_BM1366(burst + len, TYPE_CMD | GROUP_SINGLE | CMD_SETADDRESS, address, sizeof(address));
+    }
+
+    for (int i = 0; i < chip_count; i++) {
+        uint8_t addr = i * BM1366_CHIP_ADDRESS_INTERVAL;
+        const uint8_t chip_init_cmds[CHIP_INIT_CMDS][6] = {
+            {addr, 0xA8, 0x00, 0x07, 0x01, 0xF0},
+            {addr, 0x18, 0xF0, 0x00, 0xC1, 0x00},
+            {addr, 0x3C, 0x80, 0x00, 0x8b, 0x00},
+            {addr, 0x3C, 0x80, 0x00, 0x80, 0x18},
+            {addr, 0x3C, 0x80, 0x00, 0x82, 0xAA}
+        };
 
-    free(buf);
+        for (int j = 0; j < CHIP_INIT_CMDS; j++) {
+            len += _build_BM1366(burst + len, TYPE_CMD | GROUP_SINGLE | CMD_WRITE, chip_init_cmds[j], 6);
+        }
+    }
+
+    SERIAL_send(chain, burst, len, BM1366_SERIALTX_DEBUG);
+    free(burst);
+    return true;
 }
 
-static void _send_chain_inactive(void)
+// Returns the offset of the next AA 55 preamble in buf[from, len).
+// When there is none, a trailing AA is kept since it may be the start of the next frame.
+static int _find_preamble(const uint8_t * buf, int from, int len)
 {
+    for (int i = from; i < len - 1; i++) {
+        if (buf[i] == 0xAA && buf[i + 1] == 0x55) {
+            return i;
+        }
+    }
 
-    unsigned char read_address[2] = {0x00, 0x00};
-    // send serial data
-    _send_BM1366((TYPE_CMD | GROUP_ALL | CMD_INACTIVE), read_address, 2, BM1366_SERIALTX_DEBUG);
+    return (len > from && buf[len - 1] == 0xAA) ? len - 1 : len;
 }
 
-static void _set_chip_address(uint8_t chipAddr)
+static uint16_t reverse_uint16(uint16_t num)
 {
+    return (num >> 8) | (num << 8);
+}
 
-    unsigned char read_address[2] = {chipAddr, 0x00};
-    // send serial data
-    _send_BM1366((TYPE_CMD | GROUP_SINGLE | CMD_SETADDRESS), read_address, 2, BM1366_SERIALTX_DEBUG);
+static uint32_t reverse_uint32(uint32_t val)
+{
+    return ((val >> 24) & 0xff) |      // Move byte 3 to byte 0
+           ((val << 8) & 0xff0000) |   // Move byte 1 to byte 2
+           ((val >> 8) & 0xff00) |     // Move byte 2 to byte 1
+           ((val << 24) & 0xff000000); // Move byte 0 to byte 3
 }
 
 // reset the BM1366 via the RTS line
-static void _reset(void)
+static void _reset(uint8_t chain)
 {
-    gpio_set_level(BM1366_RST_PIN, 0);
+    gpio_set_level(chains[chain].reset_pin, 0);
 
     // delay for 100ms
     vTaskDelay(100 / portTICK_PERIOD_MS);
 
     // set the gpio pin high
-    gpio_set_level(BM1366_RST_PIN, 1);
+    gpio_set_level(chains[chain].reset_pin, 1);
 
     // delay for 100ms
     vTaskDelay(100 / portTICK_PERIOD_MS);
 }
 
-bool BM1366_send_hash_frequency(float target_freq) {
-    float max_diff = 0.001;
-    uint8_t freqbuf[6] = {0x00, 0x08, 0x40, 0xA0, 0x02, 0x41};
-    uint8_t postdiv_min = 255;
-    uint8_t postdiv2_min = 255;
-    float best_freq = 0;
-    uint8_t best_refdiv = 0, best_fbdiv = 0, best_postdiv1 = 0, best_postdiv2 = 0;
-    bool found = false;
-
-    for (uint8_t refdiv = 2; refdiv > 0; refdiv--) {
-        for (uint8_t postdiv1 = 7; postdiv1 > 0; postdiv1--) {
-            for (uint8_t postdiv2 = 7; postdiv2 > 0; postdiv2--) {
-                uint16_t fb_divider = round(target_freq / 25.0 * (refdiv * postdiv2 * postdiv1));
-                float newf = 25.0 * fb_divider / (refdiv * postdiv2 * postdiv1);
-
-                if (fb_divider >= 0xa0 && fb_divider <= 0xef &&
-                    fabs(target_freq - newf) < max_diff &&
-                    postdiv1 >= postdiv2 &&
-                    postdiv1 * postdiv2 < postdiv_min &&
-                    postdiv2 <= postdiv2_min) {
-
-                    postdiv2_min = postdiv2;
-                    postdiv_min = postdiv1 * postdiv2;
-                    best_freq = newf;
-                    best_refdiv = refdiv;
-                    best_fbdiv = fb_divider;
-                    best_postdiv1 = postdiv1;
-                    best_postdiv2 = postdiv2;
-                    found = true;
+static uint16_t _warm_state_crc(const bm1366_warm_state * state)
+{
+    return crc16((const unsigned char *) state, offsetof(bm1366_warm_state, crc));
+}
+
+static void _invalidate_warm_state(uint8_t chain)
+{
+    warm_state[chain].magic = 0;
+}
+
+// Records the chain as it is now, called after every change to the chain wide settings with the
+// chain's ramp_lock held
+static void _save_warm_state(uint8_t chain)
+{
+    bm1366_chain * c = &chains[chain];
+    bm1366_warm_state * state = &warm_state[chain];
+
+    if (c->chip_count == 0 || c->chip_count > ASIC_MAX_CHIPS || c->chips == NULL) {
+        _invalidate_warm_state(chain);
+        return;
+    }
+
+    state->magic = WARM_STATE_MAGIC;
+    state->chip_count = c->chip_count;
+    state->baud_rung_index = c->baud_rung_index;
+    state->frequency = c->current_frequency;
+    state->pll_parameter = c->pll_parameter;
+    state->ticket_difficulty = c->ticket_difficulty;
+    for (int i = 0; i < c->chip_count; i++) {
+        state->chips[i].frequency = c->chips[i].frequency;
+        state->chips[i].pll_parameter = c->chips[i].pll_parameter;
+    }
+    state->crc = _warm_state_crc(state);
+}
+
+// Every usable PLL0 divider setting in the hash clock range, sorted by frequency and
+// built once at boot. Entries pack fbdiv | (refdiv - 1) << 8 | (postdiv1 - 1) << 9 | (postdiv2 - 1) << 12,
+// the frequency is 25 MHz * fbdiv / (refdiv * postdiv1 * postdiv2).
+static uint16_t * pll_table = NULL;
+static int pll_table_len = 0;
+
+#define PLL_FBDIV(e) ((e) & 0xff)
+#define PLL_REFDIV(e) ((((e) >> 8) & 0x1) + 1)
+#define PLL_POSTDIV1(e) ((((e) >> 9) & 0x7) + 1)
+#define PLL_POSTDIV2(e) ((((e) >> 12) & 0x7) + 1)
+#define PLL_DIVISOR(e) (PLL_REFDIV(e) * PLL_POSTDIV1(e) * PLL_POSTDIV2(e))
+
+static float _pll_frequency(uint16_t entry)
+{
+    return FREQ_MULT * PLL_FBDIV(entry) / PLL_DIVISOR(entry);
+}
+
+// orders by frequency, compared exactly as fractions, then prefers the smallest post dividers
+static int _pll_compare(const void * a, const void * b)
+{
+    uint16_t x = *(const uint16_t *) a;
+    uint16_t y = *(const uint16_t *) b;
+
+    int lhs = PLL_FBDIV(x) * PLL_DIVISOR(y);
+    int rhs = PLL_FBDIV(y) * PLL_DIVISOR(x);
+    if (lhs != rhs) {
+        return lhs - rhs;
+    }
+    int postdiv = PLL_POSTDIV1(x) * PLL_POSTDIV2(x) - PLL_POSTDIV1(y) * PLL_POSTDIV2(y);
+    if (postdiv != 0) {
+        return postdiv;
+    }
+    if (PLL_POSTDIV2(x) != PLL_POSTDIV2(y)) {
+        return PLL_POSTDIV2(x) - PLL_POSTDIV2(y);
+    }
+    return PLL_REFDIV(y) - PLL_REFDIV(x);
+}
+
+static void _init_pll_table(void)
+{
+    if (pll_table != NULL) {
+        return;
+    }
+
+    int max_entries = 2 * 7 * 7 * (PLL_FBDIV_MAX - PLL_FBDIV_MIN + 1);
+    uint16_t * entries = malloc(max_entries * sizeof(uint16_t));
+    if (entries == NULL) {
+        ESP_LOGE(TAG, "No memory for the PLL table");
+        return;
+    }
+
+    int count = 0;
+    for (int refdiv = 1; refdiv <= 2; refdiv++) {
+        for (int postdiv1 = 1; postdiv1 <= 7; postdiv1++) {
+            for (int postdiv2 = 1; postdiv2 <= postdiv1; postdiv2++) {
+                for (int fbdiv = PLL_FBDIV_MIN; fbdiv <= PLL_FBDIV_MAX; fbdiv++) {
+                    uint16_t entry = fbdiv | (refdiv - 1) << 8 | (postdiv1 - 1) << 9 | (postdiv2 - 1) << 12;
+                    float freq = _pll_frequency(entry);
+                    if (freq >= PLL_TABLE_MIN_FREQ && freq <= PLL_TABLE_MAX_FREQ) {
+                        entries[count++] = entry;
+                    }
                 }
             }
         }
     }
 
-    if (!found) {
-        ESP_LOGE(TAG, "Didn't find PLL settings for target frequency %.2f", target_freq);
+    qsort(entries, count, sizeof(uint16_t), _pll_compare);
+
+    // keep the preferred setting for each frequency
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || PLL_FBDIV(entries[i]) * PLL_DIVISOR(entries[unique - 1]) !=
+                               PLL_FBDIV(entries[unique - 1]) * PLL_DIVISOR(entries[i])) {
+            entries[unique++] = entries[i];
+        }
+    }
+
+    uint16_t * table = realloc(entries, unique * sizeof(uint16_t));
+    pll_table = table != NULL ? table : entries;
+    pll_table_len = unique;
+    ESP_LOGI(TAG, "PLL table: %d settings from %.2f to %.2f MHz", unique, _pll_frequency(pll_table[0]),
+             _pll_frequency(pll_table[unique - 1]));
+}
+
+// Looks up the PLL0 setting closest to target_freq and writes the 4 byte register value to pll
+static bool _pll_for_frequency(float target_freq, uint8_t * pll, float * actual_freq) {
+    if (pll_table_len == 0) {
+        ESP_LOGE(TAG, "PLL table not available");
+        return false;
+    }
+
+    // first entry at or above the target
+    int lo = 0;
+    int hi = pll_table_len - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_pll_frequency(pll_table[mid]) < target_freq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && target_freq - _pll_frequency(pll_table[lo - 1]) < _pll_frequency(pll_table[lo]) - target_freq) {
+        lo--;
+    }
+
+    uint16_t entry = pll_table[lo];
+    pll[0] = (PLL_FBDIV(entry) * 25 / PLL_REFDIV(entry) >= 2400) ? 0x50 : 0x40;
+    pll[1] = PLL_FBDIV(entry);
+    pll[2] = PLL_REFDIV(entry);
+    pll[3] = (((PLL_POSTDIV1(entry) - 1) & 0xf) << 4) | ((PLL_POSTDIV2(entry) - 1) & 0xf);
+    *actual_freq = _pll_frequency(entry);
+    return true;
+}
+
+static uint32_t _pll_value(const uint8_t * pll)
+{
+    return (pll[0] << 24) | (pll[1] << 16) | (pll[2] << 8) | pll[3];
+}
+
+static void _send_chip_pll(uint8_t chain, uint16_t chip, uint32_t pll_parameter)
+{
+    uint8_t freqbuf[6] = {chip * BM1366_CHIP_ADDRESS_INTERVAL, PLL0_PARAMETER, pll_parameter >> 24, pll_parameter >> 16,
+                          pll_parameter >> 8, pll_parameter};
+    _send_BM1366(chain, TYPE_CMD | GROUP_SINGLE | CMD_WRITE, freqbuf, sizeof(freqbuf), BM1366_SERIALTX_DEBUG);
+}
+
+// Called with the chain's ramp_lock held
+static bool _send_hash_frequency(uint8_t chain, float target_freq) {
+    bm1366_chain * c = &chains[chain];
+    uint8_t freqbuf[6] = {0x00, PLL0_PARAMETER};
+    float best_freq;
+
+    if (!_pll_for_frequency(target_freq, freqbuf + 2, &best_freq)) {
         return false;
     }
 
-    freqbuf[2] = (best_fbdiv * 25 / best_refdiv >= 2400) ? 0x50 : 0x40;
-    freqbuf[3] = best_fbdiv;
-    freqbuf[4] = best_refdiv;
-    freqbuf[5] = (((best_postdiv1 - 1) & 0xf) << 4) | ((best_postdiv2 - 1) & 0xf);
+    _send_BM1366(chain, TYPE_CMD | GROUP_ALL | CMD_WRITE, freqbuf, sizeof(freqbuf), BM1366_SERIALTX_DEBUG);
 
-    _send_BM1366(TYPE_CMD | GROUP_ALL | CMD_WRITE, freqbuf, sizeof(freqbuf), BM1366_SERIALTX_DEBUG);
+    ESP_LOGI(TAG, "Setting chain %u Frequency to %.2fMHz (%.2f)", chain, target_freq, best_freq);
+    c->current_frequency = target_freq;
+    c->actual_frequency = best_freq;
+    c->pll_parameter = _pll_value(freqbuf + 2);
 
-    ESP_LOGI(TAG, "Setting Frequency to %.2fMHz (%.2f)", target_freq, best_freq);
-    current_frequency = target_freq;
+    // a broadcast write lands on every chip, put the per chip settings back on top
+    for (int i = 0; c->chips != NULL && i < c->chip_count; i++) {
+        if (c->chips[i].frequency != 0) {
+            _send_chip_pll(chain, i, c->chips[i].pll_parameter);
+        }
+    }
+    _save_warm_state(chain);
     return true;
 }
 
-bool do_frequency_transition(float target_frequency) {
-    float step = 6.25;
-    float current = current_frequency;
-    float target = target_frequency;
-
-    // Determine the direction of the transition
-    float direction = (target > current) ? step : -step;
-
-    // Align to the next 6.25-dividable value if not already on one
-    if (fmod(current, step) != 0) {
-        // If ramping up, round up to the next multiple; if ramping down, round down
-        float next_dividable;
-        if (direction > 0) {
-            next_dividable = ceil(current / step) * step;
-        } else {
-            next_dividable = floor(current / step) * step;
+bool BM1366_set_chip_frequency(uint8_t chain, uint16_t chip, float target_freq)
+{
+    bm1366_chain * c = &chains[chain];
+    if (c->chips == NULL || chip >= c->chip_count) {
+        return false;
+    }
+
+    uint8_t pll[4];
+    float best_freq;
+
+    if (!_pll_for_frequency(target_freq, pll, &best_freq)) {
+        return false;
+    }
+
+    _send_chip_pll(chain, chip, _pll_value(pll));
+
+    ESP_LOGI(TAG, "Setting chain %u chip %u Frequency to %.2fMHz (%.2f)", chain, chip, target_freq, best_freq);
+    pthread_mutex_lock(&c->ramp_lock);
+    c->chips[chip].frequency = target_freq;
+    c->chips[chip].actual_frequency = best_freq;
+    c->chips[chip].pll_parameter = _pll_value(pll);
+    _save_warm_state(chain);
+    pthread_mutex_unlock(&c->ramp_lock);
+    return true;
+}
+
+// Frequency set on the chip alone, 0 while it follows the chain
+float BM1366_get_chip_frequency(uint8_t chain, uint16_t chip)
+{
+    bm1366_chain * c = &chains[chain];
+    if (c->chips == NULL || chip >= c->chip_count) {
+        return 0;
+    }
+
+    return c->chips[chip].frequency;
+}
+
+// Frequency the chip's PLL really runs at, chips without an override or out of range give the chain's
+float BM1366_get_actual_frequency(uint8_t chain, uint16_t chip)
+{
+    bm1366_chain * c = &chains[chain];
+    if (c->chips != NULL && chip < c->chip_count && c->chips[chip].frequency != 0) {
+        return c->chips[chip].actual_frequency;
+    }
+
+    return c->actual_frequency;
+}
+
+// chains that made it through init
+static bool _chain_active(uint8_t chain)
+{
+    return chains[chain].chip_count > 0;
+}
+
+// Writes the frequency straight to every chain, only from the task that owns the UARTs
+bool BM1366_send_hash_frequency(float target_freq)
+{
+    bool ok = true;
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        if (_chain_active(chain)) {
+            pthread_mutex_lock(&chains[chain].ramp_lock);
+            // a direct write replaces whatever ramp was running
+            chains[chain].ramp_target = target_freq;
+            ok &= _send_hash_frequency(chain, target_freq);
+            pthread_mutex_unlock(&chains[chain].ramp_lock);
         }
-        current = next_dividable;
-        BM1366_send_hash_frequency(current);
-        vTaskDelay(100 / portTICK_PERIOD_MS);
     }
+    return ok;
+}
+
+// Runs in the esp_timer task for the life of the chain. While a ramp runs it marks the next step
+// due and wakes the task that takes it, an unlocked read is fine for that
+static void _ramp_tick(void * arg)
+{
+    uint8_t chain = (uintptr_t) arg;
+    bm1366_chain * c = &chains[chain];
+    if (c->current_frequency == c->ramp_target) {
+        return;
+    }
+    c->ramp_step_due = true;
+    SemaphoreHandle_t wake = c->ramp_wake;
+    if (wake != NULL) {
+        xSemaphoreGive(wake);
+    }
+}
 
-    // Ramp in the appropriate direction
-    while ((direction > 0 && current < target) || (direction < 0 && current > target)) {
-        float next_step = fmin(fabs(direction), fabs(target - current));
-        current += direction > 0 ? next_step : -next_step;
-        BM1366_send_hash_frequency(current);
-        vTaskDelay(100 / portTICK_PERIOD_MS);
+/// @brief takes one ramp step if the timer has marked one due, from the task that owns the UART.
+/// The ramp is idle whenever the current frequency equals the target, so retargeting or
+/// cancelling is just a write of ramp_target
+/// @param wake given every RAMP_STEP_MS while a ramp runs, NULL to keep the last one
+/// @return whether a step was due
+bool BM1366_run_frequency_ramp(uint8_t chain, SemaphoreHandle_t wake)
+{
+    bm1366_chain * c = &chains[chain];
+    if (wake != NULL) {
+        c->ramp_wake = wake;
     }
-    // Set the exact target frequency to finalize
-    BM1366_send_hash_frequency(target);
+    if (!c->ramp_step_due) {
+        return false;
+    }
+    c->ramp_step_due = false;
+
+    pthread_mutex_lock(&c->ramp_lock);
+    float current = c->current_frequency;
+    float target = c->ramp_target;
+    if (current == target) {
+        pthread_mutex_unlock(&c->ramp_lock);
+        return true;
+    }
+
+    // onto the 6.25 MHz grid first, then a step at a time, never past the target
+    float next;
+    if (target > current) {
+        next = floor(current / RAMP_STEP) * RAMP_STEP + RAMP_STEP;
+        next = fmin(next, target);
+    } else {
+        next = ceil(current / RAMP_STEP) * RAMP_STEP - RAMP_STEP;
+        next = fmax(next, target);
+    }
+
+    if (!_send_hash_frequency(chain, next)) {
+        ESP_LOGE(TAG, "Chain %u ramp stopped at %.2f MHz", chain, current);
+        c->ramp_target = current;
+    } else if (next == target) {
+        ESP_LOGI(TAG, "Chain %u reached %.2f MHz", chain, target);
+    }
+    pthread_mutex_unlock(&c->ramp_lock);
     return true;
 }
 
+static bool _start_ramp_timer(uint8_t chain)
+{
+    bm1366_chain * c = &chains[chain];
+    if (c->ramp_timer != NULL) {
+        return true;
+    }
+
+    const esp_timer_create_args_t args = {
+        .callback = _ramp_tick,
+        .arg = (void *) (uintptr_t) chain,
+        .name = "bm1366 ramp",
+    };
+    if (esp_timer_create(&args, &c->ramp_timer) != ESP_OK ||
+        esp_timer_start_periodic(c->ramp_timer, RAMP_STEP_MS * 1000) != ESP_OK) {
+        ESP_LOGE(TAG, "Chain %u: can't start the frequency ramp timer", chain);
+        return false;
+    }
+    return true;
+}
+
+// Starts or retargets the ramp on every chain and returns right away, progress is
+// available from BM1366_get_frequency_ramp
+bool do_frequency_transition(float target_frequency) {
+    bool ok = true;
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        if (_chain_active(chain)) {
+            pthread_mutex_lock(&chains[chain].ramp_lock);
+            ESP_LOGI(TAG, "Ramping chain %u from %.2f MHz to %.2f MHz", chain, chains[chain].current_frequency, target_frequency);
+            chains[chain].ramp_target = target_frequency;
+            pthread_mutex_unlock(&chains[chain].ramp_lock);
+            ok &= chains[chain].ramp_timer != NULL;
+        }
+    }
+    return ok;
+}
+
+// Stops every ramp at the frequency it has reached
+void BM1366_cancel_frequency_ramp(void)
+{
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        pthread_mutex_lock(&chains[chain].ramp_lock);
+        if (chains[chain].ramp_target != chains[chain].current_frequency) {
+            ESP_LOGI(TAG, "Chain %u ramp cancelled at %.2f MHz", chain, chains[chain].current_frequency);
+        }
+        chains[chain].ramp_target = chains[chain].current_frequency;
+        pthread_mutex_unlock(&chains[chain].ramp_lock);
+    }
+}
+
+void BM1366_get_frequency_ramp(uint8_t chain, asic_frequency_ramp * ramp)
+{
+    pthread_mutex_lock(&chains[chain].ramp_lock);
+    ramp->current = chains[chain].current_frequency;
+    ramp->target = chains[chain].ramp_target;
+    pthread_mutex_unlock(&chains[chain].ramp_lock);
+    ramp->active = ramp->current != ramp->target;
+}
+
 // Add this new function to allow external calls for frequency changes
 bool BM1366_set_frequency(float target_freq) {
     return do_frequency_transition(target_freq);
 }
 
-static int count_asic_chips(void) {
-    _send_BM1366(TYPE_CMD | GROUP_ALL | CMD_READ, (uint8_t[]){0x00, 0x00}, 2, false);
+// A saved configuration is only trusted after a software restart, and only when it
+// describes the chain that is expected now
+static bool _warm_state_valid(uint8_t chain, uint16_t asic_count)
+{
+    const bm1366_warm_state * state = &warm_state[chain];
+
+    return esp_reset_reason() == ESP_RST_SW &&
+           state->magic == WARM_STATE_MAGIC &&
+           state->crc == _warm_state_crc(state) &&
+           state->chip_count == asic_count &&
+           state->baud_rung_index < sizeof(baud_ladder) / sizeof(baud_ladder[0]);
+}
+
+// Reads PLL0 back from every chip at the saved baud. The chips are still hashing the last
+// job, nonces are skipped. Every chip has to answer from its own address with the PLL value
+// it was last given, a chain that was reset or power cycled answers at 115200 from address 0.
+static bool _verify_warm_chain(uint8_t chain)
+{
+    const bm1366_warm_state * state = &warm_state[chain];
+    uint8_t read_reg[2] = {0x00, PLL0_PARAMETER};
+    uint8_t buf[BM1366_RESPONSE_SIZE * 8];
+    uint64_t seen = 0;
+    int replies = 0;
+    int len = 0;
+
+    SERIAL_set_baud(chain, baud_ladder[state->baud_rung_index].baud);
+    SERIAL_clear_buffer(chain);
+    _send_BM1366(chain, TYPE_CMD | GROUP_ALL | CMD_READ, read_reg, sizeof(read_reg), BM1366_SERIALTX_DEBUG);
+
+    while (replies < state->chip_count) {
+        int received = SERIAL_wait_rx(chain, buf + len, sizeof(buf) - len, WARM_VERIFY_TIMEOUT_MS);
+        if (received <= 0) {
+            return false;
+        }
+        len += received;
+
+        int pos = 0;
+        while (len - pos >= BM1366_RESPONSE_SIZE) {
+            if (buf[pos] != 0xAA || buf[pos + 1] != 0x55) {
+                pos = _find_preamble(buf, pos + 1, len);
+                continue;
+            }
+
+            asic_result frame;
+            memcpy(&frame, buf + pos, BM1366_RESPONSE_SIZE);
+            pos += BM1366_RESPONSE_SIZE;
+
+            if (crc5((uint8_t *) &frame + 2, BM1366_RESPONSE_SIZE - 2) != 0 || (frame.crc & RESPONSE_JOB)) {
+                continue;
+            }
+
+            int chip = frame.midstate_num / BM1366_CHIP_ADDRESS_INTERVAL;
+            if (frame.job_id != PLL0_PARAMETER || frame.midstate_num % BM1366_CHIP_ADDRESS_INTERVAL != 0 ||
+                chip >= state->chip_count || (seen & (1ULL << chip))) {
+                return false;
+            }
+
+            uint32_t expected = state->chips[chip].frequency != 0 ? state->chips[chip].pll_parameter : state->pll_parameter;
+            if (reverse_uint32(frame.nonce) != expected) {
+                return false;
+            }
+
+            seen |= 1ULL << chip;
+            replies++;
+        }
+        len -= pos;
+        memmove(buf, buf + pos, len);
+    }
+
+    return true;
+}
+
+// Takes the driver state over from the saved configuration, the chips already run it
+static void _resume_warm_chain(uint8_t chain)
+{
+    bm1366_chain * c = &chains[chain];
+    const bm1366_warm_state * state = &warm_state[chain];
+    uint8_t pll[4];
+
+    c->baud_rung_index = state->baud_rung_index;
+    c->current_frequency = state->frequency;
+    c->ramp_target = state->frequency;
+    c->pll_parameter = state->pll_parameter;
+    _pll_for_frequency(state->frequency, pll, &c->actual_frequency);
+
+    for (int i = 0; i < state->chip_count; i++) {
+        c->chips[i].frequency = state->chips[i].frequency;
+        c->chips[i].pll_parameter = state->chips[i].pll_parameter;
+        if (state->chips[i].frequency != 0) {
+            _pll_for_frequency(state->chips[i].frequency, pll, &c->chips[i].actual_frequency);
+        }
+    }
+    c->resumed = true;
+}
+
+// Counts the chip id replies. Stops once the expected number has answered, or when the
+// line goes quiet for CHIP_ID_GAP_MS after the last reply.
+static int count_asic_chips(uint8_t chain, uint16_t expected) {
+    _send_simple(chain, read_chip_id_frame, sizeof(read_chip_id_frame));
 
     int chip_counter = 0;
-    while (true) {
-        if (SERIAL_rx(asic_response_buffer, 11, 5000) <= 0) {
+    while (chip_counter < expected) {
+        uint16_t timeout = chip_counter == 0 ? CHIP_ID_FIRST_TIMEOUT_MS : CHIP_ID_GAP_MS;
+        if (SERIAL_rx(chain, asic_response_buffer, 11, timeout) <= 0) {
             break;
         }
-        
+
         if (memcmp(asic_response_buffer, "\xaa\x55\x13\x66\x00\x00", 6) == 0) {
             chip_counter++;
         }
     }
 
-    _send_chain_inactive();
+    _send_chain_inactive(chain);
     return chip_counter;
 }
 
-static void do_frequency_ramp_up(float target_frequency) {
-    ESP_LOGI(TAG, "Ramping up frequency from %.2f MHz to %.2f MHz", current_frequency, target_frequency);
-    do_frequency_transition(target_frequency);
-}
-
-uint8_t BM1366_init(uint64_t frequency, uint16_t asic_count)
+uint8_t BM1366_init(uint8_t chain, uint64_t frequency, uint16_t asic_count)
 {
-    ESP_LOGI(TAG, "Initializing BM1366");
+    ESP_LOGI(TAG, "Initializing BM1366 chain %u", chain);
 
     memset(asic_response_buffer, 0, SERIAL_BUF_SIZE);
 
-    esp_rom_gpio_pad_select_gpio(BM1366_RST_PIN);
-    gpio_set_direction(BM1366_RST_PIN, GPIO_MODE_OUTPUT);
-
-    // reset the bm1366
-    _reset();
+    _init_job_id_crc_delta();
+    _init_pll_table();
+
+    pthread_mutex_lock(&chains[chain].ramp_lock);
+    chains[chain].chip_count = 0;
+    chains[chain].current_frequency = RESET_FREQUENCY;
+    chains[chain].ramp_target = RESET_FREQUENCY;
+    pthread_mutex_unlock(&chains[chain].ramp_lock);
+    chains[chain].baud_rung_index = 0;
+    chains[chain].rx_len = 0;
+    chains[chain].resumed = false;
+
+    // drive the reset line high before it becomes an output so a running chain isn't reset
+    gpio_set_level(chains[chain].reset_pin, 1);
+    esp_rom_gpio_pad_select_gpio(chains[chain].reset_pin);
+    gpio_set_direction(chains[chain].reset_pin, GPIO_MODE_OUTPUT);
+
+    int64_t start = esp_timer_get_time();
+    bool warm = _warm_state_valid(chain, asic_count) && _verify_warm_chain(chain);
+    int chip_counter = asic_count;
+
+    if (!warm) {
+        _invalidate_warm_state(chain);
+        SERIAL_set_baud(chain, 115200);
+        SERIAL_clear_buffer(chain);
+
+        // reset the bm1366
+        _reset(chain);
+
+        for (int i = 0; i < 4; i++) {
+            _send_simple(chain, init_frame, sizeof(init_frame));
+        }
 
-    uint8_t init_cmd[] = {0x00, 0xA4, 0x90, 0x00, 0xFF, 0xFF};
-    for (int i = 0; i < 4; i++) {
-        _send_BM1366(TYPE_CMD | GROUP_ALL | CMD_WRITE, init_cmd, 6, false);
+        chip_counter = count_asic_chips(chain, asic_count);
     }
 
-    int chip_counter = count_asic_chips();
-
     if (chip_counter != asic_count) {
         ESP_LOGE(TAG, "Chip count mismatch. Expected: %d, Actual: %d", asic_count, chip_counter);
         return 0;
     }
 
-    uint8_t init_cmds[][6] = {
-        {0x00, 0xA8, 0x00, 0x07, 0x00, 0x00},
-        {0x00, 0x18, 0xFF, 0x0F, 0xC1, 0x00},
-        {0x00, 0x3C, 0x80, 0x00, 0x8b, 0x00},
-        {0x00, 0x3C, 0x80, 0x00, 0x80, 0x18},
-        {0x00, 0x14, 0x00, 0x00, 0x00, 0xFF},
-        {0x00, 0x54, 0x00, 0x00, 0x00, 0x03},
-        {0x00, 0x58, 0x02, 0x11, 0x11, 0x11}
-    };
-
-    for (int i = 0; i < sizeof(init_cmds) / sizeof(init_cmds[0]); i++) {
-        _send_BM1366(TYPE_CMD | GROUP_ALL | CMD_WRITE, init_cmds[i], 6, false);
-    }
-
-    for (int i = 0; i < chip_counter; i++) {
-        _set_chip_address(i * 2);
-    }
-
-    for (int i = 0; i < chip_counter; i++) {
-        uint8_t chip_init_cmds[][6] = {
-            {i*2, 0xA8, 0x00, 0x07, 0x01, 0xF0},
-            {i*2, 0x18, 0xF0, 0x00, 0xC1, 0x00},
-            {i*2, 0x3C, 0x80, 0x00, 0x8b, 0x00},
-            {i*2, 0x3C, 0x80, 0x00, 0x80, 0x18},
-            {i*2, 0x3C, 0x80, 0x00, 0x82, 0xAA}
-        };
+    free(chains[chain].telemetry);
+    chains[chain].telemetry = calloc(chip_counter, sizeof(asic_chip_telemetry));
+    free(chains[chain].chips);
+    chains[chain].chips = calloc(chip_counter, sizeof(bm1366_chip));
+    chains[chain].poll_index = 0;
+
+    if (warm) {
+        pthread_mutex_lock(&chains[chain].ramp_lock);
+        _resume_warm_chain(chain);
+        pthread_mutex_unlock(&chains[chain].ramp_lock);
+        // rewritten as is, the chips already run with it
+        BM1366_set_job_difficulty_mask(chain, warm_state[chain].ticket_difficulty);
+        ESP_LOGI(TAG, "Resumed chain %u after restart: %i chip(s) at %d baud and %.2f MHz, verified in %lld ms", chain,
+                 chip_counter, baud_ladder[chains[chain].baud_rung_index].baud, chains[chain].current_frequency,
+                 (esp_timer_get_time() - start) / 1000);
+    } else {
+        for (int i = 0; i < sizeof(init_frames) / sizeof(init_frames[0]); i++) {
+            _send_simple(chain, init_frames[i], sizeof(init_frames[i]));
+        }
 
-        for (int j = 0; j < sizeof(chip_init_cmds) / sizeof(chip_init_cmds[0]); j++) {
-            _send_BM1366(TYPE_CMD | GROUP_SINGLE | CMD_WRITE, chip_init_cmds[j], 6, false);
+        if (!_init_chips(chain, chip_counter)) {
+            return 0;
         }
-        vTaskDelay(pdMS_TO_TICKS(500));
-    }
 
-    BM1366_set_job_difficulty_mask(BM1366_INITIAL_DIFFICULTY);
+        BM1366_set_job_difficulty_mask(chain, BM1366_INITIAL_DIFFICULTY);
 
-    do_frequency_ramp_up((float)frequency);
+        _send_simple(chain, hash_counting_frame, sizeof(hash_counting_frame));
+        _send_simple(chain, init_frame, sizeof(init_frame));
 
-    _send_BM1366(TYPE_CMD | GROUP_ALL | CMD_WRITE, (uint8_t[]){0x00, 0x10, 0x00, 0x00, 0x15, 0xa4}, 6, false);
-    _send_BM1366(TYPE_CMD | GROUP_ALL | CMD_WRITE, (uint8_t[]){0x00, 0xA4, 0x90, 0x00, 0xFF, 0xFF}, 6, false);
-    
-    ESP_LOGI(TAG, "%i chip(s) detected on the chain, expected %i", chip_counter, asic_count);
+        ESP_LOGI(TAG, "%i chip(s) detected on chain %u, expected %i, enumerated in %lld ms", chip_counter, chain, asic_count,
+                 (esp_timer_get_time() - start) / 1000);
+    }
+    pthread_mutex_lock(&chains[chain].ramp_lock);
+    chains[chain].chip_count = chip_counter;
+    _save_warm_state(chain);
+
+    // mining starts at the current frequency, ASIC_task walks it up to the target between jobs
+    ESP_LOGI(TAG, "Ramping chain %u from %.2f MHz to %.2f MHz", chain, chains[chain].current_frequency, (float) frequency);
+    chains[chain].ramp_target = frequency;
+    pthread_mutex_unlock(&chains[chain].ramp_lock);
+    _start_ramp_timer(chain);
     return chip_counter;
 }
 
 // Baud formula = 25M/((denominator+1)*8)
 // The denominator is 5 bits found in the misc_control (bits 9-13)
-int BM1366_set_default_baud(void)
+int BM1366_set_default_baud(uint8_t chain)
 {
     // default divider of 26 (11010) for 115,749
-    unsigned char baudrate[9] = {0x00, MISC_CONTROL, 0x00, 0x00, 0b01111010, 0b00110001}; // baudrate - misc_control
-    _send_BM1366((TYPE_CMD | GROUP_ALL | CMD_WRITE), baudrate, 6, BM1366_SERIALTX_DEBUG);
+    _send_simple(chain, default_baud_frame, sizeof(default_baud_frame));
     return 115749;
 }
 
-int BM1366_set_max_baud(void)
+// Moves the chain and then the host to a rung of the baud ladder.
+// Repeat the command when stepping down, the link at the current rate may be unreliable.
+static void _switch_baud(uint8_t chain, int index)
 {
-    // divider of 0 for 3,125,000
-    ESP_LOGI(TAG, "Setting max baud of 1000000");
+    // the chips may not follow, don't resume from a half switched link
+    _invalidate_warm_state(chain);
+
+    int repeat = index < chains[chain].baud_rung_index ? BAUD_STEP_DOWN_REPEAT : 1;
+    for (int i = 0; i < repeat; i++) {
+        _send_simple(chain, baud_ladder[index].frame, BM1366_CMD_FRAME_SIZE);
+    }
+
+    SERIAL_set_baud(chain, baud_ladder[index].baud);
+    vTaskDelay(BAUD_SETTLE_MS / portTICK_PERIOD_MS);
+    SERIAL_clear_buffer(chain);
 
-    unsigned char init8[11] = {0x55, 0xAA, 0x51, 0x09, 0x00, 0x28, 0x11, 0x30, 0x02, 0x00, 0x03};
-    _send_simple(init8, 11);
-    return 1000000;
+    chains[chain].baud_rung_index = index;
 }
 
-void BM1366_set_job_difficulty_mask(int difficulty)
+// Reads the chip id register of every chip a few times and checks the replies.
+// Returns the fraction of expected replies that were missing or failed the CRC.
+static float _test_link(uint8_t chain)
+{
+    int chip_count = chains[chain].chip_count;
+    int expected = chip_count * BAUD_TEST_ROUNDS;
+    int valid = 0;
+
+    if (expected == 0) {
+        return 1.0;
+    }
+
+    for (int round = 0; round < BAUD_TEST_ROUNDS; round++) {
+        uint8_t buf[BM1366_RESPONSE_SIZE * 4];
+        int len = 0;
+        int replies = 0;
+
+        _send_simple(chain, read_chip_id_frame, sizeof(read_chip_id_frame));
+
+        while (replies < chip_count) {
+            int received = SERIAL_wait_rx(chain, buf + len, sizeof(buf) - len, BAUD_TEST_TIMEOUT_MS);
+            if (received <= 0) {
+                break;
+            }
+            len += received;
+
+            int pos = 0;
+            while (len - pos >= BM1366_RESPONSE_SIZE) {
+                if (buf[pos] != 0xAA || buf[pos + 1] != 0x55) {
+                    pos = _find_preamble(buf, pos + 1, len);
+                    continue;
+                }
+                if (crc5(buf + pos + 2, BM1366_RESPONSE_SIZE - 2) == 0 && buf[pos + 2] == 0x13 && buf[pos + 3] == 0x66) {
+                    valid++;
+                }
+                replies++;
+                pos += BM1366_RESPONSE_SIZE;
+            }
+            len -= pos;
+            memmove(buf, buf + pos, len);
+        }
+    }
+
+    return 1.0 - (float) valid / expected;
+}
+
+// Walks up the baud ladder from the default rate, testing the link at each rung,
+// and settles on the fastest rate that keeps the readback error rate under the threshold.
+int BM1366_set_max_baud(uint8_t chain)
+{
+    int best = chains[chain].baud_rung_index;
+
+    // a resumed chain already runs at the rate probed before the restart
+    if (chains[chain].resumed) {
+        chains[chain].resumed = false;
+        ESP_LOGI(TAG, "Keeping chain %u at %d baud", chain, baud_ladder[best].baud);
+        return baud_ladder[best].baud;
+    }
+
+    for (int i = best + 1; i < sizeof(baud_ladder) / sizeof(baud_ladder[0]); i++) {
+        _switch_baud(chain, i);
+        float error_rate = _test_link(chain);
+        ESP_LOGI(TAG, "Chain %u baud %d: %.1f%% readback errors", chain, baud_ladder[i].baud, error_rate * 100);
+
+        if (error_rate > BAUD_MAX_ERROR_RATE) {
+            break;
+        }
+        best = i;
+    }
+
+    if (chains[chain].baud_rung_index != best) {
+        _switch_baud(chain, best);
+        if (_test_link(chain) > BAUD_MAX_ERROR_RATE) {
+            ESP_LOGE(TAG, "Chain %u link still failing after falling back to %d baud", chain, baud_ladder[best].baud);
+        }
+    }
+
+    pthread_mutex_lock(&chains[chain].ramp_lock);
+    _save_warm_state(chain);
+    pthread_mutex_unlock(&chains[chain].ramp_lock);
+    ESP_LOGI(TAG, "Setting max baud of %d", baud_ladder[best].baud);
+    return baud_ladder[best].baud;
+}
+
+// Drops one rung when the link degrades at runtime, returns the new baud or 0 if already at the bottom.
+int BM1366_step_down_baud(uint8_t chain)
+{
+    int index = chains[chain].baud_rung_index;
+    if (index == 0) {
+        return 0;
+    }
+
+    _switch_baud(chain, index - 1);
+    pthread_mutex_lock(&chains[chain].ramp_lock);
+    _save_warm_state(chain);
+    pthread_mutex_unlock(&chains[chain].ramp_lock);
+    ESP_LOGW(TAG, "Chain %u link errors, falling back to %d baud", chain, baud_ladder[index - 1].baud);
+    return baud_ladder[index - 1].baud;
+}
+
+uint32_t BM1366_set_job_difficulty_mask(uint8_t chain, uint32_t difficulty)
 {
 
     // Default mask of 256 diff
@@ -367,113 +1120,257 @@ void BM1366_set_job_difficulty_mask(int difficulty)
         job_difficulty_mask[5 - i] = _reverse_bits(value);
     }
 
-    ESP_LOGI(TAG, "Setting job ASIC mask to %d", difficulty);
+    ESP_LOGI(TAG, "Setting chain %u job ASIC mask to %lu", chain, difficulty);
+
+    _send_BM1366(chain, (TYPE_CMD | GROUP_ALL | CMD_WRITE), job_difficulty_mask, 6, BM1366_SERIALTX_DEBUG);
 
-    _send_BM1366((TYPE_CMD | GROUP_ALL | CMD_WRITE), job_difficulty_mask, 6, BM1366_SERIALTX_DEBUG);
+    // the chip reports every nonce that clears the mask, so the effective ticket difficulty is mask + 1
+    pthread_mutex_lock(&chains[chain].ramp_lock);
+    chains[chain].ticket_difficulty = difficulty + 1;
+    _save_warm_state(chain);
+    pthread_mutex_unlock(&chains[chain].ramp_lock);
+    return difficulty + 1;
 }
 
-static uint8_t id = 0;
+uint32_t BM1366_get_job_difficulty_mask(uint8_t chain)
+{
+    return chains[chain].ticket_difficulty;
+}
+
+// Serializes the job into its final wire frame with a job id of 0.
+// Runs in the job factory so it stays off the dispatch path.
+void BM1366_prepare_work(bm_job * next_bm_job)
+{
+    uint8_t * frame = next_bm_job->asic_frame;
+
+    frame[0] = 0x55;
+    frame[1] = 0xAA;
+    frame[2] = TYPE_JOB | GROUP_SINGLE | CMD_WRITE;
+    frame[3] = sizeof(BM1366_job) + 4;
+
+    BM1366_job * job = (BM1366_job *) (frame + BM1366_JOB_ID_OFFSET);
+    job->job_id = 0;
+    job->num_midstates = 0x01;
+    memcpy(&job->starting_nonce, &next_bm_job->starting_nonce, 4);
+    memcpy(&job->nbits, &next_bm_job->target, 4);
+    memcpy(&job->ntime, &next_bm_job->ntime, 4);
+    memcpy(job->merkle_root, next_bm_job->merkle_root_be, 32);
+    memcpy(job->prev_block_hash, next_bm_job->prev_block_hash_be, 32);
+    memcpy(&job->version, &next_bm_job->version, 4);
+
+    uint16_t crc16_total = crc16_false(frame + 2, sizeof(BM1366_job) + 2);
+    frame[BM1366_JOB_FRAME_SIZE - 2] = (crc16_total >> 8) & 0xFF;
+    frame[BM1366_JOB_FRAME_SIZE - 1] = crc16_total & 0xFF;
+
+    next_bm_job->asic_frame_len = BM1366_JOB_FRAME_SIZE;
+}
 
 void BM1366_send_work(void * pvParameters, bm_job * next_bm_job)
 {
 
-    GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
+    AsicChain * chain = (AsicChain *) pvParameters;
+
+    if (next_bm_job->asic_frame_len != BM1366_JOB_FRAME_SIZE) {
+        BM1366_prepare_work(next_bm_job);
+    }
 
-    BM1366_job job;
-    id = (id + 8) % 128;
-    job.job_id = id;
-    job.num_midstates = 0x01;
-    memcpy(&job.starting_nonce, &next_bm_job->starting_nonce, 4);
-    memcpy(&job.nbits, &next_bm_job->target, 4);
-    memcpy(&job.ntime, &next_bm_job->ntime, 4);
-    memcpy(job.merkle_root, next_bm_job->merkle_root_be, 32);
-    memcpy(job.prev_block_hash, next_bm_job->prev_block_hash_be, 32);
-    memcpy(&job.version, &next_bm_job->version, 4);
+    uint8_t id = chains[chain->id].job_id = (chains[chain->id].job_id + 8) % 128;
 
-    if (GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job.job_id] != NULL) {
-        free_bm_job(GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job.job_id]);
+    // patch the job id into the prepared frame and fix up the crc to match
+    uint8_t * frame = next_bm_job->asic_frame;
+    uint16_t crc16_total = (frame[BM1366_JOB_FRAME_SIZE - 2] << 8) | frame[BM1366_JOB_FRAME_SIZE - 1];
+    crc16_total ^= job_id_crc_delta[frame[BM1366_JOB_ID_OFFSET] / 8] ^ job_id_crc_delta[id / 8];
+    frame[BM1366_JOB_ID_OFFSET] = id;
+    frame[BM1366_JOB_FRAME_SIZE - 2] = (crc16_total >> 8) & 0xFF;
+    frame[BM1366_JOB_FRAME_SIZE - 1] = crc16_total & 0xFF;
+
+    if (chain->ASIC_TASK_MODULE.active_jobs[id] != NULL) {
+        free_bm_job(chain->ASIC_TASK_MODULE.active_jobs[id]);
     }
 
-    GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job.job_id] = next_bm_job;
+    chain->ASIC_TASK_MODULE.active_jobs[id] = next_bm_job;
 
-    pthread_mutex_lock(&GLOBAL_STATE->valid_jobs_lock);
-    GLOBAL_STATE->valid_jobs[job.job_id] = 1;
+    pthread_mutex_lock(&chain->valid_jobs_lock);
+    chain->valid_jobs[id] = 1;
     
     //debug sent jobs - this can get crazy if the interval is short
     #if BM1366_DEBUG_JOBS
-    ESP_LOGI(TAG, "Send Job: %02X", job.job_id);
+    ESP_LOGI(TAG, "Send Job: %u/%02X", chain->id, id);
     #endif
-    pthread_mutex_unlock(&GLOBAL_STATE->valid_jobs_lock);
+    pthread_mutex_unlock(&chain->valid_jobs_lock);
 
-    _send_BM1366((TYPE_JOB | GROUP_SINGLE | CMD_WRITE), &job, sizeof(BM1366_job), BM1366_DEBUG_WORK);
+    SERIAL_send(chain->id, frame, BM1366_JOB_FRAME_SIZE, BM1366_DEBUG_WORK);
 }
 
-asic_result * BM1366_receive_work(void)
+// Pulls whatever the UART has buffered and splits it into complete response frames.
+// Garbage is skipped up to the next preamble rather than flushing the UART, so the
+// nonces queued behind a corrupted frame survive. A partial frame is kept for the next call.
+static int BM1366_receive_work(uint8_t chain, asic_result * frames, int max_frames)
 {
-    // wait for a response, wait time is pretty arbitrary
-    int received = SERIAL_rx(asic_response_buffer, 11, 60000);
+    bm1366_chain * c = &chains[chain];
+
+    // only sleep on the UART when there is no complete frame left over from the last batch
+    uint16_t timeout_ms = c->rx_len >= BM1366_RESPONSE_SIZE ? 0 : BM1366_RX_TIMEOUT_MS;
+    int received = SERIAL_wait_rx(chain, c->rx_buffer + c->rx_len, sizeof(c->rx_buffer) - c->rx_len, timeout_ms);
 
     if (received < 0) {
         ESP_LOGI(TAG, "Error in serial RX");
-        return NULL;
-    } else if (received == 0) {
-        // Didn't find a solution, restart and try again
-        return NULL;
+        c->rx_len = 0;
+        return 0;
     }
 
-    if (received != 11 || asic_response_buffer[0] != 0xAA || asic_response_buffer[1] != 0x55) {
-        ESP_LOGI(TAG, "Serial RX invalid %i", received);
-        ESP_LOG_BUFFER_HEX(TAG, asic_response_buffer, received);
-        SERIAL_clear_buffer();
-        return NULL;
+    c->rx_len += received;
+
+    int count = 0;
+    int pos = 0;
+    while (c->rx_len - pos >= BM1366_RESPONSE_SIZE && count < max_frames) {
+        if (c->rx_buffer[pos] != 0xAA || c->rx_buffer[pos + 1] != 0x55) {
+            int next = _find_preamble(c->rx_buffer, pos + 1, c->rx_len);
+            ESP_LOGI(TAG, "Serial RX out of sync, skipping %i bytes", next - pos);
+            ESP_LOG_BUFFER_HEX(TAG, c->rx_buffer + pos, next - pos);
+            c->rx_stats.resyncs++;
+            c->rx_stats.bytes_discarded += next - pos;
+            pos = next;
+            continue;
+        }
+
+        // the crc covers everything after the preamble, so a valid frame leaves no remainder
+        if (crc5(c->rx_buffer + pos + 2, BM1366_RESPONSE_SIZE - 2) != 0) {
+            int next = _find_preamble(c->rx_buffer, pos + 2, c->rx_len);
+            ESP_LOGI(TAG, "Serial RX CRC error");
+            ESP_LOG_BUFFER_HEX(TAG, c->rx_buffer + pos, BM1366_RESPONSE_SIZE);
+            c->rx_stats.crc_errors++;
+            c->rx_stats.bytes_discarded += next - pos;
+            pos = next;
+            continue;
+        }
+
+        memcpy(&frames[count++], c->rx_buffer + pos, BM1366_RESPONSE_SIZE);
+        pos += BM1366_RESPONSE_SIZE;
     }
 
-    return (asic_result *) asic_response_buffer;
+    c->rx_len -= pos;
+    memmove(c->rx_buffer, c->rx_buffer + pos, c->rx_len);
+
+    return count;
 }
 
-static uint16_t reverse_uint16(uint16_t num)
+void BM1366_get_rx_stats(uint8_t chain, asic_rx_stats * stats)
 {
-    return (num >> 8) | (num << 8);
+    *stats = chains[chain].rx_stats;
 }
 
-static uint32_t reverse_uint32(uint32_t val)
+// Asks every chip on the chain for the next register in polled_registers, the replies
+// come back between nonces and are picked up by BM1366_proccess_work
+void BM1366_poll_registers(uint8_t chain)
 {
-    return ((val >> 24) & 0xff) |      // Move byte 3 to byte 0
-           ((val << 8) & 0xff0000) |   // Move byte 1 to byte 2
-           ((val >> 8) & 0xff00) |     // Move byte 2 to byte 1
-           ((val << 24) & 0xff000000); // Move byte 0 to byte 3
+    bm1366_chain * c = &chains[chain];
+    if (c->telemetry == NULL) {
+        return;
+    }
+
+    uint8_t read_reg[2] = {0x00, polled_registers[c->poll_index]};
+    c->poll_index = (c->poll_index + 1) % sizeof(polled_registers);
+    _send_BM1366(chain, TYPE_CMD | GROUP_ALL | CMD_READ, read_reg, 2, BM1366_SERIALTX_DEBUG);
 }
 
-task_result * BM1366_proccess_work(void * pvParameters)
+bool BM1366_get_chip_telemetry(uint8_t chain, uint16_t chip, asic_chip_telemetry * telemetry)
 {
+    bm1366_chain * c = &chains[chain];
+    if (c->telemetry == NULL || chip >= c->chip_count) {
+        return false;
+    }
 
-    asic_result * asic_result = BM1366_receive_work();
+    *telemetry = c->telemetry[chip];
+    return true;
+}
 
-    if (asic_result == NULL) {
-        return NULL;
+// register replies carry the value in the nonce field, the chip address and the register in place of the job id
+static void _store_register(uint8_t chain, const asic_result * frame)
+{
+    bm1366_chain * c = &chains[chain];
+    int chip = frame->midstate_num / BM1366_CHIP_ADDRESS_INTERVAL;
+    if (c->telemetry == NULL || chip >= c->chip_count) {
+        return;
     }
 
-    uint8_t job_id = asic_result->job_id & 0xf8;
-    uint8_t core_id = (uint8_t)((reverse_uint32(asic_result->nonce) >> 25) & 0x7f); // BM1366 has 112 cores, so it should be coded on 7 bits
-    uint8_t small_core_id = asic_result->job_id & 0x07; // BM1366 has 8 small cores, so it should be coded on 3 bits
-    uint32_t version_bits = (reverse_uint16(asic_result->version) << 13); // shift the 16 bit value left 13
-    ESP_LOGI(TAG, "Job ID: %02X, Core: %d/%d, Ver: %08" PRIX32, job_id, core_id, small_core_id, version_bits);
+    asic_chip_telemetry * telemetry = &c->telemetry[chip];
+    uint32_t value = reverse_uint32(frame->nonce);
 
-    GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
+    switch (frame->job_id) {
+        case TOTAL_HASH_COUNTER: {
+            int64_t now = esp_timer_get_time();
+            if (telemetry->hash_counter_time != 0) {
+                // unsigned difference copes with the counter wrapping
+                uint32_t delta = value - telemetry->hash_counter;
+                telemetry->hashrate = delta * HASH_COUNTER_LSB / ((now - telemetry->hash_counter_time) / 1e6) / 1e9;
+            }
+            telemetry->hash_counter = value;
+            telemetry->hash_counter_time = now;
+            break;
+        }
+        case ERROR_COUNTER:
+            telemetry->error_counter = value;
+            break;
+        case PLL0_PARAMETER: {
+            uint32_t written = c->chips[chip].frequency != 0 ? c->chips[chip].pll_parameter : c->pll_parameter;
+            telemetry->pll_parameter = value;
+            telemetry->pll_match = value == written;
+            if (!telemetry->pll_match) {
+                ESP_LOGW(TAG, "Chain %u chip %d PLL reads %08" PRIX32 ", wrote %08" PRIX32, chain, chip, value, written);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+int BM1366_proccess_work(void * pvParameters, task_result * results, int max_results)
+{
+    AsicChain * chain = (AsicChain *) pvParameters;
 
-    if (GLOBAL_STATE->valid_jobs[job_id] == 0) {
-        ESP_LOGE(TAG, "Invalid job found, 0x%02X", job_id);
-        return NULL;
+    asic_result frames[BM1366_RX_BATCH_SIZE];
+    if (max_results > BM1366_RX_BATCH_SIZE) {
+        max_results = BM1366_RX_BATCH_SIZE;
     }
 
-    uint32_t rolled_version = GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->version | version_bits;
+    int received = BM1366_receive_work(chain->id, frames, max_results);
+    int count = 0;
 
-    int asic_nr = (asic_result->nonce & 0x0000fc00) >> 10;
+    for (int i = 0; i < received; i++) {
+        asic_result * asic_result = &frames[i];
 
-    result.job_id = job_id;
-    result.asic_nr = asic_nr;
-    result.nonce = asic_result->nonce;
-    result.rolled_version = rolled_version;
+        if ((asic_result->crc & RESPONSE_JOB) == 0) {
+            _store_register(chain->id, asic_result);
+            continue;
+        }
+
+        uint8_t job_id = asic_result->job_id & 0xf8;
+        uint8_t core_id = (uint8_t)((reverse_uint32(asic_result->nonce) >> 25) & 0x7f); // BM1366 has 112 cores, so it should be coded on 7 bits
+        uint8_t small_core_id = asic_result->job_id & 0x07; // BM1366 has 8 small cores, so it should be coded on 3 bits
+        uint32_t version_bits = (reverse_uint16(asic_result->version) << 13); // shift the 16 bit value left 13
+        ESP_LOGI(TAG, "Job ID: %02X, Core: %d/%d, Ver: %08" PRIX32, job_id, core_id, small_core_id, version_bits);
+
+        if (chain->valid_jobs[job_id] == 0) {
+            ESP_LOGE(TAG, "Invalid job found, 0x%02X", job_id);
+            continue;
+        }
+
+        uint32_t rolled_version = chain->ASIC_TASK_MODULE.active_jobs[job_id]->version | version_bits;
 
-    return &result;
-}
\ No newline at end of file
+        int asic_nr = (asic_result->nonce & 0x0000fc00) >> 10;
+        int chip = asic_nr / BM1366_CHIP_ADDRESS_INTERVAL;
+
+        results[count].job_id = job_id;
+        results[count].asic_nr = asic_nr;
+        results[count].chip = chip < chains[chain->id].chip_count ? chip : ASIC_MAX_CHIPS;
+        results[count].core_id = core_id;
+        results[count].small_core_id = small_core_id;
+        results[count].nonce = asic_result->nonce;
+        results[count].rolled_version = rolled_version;
+        count++;
+    }
+
+    return count;
+}
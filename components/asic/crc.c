@@ -3,55 +3,57 @@
 #include <string.h>
 
 #include "bm1366.h"
+#include "crc.h"
+
+/* crc5 (x^5 + x^2 + 1, init 0x1f) lookup table, one entry per input byte.
+ * The 5-bit register is kept in the top bits of a byte so a whole byte can be
+ * shifted in per lookup; entries are the register after 8 bit steps.
+ * Generated from the bit-serial version described at
+ * https://mightydevices.com/index.php/2018/02/reverse-engineering-antminer-s1/ */
+static const uint8_t crc5_table[256] = {
+	0x00, 0x28, 0x50, 0x78, 0xA0, 0x88, 0xF0, 0xD8,
+	0x68, 0x40, 0x38, 0x10, 0xC8, 0xE0, 0x98, 0xB0,
+	0xD0, 0xF8, 0x80, 0xA8, 0x70, 0x58, 0x20, 0x08,
+	0xB8, 0x90, 0xE8, 0xC0, 0x18, 0x30, 0x48, 0x60,
+	0x88, 0xA0, 0xD8, 0xF0, 0x28, 0x00, 0x78, 0x50,
+	0xE0, 0xC8, 0xB0, 0x98, 0x40, 0x68, 0x10, 0x38,
+	0x58, 0x70, 0x08, 0x20, 0xF8, 0xD0, 0xA8, 0x80,
+	0x30, 0x18, 0x60, 0x48, 0x90, 0xB8, 0xC0, 0xE8,
+	0x38, 0x10, 0x68, 0x40, 0x98, 0xB0, 0xC8, 0xE0,
+	0x50, 0x78, 0x00, 0x28, 0xF0, 0xD8, 0xA0, 0x88,
+	0xE8, 0xC0, 0xB8, 0x90, 0x48, 0x60, 0x18, 0x30,
+	0x80, 0xA8, 0xD0, 0xF8, 0x20, 0x08, 0x70, 0x58,
+	0xB0, 0x98, 0xE0, 0xC8, 0x10, 0x38, 0x40, 0x68,
+	0xD8, 0xF0, 0x88, 0xA0, 0x78, 0x50, 0x28, 0x00,
+	0x60, 0x48, 0x30, 0x18, 0xC0, 0xE8, 0x90, 0xB8,
+	0x08, 0x20, 0x58, 0x70, 0xA8, 0x80, 0xF8, 0xD0,
+	0x70, 0x58, 0x20, 0x08, 0xD0, 0xF8, 0x80, 0xA8,
+	0x18, 0x30, 0x48, 0x60, 0xB8, 0x90, 0xE8, 0xC0,
+	0xA0, 0x88, 0xF0, 0xD8, 0x00, 0x28, 0x50, 0x78,
+	0xC8, 0xE0, 0x98, 0xB0, 0x68, 0x40, 0x38, 0x10,
+	0xF8, 0xD0, 0xA8, 0x80, 0x58, 0x70, 0x08, 0x20,
+	0x90, 0xB8, 0xC0, 0xE8, 0x30, 0x18, 0x60, 0x48,
+	0x28, 0x00, 0x78, 0x50, 0x88, 0xA0, 0xD8, 0xF0,
+	0x40, 0x68, 0x10, 0x38, 0xE0, 0xC8, 0xB0, 0x98,
+	0x48, 0x60, 0x18, 0x30, 0xE8, 0xC0, 0xB8, 0x90,
+	0x20, 0x08, 0x70, 0x58, 0x80, 0xA8, 0xD0, 0xF8,
+	0x98, 0xB0, 0xC8, 0xE0, 0x38, 0x10, 0x68, 0x40,
+	0xF0, 0xD8, 0xA0, 0x88, 0x50, 0x78, 0x00, 0x28,
+	0xC0, 0xE8, 0x90, 0xB8, 0x60, 0x48, 0x30, 0x18,
+	0xA8, 0x80, 0xF8, 0xD0, 0x08, 0x20, 0x58, 0x70,
+	0x10, 0x38, 0x40, 0x68, 0xB0, 0x98, 0xE0, 0xC8,
+	0x78, 0x50, 0x28, 0x00, 0xD8, 0xF0, 0x88, 0xA0,
+};
 
 /* compute crc5 over given number of bytes */
-// adapted from https://mightydevices.com/index.php/2018/02/reverse-engineering-antminer-s1/
-uint8_t crc5(uint8_t *data, uint8_t len)
+uint8_t crc5(const uint8_t *data, uint8_t len)
 {
-	uint8_t i, j, k, index = 0;
-	uint8_t crc = CRC5_MASK;
-	/* registers */
-	uint8_t crcin[5] = {1, 1, 1, 1, 1};
-	uint8_t crcout[5] = {1, 1, 1, 1, 1};
-	uint8_t din = 0;
-
-	len *= 8;
+	uint8_t crc = CRC5_MASK << 3;
 
-	/* push data bits */
-	for (j = 0x80, k = 0, i = 0; i < len; i++)
-	{
-		/* input bit */
-		din = (data[index] & j) != 0;
-		/* shift register */
-		crcout[0] = crcin[4] ^ din;
-		crcout[1] = crcin[0];
-		crcout[2] = crcin[1] ^ crcin[4] ^ din;
-		crcout[3] = crcin[2];
-		crcout[4] = crcin[3];
-		/* next bit */
-		j >>= 1, k++;
-		/* next byte */
-		if (k == 8)
-			j = 0x80, k = 0, index++;
-		/* apply new shift register value */
-		memcpy(crcin, crcout, 5);
-		// crcin = crcout[0];
-	}
+	while (len--)
+		crc = crc5_table[crc ^ *data++];
 
-	crc = 0;
-	/* extract bitmask from register */
-	if (crcin[4])
-		crc |= 0x10;
-	if (crcin[3])
-		crc |= 0x08;
-	if (crcin[2])
-		crc |= 0x04;
-	if (crcin[1])
-		crc |= 0x02;
-	if (crcin[0])
-		crc |= 0x01;
-
-	return crc;
+	return crc >> 3;
 }
 
 // kindly provided by cgminer
@@ -90,7 +92,7 @@ unsigned int crc16_table[256] = {
 	0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0};
 
 /* CRC-16/CCITT */
-uint16_t crc16(uint8_t *buffer, uint16_t len)
+uint16_t crc16(const uint8_t *buffer, uint16_t len)
 {
 	uint16_t crc;
 
@@ -102,7 +104,7 @@ uint16_t crc16(uint8_t *buffer, uint16_t len)
 }
 
 /* CRC-16/CCITT-FALSE */
-uint16_t crc16_false(uint8_t *buffer, uint16_t len)
+uint16_t crc16_false(const uint8_t *buffer, uint16_t len)
 {
 	uint16_t crc;
 
@@ -3,10 +3,16 @@
 
 #include "common.h"
 #include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "mining.h"
 
 #define CRC5_MASK 0x1F
 #define BM1366_INITIAL_DIFFICULTY 512
+// chips are addressed 0, 2, 4, ... during enumeration
+#define BM1366_CHIP_ADDRESS_INTERVAL 2
+// most responses handed to the result task per wakeup
+#define BM1366_RX_BATCH_SIZE 16
 
 #define BM1366_SERIALTX_DEBUG false
 #define BM1366_SERIALRX_DEBUG false
@@ -45,15 +51,28 @@ typedef struct __attribute__((__packed__))
     uint8_t version[4];
 } BM1366_job;
 
-uint8_t BM1366_init(uint64_t frequency, uint16_t asic_count);
+uint8_t BM1366_init(uint8_t chain, uint64_t frequency, uint16_t asic_count);
 
 void BM1366_send_init(void);
-void BM1366_send_work(void * GLOBAL_STATE, bm_job * next_bm_job);
-void BM1366_set_job_difficulty_mask(int);
-int BM1366_set_max_baud(void);
-int BM1366_set_default_baud(void);
+void BM1366_prepare_work(bm_job * next_bm_job);
+void BM1366_send_work(void * chain, bm_job * next_bm_job);
+uint32_t BM1366_set_job_difficulty_mask(uint8_t chain, uint32_t difficulty);
+uint32_t BM1366_get_job_difficulty_mask(uint8_t chain);
+int BM1366_set_max_baud(uint8_t chain);
+int BM1366_set_default_baud(uint8_t chain);
+int BM1366_step_down_baud(uint8_t chain);
 bool BM1366_send_hash_frequency(float frequency);
+bool BM1366_set_chip_frequency(uint8_t chain, uint16_t chip, float frequency);
+float BM1366_get_chip_frequency(uint8_t chain, uint16_t chip);
+float BM1366_get_actual_frequency(uint8_t chain, uint16_t chip);
 bool do_frequency_transition(float target_frequency);
-task_result * BM1366_proccess_work(void * GLOBAL_STATE);
+bool BM1366_set_frequency(float target_freq);
+bool BM1366_run_frequency_ramp(uint8_t chain, SemaphoreHandle_t wake);
+void BM1366_cancel_frequency_ramp(void);
+void BM1366_get_frequency_ramp(uint8_t chain, asic_frequency_ramp * ramp);
+int BM1366_proccess_work(void * chain, task_result * results, int max_results);
+void BM1366_get_rx_stats(uint8_t chain, asic_rx_stats * stats);
+void BM1366_poll_registers(uint8_t chain);
+bool BM1366_get_chip_telemetry(uint8_t chain, uint16_t chip, asic_chip_telemetry * telemetry);
 
 #endif /* BM1366_H_ */
\ No newline at end of file
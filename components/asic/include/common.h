@@ -1,16 +1,58 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
+// independent strings of ASICs, each on its own UART
+#define ASIC_MAX_CHAINS 2
+// chips addressable on one chain and cores per chip, bounded by the width of the fields in a response
+#define ASIC_MAX_CHIPS 64
+#define ASIC_MAX_CORES 128
+
 typedef struct __attribute__((__packed__))
 {
     uint8_t job_id;
     uint32_t nonce;
     uint32_t rolled_version;
     int asic_nr;
+    // position of the chip on the chain, ASIC_MAX_CHIPS when the address is unknown
+    uint8_t chip;
+    uint8_t core_id;
+    uint8_t small_core_id;
 } task_result;
 
+typedef struct
+{
+    // times the parser had to search for the next preamble
+    uint32_t resyncs;
+    // frames with a valid preamble whose CRC5 didn't check out
+    uint32_t crc_errors;
+    // bytes dropped while resyncing or with a failed frame
+    uint32_t bytes_discarded;
+} asic_rx_stats;
+
+typedef struct
+{
+    bool active;
+    // MHz last written to the chain and where the ramp is heading
+    float current;
+    float target;
+} asic_frequency_ramp;
+
+// Values a chip reports about itself through register reads
+typedef struct
+{
+    // GH/s from the chip's own hash counter between the last two readbacks
+    double hashrate;
+    uint32_t hash_counter;
+    int64_t hash_counter_time;
+    uint32_t error_counter;
+    // PLL parameter as read back and whether it matches what was written
+    uint32_t pll_parameter;
+    bool pll_match;
+} asic_chip_telemetry;
+
 static unsigned char _reverse_bits(unsigned char num)
 {
     unsigned char reversed = 0;
@@ -1,8 +1,10 @@
 #ifndef CRC_H_
 #define CRC_H_
 
-uint8_t crc5(uint8_t *data, uint8_t len);
-unsigned short crc16(const unsigned char *buffer, int len);
-unsigned short crc16_false(const unsigned char *buffer, int len);
+#include <stdint.h>
+
+uint8_t crc5(const uint8_t *data, uint8_t len);
+uint16_t crc16(const uint8_t *buffer, uint16_t len);
+uint16_t crc16_false(const uint8_t *buffer, uint16_t len);
 
 #endif // PRETTY_H_
\ No newline at end of file
@@ -2,12 +2,24 @@
 #define SERIAL_H_
 
 #define SERIAL_BUF_SIZE 16
+// UART1 and UART2, one per ASIC chain
+#define SERIAL_MAX_PORTS 2
 
-int SERIAL_send(uint8_t *, int, bool);
-void SERIAL_init(void);
-void SERIAL_debug_rx(void);
-int16_t SERIAL_rx(uint8_t *, uint16_t, uint16_t);
-void SERIAL_clear_buffer(void);
-void SERIAL_set_baud(int baud);
+typedef struct
+{
+    // most bytes seen waiting in the driver rx buffer
+    uint32_t high_water;
+    // rx fifo or driver buffer overruns, the bytes lost show up as CRC errors and resyncs
+    uint32_t overflows;
+} serial_rx_stats;
+
+int SERIAL_send(uint8_t port, const uint8_t *, int, bool);
+void SERIAL_init(uint8_t port);
+void SERIAL_debug_rx(uint8_t port);
+int16_t SERIAL_rx(uint8_t port, uint8_t *, uint16_t, uint16_t);
+int16_t SERIAL_wait_rx(uint8_t port, uint8_t *, uint16_t, uint16_t);
+void SERIAL_get_rx_stats(uint8_t port, serial_rx_stats *);
+void SERIAL_clear_buffer(uint8_t port);
+void SERIAL_set_baud(uint8_t port, int baud);
 
 #endif /* SERIAL_H_ */
\ No newline at end of file
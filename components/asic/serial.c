@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 
 #include "driver/uart.h"
 
@@ -15,13 +16,30 @@
 #define ECHO_TEST_TXD (17)
 #define ECHO_TEST_RXD (18)
 #define BUF_SIZE (1024)
+#define UART_EVENT_QUEUE_SIZE (20)
 
 static const char *TAG = "serial";
 
-void SERIAL_init(void)
+typedef struct
 {
-    ESP_LOGI(TAG, "Initializing serial");
-    // Configure UART1 parameters
+    uart_port_t uart_num;
+    int tx_pin;
+    int rx_pin;
+    QueueHandle_t queue;
+    serial_rx_stats rx_stats;
+} serial_port;
+
+// one UART per ASIC chain, UART0 stays with the console
+static serial_port ports[SERIAL_MAX_PORTS] = {
+    {.uart_num = UART_NUM_1, .tx_pin = ECHO_TEST_TXD, .rx_pin = ECHO_TEST_RXD},
+    {.uart_num = UART_NUM_2, .tx_pin = CONFIG_ASIC_CHAIN2_TX_PIN, .rx_pin = CONFIG_ASIC_CHAIN2_RX_PIN},
+};
+
+void SERIAL_init(uint8_t port)
+{
+    serial_port *p = &ports[port];
+
+    ESP_LOGI(TAG, "Initializing serial %u (TX: IO%d, RX: IO%d)", port, p->tx_pin, p->rx_pin);
     uart_config_t uart_config = {
         .baud_rate = 115200,
         .data_bits = UART_DATA_8_BITS,
@@ -30,24 +48,24 @@ void SERIAL_init(void)
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
         .rx_flow_ctrl_thresh = 122,
     };
-    // Configure UART1 parameters
-    uart_param_config(UART_NUM_1, &uart_config);
-    // Set UART1 pins(TX: IO17, RX: I018)
-    uart_set_pin(UART_NUM_1, ECHO_TEST_TXD, ECHO_TEST_RXD, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_param_config(p->uart_num, &uart_config);
+    uart_set_pin(p->uart_num, p->tx_pin, p->rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
 
-    // Install UART driver (we don't need an event queue here)
+    // Install UART driver with an event queue so the result path can sleep until data arrives
     // tx buffer 0 so the tx time doesn't overlap with the job wait time
     //  by returning before the job is written
-    uart_driver_install(UART_NUM_1, BUF_SIZE * 2, BUF_SIZE * 2, 0, NULL, 0);
+    uart_driver_install(p->uart_num, BUF_SIZE * 2, BUF_SIZE * 2, UART_EVENT_QUEUE_SIZE, &p->queue, 0);
 }
 
-void SERIAL_set_baud(int baud)
+void SERIAL_set_baud(uint8_t port, int baud)
 {
-    ESP_LOGI(TAG, "Changing UART baud to %i", baud);
-    uart_set_baudrate(UART_NUM_1, baud);
+    ESP_LOGI(TAG, "Changing UART %u baud to %i", port, baud);
+    // let a pending baud change command go out at the old rate first
+    uart_wait_tx_done(ports[port].uart_num, 100 / portTICK_PERIOD_MS);
+    uart_set_baudrate(ports[port].uart_num, baud);
 }
 
-int SERIAL_send(uint8_t *data, int len, bool debug)
+int SERIAL_send(uint8_t port, const uint8_t *data, int len, bool debug)
 {
     if (debug)
     {
@@ -56,21 +74,22 @@ int SERIAL_send(uint8_t *data, int len, bool debug)
         printf("\n");
     }
 
-    return uart_write_bytes(UART_NUM_1, (const char *)data, len);
+    return uart_write_bytes(ports[port].uart_num, (const char *)data, len);
 }
 
 /// @brief waits for a serial response from the device
+/// @param port chain the device is on
 /// @param buf buffer to read data into
 /// @param buf number of ms to wait before timing out
 /// @return number of bytes read, or -1 on error
-int16_t SERIAL_rx(uint8_t *buf, uint16_t size, uint16_t timeout_ms)
+int16_t SERIAL_rx(uint8_t port, uint8_t *buf, uint16_t size, uint16_t timeout_ms)
 {
-    int16_t bytes_read = uart_read_bytes(UART_NUM_1, buf, size, timeout_ms / portTICK_PERIOD_MS);
+    int16_t bytes_read = uart_read_bytes(ports[port].uart_num, buf, size, timeout_ms / portTICK_PERIOD_MS);
 
     #if BM1366_SERIALRX_DEBUG
     size_t buff_len = 0;
     if (bytes_read > 0) {
-        uart_get_buffered_data_len(UART_NUM_1, &buff_len);
+        uart_get_buffered_data_len(ports[port].uart_num, &buff_len);
         printf("rx: ");
         prettyHex((unsigned char*) buf, bytes_read);
         printf(" [%d]\n", buff_len);
@@ -80,12 +99,91 @@ int16_t SERIAL_rx(uint8_t *buf, uint16_t size, uint16_t timeout_ms)
     return bytes_read;
 }
 
-void SERIAL_debug_rx(void)
+// Overflows are only counted. The bytes lost fail their frame's CRC and the caller's parser
+// resyncs on the next preamble, so the intact frames buffered around them are kept
+static void _handle_event(uint8_t port, const uart_event_t *event)
+{
+    switch (event->type)
+    {
+    case UART_FIFO_OVF:
+    case UART_BUFFER_FULL:
+        ports[port].rx_stats.overflows++;
+        ESP_LOGW(TAG, "UART %u rx overflow (%s)", port, event->type == UART_FIFO_OVF ? "fifo" : "buffer");
+        break;
+    default:
+        break;
+    }
+}
+
+/// @brief waits for UART data and reads everything that is already buffered
+/// @param port chain to read from
+/// @param buf buffer to read data into
+/// @param size size of buf
+/// @param timeout_ms number of ms to wait for data before timing out
+/// @return number of bytes read, 0 on timeout
+int16_t SERIAL_wait_rx(uint8_t port, uint8_t *buf, uint16_t size, uint16_t timeout_ms)
+{
+    serial_port *p = &ports[port];
+    uart_event_t event;
+    size_t buffered = 0;
+
+    // events queue up while buffered data is read without waiting, drain them on every call
+    while (xQueueReceive(p->queue, &event, 0) == pdTRUE)
+    {
+        _handle_event(port, &event);
+    }
+    uart_get_buffered_data_len(p->uart_num, &buffered);
+
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = timeout_ms / portTICK_PERIOD_MS;
+
+    while (buffered == 0)
+    {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+
+        if (elapsed >= timeout || xQueueReceive(p->queue, &event, timeout - elapsed) != pdTRUE)
+        {
+            return 0;
+        }
+        _handle_event(port, &event);
+
+        uart_get_buffered_data_len(p->uart_num, &buffered);
+    }
+
+    if (buffered > p->rx_stats.high_water)
+    {
+        p->rx_stats.high_water = buffered;
+    }
+
+    if (buffered > size)
+    {
+        buffered = size;
+    }
+
+    int16_t bytes_read = uart_read_bytes(p->uart_num, buf, buffered, 0);
+
+    #if BM1366_SERIALRX_DEBUG
+    if (bytes_read > 0) {
+        printf("rx: ");
+        prettyHex((unsigned char*) buf, bytes_read);
+        printf(" [%d]\n", buffered);
+    }
+    #endif
+
+    return bytes_read;
+}
+
+void SERIAL_get_rx_stats(uint8_t port, serial_rx_stats *stats)
+{
+    *stats = ports[port].rx_stats;
+}
+
+void SERIAL_debug_rx(uint8_t port)
 {
     int ret;
     uint8_t buf[100];
 
-    ret = SERIAL_rx(buf, 100, 20);
+    ret = SERIAL_rx(port, buf, 100, 20);
     if (ret < 0)
     {
         fprintf(stderr, "unable to read data\n");
@@ -95,7 +193,11 @@ void SERIAL_debug_rx(void)
     memset(buf, 0, 100);
 }
 
-void SERIAL_clear_buffer(void)
+void SERIAL_clear_buffer(uint8_t port)
 {
-    uart_flush(UART_NUM_1);
+    uart_flush(ports[port].uart_num);
+    if (ports[port].queue != NULL)
+    {
+        xQueueReset(ports[port].queue);
+    }
 }
@@ -0,0 +1,383 @@
+#include "bm1366_emulator.h"
+#include "crc.h"
+#include "driver/gpio.h"
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RESPONSE_SIZE 11
+#define RX_BUFFER_SIZE 2048
+#define CHIP_RESET_BAUD 115200
+// how far apart the two ends' rates may be and still understand each other
+#define BAUD_TOLERANCE 0.03
+
+#define TYPE_JOB 0x20
+#define GROUP_ALL 0x10
+#define CMD_MASK 0x0f
+#define CMD_SETADDRESS 0x00
+#define CMD_WRITE 0x01
+#define CMD_READ 0x02
+#define CMD_INACTIVE 0x03
+
+#define CHIP_ID_REGISTER 0x00
+#define PLL0_PARAMETER 0x08
+#define TICKET_MASK 0x14
+#define MISC_CONTROL 0x18
+#define FAST_UART_CONFIGURATION 0x28
+
+typedef struct
+{
+    uint8_t reg;
+    uint32_t value;
+    int baud;
+} baud_write;
+
+// the register writes bm1366.c switches the rate with, other writes to these registers leave it alone
+static const baud_write baud_writes[] = {
+    {MISC_CONTROL, 0x00007A31, 115749},
+    {FAST_UART_CONFIGURATION, 0x11300200, 1000000},
+    {MISC_CONTROL, 0x00006131, 1562500},
+    {MISC_CONTROL, 0x00006031, 3125000},
+};
+
+// the chains' UARTs and reset lines as serial.c and bm1366.c drive them
+static const uart_port_t chain_uarts[ASIC_MAX_CHAINS] = {UART_NUM_1, UART_NUM_2};
+static const gpio_num_t chain_reset_pins[ASIC_MAX_CHAINS] = {GPIO_NUM_1, CONFIG_ASIC_CHAIN2_RST_PIN};
+
+typedef struct
+{
+    bm1366_emulated_chain chain;
+    // replies the host hasn't read yet
+    uint8_t rx[RX_BUFFER_SIZE];
+    size_t rx_len;
+    QueueHandle_t events;
+    // chip the next set address goes to
+    int next_address;
+} emulated_port;
+
+static emulated_port ports[ASIC_MAX_CHAINS];
+static bool reset_reason_set;
+static esp_reset_reason_t reset_reason;
+
+esp_reset_reason_t __real_esp_reset_reason(void);
+esp_err_t __real_gpio_set_level(gpio_num_t gpio_num, uint32_t level);
+esp_err_t __real_uart_param_config(uart_port_t uart_num, const uart_config_t * uart_config);
+esp_err_t __real_uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num);
+esp_err_t __real_uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                                     QueueHandle_t * uart_queue, int intr_alloc_flags);
+esp_err_t __real_uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate);
+esp_err_t __real_uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait);
+int __real_uart_write_bytes(uart_port_t uart_num, const void * src, size_t size);
+int __real_uart_read_bytes(uart_port_t uart_num, void * buf, uint32_t length, TickType_t ticks_to_wait);
+esp_err_t __real_uart_get_buffered_data_len(uart_port_t uart_num, size_t * size);
+esp_err_t __real_uart_flush(uart_port_t uart_num);
+
+static emulated_port * _port_for_uart(uart_port_t uart_num)
+{
+    for (int i = 0; i < ASIC_MAX_CHAINS; i++) {
+        if (chain_uarts[i] == uart_num) {
+            return &ports[i];
+        }
+    }
+    return NULL;
+}
+
+static void _reset_chips(emulated_port * port)
+{
+    for (int i = 0; i < ASIC_MAX_CHIPS; i++) {
+        port->chain.chips[i] = (bm1366_emulated_chip){.address = -1};
+    }
+    port->chain.chip_baud = CHIP_RESET_BAUD;
+    port->next_address = 0;
+    port->rx_len = 0;
+}
+
+static bool _bauds_match(const bm1366_emulated_chain * chain)
+{
+    return abs(chain->chip_baud - chain->host_baud) <= chain->chip_baud * BAUD_TOLERANCE;
+}
+
+// a response frame: the value big endian, then the chip address and register, the last
+// byte's top bit marks a nonce and the rest is picked for the crc5 to check out
+static void _reply(emulated_port * port, uint32_t value, uint8_t address, uint8_t reg)
+{
+    uint8_t frame[RESPONSE_SIZE] = {0xAA, 0x55, value >> 24, value >> 16, value >> 8, value, address, reg, 0x00, 0x00, 0x00};
+    while (crc5(frame + 2, RESPONSE_SIZE - 2) != 0) {
+        frame[RESPONSE_SIZE - 1]++;
+    }
+    if (port->chain.max_clean_baud != 0 && port->chain.host_baud > port->chain.max_clean_baud) {
+        frame[3] ^= 0x10;
+    }
+    if (port->rx_len + RESPONSE_SIZE > sizeof(port->rx)) {
+        return;
+    }
+    memcpy(port->rx + port->rx_len, frame, RESPONSE_SIZE);
+    port->rx_len += RESPONSE_SIZE;
+
+    uart_event_t event = {.type = UART_DATA, .size = RESPONSE_SIZE};
+    if (port->events != NULL) {
+        xQueueSend(port->events, &event, 0);
+    }
+}
+
+static void _read(emulated_port * port, bool all, uint8_t address, uint8_t reg)
+{
+    if (reg == CHIP_ID_REGISTER) {
+        port->chain.chip_id_reads++;
+    }
+    for (int i = 0; i < port->chain.chip_count; i++) {
+        bm1366_emulated_chip * chip = &port->chain.chips[i];
+        if (!all && chip->address != address) {
+            continue;
+        }
+        uint8_t from = chip->address < 0 ? 0 : chip->address;
+        switch (reg) {
+            case CHIP_ID_REGISTER:
+                _reply(port, 0x13660000, from, reg);
+                break;
+            case PLL0_PARAMETER:
+                _reply(port, chip->pll_parameter, from, reg);
+                break;
+            case TICKET_MASK:
+                _reply(port, chip->ticket_mask, from, reg);
+                break;
+            default:
+                _reply(port, 0, from, reg);
+                break;
+        }
+    }
+}
+
+static void _write(emulated_port * port, bool all, uint8_t address, uint8_t reg, uint32_t value)
+{
+    for (int i = 0; i < port->chain.chip_count; i++) {
+        bm1366_emulated_chip * chip = &port->chain.chips[i];
+        if (!all && chip->address != address) {
+            continue;
+        }
+        if (reg == PLL0_PARAMETER) {
+            chip->pll_parameter = value;
+        } else if (reg == TICKET_MASK) {
+            chip->ticket_mask = value;
+        }
+    }
+
+    for (int i = 0; i < sizeof(baud_writes) / sizeof(baud_writes[0]); i++) {
+        if (all && baud_writes[i].reg == reg && baud_writes[i].value == value) {
+            port->chain.chip_baud = baud_writes[i].baud;
+            port->chain.baud_switches++;
+        }
+    }
+}
+
+// frames are preamble, header, length, data and a crc5 over header to data, jobs end in a crc16
+static void _receive(emulated_port * port, const uint8_t * data, size_t len)
+{
+    size_t pos = 0;
+    while (pos + 4 <= len) {
+        // the chips hear noise while the rates differ, a baud write can change that mid burst
+        if (!_bauds_match(&port->chain)) {
+            return;
+        }
+
+        const uint8_t * frame = data + pos;
+        size_t frame_len = frame[3] + 2;
+        if (frame[0] != 0x55 || frame[1] != 0xAA || pos + frame_len > len) {
+            port->chain.bad_frames++;
+            return;
+        }
+        pos += frame_len;
+
+        uint8_t header = frame[2];
+        if (header & TYPE_JOB) {
+            continue;
+        }
+        if (crc5(frame + 2, frame_len - 3) != frame[frame_len - 1]) {
+            port->chain.bad_frames++;
+            continue;
+        }
+
+        bool all = header & GROUP_ALL;
+        switch (header & CMD_MASK) {
+            case CMD_SETADDRESS:
+                if (port->next_address < port->chain.chip_count) {
+                    port->chain.chips[port->next_address++].address = frame[4];
+                }
+                break;
+            case CMD_WRITE:
+                _write(port, all, frame[4], frame[5], (uint32_t) frame[6] << 24 | frame[7] << 16 | frame[8] << 8 | frame[9]);
+                break;
+            case CMD_READ:
+                _read(port, all, frame[4], frame[5]);
+                break;
+            case CMD_INACTIVE:
+                for (int i = 0; i < port->chain.chip_count; i++) {
+                    port->chain.chips[i].address = -1;
+                }
+                port->next_address = 0;
+                break;
+        }
+    }
+}
+
+/// @brief powers up fresh chains with chip_counts[chain] chips each, the host side
+/// keeps its driver
+/// @param reset_reason what esp_reset_reason reports from now on
+void BM1366_EMULATOR_reset(const int * chip_counts, esp_reset_reason_t reset_reason)
+{
+    for (int i = 0; i < ASIC_MAX_CHAINS; i++) {
+        emulated_port * port = &ports[i];
+        int host_baud = port->chain.host_baud;
+        bool installed = port->chain.driver_installed;
+        memset(&port->chain, 0, sizeof(port->chain));
+        port->chain.chip_count = chip_counts[i];
+        port->chain.host_baud = host_baud;
+        port->chain.driver_installed = installed;
+        _reset_chips(port);
+    }
+    BM1366_EMULATOR_set_reset_reason(reset_reason);
+}
+
+void BM1366_EMULATOR_set_reset_reason(esp_reset_reason_t reason)
+{
+    reset_reason = reason;
+    reset_reason_set = true;
+}
+
+/// @brief the chain loses power, its chips come back unaddressed at the reset baud
+void BM1366_EMULATOR_power_cycle(uint8_t chain)
+{
+    _reset_chips(&ports[chain]);
+}
+
+bm1366_emulated_chain * BM1366_EMULATOR_chain(uint8_t chain)
+{
+    return &ports[chain].chain;
+}
+
+esp_reset_reason_t __wrap_esp_reset_reason(void)
+{
+    return reset_reason_set ? reset_reason : __real_esp_reset_reason();
+}
+
+// the chips are held in reset while their line is low
+esp_err_t __wrap_gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    for (int i = 0; i < ASIC_MAX_CHAINS; i++) {
+        if (chain_reset_pins[i] == gpio_num && level == 0) {
+            _reset_chips(&ports[i]);
+            ports[i].chain.resets++;
+        }
+    }
+    return __real_gpio_set_level(gpio_num, level);
+}
+
+esp_err_t __wrap_uart_param_config(uart_port_t uart_num, const uart_config_t * uart_config)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_param_config(uart_num, uart_config);
+    }
+    port->chain.host_baud = uart_config->baud_rate;
+    return ESP_OK;
+}
+
+esp_err_t __wrap_uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+{
+    if (_port_for_uart(uart_num) == NULL) {
+        return __real_uart_set_pin(uart_num, tx_io_num, rx_io_num, rts_io_num, cts_io_num);
+    }
+    return ESP_OK;
+}
+
+esp_err_t __wrap_uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size,
+                                     QueueHandle_t * uart_queue, int intr_alloc_flags)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_driver_install(uart_num, rx_buffer_size, tx_buffer_size, queue_size, uart_queue, intr_alloc_flags);
+    }
+    if (port->events == NULL) {
+        port->events = xQueueCreate(queue_size, sizeof(uart_event_t));
+    }
+    *uart_queue = port->events;
+    port->chain.driver_installed = true;
+    return ESP_OK;
+}
+
+esp_err_t __wrap_uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_set_baudrate(uart_num, baudrate);
+    }
+    port->chain.host_baud = baudrate;
+    return ESP_OK;
+}
+
+esp_err_t __wrap_uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    if (_port_for_uart(uart_num) == NULL) {
+        return __real_uart_wait_tx_done(uart_num, ticks_to_wait);
+    }
+    return ESP_OK;
+}
+
+int __wrap_uart_write_bytes(uart_port_t uart_num, const void * src, size_t size)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_write_bytes(uart_num, src, size);
+    }
+    if (!port->chain.driver_installed) {
+        return -1;
+    }
+    _receive(port, src, size);
+    return size;
+}
+
+// the chips have answered by the time a read happens, one that finds nothing times out
+int __wrap_uart_read_bytes(uart_port_t uart_num, void * buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_read_bytes(uart_num, buf, length, ticks_to_wait);
+    }
+    if (!port->chain.driver_installed) {
+        return -1;
+    }
+    if (port->rx_len == 0) {
+        vTaskDelay(ticks_to_wait);
+        return 0;
+    }
+
+    size_t len = length < port->rx_len ? length : port->rx_len;
+    memcpy(buf, port->rx, len);
+    port->rx_len -= len;
+    memmove(port->rx, port->rx + len, port->rx_len);
+    return len;
+}
+
+esp_err_t __wrap_uart_get_buffered_data_len(uart_port_t uart_num, size_t * size)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_get_buffered_data_len(uart_num, size);
+    }
+    *size = port->rx_len;
+    return ESP_OK;
+}
+
+esp_err_t __wrap_uart_flush(uart_port_t uart_num)
+{
+    emulated_port * port = _port_for_uart(uart_num);
+    if (port == NULL) {
+        return __real_uart_flush(uart_num);
+    }
+    port->rx_len = 0;
+    return ESP_OK;
+}
@@ -0,0 +1,47 @@
+#ifndef BM1366_EMULATOR_H_
+#define BM1366_EMULATOR_H_
+
+#include "common.h"
+#include "esp_system.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// BM1366 chains behind the UART driver. The test app links with the driver calls serial.c
+// makes wrapped (see CMakeLists.txt), UART1 and UART2 each lead to an emulated chain and
+// every other port to the real driver. The chips answer what they are sent the moment
+// it's written, as long as they and the host run at the same baud.
+
+// chip id replies, register reads and the address, baud and PLL writes are modelled,
+// anything else is stored or ignored
+typedef struct
+{
+    // set by chain inactive and set address, -1 until addressed
+    int address;
+    uint32_t pll_parameter;
+    uint32_t ticket_mask;
+} bm1366_emulated_chip;
+
+typedef struct
+{
+    int chip_count;
+    bm1366_emulated_chip chips[ASIC_MAX_CHIPS];
+    // what the chips and the host's UART run at
+    int chip_baud;
+    int host_baud;
+    // above this the chips' replies arrive corrupted, 0 for a clean link at any rate
+    int max_clean_baud;
+    bool driver_installed;
+    // what happened on the chain since the last BM1366_EMULATOR_reset
+    int resets;
+    int chip_id_reads;
+    int baud_switches;
+    // frames with a broken preamble, length or crc
+    int bad_frames;
+} bm1366_emulated_chain;
+
+void BM1366_EMULATOR_reset(const int * chip_counts, esp_reset_reason_t reset_reason);
+void BM1366_EMULATOR_set_reset_reason(esp_reset_reason_t reset_reason);
+void BM1366_EMULATOR_power_cycle(uint8_t chain);
+bm1366_emulated_chain * BM1366_EMULATOR_chain(uint8_t chain);
+
+#endif /* BM1366_EMULATOR_H_ */
@@ -0,0 +1,141 @@
+#include "bm1366.h"
+#include "bm1366_emulator.h"
+#include "serial.h"
+#include "unity.h"
+
+#define FREQUENCY 490
+#define CHIP_FREQUENCY 450
+
+// a different chip count on each chain so a swapped port or reset line shows
+static const int chip_counts[ASIC_MAX_CHAINS] = {3, 2};
+
+// powers the chains up fresh and brings both through a cold init
+static void cold_start(void)
+{
+    BM1366_EMULATOR_reset(chip_counts, ESP_RST_POWERON);
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        SERIAL_init(chain);
+        TEST_ASSERT_EQUAL(chip_counts[chain], BM1366_init(chain, FREQUENCY, chip_counts[chain]));
+    }
+}
+
+// the ESP restarts under running chains, the counters start over
+static void software_restart(void)
+{
+    BM1366_EMULATOR_set_reset_reason(ESP_RST_SW);
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        bm1366_emulated_chain *c = BM1366_EMULATOR_chain(chain);
+        c->resets = 0;
+        c->chip_id_reads = 0;
+        c->baud_switches = 0;
+    }
+}
+
+static uint32_t chip_pll(uint8_t chain, int chip)
+{
+    return BM1366_EMULATOR_chain(chain)->chips[chip].pll_parameter;
+}
+
+TEST_CASE("cold init enumerates each chain on its own port", "[bm1366]")
+{
+    cold_start();
+
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        bm1366_emulated_chain *c = BM1366_EMULATOR_chain(chain);
+        TEST_ASSERT_EQUAL(1, c->resets);
+        TEST_ASSERT_EQUAL(1, c->chip_id_reads);
+        for (int i = 0; i < c->chip_count; i++) {
+            TEST_ASSERT_EQUAL(i * BM1366_CHIP_ADDRESS_INTERVAL, c->chips[i].address);
+        }
+    }
+}
+
+TEST_CASE("each chain settles on its own max baud", "[bm1366]")
+{
+    cold_start();
+    // the second chain's wiring doesn't hold up past 1M
+    BM1366_EMULATOR_chain(1)->max_clean_baud = 1000000;
+
+    TEST_ASSERT_EQUAL(3125000, BM1366_set_max_baud(0));
+    TEST_ASSERT_EQUAL(1000000, BM1366_set_max_baud(1));
+
+    TEST_ASSERT_EQUAL(3125000, BM1366_EMULATOR_chain(0)->chip_baud);
+    TEST_ASSERT_EQUAL(3125000, BM1366_EMULATOR_chain(0)->host_baud);
+    TEST_ASSERT_EQUAL(1000000, BM1366_EMULATOR_chain(1)->chip_baud);
+    TEST_ASSERT_EQUAL(1000000, BM1366_EMULATOR_chain(1)->host_baud);
+}
+
+TEST_CASE("a chip frequency only lands on its own chain", "[bm1366]")
+{
+    cold_start();
+    TEST_ASSERT_TRUE(BM1366_send_hash_frequency(FREQUENCY));
+    TEST_ASSERT_TRUE(BM1366_set_chip_frequency(1, 1, CHIP_FREQUENCY));
+
+    uint32_t chain_pll = chip_pll(0, 0);
+    TEST_ASSERT_NOT_EQUAL(0, chain_pll);
+    for (int i = 0; i < chip_counts[0]; i++) {
+        TEST_ASSERT_EQUAL_HEX32(chain_pll, chip_pll(0, i));
+    }
+    TEST_ASSERT_EQUAL_HEX32(chain_pll, chip_pll(1, 0));
+    TEST_ASSERT_NOT_EQUAL(chain_pll, chip_pll(1, 1));
+    TEST_ASSERT_EQUAL_FLOAT(0, BM1366_get_chip_frequency(0, 1));
+    TEST_ASSERT_EQUAL_FLOAT(CHIP_FREQUENCY, BM1366_get_chip_frequency(1, 1));
+}
+
+TEST_CASE("a software restart resumes both chains", "[bm1366]")
+{
+    cold_start();
+    BM1366_EMULATOR_chain(1)->max_clean_baud = 1000000;
+    BM1366_set_max_baud(0);
+    BM1366_set_max_baud(1);
+    BM1366_send_hash_frequency(FREQUENCY);
+    BM1366_set_chip_frequency(1, 1, CHIP_FREQUENCY);
+    uint32_t chip_pll_before = chip_pll(1, 1);
+
+    software_restart();
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        SERIAL_init(chain);
+        TEST_ASSERT_EQUAL(chip_counts[chain], BM1366_init(chain, FREQUENCY, chip_counts[chain]));
+    }
+    TEST_ASSERT_EQUAL(3125000, BM1366_set_max_baud(0));
+    TEST_ASSERT_EQUAL(1000000, BM1366_set_max_baud(1));
+
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        bm1366_emulated_chain *c = BM1366_EMULATOR_chain(chain);
+        TEST_ASSERT_EQUAL(0, c->resets);
+        TEST_ASSERT_EQUAL(0, c->chip_id_reads);
+        TEST_ASSERT_EQUAL(0, c->baud_switches);
+    }
+    TEST_ASSERT_EQUAL_FLOAT(CHIP_FREQUENCY, BM1366_get_chip_frequency(1, 1));
+    TEST_ASSERT_EQUAL_HEX32(chip_pll_before, chip_pll(1, 1));
+}
+
+TEST_CASE("a power cycled chain is initialized cold on its own", "[bm1366]")
+{
+    cold_start();
+    BM1366_set_max_baud(0);
+    BM1366_set_max_baud(1);
+    BM1366_send_hash_frequency(FREQUENCY);
+    BM1366_set_chip_frequency(0, 2, CHIP_FREQUENCY);
+    BM1366_set_chip_frequency(1, 1, CHIP_FREQUENCY);
+
+    BM1366_EMULATOR_power_cycle(1);
+    software_restart();
+    for (uint8_t chain = 0; chain < ASIC_MAX_CHAINS; chain++) {
+        SERIAL_init(chain);
+        TEST_ASSERT_EQUAL(chip_counts[chain], BM1366_init(chain, FREQUENCY, chip_counts[chain]));
+    }
+
+    bm1366_emulated_chain *resumed = BM1366_EMULATOR_chain(0);
+    TEST_ASSERT_EQUAL(0, resumed->resets);
+    TEST_ASSERT_EQUAL(0, resumed->chip_id_reads);
+    TEST_ASSERT_EQUAL_FLOAT(CHIP_FREQUENCY, BM1366_get_chip_frequency(0, 2));
+
+    bm1366_emulated_chain *cold = BM1366_EMULATOR_chain(1);
+    TEST_ASSERT_EQUAL(1, cold->resets);
+    TEST_ASSERT_EQUAL(1, cold->chip_id_reads);
+    TEST_ASSERT_EQUAL_FLOAT(0, BM1366_get_chip_frequency(1, 1));
+    for (int i = 0; i < cold->chip_count; i++) {
+        TEST_ASSERT_EQUAL(i * BM1366_CHIP_ADDRESS_INTERVAL, cold->chips[i].address);
+    }
+}
@@ -0,0 +1,131 @@
+#include "crc.h"
+#include "bm1366.h"
+#include "esp_timer.h"
+#include "unity.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a job frame hashes its header and payload, the largest the chain is sent
+#define JOB_CRC_LEN (sizeof(BM1366_job) + 2)
+#define TIMING_ROUNDS 1000
+
+// the bit-serial crc5 the table was generated from, see crc.c
+static uint8_t crc5_reference(const uint8_t *data, uint8_t len)
+{
+    uint8_t crcin[5] = {1, 1, 1, 1, 1};
+    uint8_t crcout[5];
+
+    for (int i = 0; i < len * 8; i++) {
+        uint8_t din = (data[i / 8] >> (7 - i % 8)) & 1;
+        crcout[0] = crcin[4] ^ din;
+        crcout[1] = crcin[0];
+        crcout[2] = crcin[1] ^ crcin[4] ^ din;
+        crcout[3] = crcin[2];
+        crcout[4] = crcin[3];
+        memcpy(crcin, crcout, 5);
+    }
+    return crcin[4] << 4 | crcin[3] << 3 | crcin[2] << 2 | crcin[1] << 1 | crcin[0];
+}
+
+// CRC-16/CCITT-FALSE one bit at a time, poly 0x1021 and init 0xffff
+static uint16_t crc16_false_reference(const uint8_t *data, uint16_t len)
+{
+    uint16_t crc = 0xffff;
+
+    while (len-- > 0) {
+        crc ^= *data++ << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static void fill_random(uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = rand();
+    }
+}
+
+TEST_CASE("crc5 matches the frames the chips accept", "[crc]")
+{
+    // header bytes and the crc of chain inactive, read chip id and the max baud write
+    static const uint8_t chain_inactive[] = {0x53, 0x05, 0x00, 0x00};
+    static const uint8_t read_chip_id[] = {0x52, 0x05, 0x00, 0x00};
+    static const uint8_t max_baud[] = {0x51, 0x09, 0x00, 0x28, 0x11, 0x30, 0x02, 0x00};
+
+    TEST_ASSERT_EQUAL_HEX8(0x03, crc5(chain_inactive, sizeof(chain_inactive)));
+    TEST_ASSERT_EQUAL_HEX8(0x0A, crc5(read_chip_id, sizeof(read_chip_id)));
+    TEST_ASSERT_EQUAL_HEX8(0x03, crc5(max_baud, sizeof(max_baud)));
+}
+
+TEST_CASE("crc5 table matches the bit-serial reference", "[crc]")
+{
+    uint8_t buf[JOB_CRC_LEN];
+
+    srand(1366);
+    for (int i = 0; i < 1000; i++) {
+        uint8_t len = 1 + rand() % sizeof(buf);
+        fill_random(buf, len);
+        TEST_ASSERT_EQUAL_HEX8(crc5_reference(buf, len), crc5(buf, len));
+    }
+    for (int b = 0; b < 256; b++) {
+        buf[0] = b;
+        TEST_ASSERT_EQUAL_HEX8(crc5_reference(buf, 1), crc5(buf, 1));
+    }
+}
+
+TEST_CASE("crc16_false matches the reference", "[crc]")
+{
+    static const uint8_t check[] = "123456789";
+    uint8_t buf[JOB_CRC_LEN];
+
+    // the catalogue check value of CRC-16/CCITT-FALSE
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, crc16_false(check, sizeof(check) - 1));
+
+    srand(1397);
+    for (int i = 0; i < 1000; i++) {
+        uint16_t len = 1 + rand() % sizeof(buf);
+        fill_random(buf, len);
+        TEST_ASSERT_EQUAL_HEX16(crc16_false_reference(buf, len), crc16_false(buf, len));
+    }
+}
+
+TEST_CASE("crc time per job frame", "[crc][timing]")
+{
+    uint8_t buf[JOB_CRC_LEN];
+    volatile uint32_t sink = 0;
+    fill_random(buf, sizeof(buf));
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < TIMING_ROUNDS; i++) {
+        sink += crc5(buf, sizeof(buf));
+    }
+    int64_t crc5_table_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < TIMING_ROUNDS; i++) {
+        sink += crc5_reference(buf, sizeof(buf));
+    }
+    int64_t crc5_serial_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < TIMING_ROUNDS; i++) {
+        sink += crc16_false(buf, sizeof(buf));
+    }
+    int64_t crc16_table_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    for (int i = 0; i < TIMING_ROUNDS; i++) {
+        sink += crc16_false_reference(buf, sizeof(buf));
+    }
+    int64_t crc16_serial_us = esp_timer_get_time() - start;
+
+    printf("%u byte job frame, %d rounds: crc5 %" PRId64 " us (bit-serial %" PRId64 " us), crc16 %" PRId64 " us (bit-serial %" PRId64 " us)\n",
+           (unsigned) sizeof(buf), TIMING_ROUNDS, crc5_table_us, crc5_serial_us, crc16_table_us, crc16_serial_us);
+    TEST_ASSERT_LESS_THAN(crc5_serial_us, crc5_table_us);
+    TEST_ASSERT_LESS_THAN(crc16_serial_us, crc16_table_us);
+}
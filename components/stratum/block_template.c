@@ -0,0 +1,523 @@
+/******************************************************************************
+ *  *
+ * References:
+ *  1. BIP 22/23 getblocktemplate - [link](https://github.com/bitcoin/bips/blob/master/bip-0022.mediawiki)
+ *  2. BIP 34 block height in coinbase - [link](https://github.com/bitcoin/bips/blob/master/bip-0034.mediawiki)
+ *  3. BIP 141 witness commitment - [link](https://github.com/bitcoin/bips/blob/master/bip-0141.mediawiki)
+ *
+ * JSON-RPC to a node over plain HTTP/1.0, one connection per call. The coinbase and
+ * merkle branches are built here in the same form a pool sends with mining.notify.
+ *****************************************************************************/
+
+#include "block_template.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "mbedtls/base64.h"
+#include "mining.h"
+#include "pool_connect.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char * TAG = "block_template";
+
+static const char coinbase_tag[] = "/bitaxe/";
+
+static int _connect(const gbt_node * node, int timeout_s)
+{
+    int sock = POOL_connect(node->host, node->port, POOL_CONNECT_TIMEOUT_MS, NULL);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to connect to %s:%u (%d)", node->host, node->port, sock);
+        return -1;
+    }
+
+    struct timeval timeout = {.tv_sec = timeout_s};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+static bool _send_all(int sock, const char * data, size_t len)
+{
+    while (len > 0) {
+        int ret = write(sock, data, len);
+        if (ret <= 0) {
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+// Reads until the node closes the connection, which it does after one HTTP/1.0 response
+static char * _recv_response(int sock)
+{
+    size_t size = 4096;
+    size_t used = 0;
+    char * buf = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+
+    while (buf != NULL) {
+        if (used + 1 == size) {
+            if (size >= GBT_MAX_RESPONSE_SIZE) {
+                ESP_LOGE(TAG, "Response over %d bytes, lower -blockmaxweight on the node", GBT_MAX_RESPONSE_SIZE);
+                heap_caps_free(buf);
+                return NULL;
+            }
+            char * grown = heap_caps_realloc(buf, size * 2, MALLOC_CAP_SPIRAM);
+            if (grown == NULL) {
+                ESP_LOGE(TAG, "Out of memory for a %u byte response", (unsigned) size * 2);
+                heap_caps_free(buf);
+                return NULL;
+            }
+            buf = grown;
+            size *= 2;
+        }
+
+        int ret = recv(sock, buf + used, size - used - 1, 0);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to read response (errno %d: %s)", errno, strerror(errno));
+            heap_caps_free(buf);
+            return NULL;
+        }
+        if (ret == 0) {
+            buf[used] = '\0';
+            break;
+        }
+        used += ret;
+    }
+    return buf;
+}
+
+void GBT_set_auth(gbt_node * node, const char * user, const char * password)
+{
+    char credentials[90];
+    size_t len = snprintf(credentials, sizeof(credentials), "%s:%s", user, password);
+    size_t olen;
+
+    if (len >= sizeof(credentials) ||
+        mbedtls_base64_encode((unsigned char *) node->auth, sizeof(node->auth), &olen, (unsigned char *) credentials, len) != 0) {
+        ESP_LOGE(TAG, "RPC credentials too long");
+        node->auth[0] = '\0';
+    }
+}
+
+/// @brief calls a JSON-RPC method on the node
+/// @param params JSON array of the method's parameters
+/// @param timeout_s how long the node may take to answer, long polls are held until the template changes
+/// @return the parsed response, the caller deletes it. NULL if the call failed or the node returned an error
+cJSON * GBT_rpc(const gbt_node * node, const char * method, const char * params, int timeout_s)
+{
+    char request[96];
+    char head[320];
+    size_t params_len = strlen(params);
+
+    int request_len = snprintf(request, sizeof(request), "{\"jsonrpc\":\"1.0\",\"id\":\"bitaxe\",\"method\":\"%s\",\"params\":", method);
+    int head_len = snprintf(head, sizeof(head),
+                            "POST / HTTP/1.0\r\n"
+                            "Host: %s:%u\r\n"
+                            "Authorization: Basic %s\r\n"
+                            "Content-Type: application/json\r\n"
+                            "Content-Length: %u\r\n\r\n",
+                            node->host, node->port, node->auth, (unsigned) (request_len + params_len + 1));
+
+    int sock = _connect(node, timeout_s);
+    if (sock < 0) {
+        return NULL;
+    }
+
+    char * response = NULL;
+    if (_send_all(sock, head, head_len) && _send_all(sock, request, request_len) && _send_all(sock, params, params_len) &&
+        _send_all(sock, "}", 1)) {
+        response = _recv_response(sock);
+    }
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+
+    if (response == NULL) {
+        return NULL;
+    }
+
+    int status = 0;
+    sscanf(response, "HTTP/%*s %d", &status);
+    char * body = strstr(response, "\r\n\r\n");
+    cJSON * root = body != NULL ? cJSON_Parse(body + 4) : NULL;
+    heap_caps_free(response);
+
+    // a failed login comes back without a body
+    if (root == NULL) {
+        ESP_LOGE(TAG, "%s failed, HTTP %d", method, status);
+        return NULL;
+    }
+
+    cJSON * error = cJSON_GetObjectItem(root, "error");
+    if (error != NULL && !cJSON_IsNull(error)) {
+        cJSON * message = cJSON_GetObjectItem(error, "message");
+        ESP_LOGE(TAG, "%s failed: %s", method, cJSON_IsString(message) ? message->valuestring : "unknown error");
+        cJSON_Delete(root);
+        return NULL;
+    }
+    return root;
+}
+
+/// @brief asks the node for the output script of an address, so the device never decodes addresses itself
+bool GBT_get_payout_script(const gbt_node * node, const char * address, uint8_t * script, size_t * script_len)
+{
+    char params[128];
+    snprintf(params, sizeof(params), "[\"%s\"]", address);
+
+    cJSON * root = GBT_rpc(node, "validateaddress", params, GBT_RPC_TIMEOUT_S);
+    if (root == NULL) {
+        return false;
+    }
+
+    cJSON * result = cJSON_GetObjectItem(root, "result");
+    cJSON * script_hex = cJSON_GetObjectItem(result, "scriptPubKey");
+    bool valid = cJSON_IsTrue(cJSON_GetObjectItem(result, "isvalid")) && cJSON_IsString(script_hex) &&
+                 strlen(script_hex->valuestring) / 2 <= GBT_MAX_SCRIPT_SIZE;
+
+    if (valid) {
+        *script_len = hex2bin(script_hex->valuestring, script, strlen(script_hex->valuestring) / 2);
+    } else {
+        ESP_LOGE(TAG, "Payout address %s rejected by the node", address);
+    }
+    cJSON_Delete(root);
+    return valid;
+}
+
+static size_t _put(uint8_t * buf, size_t pos, const void * data, size_t len)
+{
+    memcpy(buf + pos, data, len);
+    return pos + len;
+}
+
+static size_t _put_le(uint8_t * buf, size_t pos, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        buf[pos++] = value >> (8 * i);
+    }
+    return pos;
+}
+
+// CompactSize
+static size_t _put_varint(uint8_t * buf, size_t pos, uint64_t value)
+{
+    if (value < 0xfd) {
+        return _put_le(buf, pos, value, 1);
+    }
+    if (value <= 0xffff) {
+        buf[pos] = 0xfd;
+        return _put_le(buf, pos + 1, value, 2);
+    }
+    if (value <= 0xffffffff) {
+        buf[pos] = 0xfe;
+        return _put_le(buf, pos + 1, value, 4);
+    }
+    buf[pos] = 0xff;
+    return _put_le(buf, pos + 1, value, 8);
+}
+
+// BIP34 height push, the minimal script number encoding the node checks against
+static size_t _put_height(uint8_t * buf, size_t pos, uint32_t height)
+{
+    if (height <= 16) {
+        // OP_0, OP_1 .. OP_16
+        buf[pos] = height == 0 ? 0x00 : 0x50 + height;
+        return pos + 1;
+    }
+
+    size_t len_pos = pos++;
+    while (height > 0) {
+        buf[pos++] = height & 0xff;
+        height >>= 8;
+    }
+    // keep the number positive
+    if (buf[pos - 1] & 0x80) {
+        buf[pos++] = 0x00;
+    }
+    buf[len_pos] = pos - len_pos - 1;
+    return pos;
+}
+
+static char * _to_hex(const uint8_t * buf, size_t len)
+{
+    char * hex = malloc(len * 2 + 1);
+    if (hex != NULL) {
+        bin2hex(buf, len, hex, len * 2 + 1);
+    }
+    return hex;
+}
+
+// Splits the coinbase around the extranonce: version, the null input and its scriptSig up
+// to the height go in coinbase_1, the tag, sequence, outputs and lock time in coinbase_2
+static bool _build_coinbase(block_template * tmpl, uint64_t value, const uint8_t * payout_script, size_t payout_script_len,
+                            const char * witness_commitment)
+{
+    uint8_t height[8];
+    size_t height_len = _put_height(height, 0, tmpl->height);
+    uint8_t buf[256];
+    size_t pos = 0;
+
+    pos = _put_le(buf, pos, 1, 4);
+    pos = _put_varint(buf, pos, 1);
+    memset(buf + pos, 0, 32);
+    pos = _put_le(buf, pos + 32, 0xffffffff, 4);
+    pos = _put_varint(buf, pos, height_len + GBT_EXTRANONCE_1_LEN + GBT_EXTRANONCE_2_LEN + strlen(coinbase_tag));
+    pos = _put(buf, pos, height, height_len);
+    tmpl->coinbase_1 = _to_hex(buf, pos);
+
+    pos = _put(buf, 0, coinbase_tag, strlen(coinbase_tag));
+    pos = _put_le(buf, pos, 0xffffffff, 4);
+    pos = _put_varint(buf, pos, witness_commitment != NULL ? 2 : 1);
+    pos = _put_le(buf, pos, value, 8);
+    pos = _put_varint(buf, pos, payout_script_len);
+    pos = _put(buf, pos, payout_script, payout_script_len);
+    if (witness_commitment != NULL) {
+        size_t len = strlen(witness_commitment) / 2;
+        pos = _put_le(buf, pos, 0, 8);
+        pos = _put_varint(buf, pos, len);
+        pos += hex2bin(witness_commitment, buf + pos, len);
+    }
+    pos = _put_le(buf, pos, 0, 4);
+    tmpl->coinbase_2 = _to_hex(buf, pos);
+
+    return tmpl->coinbase_1 != NULL && tmpl->coinbase_2 != NULL;
+}
+
+// Branches from the coinbase up to the root, the list mining.notify carries. hashes holds
+// the txids after the coinbase and is used as scratch space
+static size_t _merkle_branches(uint8_t (*hashes)[32], size_t count, uint8_t * branches)
+{
+    size_t n = 0;
+
+    // each row is kept without its coinbase side entry, the first hash left is the branch
+    while (count > 0 && n < GBT_MAX_MERKLE_BRANCHES) {
+        memcpy(branches + n++ * 32, hashes[0], 32);
+
+        size_t next = 0;
+        for (size_t i = 1; i < count; i += 2) {
+            uint8_t pair[64];
+            memcpy(pair, hashes[i], 32);
+            // an odd row pairs its last hash with itself
+            memcpy(pair + 32, hashes[i + 1 < count ? i + 1 : i], 32);
+            uint8_t * hash = double_sha256_bin(pair, 64);
+            memcpy(hashes[next++], hash, 32);
+            free(hash);
+        }
+        count = next;
+    }
+    return n;
+}
+
+static const char * _get_string(const cJSON * object, const char * name)
+{
+    cJSON * item = cJSON_GetObjectItem(object, name);
+    return cJSON_IsString(item) ? item->valuestring : NULL;
+}
+
+static bool _get_u32(const cJSON * object, const char * name, uint32_t * value)
+{
+    cJSON * item = cJSON_GetObjectItem(object, name);
+    if (!cJSON_IsNumber(item)) {
+        return false;
+    }
+    *value = (uint32_t) item->valuedouble;
+    return true;
+}
+
+/// @brief fills tmpl from a getblocktemplate result, paying the whole coinbase value to payout_script
+/// @return false if the template is malformed or doesn't fit in memory, tmpl may be partly filled
+bool GBT_parse_template(const cJSON * result, const uint8_t * payout_script, size_t payout_script_len, const char * extranonce_1,
+                        block_template * tmpl)
+{
+    const char * prev_hash = _get_string(result, "previousblockhash");
+    const char * bits = _get_string(result, "bits");
+    const char * longpollid = _get_string(result, "longpollid");
+    const char * witness_commitment = _get_string(result, "default_witness_commitment");
+    cJSON * coinbase_value = cJSON_GetObjectItem(result, "coinbasevalue");
+    cJSON * transactions = cJSON_GetObjectItem(result, "transactions");
+    cJSON * tx;
+
+    if (prev_hash == NULL || strlen(prev_hash) != 64 || bits == NULL || !cJSON_IsNumber(coinbase_value) || !cJSON_IsArray(transactions) ||
+        !_get_u32(result, "version", &tmpl->version) || !_get_u32(result, "height", &tmpl->height) ||
+        !_get_u32(result, "curtime", &tmpl->curtime) ||
+        (witness_commitment != NULL && strlen(witness_commitment) / 2 > GBT_MAX_SCRIPT_SIZE)) {
+        ESP_LOGE(TAG, "Malformed block template");
+        return false;
+    }
+
+    size_t data_len = 0;
+    cJSON_ArrayForEach(tx, transactions)
+    {
+        const char * data = _get_string(tx, "data");
+        const char * txid = _get_string(tx, "txid");
+        if (data == NULL || txid == NULL || strlen(txid) != 64) {
+            ESP_LOGE(TAG, "Malformed transaction in block template");
+            return false;
+        }
+        data_len += strlen(data);
+    }
+
+    tmpl->tx_count = cJSON_GetArraySize(transactions);
+    tmpl->nbits = strtoul(bits, NULL, 16);
+    hex2bin(prev_hash, tmpl->prev_hash, 32);
+    reverse_bytes(tmpl->prev_hash, 32);
+    snprintf(tmpl->longpollid, sizeof(tmpl->longpollid), "%s", longpollid != NULL ? longpollid : "");
+    snprintf(tmpl->extranonce_1, sizeof(tmpl->extranonce_1), "%s", extranonce_1);
+    tmpl->segwit = witness_commitment != NULL;
+
+    uint8_t(*txids)[32] = malloc((tmpl->tx_count + 1) * 32);
+    tmpl->tx_data = heap_caps_malloc(data_len + 1, MALLOC_CAP_SPIRAM);
+    tmpl->merkle_branches = malloc(GBT_MAX_MERKLE_BRANCHES * 32);
+    if (txids == NULL || tmpl->tx_data == NULL || tmpl->merkle_branches == NULL) {
+        ESP_LOGE(TAG, "Out of memory for a block template of %u transactions", (unsigned) tmpl->tx_count);
+        free(txids);
+        return false;
+    }
+
+    size_t pos = 0;
+    size_t i = 0;
+    cJSON_ArrayForEach(tx, transactions)
+    {
+        const char * data = _get_string(tx, "data");
+        size_t len = strlen(data);
+        memcpy(tmpl->tx_data + pos, data, len);
+        pos += len;
+
+        // txids are shown byte reversed
+        hex2bin(_get_string(tx, "txid"), txids[i], 32);
+        reverse_bytes(txids[i++], 32);
+    }
+    tmpl->tx_data[pos] = '\0';
+
+    tmpl->n_merkle_branches = _merkle_branches(txids, tmpl->tx_count, tmpl->merkle_branches);
+    free(txids);
+
+    return _build_coinbase(tmpl, (uint64_t) coinbase_value->valuedouble, payout_script, payout_script_len, witness_commitment);
+}
+
+/// @brief a job for the job factory in the same hex form as mining.notify, extranonce_2 is rolled as for a pool
+mining_notify * GBT_template_to_notify(const block_template * tmpl)
+{
+    mining_notify * notify = calloc(1, sizeof(mining_notify));
+    char job_id[11];
+    uint8_t swapped[32];
+
+    snprintf(job_id, sizeof(job_id), "%lu", tmpl->id);
+    notify->job_id = strdup(job_id);
+
+    // mining.notify sends the previous block hash with every 4 byte word swapped
+    for (int i = 0; i < 32; i += 4) {
+        swapped[i] = tmpl->prev_hash[i + 3];
+        swapped[i + 1] = tmpl->prev_hash[i + 2];
+        swapped[i + 2] = tmpl->prev_hash[i + 1];
+        swapped[i + 3] = tmpl->prev_hash[i];
+    }
+    notify->prev_block_hash = _to_hex(swapped, 32);
+
+    notify->coinbase_1 = strdup(tmpl->coinbase_1);
+    notify->coinbase_2 = strdup(tmpl->coinbase_2);
+    notify->merkle_branches = malloc(tmpl->n_merkle_branches * 32);
+    memcpy(notify->merkle_branches, tmpl->merkle_branches, tmpl->n_merkle_branches * 32);
+    notify->n_merkle_branches = tmpl->n_merkle_branches;
+
+    notify->version = tmpl->version;
+    notify->target = tmpl->nbits;
+    notify->ntime = tmpl->curtime;
+    return notify;
+}
+
+static char * _append(char * dest, const char * src, size_t len)
+{
+    memcpy(dest, src, len);
+    return dest + len;
+}
+
+/// @brief assembles the block for a nonce found on tmpl as submitblock's params, ["<block hex>"]
+/// @return the params in PSRAM to be freed with heap_caps_free, NULL if they don't fit in memory
+char * GBT_block_params(const block_template * tmpl, const char * extranonce_2, uint32_t version, uint32_t ntime, uint32_t nonce)
+{
+    char * coinbase = construct_coinbase_tx(tmpl->coinbase_1, tmpl->coinbase_2, tmpl->extranonce_1, extranonce_2);
+    char * merkle_root = calculate_merkle_root_hash(coinbase, (uint8_t(*)[32]) tmpl->merkle_branches, tmpl->n_merkle_branches);
+
+    uint8_t header[80];
+    memcpy(header, &version, 4);
+    memcpy(header + 4, tmpl->prev_hash, 32);
+    hex2bin(merkle_root, header + 36, 32);
+    memcpy(header + 68, &ntime, 4);
+    memcpy(header + 72, &tmpl->nbits, 4);
+    memcpy(header + 76, &nonce, 4);
+    free(merkle_root);
+
+    uint8_t tx_count[9];
+    size_t tx_count_len = _put_varint(tx_count, 0, tmpl->tx_count + 1);
+    size_t coinbase_len = strlen(coinbase);
+    size_t tx_data_len = strlen(tmpl->tx_data);
+
+    // the params are ["<block hex>"], a witness adds marker, flag and one 32 byte item
+    size_t size = 2 + 160 + tx_count_len * 2 + coinbase_len + 4 + 68 + tx_data_len + 3;
+    char * params = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (params == NULL) {
+        ESP_LOGE(TAG, "Out of memory for a %u byte block", (unsigned) size / 2);
+        free(coinbase);
+        return NULL;
+    }
+
+    char * p = _append(params, "[\"", 2);
+    p += bin2hex(header, sizeof(header), p, 161);
+    p += bin2hex(tx_count, tx_count_len, p, tx_count_len * 2 + 1);
+    if (tmpl->segwit) {
+        p = _append(p, coinbase, 8);
+        p = _append(p, "0001", 4);
+        p = _append(p, coinbase + 8, coinbase_len - 16);
+        // the all zero witness reserved value the template's commitment was made with
+        p = _append(p, "0120", 4);
+        memset(p, '0', 64);
+        p = _append(p + 64, coinbase + coinbase_len - 8, 8);
+    } else {
+        p = _append(p, coinbase, coinbase_len);
+    }
+    p = _append(p, tmpl->tx_data, tx_data_len);
+    _append(p, "\"]", 3);
+    free(coinbase);
+    return params;
+}
+
+/// @brief hands the block for a nonce found on tmpl to the node with submitblock
+/// @return true if the node took the block
+bool GBT_submit_block(const gbt_node * node, const block_template * tmpl, const char * extranonce_2, uint32_t version,
+                      uint32_t ntime, uint32_t nonce)
+{
+    char * params = GBT_block_params(tmpl, extranonce_2, version, ntime, nonce);
+    if (params == NULL) {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Submitting block %lu", tmpl->height);
+    cJSON * root = GBT_rpc(node, "submitblock", params, GBT_RPC_TIMEOUT_S);
+    heap_caps_free(params);
+    if (root == NULL) {
+        return false;
+    }
+
+    // null when the block was taken, otherwise the reason it wasn't
+    cJSON * result = cJSON_GetObjectItem(root, "result");
+    bool accepted = cJSON_IsNull(result);
+    if (accepted) {
+        ESP_LOGI(TAG, "Block %lu accepted", tmpl->height);
+    } else {
+        ESP_LOGE(TAG, "Block %lu rejected: %s", tmpl->height, cJSON_IsString(result) ? result->valuestring : "unknown");
+    }
+    cJSON_Delete(root);
+    return accepted;
+}
+
+void GBT_free_template(block_template * tmpl)
+{
+    free(tmpl->coinbase_1);
+    free(tmpl->coinbase_2);
+    free(tmpl->merkle_branches);
+    heap_caps_free(tmpl->tx_data);
+    free(tmpl);
+}
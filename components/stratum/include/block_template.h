@@ -0,0 +1,75 @@
+#ifndef BLOCK_TEMPLATE_H
+#define BLOCK_TEMPLATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "cJSON.h"
+#include "stratum_api.h"
+
+// the whole RPC response is held while it is parsed. A node feeding a unit should
+// keep its templates under this with -blockmaxweight
+#define GBT_MAX_RESPONSE_SIZE (2 * 1024 * 1024)
+#define GBT_MAX_MERKLE_BRANCHES 32
+#define GBT_MAX_SCRIPT_SIZE 64
+#define GBT_LONGPOLL_ID_SIZE 128
+#define GBT_EXTRANONCE_1_LEN 4
+#define GBT_EXTRANONCE_2_LEN 4
+
+#define GBT_RPC_TIMEOUT_S 10
+// the node holds a long poll until the template changes, which on a quiet chain can take a while
+#define GBT_LONGPOLL_TIMEOUT_S 600
+
+typedef struct
+{
+    const char * host;
+    uint16_t port;
+    // base64 of user:password for HTTP basic auth
+    char auth[128];
+} gbt_node;
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t height;
+    uint32_t version;
+    uint32_t nbits;
+    uint32_t curtime;
+    // internal byte order, as it goes into the block header
+    uint8_t prev_hash[32];
+    char longpollid[GBT_LONGPOLL_ID_SIZE];
+
+    // coinbase hex either side of extranonce_1 + extranonce_2, like mining.notify
+    char * coinbase_1;
+    char * coinbase_2;
+    char extranonce_1[GBT_EXTRANONCE_1_LEN * 2 + 1];
+    // the coinbase carries a witness commitment, so it needs its witness in the block
+    bool segwit;
+
+    uint8_t * merkle_branches;
+    size_t n_merkle_branches;
+
+    // every transaction after the coinbase, serialized hex back to back
+    char * tx_data;
+    size_t tx_count;
+} block_template;
+
+void GBT_set_auth(gbt_node * node, const char * user, const char * password);
+
+cJSON * GBT_rpc(const gbt_node * node, const char * method, const char * params, int timeout_s);
+
+bool GBT_get_payout_script(const gbt_node * node, const char * address, uint8_t * script, size_t * script_len);
+
+bool GBT_parse_template(const cJSON * result, const uint8_t * payout_script, size_t payout_script_len, const char * extranonce_1,
+                        block_template * tmpl);
+
+mining_notify * GBT_template_to_notify(const block_template * tmpl);
+
+char * GBT_block_params(const block_template * tmpl, const char * extranonce_2, uint32_t version, uint32_t ntime, uint32_t nonce);
+
+bool GBT_submit_block(const gbt_node * node, const block_template * tmpl, const char * extranonce_2, uint32_t version,
+                      uint32_t ntime, uint32_t nonce);
+
+void GBT_free_template(block_template * tmpl);
+
+#endif // BLOCK_TEMPLATE_H
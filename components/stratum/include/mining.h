@@ -3,6 +3,9 @@
 
 #include "stratum_api.h"
 
+// large enough for the serialized job packet of any supported ASIC
+#define BM_JOB_MAX_FRAME_SIZE 96
+
 typedef struct
 {
     uint32_t version;
@@ -23,6 +26,11 @@ typedef struct
     uint32_t pool_diff;
     char *jobid;
     char *extranonce2;
+
+    // wire frame prepared by the ASIC driver when the job is built,
+    // dispatch only patches in the job id and its crc
+    uint8_t asic_frame[BM_JOB_MAX_FRAME_SIZE];
+    uint8_t asic_frame_len;
 } bm_job;
 
 void free_bm_job(bm_job *job);
@@ -0,0 +1,29 @@
+#ifndef POOL_CONNECT_H
+#define POOL_CONNECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "lwip/sockets.h"
+
+// lwIP doesn't hand out record TTLs, resolved addresses are kept this long instead. An
+// expired entry is still used if the lookup to refresh it fails
+#define POOL_DNS_TTL_S 300
+#define POOL_DNS_CACHE_SIZE 4
+#define POOL_HOST_SIZE 128
+// IPv6 and IPv4 candidates together, interleaved IPv6 first
+#define POOL_MAX_ADDRESSES 4
+
+#define POOL_CONNECT_TIMEOUT_MS 5000
+// how long one address gets before the next is tried alongside it, RFC 8305's connection attempt delay
+#define POOL_CONNECT_ATTEMPT_DELAY_MS 250
+
+// why a host couldn't be reached
+#define POOL_CONNECT_DNS_FAILED -1
+#define POOL_CONNECT_SOCKET_FAILED -2
+#define POOL_CONNECT_FAILED -3
+
+int POOL_resolve(const char * host, uint16_t port, struct sockaddr_storage * addrs, int max_addrs);
+
+int POOL_connect(const char * host, uint16_t port, int timeout_ms, int64_t * connect_us);
+
+#endif // POOL_CONNECT_H
@@ -2,6 +2,8 @@
 #define STRATUM_API_H
 
 #include "cJSON.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -17,14 +19,13 @@ typedef enum
     MINING_SET_DIFFICULTY,
     MINING_SET_VERSION_MASK,
     STRATUM_RESULT,
-    STRATUM_RESULT_SETUP,
     STRATUM_RESULT_VERSION_MASK,
     STRATUM_RESULT_SUBSCRIBE,
     CLIENT_RECONNECT
 } stratum_method;
 
-static const int  STRATUM_ID_SUBSCRIBE    = 1;
-static const int  STRATUM_ID_CONFIGURE    = 2;
+// long enough for the reasons pools give, "Low difficulty share" and the like
+#define STRATUM_V1_ERROR_SIZE 48
 
 typedef struct
 {
@@ -39,6 +40,8 @@ typedef struct
     uint32_t target;
     uint32_t ntime;
     uint32_t difficulty;
+    // set for header-only jobs where the pool built the merkle root, coinbase and branches are unused
+    char *merkle_root;
 } mining_notify;
 
 typedef struct
@@ -59,28 +62,121 @@ typedef struct
     uint32_t version_mask;
     // result
     bool response_success;
+    // the pool's reason when it wasn't a success, empty if it gave none
+    char error_message[STRATUM_V1_ERROR_SIZE];
 } StratumApiV1Message;
 
-void STRATUM_V1_reset_uid();
+// requests kept per connection until the pool answers them, slots are picked by message id
+// so one still unanswered that many requests later is given up on
+#define STRATUM_V1_MAX_PENDING 32
+// job ids are kept for logging, a longer one is cut short
+#define STRATUM_V1_JOB_ID_SIZE 32
 
-void STRATUM_V1_initialize_buffer();
-
-char *STRATUM_V1_receive_jsonrpc_line(int sockfd);
-
-int STRATUM_V1_subscribe(int socket, char * model);
+typedef enum
+{
+    STRATUM_REQUEST_SUBSCRIBE,
+    STRATUM_REQUEST_CONFIGURE,
+    STRATUM_REQUEST_SUGGEST_DIFFICULTY,
+    STRATUM_REQUEST_AUTHORIZE,
+    STRATUM_REQUEST_SUBMIT,
+    // a share from a swarm miner, answered through the proxy
+    STRATUM_REQUEST_FORWARD
+} stratum_request;
+
+// A request the pool hasn't answered yet. Shares also keep what they were made from, so
+// the result can be put down to the job and the chip that found it
+typedef struct
+{
+    // 0 for a free slot
+    int message_id;
+    stratum_request type;
+    int64_t sent_us;
+    char job_id[STRATUM_V1_JOB_ID_SIZE];
+    uint32_t nonce;
+    uint32_t difficulty;
+    uint8_t chain;
+    uint16_t chip;
+} StratumPendingRequest;
+
+// lines waiting for the task that owns the socket, a full queue means the pool has stopped reading
+#define STRATUM_V1_TX_QUEUE_SIZE 32
+// how long a write may sit on a socket the pool isn't draining before the connection is dropped
+#define STRATUM_V1_WRITE_TIMEOUT_MS 5000
+// lines queued together go out in one write of up to this much
+#define STRATUM_V1_TX_BATCH_SIZE 4096
+// the start of every mining.submit, up to and including the worker name
+#define STRATUM_V1_SUBMIT_PREFIX_SIZE 256
+
+// One pool connection. Each keeps its own partly received line and its own message ids,
+// which must be unique per request that expects a response. Only the task reading from it
+// touches the socket, everyone else queues lines for it to write
+typedef struct
+{
+    int sock;
+    QueueHandle_t tx_queue;
+    // eventfd that wakes the owner out of select when a line is queued
+    int wake_fd;
+    // queued lines coalesced for writing, what's left of them starts at tx_sent
+    char *tx_batch;
+    size_t tx_len;
+    size_t tx_sent;
+    int64_t tx_progress_us;
+    // shares in the batch and the sum of when they were queued
+    int tx_batch_shares;
+    int64_t tx_batch_queued_us;
+    // smoothed time from a share being queued to it being written, and the longest the queue has been
+    float submit_latency_ms;
+    UBaseType_t tx_queue_peak;
+    // rendered once per session by STRATUM_V1_set_worker
+    char submit_prefix[STRATUM_V1_SUBMIT_PREFIX_SIZE];
+    size_t submit_prefix_len;
+    int send_uid;
+    char *rx_buf;
+    size_t rx_buf_size;
+    StratumPendingRequest pending[STRATUM_V1_MAX_PENDING];
+    // set for a stratum+ssl pool, everything then goes through its session
+    struct stratum_tls *tls;
+    // set by STRATUM_V1_request_close, the owner drops the connection when it next wakes
+    volatile bool close_requested;
+} StratumConnection;
+
+void STRATUM_V1_reset_connection(StratumConnection *connection, int sock);
+
+int STRATUM_V1_receive(StratumConnection *connection, void *buf, size_t len);
+
+char *STRATUM_V1_receive_jsonrpc_line(StratumConnection *connection);
+
+int STRATUM_V1_queue_frame(StratumConnection *connection, const void *data, size_t len, bool share);
+
+void STRATUM_V1_request_close(StratumConnection *connection);
+
+int STRATUM_V1_subscribe(StratumConnection *connection, char * model);
 
 void STRATUM_V1_parse(StratumApiV1Message *message, const char *stratum_json);
 
+void STRATUM_V1_parse_result(StratumApiV1Message *message, const char *stratum_json, stratum_request type);
+
 void STRATUM_V1_free_mining_notify(mining_notify *params);
 
-int STRATUM_V1_authenticate(int socket, const char *username, const char *pass);
+int STRATUM_V1_authenticate(StratumConnection *connection, const char *username, const char *pass);
 
-int STRATUM_V1_configure_version_rolling(int socket, uint32_t * version_mask);
+int STRATUM_V1_configure_version_rolling(StratumConnection *connection, uint32_t * version_mask);
 
-int STRATUM_V1_suggest_difficulty(int socket, uint32_t difficulty);
+int STRATUM_V1_suggest_difficulty(StratumConnection *connection, uint32_t difficulty);
 
-int STRATUM_V1_submit_share(int socket, const char *username, const char *jobid,
+void STRATUM_V1_set_worker(StratumConnection *connection, const char *username);
+
+int STRATUM_V1_submit_share(StratumConnection *connection, const char *jobid,
                             const char *extranonce_2, const uint32_t ntime, const uint32_t nonce,
-                            const uint32_t version);
+                            const uint32_t version, uint32_t difficulty, uint8_t chain, uint16_t chip);
+
+UBaseType_t STRATUM_V1_queue_depth(StratumConnection *connection);
+
+int STRATUM_V1_forward_share(StratumConnection *connection, const char *username, const char *jobid, const char *extranonce_2,
+                             const char *ntime, const char *nonce, const char *version);
+
+bool STRATUM_V1_take_pending(StratumConnection *connection, int64_t message_id, StratumPendingRequest *request);
+
+const char *STRATUM_V1_request_name(stratum_request type);
 
 #endif // STRATUM_API_H
\ No newline at end of file
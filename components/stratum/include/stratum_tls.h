@@ -0,0 +1,30 @@
+#ifndef STRATUM_TLS_H
+#define STRATUM_TLS_H
+
+#include "mbedtls/x509_crt.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// PSRAM set aside for mbedtls. Each connection keeps its record buffers here between
+// sessions, handshakes borrow the rest while they run
+#define STRATUM_TLS_ARENA_SIZE (96 * 1024)
+// sessions kept for resumption, one per pool
+#define STRATUM_TLS_SESSION_CACHE_SIZE 2
+#define STRATUM_TLS_HANDSHAKE_TIMEOUT_MS 10000
+
+typedef struct stratum_tls stratum_tls;
+
+stratum_tls * STRATUM_TLS_create(void);
+
+void STRATUM_TLS_set_ca_chain(stratum_tls * tls, mbedtls_x509_crt * ca);
+
+bool STRATUM_TLS_handshake(stratum_tls * tls, int sock, const char * host, uint16_t port, int64_t * handshake_us);
+
+int STRATUM_TLS_read(stratum_tls * tls, char * buf, size_t len);
+
+int STRATUM_TLS_write(stratum_tls * tls, const char * data, size_t len);
+
+void STRATUM_TLS_reset(stratum_tls * tls, bool notify);
+
+#endif // STRATUM_TLS_H
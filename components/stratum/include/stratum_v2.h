@@ -0,0 +1,89 @@
+#ifndef STRATUM_V2_H
+#define STRATUM_V2_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stratum_api.h"
+
+// frame header: extension_type U16, msg_type U8, msg_length U24, all little endian
+#define SV2_HEADER_SIZE 6
+// set in extension_type for messages addressed to a channel
+#define SV2_CHANNEL_MSG 0x8000
+#define SV2_MAX_PAYLOAD 512
+
+#define SV2_SETUP_CONNECTION 0x00
+#define SV2_SETUP_CONNECTION_SUCCESS 0x01
+#define SV2_SETUP_CONNECTION_ERROR 0x02
+#define SV2_OPEN_STANDARD_MINING_CHANNEL 0x10
+#define SV2_OPEN_STANDARD_MINING_CHANNEL_SUCCESS 0x11
+#define SV2_OPEN_MINING_CHANNEL_ERROR 0x12
+#define SV2_NEW_MINING_JOB 0x15
+#define SV2_SUBMIT_SHARES_STANDARD 0x1a
+#define SV2_SUBMIT_SHARES_SUCCESS 0x1c
+#define SV2_SUBMIT_SHARES_ERROR 0x1d
+#define SV2_SET_NEW_PREV_HASH 0x20
+#define SV2_SET_TARGET 0x21
+#define SV2_RECONNECT 0x25
+
+// SetupConnection flags for the mining protocol
+#define SV2_REQUIRES_STANDARD_JOBS 0x01
+#define SV2_REQUIRES_VERSION_ROLLING 0x04
+
+typedef enum
+{
+    STRATUM_V2_UNKNOWN,
+    STRATUM_V2_SETUP_SUCCESS,
+    STRATUM_V2_SETUP_ERROR,
+    STRATUM_V2_CHANNEL_OPENED,
+    STRATUM_V2_CHANNEL_ERROR,
+    STRATUM_V2_NEW_JOB,
+    STRATUM_V2_NEW_PREV_HASH,
+    STRATUM_V2_SET_TARGET,
+    STRATUM_V2_SHARES_ACCEPTED,
+    STRATUM_V2_SHARE_REJECTED,
+    STRATUM_V2_RECONNECT
+} stratum_v2_method;
+
+typedef struct
+{
+    stratum_v2_method method;
+    uint32_t channel_id;
+
+    // NewMiningJob, a future job has no min_ntime and waits for its SetNewPrevHash
+    uint32_t job_id;
+    bool future_job;
+    uint32_t version;
+    // header byte order, as they go into the block header
+    uint8_t merkle_root[32];
+
+    // SetNewPrevHash
+    uint8_t prev_hash[32];
+    uint32_t min_ntime;
+    uint32_t nbits;
+
+    // OpenStandardMiningChannel.Success, SetTarget
+    uint8_t target[32];
+
+    // SubmitShares.Success
+    uint32_t accepted_count;
+    // SubmitShares.Error
+    uint32_t sequence_number;
+
+    // *.Error
+    char error_code[64];
+} StratumApiV2Message;
+
+int STRATUM_V2_setup_connection(StratumConnection * connection, const char * host, uint16_t port, const char * hardware, const char * firmware);
+
+int STRATUM_V2_open_standard_channel(StratumConnection * connection, uint32_t request_id, const char * user, float nominal_hashrate);
+
+int STRATUM_V2_submit_share(StratumConnection * connection, uint32_t channel_id, uint32_t sequence_number, uint32_t job_id,
+                            uint32_t nonce, uint32_t ntime, uint32_t version);
+
+int STRATUM_V2_receive_message(StratumConnection * connection, StratumApiV2Message * message);
+
+mining_notify * STRATUM_V2_job_to_notify(const StratumApiV2Message * job, const StratumApiV2Message * prev_hash, uint32_t ntime);
+
+double STRATUM_V2_target_to_difficulty(const uint8_t * target);
+
+#endif // STRATUM_V2_H
@@ -8,6 +8,8 @@ int hex2char(uint8_t x, char *c);
 
 size_t bin2hex(const uint8_t *buf, size_t buflen, char *hex, size_t hexlen);
 
+void word2hex(uint32_t word, char *hex);
+
 uint8_t hex2val(char c);
 void flip80bytes(void *dest_p, const void *src_p);
 void flip32bytes(void *dest_p, const void *src_p);
@@ -61,6 +61,7 @@ bm_job construct_bm_job(mining_notify *params, const char *merkle_root, const ui
     new_job.target = params->target;
     new_job.ntime = params->ntime;
     new_job.pool_diff = params->difficulty;
+    new_job.asic_frame_len = 0;
 
     hex2bin(merkle_root, new_job.merkle_root, 32);
 
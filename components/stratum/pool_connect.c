@@ -0,0 +1,315 @@
+/******************************************************************************
+ *  *
+ * References:
+ *  1. RFC 8305 Happy Eyeballs Version 2 - [link](https://datatracker.ietf.org/doc/html/rfc8305)
+ *  2. RFC 8767 Serving Stale Data to Improve DNS Resiliency - [link](https://datatracker.ietf.org/doc/html/rfc8767)
+ *
+ * Connections to pools and nodes. Lookups go through a small cache so a reconnect
+ * doesn't wait on DNS, and connects are non-blocking with a bounded timeout.
+ *****************************************************************************/
+
+#include "pool_connect.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/netdb.h"
+#include <pthread.h>
+#include <string.h>
+
+static const char * TAG = "pool_connect";
+
+typedef struct
+{
+    char host[POOL_HOST_SIZE];
+    // ports are left 0, the caller's goes in on the way out
+    struct sockaddr_storage addrs[POOL_MAX_ADDRESSES];
+    int n_addrs;
+    int64_t expires_us;
+} dns_entry;
+
+static dns_entry dns_cache[POOL_DNS_CACHE_SIZE];
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static socklen_t _addr_len(const struct sockaddr_storage * addr)
+{
+#if LWIP_IPV6
+    if (addr->ss_family == AF_INET6) {
+        return sizeof(struct sockaddr_in6);
+    }
+#endif
+    return sizeof(struct sockaddr_in);
+}
+
+static void _set_port(struct sockaddr_storage * addr, uint16_t port)
+{
+#if LWIP_IPV6
+    if (addr->ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+        return;
+    }
+#endif
+    ((struct sockaddr_in *) addr)->sin_port = htons(port);
+}
+
+static void _addr_str(const struct sockaddr_storage * addr, char * str, size_t size)
+{
+#if LWIP_IPV6
+    if (addr->ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *) addr)->sin6_addr, str, size);
+        return;
+    }
+#endif
+    inet_ntop(AF_INET, &((const struct sockaddr_in *) addr)->sin_addr, str, size);
+}
+
+// Looks up one address family, returns how many addresses were found
+static int _lookup(const char * host, int family, struct sockaddr_storage * addrs, int max_addrs)
+{
+    struct addrinfo hints = {.ai_family = family, .ai_socktype = SOCK_STREAM};
+    struct addrinfo * res = NULL;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) {
+        return 0;
+    }
+
+    int n = 0;
+    for (struct addrinfo * ai = res; ai != NULL && n < max_addrs; ai = ai->ai_next) {
+        if (ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+            memset(&addrs[n], 0, sizeof(struct sockaddr_storage));
+            memcpy(&addrs[n++], ai->ai_addr, ai->ai_addrlen);
+        }
+    }
+    freeaddrinfo(res);
+    return n;
+}
+
+// Both families interleaved, IPv6 first, so a broken path on either costs one attempt delay
+static int _lookup_all(const char * host, struct sockaddr_storage * addrs)
+{
+    struct sockaddr_storage v4[POOL_MAX_ADDRESSES];
+    struct sockaddr_storage v6[POOL_MAX_ADDRESSES];
+    int n4 = _lookup(host, AF_INET, v4, POOL_MAX_ADDRESSES);
+    int n6 = 0;
+#if LWIP_IPV6
+    n6 = _lookup(host, AF_INET6, v6, POOL_MAX_ADDRESSES);
+#endif
+
+    int n = 0;
+    for (int i = 0; n < POOL_MAX_ADDRESSES && (i < n4 || i < n6); i++) {
+        if (i < n6) {
+            addrs[n++] = v6[i];
+        }
+        if (i < n4 && n < POOL_MAX_ADDRESSES) {
+            addrs[n++] = v4[i];
+        }
+    }
+    return n;
+}
+
+// Called with dns_lock held
+static dns_entry * _find(const char * host)
+{
+    for (int i = 0; i < POOL_DNS_CACHE_SIZE; i++) {
+        if (strcmp(dns_cache[i].host, host) == 0) {
+            return &dns_cache[i];
+        }
+    }
+    return NULL;
+}
+
+// Called with dns_lock held. An empty slot, or else the one closest to expiring
+static dns_entry * _evict(void)
+{
+    dns_entry * oldest = &dns_cache[0];
+    for (int i = 0; i < POOL_DNS_CACHE_SIZE; i++) {
+        if (dns_cache[i].host[0] == '\0') {
+            return &dns_cache[i];
+        }
+        if (dns_cache[i].expires_us < oldest->expires_us) {
+            oldest = &dns_cache[i];
+        }
+    }
+    return oldest;
+}
+
+// Marks host's addresses for a fresh lookup next time. They are kept for when that fails
+static void _expire(const char * host)
+{
+    pthread_mutex_lock(&dns_lock);
+    dns_entry * entry = _find(host);
+    if (entry != NULL) {
+        entry->expires_us = 0;
+    }
+    pthread_mutex_unlock(&dns_lock);
+}
+
+/// @brief resolves host through the cache, looking it up again once its entry has expired
+/// @param addrs filled with up to max_addrs addresses carrying port
+/// @return how many addresses there are, 0 if host couldn't be resolved
+int POOL_resolve(const char * host, uint16_t port, struct sockaddr_storage * addrs, int max_addrs)
+{
+    struct sockaddr_storage fresh[POOL_MAX_ADDRESSES];
+    int n_addrs = 0;
+    bool cacheable = strlen(host) < POOL_HOST_SIZE;
+
+    pthread_mutex_lock(&dns_lock);
+    dns_entry * entry = cacheable ? _find(host) : NULL;
+    if (entry != NULL && esp_timer_get_time() < entry->expires_us) {
+        n_addrs = entry->n_addrs < max_addrs ? entry->n_addrs : max_addrs;
+        memcpy(addrs, entry->addrs, n_addrs * sizeof(struct sockaddr_storage));
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    if (n_addrs == 0) {
+        // without the lock, a lookup can block for seconds
+        int n_fresh = _lookup_all(host, fresh);
+
+        pthread_mutex_lock(&dns_lock);
+        entry = cacheable ? _find(host) : NULL;
+        if (n_fresh > 0 && cacheable) {
+            if (entry == NULL) {
+                entry = _evict();
+                strcpy(entry->host, host);
+            }
+            memcpy(entry->addrs, fresh, n_fresh * sizeof(struct sockaddr_storage));
+            entry->n_addrs = n_fresh;
+            entry->expires_us = esp_timer_get_time() + POOL_DNS_TTL_S * 1000000LL;
+        }
+
+        if (n_fresh > 0) {
+            n_addrs = n_fresh < max_addrs ? n_fresh : max_addrs;
+            memcpy(addrs, fresh, n_addrs * sizeof(struct sockaddr_storage));
+        } else if (entry != NULL) {
+            ESP_LOGW(TAG, "Lookup for %s failed, using its last known addresses", host);
+            n_addrs = entry->n_addrs < max_addrs ? entry->n_addrs : max_addrs;
+            memcpy(addrs, entry->addrs, n_addrs * sizeof(struct sockaddr_storage));
+        }
+        pthread_mutex_unlock(&dns_lock);
+    }
+
+    for (int i = 0; i < n_addrs; i++) {
+        _set_port(&addrs[i], port);
+    }
+    return n_addrs;
+}
+
+// Opens a non-blocking socket and starts it connecting to addr
+static int _start_attempt(const struct sockaddr_storage * addr)
+{
+    int sock = socket(addr->ss_family, SOCK_STREAM, 0);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return POOL_CONNECT_SOCKET_FAILED;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, (const struct sockaddr *) addr, _addr_len(addr)) != 0 && errno != EINPROGRESS) {
+        ESP_LOGD(TAG, "Connect failed straight away (errno %d: %s)", errno, strerror(errno));
+        close(sock);
+        return POOL_CONNECT_FAILED;
+    }
+    return sock;
+}
+
+/// @brief connects to host, starting on its next address every POOL_CONNECT_ATTEMPT_DELAY_MS,
+/// or as soon as an attempt fails, until one gets through
+/// @param connect_us if not NULL, set to how long the winning attempt took
+/// @return the connected socket, blocking again, or one of the POOL_CONNECT_ errors
+int POOL_connect(const char * host, uint16_t port, int timeout_ms, int64_t * connect_us)
+{
+    struct sockaddr_storage addrs[POOL_MAX_ADDRESSES];
+    int socks[POOL_MAX_ADDRESSES];
+    int64_t started_us[POOL_MAX_ADDRESSES];
+
+    int n_addrs = POOL_resolve(host, port, addrs, POOL_MAX_ADDRESSES);
+    if (n_addrs == 0) {
+        ESP_LOGD(TAG, "Failed DNS lookup for %s", host);
+        return POOL_CONNECT_DNS_FAILED;
+    }
+
+    int64_t now_us = esp_timer_get_time();
+    int64_t deadline_us = now_us + timeout_ms * 1000LL;
+    int64_t next_attempt_us = now_us;
+    int n_started = 0;
+    int n_pending = 0;
+    int n_socket_failed = 0;
+    int winner = -1;
+
+    while (winner < 0 && now_us < deadline_us) {
+        if (n_started < n_addrs && now_us >= next_attempt_us) {
+            int sock = _start_attempt(&addrs[n_started]);
+            started_us[n_started] = now_us;
+            socks[n_started++] = sock;
+            if (sock >= 0) {
+                n_pending++;
+                next_attempt_us = now_us + POOL_CONNECT_ATTEMPT_DELAY_MS * 1000LL;
+            } else if (sock == POOL_CONNECT_SOCKET_FAILED) {
+                n_socket_failed++;
+            }
+            continue;
+        }
+        if (n_pending == 0) {
+            break;
+        }
+
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        int max_fd = -1;
+        for (int i = 0; i < n_started; i++) {
+            if (socks[i] >= 0) {
+                FD_SET(socks[i], &write_fds);
+                max_fd = socks[i] > max_fd ? socks[i] : max_fd;
+            }
+        }
+
+        int64_t wake_us = n_started < n_addrs && next_attempt_us < deadline_us ? next_attempt_us : deadline_us;
+        struct timeval timeout = {.tv_sec = (wake_us - now_us) / 1000000, .tv_usec = (wake_us - now_us) % 1000000};
+        int ready = select(max_fd + 1, NULL, &write_fds, NULL, &timeout);
+        now_us = esp_timer_get_time();
+        if (ready < 0) {
+            ESP_LOGE(TAG, "select failed (errno %d: %s)", errno, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n_started && ready > 0; i++) {
+            if (socks[i] < 0 || !FD_ISSET(socks[i], &write_fds)) {
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                winner = i;
+                break;
+            }
+            ESP_LOGD(TAG, "Connect attempt %d to %s failed (errno %d: %s)", i, host, err, strerror(err));
+            close(socks[i]);
+            socks[i] = -1;
+            n_pending--;
+            // a refused attempt starts the next one straight away
+            next_attempt_us = now_us;
+        }
+    }
+
+    for (int i = 0; i < n_started; i++) {
+        if (i != winner && socks[i] >= 0) {
+            close(socks[i]);
+        }
+    }
+
+    if (winner < 0) {
+        ESP_LOGD(TAG, "Unable to connect to %s:%u", host, port);
+        _expire(host);
+        return n_started > 0 && n_socket_failed == n_started ? POOL_CONNECT_SOCKET_FAILED : POOL_CONNECT_FAILED;
+    }
+
+    int sock = socks[winner];
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+    if (connect_us != NULL) {
+        *connect_us = now_us - started_us[winner];
+    }
+
+    // fits an IPv6 address
+    char host_ip[48];
+    _addr_str(&addrs[winner], host_ip, sizeof(host_ip));
+    ESP_LOGD(TAG, "Connected to %s:%u (%s)", host, port, host_ip);
+    return sock;
+}
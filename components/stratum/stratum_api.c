@@ -8,60 +8,104 @@
 #include "cJSON.h"
 #include "esp_log.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
 #include "lwip/sockets.h"
+#include "stratum_tls.h"
 #include "utils.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
 #define BUFFER_SIZE 1024
 static const char * TAG = "stratum_api";
 
-static char * json_rpc_buffer = NULL;
-static size_t json_rpc_buffer_size = 0;
+static pthread_once_t eventfd_once = PTHREAD_ONCE_INIT;
+// message ids and pending requests, for every connection. Shares are sent from several tasks
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// A message ID that must be unique per request that expects a response.
-// For requests not expecting a response (called notifications), this is null.
-static int send_uid = 1;
+// what goes through a connection's queue
+typedef struct
+{
+    char * data;
+    size_t len;
+    int64_t queued_us;
+    bool share;
+} tx_line;
 
 static void debug_stratum_tx(const char *);
 int _parse_stratum_subscribe_result_message(const char * result_json_str, char ** extranonce, int * extranonce2_len);
 
-void STRATUM_V1_reset_uid()
+static void register_eventfd(void)
 {
-    ESP_LOGI(TAG, "Resetting stratum uid");
+    esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_vfs_eventfd_register(&config);
+}
 
-    send_uid = 1;
+static void drop_queued_lines(StratumConnection * connection)
+{
+    tx_line item;
+    while (xQueueReceive(connection->tx_queue, &item, 0) == pdTRUE) {
+        free(item.data);
+    }
+    connection->tx_len = 0;
+    connection->tx_sent = 0;
+    connection->tx_batch_shares = 0;
 }
 
-void STRATUM_V1_initialize_buffer()
+/// @brief starts a new session on connection, message ids begin again at 1 and anything
+/// left over from the last socket is dropped. The caller becomes the socket's owner and
+/// must keep calling STRATUM_V1_receive_jsonrpc_line for queued lines to go out
+void STRATUM_V1_reset_connection(StratumConnection * connection, int sock)
 {
-    json_rpc_buffer = malloc(BUFFER_SIZE);
-    json_rpc_buffer_size = BUFFER_SIZE;
-    memset(json_rpc_buffer, 0, BUFFER_SIZE);
-    if (json_rpc_buffer == NULL) {
-        printf("Error: Failed to allocate memory for buffer\n");
-        exit(1);
+    ESP_LOGI(TAG, "Resetting stratum uid");
+
+    if (connection->tx_queue == NULL) {
+        pthread_once(&eventfd_once, register_eventfd);
+        connection->wake_fd = eventfd(0, 0);
+        connection->tx_queue = xQueueCreate(STRATUM_V1_TX_QUEUE_SIZE, sizeof(tx_line));
+        connection->tx_batch = malloc(STRATUM_V1_TX_BATCH_SIZE);
+    }
+    drop_queued_lines(connection);
+
+    if (sock >= 0) {
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    }
+    connection->sock = sock;
+    connection->close_requested = false;
+    pthread_mutex_lock(&pending_lock);
+    connection->send_uid = 1;
+    memset(connection->pending, 0, sizeof(connection->pending));
+    pthread_mutex_unlock(&pending_lock);
+    if (connection->rx_buf != NULL) {
+        connection->rx_buf[0] = '\0';
     }
 }
 
-void cleanup_stratum_buffer()
+static void initialize_buffer(StratumConnection * connection)
 {
-    free(json_rpc_buffer);
+    connection->rx_buf = malloc(BUFFER_SIZE);
+    connection->rx_buf_size = BUFFER_SIZE;
+    if (connection->rx_buf == NULL) {
+        printf("Error: Failed to allocate memory for buffer\n");
+        exit(1);
+    }
+    memset(connection->rx_buf, 0, BUFFER_SIZE);
 }
 
-static void realloc_json_buffer(size_t len)
+static void realloc_json_buffer(StratumConnection * connection, size_t len)
 {
     size_t old, new;
 
-    old = strlen(json_rpc_buffer);
+    old = strlen(connection->rx_buf);
     new = old + len + 1;
 
-    if (new < json_rpc_buffer_size) {
+    if (new < connection->rx_buf_size) {
         return;
     }
 
     new = new + (BUFFER_SIZE - (new % BUFFER_SIZE));
-    void * new_sockbuf = realloc(json_rpc_buffer, new);
+    void * new_sockbuf = realloc(connection->rx_buf, new);
 
     if (new_sockbuf == NULL) {
         fprintf(stderr, "Error: realloc failed in recalloc_sock()\n");
@@ -70,49 +114,297 @@ static void realloc_json_buffer(size_t len)
         esp_restart();
     }
 
-    json_rpc_buffer = new_sockbuf;
-    memset(json_rpc_buffer + old, 0, new - old);
-    json_rpc_buffer_size = new;
+    connection->rx_buf = new_sockbuf;
+    memset(connection->rx_buf + old, 0, new - old);
+    connection->rx_buf_size = new;
+}
+
+// Gives request the next message id and keeps it until the pool answers. Returns the id
+static int add_pending(StratumConnection * connection, const StratumPendingRequest * request)
+{
+    pthread_mutex_lock(&pending_lock);
+    int message_id = connection->send_uid++;
+    StratumPendingRequest * slot = &connection->pending[message_id % STRATUM_V1_MAX_PENDING];
+    if (slot->message_id != 0) {
+        ESP_LOGW(TAG, "Giving up on %s %d, the pool never answered it", STRATUM_V1_request_name(slot->type), slot->message_id);
+    }
+    *slot = *request;
+    slot->message_id = message_id;
+    slot->sent_us = esp_timer_get_time();
+    pthread_mutex_unlock(&pending_lock);
+    return message_id;
+}
+
+static void wake_owner(StratumConnection * connection)
+{
+    uint64_t wake = 1;
+    write(connection->wake_fd, &wake, sizeof(wake));
+}
+
+/// @brief hands len bytes to the connection's owner, never waiting on the network. For
+/// protocols that frame their own messages, Stratum V2
+/// @param share counted in the submit latency once written
+/// @return len, or -1 if there's no connection or its queue is full
+int STRATUM_V1_queue_frame(StratumConnection * connection, const void * data, size_t len, bool share)
+{
+    if (connection->tx_queue == NULL || connection->sock < 0) {
+        return -1;
+    }
+    tx_line item = {.data = malloc(len), .len = len, .queued_us = esp_timer_get_time(), .share = share};
+    if (item.data != NULL) {
+        memcpy(item.data, data, len);
+    }
+    if (item.data == NULL || xQueueSend(connection->tx_queue, &item, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Unable to queue line for the pool, %d waiting", (int) uxQueueMessagesWaiting(connection->tx_queue));
+        free(item.data);
+        return -1;
+    }
+    UBaseType_t depth = uxQueueMessagesWaiting(connection->tx_queue);
+    if (depth > connection->tx_queue_peak) {
+        connection->tx_queue_peak = depth;
+    }
+    wake_owner(connection);
+    return len;
+}
+
+static int queue_line(StratumConnection * connection, const char * msg, bool share)
+{
+    return STRATUM_V1_queue_frame(connection, msg, strlen(msg), share);
+}
+
+/// @brief asks the connection's owner to drop it, for tasks that find it broken but
+/// don't own the socket
+void STRATUM_V1_request_close(StratumConnection * connection)
+{
+    if (connection->tx_queue == NULL) {
+        return;
+    }
+    connection->close_requested = true;
+    wake_owner(connection);
+}
+
+static int send_line(StratumConnection * connection, const char * msg)
+{
+    return queue_line(connection, msg, false);
+}
+
+// Non-blocking, -1 with errno EAGAIN when the socket isn't ready
+static int transmit(StratumConnection * connection, const char * buf, size_t len)
+{
+    if (connection->tls != NULL) {
+        return STRATUM_TLS_write(connection->tls, buf, len);
+    }
+    return send(connection->sock, buf, len, 0);
+}
+
+// Non-blocking, -1 with errno EAGAIN when there's nothing to read yet
+static int receive(StratumConnection * connection, char * buf, size_t len)
+{
+    if (connection->tls != NULL) {
+        return STRATUM_TLS_read(connection->tls, buf, len);
+    }
+    return recv(connection->sock, buf, len, 0);
+}
+
+static bool would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Moves queued lines into the batch while they fit, shares found together go out in
+// one write. Returns false if nothing was queued
+static bool fill_batch(StratumConnection * connection)
+{
+    connection->tx_len = 0;
+    connection->tx_sent = 0;
+    connection->tx_batch_shares = 0;
+    connection->tx_batch_queued_us = 0;
+
+    tx_line item;
+    while (xQueuePeek(connection->tx_queue, &item, 0) == pdTRUE) {
+        size_t len = item.len;
+        if (connection->tx_len > 0 && connection->tx_len + len > STRATUM_V1_TX_BATCH_SIZE) {
+            break;
+        }
+        xQueueReceive(connection->tx_queue, &item, 0);
+        if (len > STRATUM_V1_TX_BATCH_SIZE) {
+            ESP_LOGE(TAG, "Dropping a %u byte line, too long to send", (unsigned) len);
+        } else {
+            memcpy(connection->tx_batch + connection->tx_len, item.data, len);
+            connection->tx_len += len;
+            if (item.share) {
+                connection->tx_batch_shares++;
+                connection->tx_batch_queued_us += item.queued_us;
+            }
+        }
+        free(item.data);
+    }
+    connection->tx_progress_us = esp_timer_get_time();
+    return connection->tx_len > 0;
+}
+
+// Folds how long the batch's shares waited into the submit latency
+static void batch_written(StratumConnection * connection)
+{
+    if (connection->tx_batch_shares == 0) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    float latency_ms = (now_us * connection->tx_batch_shares - connection->tx_batch_queued_us) / 1000.0f / connection->tx_batch_shares;
+    if (connection->submit_latency_ms == 0) {
+        connection->submit_latency_ms = latency_ms;
+    } else {
+        connection->submit_latency_ms += (latency_ms - connection->submit_latency_ms) / 8;
+    }
+    connection->tx_batch_shares = 0;
+}
+
+// Writes queued lines until they're out or the socket is full. Returns false once the
+// connection is dead, including when the pool hasn't taken anything for STRATUM_V1_WRITE_TIMEOUT_MS
+static bool flush_queued_lines(StratumConnection * connection)
+{
+    while (1) {
+        if (connection->tx_sent == connection->tx_len && !fill_batch(connection)) {
+            return true;
+        }
+
+        int nbytes = transmit(connection, connection->tx_batch + connection->tx_sent, connection->tx_len - connection->tx_sent);
+        if (nbytes > 0) {
+            connection->tx_progress_us = esp_timer_get_time();
+            connection->tx_sent += nbytes;
+            if (connection->tx_sent == connection->tx_len) {
+                batch_written(connection);
+            }
+            continue;
+        }
+        if (nbytes < 0 && would_block()) {
+            if (esp_timer_get_time() - connection->tx_progress_us < STRATUM_V1_WRITE_TIMEOUT_MS * 1000LL) {
+                return true;
+            }
+            ESP_LOGE(TAG, "Pool hasn't taken any data for %d ms", STRATUM_V1_WRITE_TIMEOUT_MS);
+        } else {
+            ESP_LOGE(TAG, "Error: send (errno %d: %s)", errno, strerror(errno));
+        }
+        return false;
+    }
+}
+
+// Sleeps until the pool sends something, a line is queued, or the socket can take more of a
+// stalled write. Returns false once the connection is dead
+static bool wait_for_io(StratumConnection * connection)
+{
+    int sock = connection->sock;
+    if (sock < 0) {
+        return false;
+    }
+
+    fd_set read_fds, write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_SET(sock, &read_fds);
+    FD_SET(connection->wake_fd, &read_fds);
+    struct timeval timeout;
+    struct timeval * timeout_ptr = NULL;
+    if (connection->tx_sent < connection->tx_len) {
+        FD_SET(sock, &write_fds);
+        int64_t remaining_us = connection->tx_progress_us + STRATUM_V1_WRITE_TIMEOUT_MS * 1000LL - esp_timer_get_time();
+        remaining_us = remaining_us > 0 ? remaining_us : 0;
+        timeout.tv_sec = remaining_us / 1000000;
+        timeout.tv_usec = remaining_us % 1000000;
+        timeout_ptr = &timeout;
+    }
+
+    int max_fd = sock > connection->wake_fd ? sock : connection->wake_fd;
+    if (select(max_fd + 1, &read_fds, &write_fds, NULL, timeout_ptr) < 0) {
+        ESP_LOGE(TAG, "Error: select (errno %d: %s)", errno, strerror(errno));
+        return false;
+    }
+    if (FD_ISSET(connection->wake_fd, &read_fds)) {
+        uint64_t wakes;
+        read(connection->wake_fd, &wakes, sizeof(wakes));
+    }
+    return true;
+}
+
+/// @brief the connection's event loop. Waits for data from the pool, writing whatever
+/// other tasks queue in the meantime
+/// @return bytes read, up to len, or -1 once the connection is dead or asked to close
+int STRATUM_V1_receive(StratumConnection * connection, void * buf, size_t len)
+{
+    while (1) {
+        if (connection->close_requested) {
+            ESP_LOGW(TAG, "Closing the connection on request");
+            return -1;
+        }
+        if (!flush_queued_lines(connection)) {
+            return -1;
+        }
+
+        // read before waiting, TLS can hold decrypted data select doesn't know about
+        int nbytes = receive(connection, buf, len);
+        if (nbytes > 0) {
+            return nbytes;
+        }
+        // 0 is the pool closing the connection
+        if (nbytes < 0 && would_block() && wait_for_io(connection)) {
+            continue;
+        }
+        ESP_LOGI(TAG, "Error: recv");
+        return -1;
+    }
 }
 
-char * STRATUM_V1_receive_jsonrpc_line(int sockfd)
+/// @brief waits for the next line from the pool, see STRATUM_V1_receive
+/// @return the line, to be freed, or NULL once the connection is dead
+char * STRATUM_V1_receive_jsonrpc_line(StratumConnection * connection)
 {
-    if (json_rpc_buffer == NULL) {
-        STRATUM_V1_initialize_buffer();
+    if (connection->rx_buf == NULL) {
+        initialize_buffer(connection);
     }
     char *line, *tok = NULL;
     char recv_buffer[BUFFER_SIZE];
     int nbytes;
     size_t buflen = 0;
 
-    if (!strstr(json_rpc_buffer, "\n")) {
-        do {
-            memset(recv_buffer, 0, BUFFER_SIZE);
-            nbytes = recv(sockfd, recv_buffer, BUFFER_SIZE - 1, 0);
-            if (nbytes == -1) {
-                ESP_LOGI(TAG, "Error: recv");
-                if (json_rpc_buffer) {
-                    free(json_rpc_buffer);
-                    json_rpc_buffer=0;
-                }
-                return 0;
-            }
-
-            realloc_json_buffer(nbytes);
-            strncat(json_rpc_buffer, recv_buffer, nbytes);
-        } while (!strstr(json_rpc_buffer, "\n"));
+    while (!strstr(connection->rx_buf, "\n")) {
+        memset(recv_buffer, 0, BUFFER_SIZE);
+        nbytes = STRATUM_V1_receive(connection, recv_buffer, BUFFER_SIZE - 1);
+        if (nbytes < 0) {
+            break;
+        }
+        realloc_json_buffer(connection, nbytes);
+        strncat(connection->rx_buf, recv_buffer, nbytes);
     }
-    buflen = strlen(json_rpc_buffer);
-    tok = strtok(json_rpc_buffer, "\n");
+    if (!strstr(connection->rx_buf, "\n")) {
+        free(connection->rx_buf);
+        connection->rx_buf = NULL;
+        return 0;
+    }
+    buflen = strlen(connection->rx_buf);
+    tok = strtok(connection->rx_buf, "\n");
     line = strdup(tok);
     int len = strlen(line);
     if (buflen > len + 1)
-        memmove(json_rpc_buffer, json_rpc_buffer + len + 1, buflen - len + 1);
+        memmove(connection->rx_buf, connection->rx_buf + len + 1, buflen - len + 1);
     else
-        strcpy(json_rpc_buffer, "");
+        strcpy(connection->rx_buf, "");
     return line;
 }
 
+// Pools send [code, "message", traceback], a few an object with a message or a bare string
+static void parse_error_message(StratumApiV1Message * message, cJSON * error_json)
+{
+    cJSON * reason_json = error_json;
+    if (cJSON_IsArray(error_json)) {
+        reason_json = cJSON_GetArrayItem(error_json, 1);
+    } else if (cJSON_IsObject(error_json)) {
+        reason_json = cJSON_GetObjectItem(error_json, "message");
+    }
+    if (cJSON_IsString(reason_json)) {
+        snprintf(message->error_message, sizeof(message->error_message), "%s", reason_json->valuestring);
+    }
+}
+
 void STRATUM_V1_parse(StratumApiV1Message * message, const char * stratum_json)
 {
     cJSON * json = cJSON_Parse(stratum_json);
@@ -123,6 +415,7 @@ void STRATUM_V1_parse(StratumApiV1Message * message, const char * stratum_json)
         parsed_id = id_json->valueint;
     }
     message->message_id = parsed_id;
+    message->error_message[0] = '\0';
 
     cJSON * method_json = cJSON_GetObjectItem(json, "method");
     stratum_method result = STRATUM_UNKNOWN;
@@ -153,65 +446,24 @@ void STRATUM_V1_parse(StratumApiV1Message * message, const char * stratum_json)
 
         //if it's an error, then it's a fail
         } else if (!cJSON_IsNull(error_json)) {
-            if (parsed_id < 5) {
-                result = STRATUM_RESULT_SETUP;
-            } else {
-                result = STRATUM_RESULT;
-            }
+            // which request failed is up to the caller, by message id
+            result = STRATUM_RESULT;
             message->response_success = false;
+            parse_error_message(message, error_json);
 
         //if the result is a boolean, then parse it
         } else if (cJSON_IsBool(result_json)) {
-            if (parsed_id < 5) {
-                result = STRATUM_RESULT_SETUP;
-            } else {
-                result = STRATUM_RESULT;
-            }
+            result = STRATUM_RESULT;
             if (cJSON_IsTrue(result_json)) {
                 message->response_success = true;
             } else {
                 message->response_success = false;
             }
 
-        //if the id is STRATUM_ID_SUBSCRIBE parse it
-        } else if (parsed_id == STRATUM_ID_SUBSCRIBE) {
-            result = STRATUM_RESULT_SUBSCRIBE;
-
-            cJSON * extranonce2_len_json = cJSON_GetArrayItem(result_json, 2);
-            if (extranonce2_len_json == NULL) {
-                ESP_LOGE(TAG, "Unable to parse extranonce2_len: %s", result_json->valuestring);
-                message->response_success = false;
-                goto done;
-            }
-            message->extranonce_2_len = extranonce2_len_json->valueint;
-
-            cJSON * extranonce_json = cJSON_GetArrayItem(result_json, 1);
-            if (extranonce_json == NULL) {
-                ESP_LOGE(TAG, "Unable parse extranonce: %s", result_json->valuestring);
-                message->response_success = false;
-                goto done;
-            }
-            message->extranonce_str = malloc(strlen(extranonce_json->valuestring) + 1);
-            strcpy(message->extranonce_str, extranonce_json->valuestring);
-            message->response_success = true;
-
-            //print the extranonce_str
-            ESP_LOGI(TAG, "extranonce_str: %s", message->extranonce_str);
-            ESP_LOGI(TAG, "extranonce_2_len: %d", message->extranonce_2_len);
-
-        //if the id is STRATUM_ID_CONFIGURE parse it
-        } else if (parsed_id == STRATUM_ID_CONFIGURE) {
-            cJSON * mask = cJSON_GetObjectItem(result_json, "version-rolling.mask");
-            if (mask != NULL) {
-                result = STRATUM_RESULT_VERSION_MASK;
-                message->version_mask = strtoul(mask->valuestring, NULL, 16);
-                ESP_LOGI(TAG, "Set version mask: %08lx", message->version_mask);
-            } else {
-                ESP_LOGI(TAG, "error setting version mask: %s", stratum_json);
-            }
-
+        // anything else is read by STRATUM_V1_parse_result once the caller knows what it answers
         } else {
-            ESP_LOGI(TAG, "unhandled result in stratum message: %s", stratum_json);
+            result = STRATUM_RESULT;
+            message->response_success = true;
         }
     }
 
@@ -241,6 +493,7 @@ void STRATUM_V1_parse(StratumApiV1Message * message, const char * stratum_json)
         new_work->version = strtoul(cJSON_GetArrayItem(params, 5)->valuestring, NULL, 16);
         new_work->target = strtoul(cJSON_GetArrayItem(params, 6)->valuestring, NULL, 16);
         new_work->ntime = strtoul(cJSON_GetArrayItem(params, 7)->valuestring, NULL, 16);
+        new_work->merkle_root = NULL;
 
         message->mining_notification = new_work;
 
@@ -259,7 +512,58 @@ void STRATUM_V1_parse(StratumApiV1Message * message, const char * stratum_json)
         uint32_t version_mask = strtoul(cJSON_GetArrayItem(params, 0)->valuestring, NULL, 16);
         message->version_mask = version_mask;
     }
-    done:
+    cJSON_Delete(json);
+}
+
+/// @brief reads the result of a successful reply by the request it answers, which the
+/// message id alone doesn't tell. Sets method to STRATUM_RESULT_SUBSCRIBE or
+/// STRATUM_RESULT_VERSION_MASK when the result carries one, leaves it alone otherwise
+/// @param type the request's type, from STRATUM_V1_take_pending
+void STRATUM_V1_parse_result(StratumApiV1Message * message, const char * stratum_json, stratum_request type)
+{
+    cJSON * json = cJSON_Parse(stratum_json);
+    cJSON * result_json = cJSON_GetObjectItem(json, "result");
+
+    switch (type) {
+        case STRATUM_REQUEST_SUBSCRIBE: {
+            cJSON * extranonce2_len_json = cJSON_GetArrayItem(result_json, 2);
+            if (extranonce2_len_json == NULL) {
+                ESP_LOGE(TAG, "Unable to parse extranonce2_len: %s", stratum_json);
+                message->response_success = false;
+                break;
+            }
+            message->extranonce_2_len = extranonce2_len_json->valueint;
+
+            cJSON * extranonce_json = cJSON_GetArrayItem(result_json, 1);
+            if (extranonce_json == NULL) {
+                ESP_LOGE(TAG, "Unable parse extranonce: %s", stratum_json);
+                message->response_success = false;
+                break;
+            }
+            message->extranonce_str = malloc(strlen(extranonce_json->valuestring) + 1);
+            strcpy(message->extranonce_str, extranonce_json->valuestring);
+            message->method = STRATUM_RESULT_SUBSCRIBE;
+
+            //print the extranonce_str
+            ESP_LOGI(TAG, "extranonce_str: %s", message->extranonce_str);
+            ESP_LOGI(TAG, "extranonce_2_len: %d", message->extranonce_2_len);
+            break;
+        }
+        case STRATUM_REQUEST_CONFIGURE: {
+            cJSON * mask = cJSON_GetObjectItem(result_json, "version-rolling.mask");
+            if (mask != NULL) {
+                message->method = STRATUM_RESULT_VERSION_MASK;
+                message->version_mask = strtoul(mask->valuestring, NULL, 16);
+                ESP_LOGI(TAG, "Set version mask: %08lx", message->version_mask);
+            } else {
+                ESP_LOGI(TAG, "error setting version mask: %s", stratum_json);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
     cJSON_Delete(json);
 }
 
@@ -270,6 +574,7 @@ void STRATUM_V1_free_mining_notify(mining_notify * params)
     free(params->coinbase_1);
     free(params->coinbase_2);
     free(params->merkle_branches);
+    free(params->merkle_root);
     free(params);
 }
 
@@ -306,65 +611,205 @@ int _parse_stratum_subscribe_result_message(const char * result_json_str, char *
     return 0;
 }
 
-int STRATUM_V1_subscribe(int socket, char * model)
+int STRATUM_V1_subscribe(StratumConnection * connection, char * model)
 {
     // Subscribe
     char subscribe_msg[BUFFER_SIZE];
     const esp_app_desc_t *app_desc = esp_ota_get_app_description();
     const char *version = app_desc->version;
-    sprintf(subscribe_msg, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\"bitaxe/%s/%s\"]}\n", send_uid++, model, version);
+    int message_id = add_pending(connection, &(StratumPendingRequest){.type = STRATUM_REQUEST_SUBSCRIBE});
+    sprintf(subscribe_msg, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\"bitaxe/%s/%s\"]}\n", message_id, model, version);
     debug_stratum_tx(subscribe_msg);
 
-    return write(socket, subscribe_msg, strlen(subscribe_msg));
+    return send_line(connection, subscribe_msg);
 }
 
-int STRATUM_V1_suggest_difficulty(int socket, uint32_t difficulty)
+int STRATUM_V1_suggest_difficulty(StratumConnection * connection, uint32_t difficulty)
 {
     char difficulty_msg[BUFFER_SIZE];
-    sprintf(difficulty_msg, "{\"id\": %d, \"method\": \"mining.suggest_difficulty\", \"params\": [%ld]}\n", send_uid++, difficulty);
+    int message_id = add_pending(connection, &(StratumPendingRequest){.type = STRATUM_REQUEST_SUGGEST_DIFFICULTY});
+    sprintf(difficulty_msg, "{\"id\": %d, \"method\": \"mining.suggest_difficulty\", \"params\": [%ld]}\n", message_id, difficulty);
     debug_stratum_tx(difficulty_msg);
 
-    return write(socket, difficulty_msg, strlen(difficulty_msg));
+    return send_line(connection, difficulty_msg);
 }
 
-int STRATUM_V1_authenticate(int socket, const char * username, const char * pass)
+int STRATUM_V1_authenticate(StratumConnection * connection, const char * username, const char * pass)
 {
     char authorize_msg[BUFFER_SIZE];
-    sprintf(authorize_msg, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}\n", send_uid++, username,
+    int message_id = add_pending(connection, &(StratumPendingRequest){.type = STRATUM_REQUEST_AUTHORIZE});
+    sprintf(authorize_msg, "{\"id\": %d, \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}\n", message_id, username,
             pass);
     debug_stratum_tx(authorize_msg);
 
-    return write(socket, authorize_msg, strlen(authorize_msg));
+    return send_line(connection, authorize_msg);
+}
+
+/// @brief renders the start of every mining.submit on connection, up to the worker name.
+/// Called once a session, before any share is submitted on it
+void STRATUM_V1_set_worker(StratumConnection * connection, const char * username)
+{
+    pthread_mutex_lock(&pending_lock);
+    int len = snprintf(connection->submit_prefix, sizeof(connection->submit_prefix), "{\"method\": \"mining.submit\", \"params\": [\"%s\", \"",
+                       username);
+    if (len < 0 || len >= sizeof(connection->submit_prefix)) {
+        ESP_LOGE(TAG, "Worker name %s is too long to submit shares with", username);
+        len = 0;
+    }
+    connection->submit_prefix_len = len;
+    pthread_mutex_unlock(&pending_lock);
 }
 
-/// @param socket Socket to write to
-/// @param username The client’s user name.
+// Appends len bytes of str at *pos if they fit before end
+static bool append(char ** pos, const char * end, const char * str, size_t len)
+{
+    if (len > end - *pos) {
+        return false;
+    }
+    memcpy(*pos, str, len);
+    *pos += len;
+    return true;
+}
+
+/// @param connection Pool connection to queue the share on, its worker set by STRATUM_V1_set_worker
 /// @param jobid The job ID for the work being submitted.
 /// @param ntime The hex-encoded time value use in the block header.
 /// @param extranonce_2 The hex-encoded value of extra nonce 2.
 /// @param nonce The hex-encoded nonce value to use in the block header.
-int STRATUM_V1_submit_share(int socket, const char * username, const char * jobid, const char * extranonce_2, const uint32_t ntime,
-                             const uint32_t nonce, const uint32_t version)
+/// @param difficulty, chain, chip What the share was worth and where it came from, kept for its result
+/// @return the message id the share went out with, or -1 if it couldn't be queued
+int STRATUM_V1_submit_share(StratumConnection * connection, const char * jobid, const char * extranonce_2, const uint32_t ntime,
+                             const uint32_t nonce, const uint32_t version, uint32_t difficulty, uint8_t chain, uint16_t chip)
+{
+    // the id goes last so everything before it is the prefix, the job and fixed width hex
+    static const char separator[] = "\", \"";
+    char words[] = "\", \"00000000\", \"00000000\", \"00000000\"], \"id\": ";
+    word2hex(ntime, &words[4]);
+    word2hex(nonce, &words[16]);
+    word2hex(version, &words[28]);
+
+    StratumPendingRequest request = {.type = STRATUM_REQUEST_SUBMIT, .nonce = nonce, .difficulty = difficulty, .chain = chain, .chip = chip};
+    snprintf(request.job_id, sizeof(request.job_id), "%s", jobid);
+    int message_id = add_pending(connection, &request);
+
+    char id[12];
+    char * id_start = &id[sizeof(id)];
+    unsigned int remaining = message_id;
+    do {
+        *--id_start = '0' + remaining % 10;
+        remaining /= 10;
+    } while (remaining > 0);
+
+    char submit_msg[BUFFER_SIZE];
+    char * pos = submit_msg;
+    // leaves room for the terminator
+    const char * end = submit_msg + sizeof(submit_msg) - 1;
+
+    pthread_mutex_lock(&pending_lock);
+    bool rendered = connection->submit_prefix_len > 0 && append(&pos, end, connection->submit_prefix, connection->submit_prefix_len);
+    pthread_mutex_unlock(&pending_lock);
+    rendered = rendered && append(&pos, end, jobid, strlen(jobid)) && append(&pos, end, separator, strlen(separator)) &&
+               append(&pos, end, extranonce_2, strlen(extranonce_2)) && append(&pos, end, words, strlen(words)) &&
+               append(&pos, end, id_start, &id[sizeof(id)] - id_start) && append(&pos, end, "}\n", 2);
+    if (!rendered) {
+        ESP_LOGE(TAG, "Unable to render share for job %s", jobid);
+        STRATUM_V1_take_pending(connection, message_id, NULL);
+        return -1;
+    }
+    *pos = '\0';
+    debug_stratum_tx(submit_msg);
+
+    if (queue_line(connection, submit_msg, true) < 0) {
+        STRATUM_V1_take_pending(connection, message_id, NULL);
+        return -1;
+    }
+    return message_id;
+}
+
+/// @brief forwards a share from a downstream miner, the hex fields go out as they came in
+/// @param version NULL if the miner doesn't roll versions
+/// @return the message id the share went out with, or -1 if the write failed
+int STRATUM_V1_forward_share(StratumConnection * connection, const char * username, const char * jobid, const char * extranonce_2, const char * ntime,
+                             const char * nonce, const char * version)
 {
     char submit_msg[BUFFER_SIZE];
-    sprintf(submit_msg,
-            "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%08lx\", \"%08lx\", \"%08lx\"]}\n",
-            send_uid++, username, jobid, extranonce_2, ntime, nonce, version);
+    StratumPendingRequest request = {.type = STRATUM_REQUEST_FORWARD};
+    snprintf(request.job_id, sizeof(request.job_id), "%s", jobid);
+    int message_id = add_pending(connection, &request);
+    if (version != NULL) {
+        snprintf(submit_msg, sizeof(submit_msg),
+                 "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%s\"]}\n",
+                 message_id, username, jobid, extranonce_2, ntime, nonce, version);
+    } else {
+        snprintf(submit_msg, sizeof(submit_msg),
+                 "{\"id\": %d, \"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"]}\n",
+                 message_id, username, jobid, extranonce_2, ntime, nonce);
+    }
     debug_stratum_tx(submit_msg);
 
-    return write(socket, submit_msg, strlen(submit_msg));
+    if (queue_line(connection, submit_msg, true) < 0) {
+        STRATUM_V1_take_pending(connection, message_id, NULL);
+        return -1;
+    }
+    return message_id;
+}
+
+/// @return how many lines are waiting for the connection's owner
+UBaseType_t STRATUM_V1_queue_depth(StratumConnection * connection)
+{
+    return connection->tx_queue != NULL ? uxQueueMessagesWaiting(connection->tx_queue) : 0;
+}
+
+/// @brief looks up the request a response answers, each request can only be taken once
+/// @param request if not NULL, filled with the request
+/// @return false if no request with message_id is pending
+bool STRATUM_V1_take_pending(StratumConnection * connection, int64_t message_id, StratumPendingRequest * request)
+{
+    if (message_id <= 0) {
+        return false;
+    }
+    pthread_mutex_lock(&pending_lock);
+    StratumPendingRequest * slot = &connection->pending[message_id % STRATUM_V1_MAX_PENDING];
+    bool found = slot->message_id == message_id;
+    if (found) {
+        if (request != NULL) {
+            *request = *slot;
+        }
+        slot->message_id = 0;
+    }
+    pthread_mutex_unlock(&pending_lock);
+    return found;
+}
+
+const char * STRATUM_V1_request_name(stratum_request type)
+{
+    switch (type) {
+        case STRATUM_REQUEST_SUBSCRIBE:
+            return "mining.subscribe";
+        case STRATUM_REQUEST_CONFIGURE:
+            return "mining.configure";
+        case STRATUM_REQUEST_SUGGEST_DIFFICULTY:
+            return "mining.suggest_difficulty";
+        case STRATUM_REQUEST_AUTHORIZE:
+            return "mining.authorize";
+        case STRATUM_REQUEST_SUBMIT:
+            return "mining.submit";
+        case STRATUM_REQUEST_FORWARD:
+            return "forwarded mining.submit";
+    }
+    return "request";
 }
 
-int STRATUM_V1_configure_version_rolling(int socket, uint32_t * version_mask)
+int STRATUM_V1_configure_version_rolling(StratumConnection * connection, uint32_t * version_mask)
 {
     char configure_msg[BUFFER_SIZE * 2];
     sprintf(configure_msg,
             "{\"id\": %d, \"method\": \"mining.configure\", \"params\": [[\"version-rolling\"], {\"version-rolling.mask\": "
             "\"ffffffff\"}]}\n",
-            send_uid++);
+            add_pending(connection, &(StratumPendingRequest){.type = STRATUM_REQUEST_CONFIGURE}));
     debug_stratum_tx(configure_msg);
 
-    return write(socket, configure_msg, strlen(configure_msg));
+    return send_line(connection, configure_msg);
 }
 
 static void debug_stratum_tx(const char * msg)
@@ -0,0 +1,342 @@
+/******************************************************************************
+ *  *
+ * References:
+ *  1. RFC 5077 TLS Session Resumption without Server-Side State - [link](https://datatracker.ietf.org/doc/html/rfc5077)
+ *
+ * stratum+ssl on mbedtls. The socket is non-blocking once the handshake is done, the
+ * connection's owner waits on it with select like a plaintext one.
+ *****************************************************************************/
+
+#include "stratum_tls.h"
+#include "esp_crt_bundle.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/platform.h"
+#include "mbedtls/ssl.h"
+#include "multi_heap.h"
+#include "pool_connect.h"
+#include <pthread.h>
+#include <string.h>
+
+static const char * TAG = "stratum_tls";
+
+struct stratum_tls
+{
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    int sock;
+    // cleared when the connection is torn down, reads and writes fail from then on
+    bool active;
+    pthread_mutex_t lock;
+};
+
+typedef struct
+{
+    char host[POOL_HOST_SIZE];
+    uint16_t port;
+    bool valid;
+    mbedtls_ssl_session session;
+} tls_session_entry;
+
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context ctr_drbg;
+
+static multi_heap_handle_t arena;
+static uint8_t * arena_start;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static tls_session_entry sessions[STRATUM_TLS_SESSION_CACHE_SIZE];
+static int next_session;
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool _in_arena(const void * ptr)
+{
+    return arena_start != NULL && (const uint8_t *) ptr >= arena_start && (const uint8_t *) ptr < arena_start + STRATUM_TLS_ARENA_SIZE;
+}
+
+// mbedtls allocates here, and from the heap once the arena is full
+static void * _arena_calloc(size_t n, size_t size)
+{
+    if (size != 0 && n > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&arena_lock);
+    void * ptr = multi_heap_malloc(arena, n * size);
+    pthread_mutex_unlock(&arena_lock);
+    if (ptr == NULL) {
+        return calloc(n, size);
+    }
+    memset(ptr, 0, n * size);
+    return ptr;
+}
+
+// also frees what mbedtls allocated before the arena was installed
+static void _arena_free(void * ptr)
+{
+    if (!_in_arena(ptr)) {
+        free(ptr);
+        return;
+    }
+    pthread_mutex_lock(&arena_lock);
+    multi_heap_free(arena, ptr);
+    pthread_mutex_unlock(&arena_lock);
+}
+
+static void _tls_init(void)
+{
+    arena_start = heap_caps_malloc(STRATUM_TLS_ARENA_SIZE, MALLOC_CAP_SPIRAM);
+    if (arena_start != NULL) {
+        arena = multi_heap_register(arena_start, STRATUM_TLS_ARENA_SIZE);
+    }
+    if (arena != NULL) {
+        mbedtls_platform_set_calloc_free(_arena_calloc, _arena_free);
+    } else {
+        ESP_LOGW(TAG, "No TLS arena, mbedtls allocates from the heap");
+        free(arena_start);
+        arena_start = NULL;
+    }
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&ctr_drbg);
+    int ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *) TAG, strlen(TAG));
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to seed the TLS random generator: -0x%04x", -ret);
+    }
+}
+
+static int _bio_send(void * ctx, const unsigned char * buf, size_t len)
+{
+    stratum_tls * tls = ctx;
+    int ret = send(tls->sock, buf, len, 0);
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    }
+    return ret;
+}
+
+static int _bio_recv(void * ctx, unsigned char * buf, size_t len)
+{
+    stratum_tls * tls = ctx;
+    int ret = recv(tls->sock, buf, len, 0);
+    if (ret < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    }
+    return ret;
+}
+
+/// @brief sets up TLS for one pool connection, kept and reused across its reconnects
+/// @return NULL if mbedtls couldn't be set up
+stratum_tls * STRATUM_TLS_create(void)
+{
+    pthread_once(&tls_once, _tls_init);
+
+    stratum_tls * tls = calloc(1, sizeof(stratum_tls));
+    tls->sock = -1;
+    pthread_mutex_init(&tls->lock, NULL);
+    mbedtls_ssl_init(&tls->ssl);
+    mbedtls_ssl_config_init(&tls->conf);
+
+    int ret = mbedtls_ssl_config_defaults(&tls->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret == 0) {
+        mbedtls_ssl_conf_authmode(&tls->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_rng(&tls->conf, mbedtls_ctr_drbg_random, &ctr_drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        mbedtls_ssl_conf_session_tickets(&tls->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+        ret = esp_crt_bundle_attach(&tls->conf);
+    }
+    if (ret == 0) {
+        // the record buffers are allocated here and kept until the pool goes away
+        ret = mbedtls_ssl_setup(&tls->ssl, &tls->conf);
+    }
+    if (ret != 0) {
+        ESP_LOGE(TAG, "TLS setup failed: -0x%04x", -ret);
+        mbedtls_ssl_free(&tls->ssl);
+        mbedtls_ssl_config_free(&tls->conf);
+        pthread_mutex_destroy(&tls->lock);
+        free(tls);
+        return NULL;
+    }
+
+    mbedtls_ssl_set_bio(&tls->ssl, tls, _bio_send, _bio_recv, NULL);
+    return tls;
+}
+
+/// @brief verifies the pool against ca in place of the certificate bundle, the unit tests
+/// trust their own certificate this way. ca has to outlive tls
+void STRATUM_TLS_set_ca_chain(stratum_tls * tls, mbedtls_x509_crt * ca)
+{
+    pthread_mutex_lock(&tls->lock);
+    mbedtls_ssl_conf_verify(&tls->conf, NULL, NULL);
+    mbedtls_ssl_conf_ca_chain(&tls->conf, ca, NULL);
+    pthread_mutex_unlock(&tls->lock);
+}
+
+// Called with session_lock held
+static tls_session_entry * _find_session(const char * host, uint16_t port)
+{
+    for (int i = 0; i < STRATUM_TLS_SESSION_CACHE_SIZE; i++) {
+        if (sessions[i].valid && sessions[i].port == port && strcmp(sessions[i].host, host) == 0) {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+// Keeps the session just negotiated with host so the next connect can resume it
+static void _save_session(stratum_tls * tls, const char * host, uint16_t port)
+{
+    if (strlen(host) >= POOL_HOST_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&session_lock);
+    tls_session_entry * entry = _find_session(host, port);
+    if (entry == NULL) {
+        entry = &sessions[next_session];
+        next_session = (next_session + 1) % STRATUM_TLS_SESSION_CACHE_SIZE;
+    }
+    if (entry->valid) {
+        mbedtls_ssl_session_free(&entry->session);
+    }
+    mbedtls_ssl_session_init(&entry->session);
+    entry->valid = mbedtls_ssl_get_session(&tls->ssl, &entry->session) == 0;
+    strcpy(entry->host, host);
+    entry->port = port;
+    pthread_mutex_unlock(&session_lock);
+}
+
+/// @brief runs the TLS handshake on a connected socket, resuming the last session with
+/// host if there is one. The socket is left non-blocking
+/// @param handshake_us set to how long the handshake took
+/// @return false if the handshake failed, the socket is still the caller's to close
+bool STRATUM_TLS_handshake(stratum_tls * tls, int sock, const char * host, uint16_t port, int64_t * handshake_us)
+{
+    pthread_mutex_lock(&tls->lock);
+    mbedtls_ssl_session_reset(&tls->ssl);
+    tls->sock = sock;
+    mbedtls_ssl_set_hostname(&tls->ssl, host);
+
+    pthread_mutex_lock(&session_lock);
+    tls_session_entry * cached = _find_session(host, port);
+    if (cached != NULL) {
+        mbedtls_ssl_set_session(&tls->ssl, &cached->session);
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    int64_t start_us = esp_timer_get_time();
+    int64_t deadline_us = start_us + STRATUM_TLS_HANDSHAKE_TIMEOUT_MS * 1000LL;
+    int ret;
+    while ((ret = mbedtls_ssl_handshake(&tls->ssl)) != 0) {
+        int64_t remaining_us = deadline_us - esp_timer_get_time();
+        if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || remaining_us <= 0) {
+            ESP_LOGE(TAG, "TLS handshake with %s failed: -0x%04x (verify flags 0x%lx)", host, -ret,
+                     (unsigned long) mbedtls_ssl_get_verify_result(&tls->ssl));
+            tls->sock = -1;
+            pthread_mutex_unlock(&tls->lock);
+            return false;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sock, &fds);
+        struct timeval timeout = {.tv_sec = remaining_us / 1000000, .tv_usec = remaining_us % 1000000};
+        select(sock + 1, ret == MBEDTLS_ERR_SSL_WANT_READ ? &fds : NULL, ret == MBEDTLS_ERR_SSL_WANT_WRITE ? &fds : NULL, NULL, &timeout);
+    }
+    *handshake_us = esp_timer_get_time() - start_us;
+
+    _save_session(tls, host, port);
+    tls->active = true;
+    ESP_LOGI(TAG, "TLS handshake with %s took %lld ms%s, %s", host, *handshake_us / 1000, cached != NULL ? " offering a cached session" : "",
+             mbedtls_ssl_get_ciphersuite(&tls->ssl));
+    if (arena != NULL) {
+        ESP_LOGI(TAG, "TLS arena: %u bytes free, %u at the lowest", (unsigned) multi_heap_free_size(arena),
+                 (unsigned) multi_heap_minimum_free_size(arena));
+    }
+    pthread_mutex_unlock(&tls->lock);
+    return true;
+}
+
+// mbedtls wanting the socket again is reported like a socket would, EAGAIN
+static int _would_block(int ret)
+{
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+/// @brief reads decrypted pool data without waiting for the pool
+/// @return bytes read, 0 if the pool closed the connection, -1 on error or with errno
+/// EAGAIN if nothing has arrived yet
+int STRATUM_TLS_read(stratum_tls * tls, char * buf, size_t len)
+{
+    pthread_mutex_lock(&tls->lock);
+    if (!tls->active) {
+        pthread_mutex_unlock(&tls->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    int ret = mbedtls_ssl_read(&tls->ssl, (unsigned char *) buf, len);
+    pthread_mutex_unlock(&tls->lock);
+
+    if (ret >= 0) {
+        return ret;
+    }
+    if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        return 0;
+    }
+    if (_would_block(ret) < 0) {
+        return -1;
+    }
+    ESP_LOGE(TAG, "TLS read failed: -0x%04x", -ret);
+    errno = EIO;
+    return -1;
+}
+
+/// @brief writes as much of data as the socket takes without waiting
+/// @return bytes written, -1 on error or with errno EAGAIN if the socket is full
+int STRATUM_TLS_write(stratum_tls * tls, const char * data, size_t len)
+{
+    pthread_mutex_lock(&tls->lock);
+    if (!tls->active) {
+        pthread_mutex_unlock(&tls->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    int ret = mbedtls_ssl_write(&tls->ssl, (const unsigned char *) data, len);
+    pthread_mutex_unlock(&tls->lock);
+
+    if (ret >= 0) {
+        return ret;
+    }
+    if (_would_block(ret) < 0) {
+        return -1;
+    }
+    ESP_LOGE(TAG, "TLS write failed: -0x%04x", -ret);
+    errno = EIO;
+    return -1;
+}
+
+/// @brief ends the session before its socket is closed, reads and writes fail from here on
+/// @param notify send close_notify first, only while the socket is still open
+void STRATUM_TLS_reset(stratum_tls * tls, bool notify)
+{
+    pthread_mutex_lock(&tls->lock);
+    if (tls->active && notify) {
+        mbedtls_ssl_close_notify(&tls->ssl);
+    }
+    tls->active = false;
+    tls->sock = -1;
+    mbedtls_ssl_session_reset(&tls->ssl);
+    pthread_mutex_unlock(&tls->lock);
+}
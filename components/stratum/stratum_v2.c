@@ -0,0 +1,363 @@
+/******************************************************************************
+ *  *
+ * References:
+ *  1. Stratum V2 Mining Protocol - [link](https://github.com/stratum-mining/sv2-spec)
+ *
+ * Plaintext framing only, standard channels. The pool sends the merkle root with
+ * every job so the device only rolls version and nonce.
+ *****************************************************************************/
+
+#include "stratum_v2.h"
+#include "esp_log.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char * TAG = "stratum_v2";
+
+// difficulty 1 target, 0x00000000FFFF0000...
+static const double truediffone = 26959535291011309493156476344723991336010898738574164086137773096960.0;
+
+typedef struct
+{
+    uint8_t * buf;
+    int len;
+    int size;
+} sv2_writer;
+
+typedef struct
+{
+    const uint8_t * buf;
+    int pos;
+    int len;
+    // set once a read ran past the end, every read after that returns 0
+    bool overrun;
+} sv2_reader;
+
+static void _put_bytes(sv2_writer * w, const void * data, int len)
+{
+    if (w->len + len > w->size) {
+        w->len = w->size + 1;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void _put_u8(sv2_writer * w, uint8_t value)
+{
+    _put_bytes(w, &value, 1);
+}
+
+static void _put_u16(sv2_writer * w, uint16_t value)
+{
+    uint8_t le[2] = {value & 0xff, value >> 8};
+    _put_bytes(w, le, sizeof(le));
+}
+
+static void _put_u32(sv2_writer * w, uint32_t value)
+{
+    uint8_t le[4] = {value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24};
+    _put_bytes(w, le, sizeof(le));
+}
+
+// STR0_255, one length byte then the string
+static void _put_str(sv2_writer * w, const char * str)
+{
+    size_t len = strlen(str);
+    if (len > 255) {
+        len = 255;
+    }
+    _put_u8(w, len);
+    _put_bytes(w, str, len);
+}
+
+static const uint8_t * _get_bytes(sv2_reader * r, int len)
+{
+    if (r->overrun || r->pos + len > r->len) {
+        r->overrun = true;
+        return NULL;
+    }
+    const uint8_t * data = r->buf + r->pos;
+    r->pos += len;
+    return data;
+}
+
+static uint8_t _get_u8(sv2_reader * r)
+{
+    const uint8_t * data = _get_bytes(r, 1);
+    return data != NULL ? data[0] : 0;
+}
+
+static uint16_t _get_u16(sv2_reader * r)
+{
+    const uint8_t * data = _get_bytes(r, 2);
+    return data != NULL ? data[0] | data[1] << 8 : 0;
+}
+
+static uint32_t _get_u32(sv2_reader * r)
+{
+    const uint8_t * data = _get_bytes(r, 4);
+    return data != NULL ? data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24 : 0;
+}
+
+static void _get_u256(sv2_reader * r, uint8_t * out)
+{
+    const uint8_t * data = _get_bytes(r, 32);
+    if (data != NULL) {
+        memcpy(out, data, 32);
+    }
+}
+
+// STR0_255 into a NUL terminated buffer, cut to fit
+static void _get_str(sv2_reader * r, char * out, size_t size)
+{
+    uint8_t len = _get_u8(r);
+    const uint8_t * data = _get_bytes(r, len);
+    size_t copy = data == NULL ? 0 : (len < size - 1 ? len : size - 1);
+    if (copy > 0) {
+        memcpy(out, data, copy);
+    }
+    out[copy] = '\0';
+}
+
+// Frames the payload already in buf + SV2_HEADER_SIZE and queues it for the connection's owner
+static int _send_frame(StratumConnection * connection, uint16_t extension_type, uint8_t msg_type, uint8_t * buf, int payload_len,
+                       bool share)
+{
+    buf[0] = extension_type & 0xff;
+    buf[1] = extension_type >> 8;
+    buf[2] = msg_type;
+    buf[3] = payload_len & 0xff;
+    buf[4] = (payload_len >> 8) & 0xff;
+    buf[5] = (payload_len >> 16) & 0xff;
+
+    ESP_LOGD(TAG, "tx: type 0x%02x, %d bytes", msg_type, payload_len);
+    return STRATUM_V1_queue_frame(connection, buf, SV2_HEADER_SIZE + payload_len, share);
+}
+
+int STRATUM_V2_setup_connection(StratumConnection * connection, const char * host, uint16_t port, const char * hardware, const char * firmware)
+{
+    uint8_t buf[SV2_HEADER_SIZE + SV2_MAX_PAYLOAD];
+    sv2_writer w = {.buf = buf + SV2_HEADER_SIZE, .size = SV2_MAX_PAYLOAD};
+
+    // protocol 0 is the mining protocol, version 2 is the only one defined
+    _put_u8(&w, 0);
+    _put_u16(&w, 2);
+    _put_u16(&w, 2);
+    _put_u32(&w, SV2_REQUIRES_STANDARD_JOBS | SV2_REQUIRES_VERSION_ROLLING);
+    _put_str(&w, host);
+    _put_u16(&w, port);
+    _put_str(&w, "bitaxe");
+    _put_str(&w, hardware);
+    _put_str(&w, firmware);
+    _put_str(&w, "");
+
+    if (w.len > w.size) {
+        return -1;
+    }
+    return _send_frame(connection, 0, SV2_SETUP_CONNECTION, buf, w.len, false);
+}
+
+int STRATUM_V2_open_standard_channel(StratumConnection * connection, uint32_t request_id, const char * user, float nominal_hashrate)
+{
+    uint8_t buf[SV2_HEADER_SIZE + SV2_MAX_PAYLOAD];
+    sv2_writer w = {.buf = buf + SV2_HEADER_SIZE, .size = SV2_MAX_PAYLOAD};
+    uint8_t max_target[32];
+    memset(max_target, 0xff, sizeof(max_target));
+
+    _put_u32(&w, request_id);
+    _put_str(&w, user);
+    _put_bytes(&w, &nominal_hashrate, sizeof(nominal_hashrate));
+    _put_bytes(&w, max_target, sizeof(max_target));
+
+    if (w.len > w.size) {
+        return -1;
+    }
+    return _send_frame(connection, 0, SV2_OPEN_STANDARD_MINING_CHANNEL, buf, w.len, false);
+}
+
+int STRATUM_V2_submit_share(StratumConnection * connection, uint32_t channel_id, uint32_t sequence_number, uint32_t job_id,
+                            uint32_t nonce, uint32_t ntime, uint32_t version)
+{
+    // 24 byte payload, the whole frame is 30 bytes against ~150 for a V1 mining.submit
+    uint8_t buf[SV2_HEADER_SIZE + 24];
+    sv2_writer w = {.buf = buf + SV2_HEADER_SIZE, .size = 24};
+
+    _put_u32(&w, channel_id);
+    _put_u32(&w, sequence_number);
+    _put_u32(&w, job_id);
+    _put_u32(&w, nonce);
+    _put_u32(&w, ntime);
+    _put_u32(&w, version);
+
+    return _send_frame(connection, SV2_CHANNEL_MSG, SV2_SUBMIT_SHARES_STANDARD, buf, w.len, true);
+}
+
+static int _recv_all(StratumConnection * connection, uint8_t * buf, int len)
+{
+    int received = 0;
+    while (received < len) {
+        int ret = STRATUM_V1_receive(connection, buf + received, len - received);
+        if (ret < 0) {
+            return -1;
+        }
+        received += ret;
+    }
+    return received;
+}
+
+static void _parse_message(uint8_t msg_type, sv2_reader * r, StratumApiV2Message * message)
+{
+    switch (msg_type) {
+        case SV2_SETUP_CONNECTION_SUCCESS:
+            message->method = STRATUM_V2_SETUP_SUCCESS;
+            break;
+        case SV2_SETUP_CONNECTION_ERROR:
+            message->method = STRATUM_V2_SETUP_ERROR;
+            _get_u32(r);
+            _get_str(r, message->error_code, sizeof(message->error_code));
+            break;
+        case SV2_OPEN_STANDARD_MINING_CHANNEL_SUCCESS:
+            message->method = STRATUM_V2_CHANNEL_OPENED;
+            _get_u32(r);
+            message->channel_id = _get_u32(r);
+            _get_u256(r, message->target);
+            break;
+        case SV2_OPEN_MINING_CHANNEL_ERROR:
+            message->method = STRATUM_V2_CHANNEL_ERROR;
+            _get_u32(r);
+            _get_str(r, message->error_code, sizeof(message->error_code));
+            break;
+        case SV2_NEW_MINING_JOB: {
+            message->method = STRATUM_V2_NEW_JOB;
+            message->channel_id = _get_u32(r);
+            message->job_id = _get_u32(r);
+            // OPTION[U32], an empty option marks a future job
+            message->future_job = _get_u8(r) == 0;
+            if (!message->future_job) {
+                message->min_ntime = _get_u32(r);
+            }
+            message->version = _get_u32(r);
+            // B0_32, always a full hash here
+            if (_get_u8(r) != 32) {
+                r->overrun = true;
+            }
+            _get_u256(r, message->merkle_root);
+            break;
+        }
+        case SV2_SET_NEW_PREV_HASH:
+            message->method = STRATUM_V2_NEW_PREV_HASH;
+            message->channel_id = _get_u32(r);
+            message->job_id = _get_u32(r);
+            _get_u256(r, message->prev_hash);
+            message->min_ntime = _get_u32(r);
+            message->nbits = _get_u32(r);
+            break;
+        case SV2_SET_TARGET:
+            message->method = STRATUM_V2_SET_TARGET;
+            message->channel_id = _get_u32(r);
+            _get_u256(r, message->target);
+            break;
+        case SV2_SUBMIT_SHARES_SUCCESS:
+            message->method = STRATUM_V2_SHARES_ACCEPTED;
+            message->channel_id = _get_u32(r);
+            message->sequence_number = _get_u32(r);
+            message->accepted_count = _get_u32(r);
+            break;
+        case SV2_SUBMIT_SHARES_ERROR:
+            message->method = STRATUM_V2_SHARE_REJECTED;
+            message->channel_id = _get_u32(r);
+            message->sequence_number = _get_u32(r);
+            _get_str(r, message->error_code, sizeof(message->error_code));
+            break;
+        case SV2_RECONNECT:
+            message->method = STRATUM_V2_RECONNECT;
+            break;
+        default:
+            message->method = STRATUM_V2_UNKNOWN;
+            break;
+    }
+}
+
+/// @brief reads one frame from the pool and decodes it
+/// @param connection pool connection, the caller owns its socket and writes what's queued while waiting
+/// @param message filled in, method is STRATUM_V2_UNKNOWN for frames that aren't handled or don't decode
+/// @return payload length, or -1 if the connection failed
+int STRATUM_V2_receive_message(StratumConnection * connection, StratumApiV2Message * message)
+{
+    uint8_t header[SV2_HEADER_SIZE];
+    uint8_t payload[SV2_MAX_PAYLOAD];
+
+    memset(message, 0, sizeof(StratumApiV2Message));
+
+    if (_recv_all(connection, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    uint8_t msg_type = header[2];
+    int len = header[3] | header[4] << 8 | header[5] << 16;
+
+    if (len > sizeof(payload)) {
+        // nothing handled here is this large, read it off the socket and move on
+        ESP_LOGW(TAG, "Skipping message 0x%02x of %d bytes", msg_type, len);
+        for (int remaining = len; remaining > 0; remaining -= sizeof(payload)) {
+            if (_recv_all(connection, payload, remaining < sizeof(payload) ? remaining : sizeof(payload)) < 0) {
+                return -1;
+            }
+        }
+        return len;
+    }
+
+    if (_recv_all(connection, payload, len) < 0) {
+        return -1;
+    }
+
+    ESP_LOGD(TAG, "rx: type 0x%02x, %d bytes", msg_type, len);
+
+    sv2_reader r = {.buf = payload, .len = len};
+    _parse_message(msg_type, &r, message);
+    if (r.overrun) {
+        ESP_LOGE(TAG, "Truncated message 0x%02x of %d bytes", msg_type, len);
+        message->method = STRATUM_V2_UNKNOWN;
+    }
+
+    return len;
+}
+
+/// @brief the job on prev_hash in the same hex form mining.notify uses, so the job factory can treat both alike.
+/// A standard channel job already carries the merkle root, it becomes a header-only job
+mining_notify * STRATUM_V2_job_to_notify(const StratumApiV2Message * job, const StratumApiV2Message * prev_hash, uint32_t ntime)
+{
+    mining_notify * notify = calloc(1, sizeof(mining_notify));
+    char job_id[11];
+    uint8_t swapped[32];
+
+    snprintf(job_id, sizeof(job_id), "%lu", job->job_id);
+    notify->job_id = strdup(job_id);
+
+    // mining.notify sends the previous block hash with every 4 byte word swapped
+    for (int i = 0; i < 32; i += 4) {
+        swapped[i] = prev_hash->prev_hash[i + 3];
+        swapped[i + 1] = prev_hash->prev_hash[i + 2];
+        swapped[i + 2] = prev_hash->prev_hash[i + 1];
+        swapped[i + 3] = prev_hash->prev_hash[i];
+    }
+    notify->prev_block_hash = malloc(65);
+    bin2hex(swapped, 32, notify->prev_block_hash, 65);
+
+    notify->merkle_root = malloc(65);
+    bin2hex(job->merkle_root, 32, notify->merkle_root, 65);
+
+    notify->version = job->version;
+    notify->target = prev_hash->nbits;
+    notify->ntime = ntime;
+    return notify;
+}
+
+double STRATUM_V2_target_to_difficulty(const uint8_t * target)
+{
+    double value = le256todouble(target);
+    return value > 0 ? truediffone / value : 0;
+}
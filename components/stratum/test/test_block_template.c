@@ -0,0 +1,138 @@
+#include "block_template.h"
+#include "esp_heap_caps.h"
+#include "unity.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// A regtest getblocktemplate at height 101 with two transactions, so the coinbase's
+// sibling is the first txid and the second pairs with itself one row up. The expected
+// values were worked out independently of this component from the BIP 22/34/141 layouts
+static const char template_head[] =
+    "{\"version\": 536870912, \"bits\": \"207fffff\", \"curtime\": 1700000000, \"height\": 101, "
+    "\"coinbasevalue\": 5000002000, "
+    "\"previousblockhash\": \"0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca590b1a11466e2206\", "
+    "\"longpollid\": \"0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca590b1a11466e22061\", ";
+static const char witness_commitment[] =
+    "\"default_witness_commitment\": \"6a24aa21a9ede2f61c3f71d1defd3fa999dfa36953755c690689799962b48bebd836974e8cf9\", ";
+static const char template_transactions[] =
+    "\"transactions\": [{\"data\": \""
+    "020000000111111111111111111111111111111111111111111111111111111111111111110000000000fdffffff01f0"
+    "ca052a01000000160014222222222222222222222222222222222222222265000000"
+    "\", \"txid\": \"0abe1e7edfd124432eb67f66814c29138301da35f275cf3ddb1e69707584c552\"}, {\"data\": \""
+    "020000000133333333333333333333333333333333333333333333333333333333333333330100000000fdffffff01e8"
+    "03000000000000160014444444444444444444444444444444444444444465000000"
+    "\", \"txid\": \"468bc516cc2a4be77ed8a983337e0496b9f9b0a3b39b588e3f910d0d70db53f0\"}]}";
+
+// P2WPKH the node would return from validateaddress
+static const uint8_t payout_script[] = {0x00, 0x14, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+                                        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55};
+
+#define EXTRANONCE_1 "00000001"
+#define EXTRANONCE_2 "00000002"
+#define ROLLED_VERSION 0x20002000
+#define NTIME 1700000100
+#define NONCE 0x12345678
+
+static const char coinbase_1[] = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff120165";
+static const char segwit_coinbase_2[] =
+    "2f6269746178652fffffffff02d0f9052a01000000160014555555555555555555555555555555555555555500000000"
+    "00000000266a24aa21a9ede2f61c3f71d1defd3fa999dfa36953755c690689799962b48bebd836974e8cf900000000";
+static const char legacy_coinbase_2[] =
+    "2f6269746178652fffffffff01d0f9052a01000000160014555555555555555555555555555555555555555500000000";
+static const char merkle_branches[] =
+    "52c5847570691edb3dcf75f235da018313294c81667fb62e4324d1df7e1ebe0ab26cb3e03a03dd30a1270919c913652d"
+    "0e6b583316b14d9ab0b84ed57df2cf7e";
+// mining.notify form, every 4 byte word of the internal byte order reversed
+static const char notify_prev_hash[] = "466e2206590b1a116012afcabf5beb433a4fc3281f2a335e3cb7b2c70f9188f1";
+
+// header, tx count, the coinbase with marker, flag and its reserved witness, then the transactions
+static const char segwit_block[] =
+    "[\"0020002006226e46111a0b59caaf126043eb5bbf28c34f3a5e332a1fc7b2b73cf188910f4a47cca28192b8cdbea5e2"
+    "e28b3b62b3b2202b34903becf1b41f00d0c667b2ec64f15365ffff7f2078563412030100000000010100000000000000"
+    "00000000000000000000000000000000000000000000000000ffffffff12016500000001000000022f6269746178652f"
+    "ffffffff02d0f9052a0100000016001455555555555555555555555555555555555555550000000000000000266a24aa"
+    "21a9ede2f61c3f71d1defd3fa999dfa36953755c690689799962b48bebd836974e8cf901200000000000000000000000"
+    "000000000000000000000000000000000000000000000000000200000001111111111111111111111111111111111111"
+    "11111111111111111111111111110000000000fdffffff01f0ca052a0100000016001422222222222222222222222222"
+    "222222222222226500000002000000013333333333333333333333333333333333333333333333333333333333333333"
+    "0100000000fdffffff01e803000000000000160014444444444444444444444444444444444444444465000000\"]";
+static const char legacy_block[] =
+    "[\"0020002006226e46111a0b59caaf126043eb5bbf28c34f3a5e332a1fc7b2b73cf188910f8250fbeb74c618ff816715"
+    "0820af3f8f46a5a53474bd0feedacc114f8453b6b764f15365ffff7f2078563412030100000001000000000000000000"
+    "0000000000000000000000000000000000000000000000ffffffff12016500000001000000022f6269746178652fffff"
+    "ffff01d0f9052a0100000016001455555555555555555555555555555555555555550000000002000000011111111111"
+    "1111111111111111111111111111111111111111111111111111110000000000fdffffff01f0ca052a01000000160014"
+    "222222222222222222222222222222222222222265000000020000000133333333333333333333333333333333333333"
+    "333333333333333333333333330100000000fdffffff01e8030000000000001600144444444444444444444444444444"
+    "44444444444465000000\"]";
+
+static block_template * parse_template(bool segwit)
+{
+    char json[sizeof(template_head) + sizeof(witness_commitment) + sizeof(template_transactions)];
+    snprintf(json, sizeof(json), "%s%s%s", template_head, segwit ? witness_commitment : "", template_transactions);
+
+    cJSON * result = cJSON_Parse(json);
+    TEST_ASSERT_NOT_NULL(result);
+    block_template * tmpl = calloc(1, sizeof(block_template));
+    TEST_ASSERT_TRUE(GBT_parse_template(result, payout_script, sizeof(payout_script), EXTRANONCE_1, tmpl));
+    cJSON_Delete(result);
+    return tmpl;
+}
+
+TEST_CASE("GBT_parse_template splits the coinbase around the extranonce", "[block_template]")
+{
+    block_template * tmpl = parse_template(true);
+
+    TEST_ASSERT_EQUAL(101, tmpl->height);
+    TEST_ASSERT_EQUAL_HEX32(0x20000000, tmpl->version);
+    TEST_ASSERT_EQUAL_HEX32(0x207fffff, tmpl->nbits);
+    TEST_ASSERT_EQUAL(2, tmpl->tx_count);
+    TEST_ASSERT_TRUE(tmpl->segwit);
+    TEST_ASSERT_EQUAL_STRING(coinbase_1, tmpl->coinbase_1);
+    TEST_ASSERT_EQUAL_STRING(segwit_coinbase_2, tmpl->coinbase_2);
+
+    char branches[sizeof(merkle_branches)];
+    TEST_ASSERT_EQUAL(2, tmpl->n_merkle_branches);
+    bin2hex(tmpl->merkle_branches, tmpl->n_merkle_branches * 32, branches, sizeof(branches));
+    TEST_ASSERT_EQUAL_STRING(merkle_branches, branches);
+
+    GBT_free_template(tmpl);
+
+    tmpl = parse_template(false);
+    TEST_ASSERT_FALSE(tmpl->segwit);
+    TEST_ASSERT_EQUAL_STRING(coinbase_1, tmpl->coinbase_1);
+    TEST_ASSERT_EQUAL_STRING(legacy_coinbase_2, tmpl->coinbase_2);
+    GBT_free_template(tmpl);
+}
+
+TEST_CASE("GBT_template_to_notify swaps the previous block hash words", "[block_template]")
+{
+    block_template * tmpl = parse_template(true);
+    mining_notify * notify = GBT_template_to_notify(tmpl);
+
+    TEST_ASSERT_EQUAL_STRING(notify_prev_hash, notify->prev_block_hash);
+    TEST_ASSERT_EQUAL_STRING(coinbase_1, notify->coinbase_1);
+    TEST_ASSERT_EQUAL_STRING(segwit_coinbase_2, notify->coinbase_2);
+    TEST_ASSERT_EQUAL(2, notify->n_merkle_branches);
+    TEST_ASSERT_EQUAL_HEX32(0x207fffff, notify->target);
+    TEST_ASSERT_EQUAL(1700000000, notify->ntime);
+
+    STRATUM_V1_free_mining_notify(notify);
+    GBT_free_template(tmpl);
+}
+
+TEST_CASE("GBT_block_params serializes the block for submitblock", "[block_template]")
+{
+    block_template * tmpl = parse_template(true);
+    char * params = GBT_block_params(tmpl, EXTRANONCE_2, ROLLED_VERSION, NTIME, NONCE);
+    TEST_ASSERT_EQUAL_STRING(segwit_block, params);
+    heap_caps_free(params);
+    GBT_free_template(tmpl);
+
+    tmpl = parse_template(false);
+    params = GBT_block_params(tmpl, EXTRANONCE_2, ROLLED_VERSION, NTIME, NONCE);
+    TEST_ASSERT_EQUAL_STRING(legacy_block, params);
+    heap_caps_free(params);
+    GBT_free_template(tmpl);
+}
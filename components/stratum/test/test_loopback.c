@@ -0,0 +1,67 @@
+#include "test_loopback.h"
+#include "esp_netif.h"
+#include "lwip/sockets.h"
+#include "unity.h"
+
+static void _set_timeout(int sock)
+{
+    struct timeval timeout = {.tv_sec = LOOPBACK_TIMEOUT_MS / 1000, .tv_usec = (LOOPBACK_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+/// @brief a TCP connection to ourselves on 127.0.0.1, client plays the device and server the pool
+void loopback_pair(int * client, int * server)
+{
+    loopback_pair_buffered(client, server, 0);
+}
+
+/// @brief loopback_pair with the client's send and the server's receive buffer shrunk to
+/// buf_size before connecting, where the stack allows it. lwIP's are small already
+void loopback_pair_buffered(int * client, int * server, int buf_size)
+{
+    // brings up lwIP, no interface is needed for the loopback
+    esp_netif_init();
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addr_len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, listener);
+    if (buf_size > 0) {
+        // accepted sockets take the listener's
+        setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+    }
+    TEST_ASSERT_EQUAL(0, bind(listener, (struct sockaddr *) &addr, sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, listen(listener, 1));
+    TEST_ASSERT_EQUAL(0, getsockname(listener, (struct sockaddr *) &addr, &addr_len));
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, *client);
+    if (buf_size > 0) {
+        setsockopt(*client, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    }
+    TEST_ASSERT_EQUAL(0, connect(*client, (struct sockaddr *) &addr, sizeof(addr)));
+    *server = accept(listener, NULL, NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0, *server);
+    close(listener);
+
+    _set_timeout(*client);
+    _set_timeout(*server);
+}
+
+void loopback_send(int sock, const void * data, size_t len)
+{
+    for (size_t sent = 0; sent < len;) {
+        int ret = send(sock, (const char *) data + sent, len - sent, 0);
+        TEST_ASSERT_GREATER_THAN(0, ret);
+        sent += ret;
+    }
+}
+
+void loopback_recv(int sock, void * data, size_t len)
+{
+    for (size_t received = 0; received < len;) {
+        int ret = recv(sock, (char *) data + received, len - received, 0);
+        TEST_ASSERT_GREATER_THAN(0, ret);
+        received += ret;
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef TEST_LOOPBACK_H
+#define TEST_LOOPBACK_H
+
+#include <stddef.h>
+
+// reads on either end give up after this long, so a test that goes wrong fails instead of hanging
+#define LOOPBACK_TIMEOUT_MS 2000
+
+void loopback_pair(int * client, int * server);
+void loopback_pair_buffered(int * client, int * server, int buf_size);
+void loopback_send(int sock, const void * data, size_t len);
+void loopback_recv(int sock, void * data, size_t len);
+
+#endif // TEST_LOOPBACK_H
@@ -0,0 +1,261 @@
+#include "stratum_v2.h"
+#include "lwip/sockets.h"
+#include "test_loopback.h"
+#include "unity.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Frames as the spec lays them out: extension_type U16, msg_type U8, msg_length U24, then the
+// payload, everything little endian. The device end goes through a real connection on a
+// loopback socket, the pool end is plain bytes
+
+static StratumConnection connection;
+static int pool_sock;
+
+static void connect_pool(void)
+{
+    int sock;
+    loopback_pair(&sock, &pool_sock);
+    STRATUM_V1_reset_connection(&connection, sock);
+}
+
+static void disconnect_pool(void)
+{
+    close(connection.sock);
+    close(pool_sock);
+    STRATUM_V1_reset_connection(&connection, -1);
+}
+
+// hands frame to the device and decodes it there
+static int receive(const uint8_t * frame, size_t len, StratumApiV2Message * message)
+{
+    loopback_send(pool_sock, frame, len);
+    return STRATUM_V2_receive_message(&connection, message);
+}
+
+static void fill_sequence(uint8_t * buf, uint8_t first, int len)
+{
+    for (int i = 0; i < len; i++) {
+        buf[i] = first + i;
+    }
+}
+
+TEST_CASE("SV2 encodes SetupConnection, OpenStandardMiningChannel and SubmitSharesStandard", "[stratum_v2]")
+{
+    static const uint8_t setup_connection[] = {
+        0x00, 0x00, 0x00, 0x2e, 0x00, 0x00,
+        // protocol 0, min and max version 2, REQUIRES_STANDARD_JOBS | REQUIRES_VERSION_ROLLING
+        0x00, 0x02, 0x00, 0x02, 0x00, 0x05, 0x00, 0x00, 0x00,
+        0x0c, 'p', 'o', 'o', 'l', '.', 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+        0x08, 0x0d,
+        0x06, 'b', 'i', 't', 'a', 'x', 'e',
+        0x06, 'B', 'M', '1', '3', '6', '6',
+        0x06, 'v', '2', '.', '4', '.', '0',
+        // no device id
+        0x00,
+    };
+    static const uint8_t open_channel[] = {
+        0x00, 0x00, 0x10, 0x34, 0x00, 0x00,
+        0x01, 0x00, 0x00, 0x00,
+        0x0b, 'b', 'c', '1', 'q', '.', 'w', 'o', 'r', 'k', 'e', 'r',
+        // nominal hashrate F32, 2^40 H/s
+        0x00, 0x00, 0x80, 0x53,
+        // max target
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+    static const uint8_t submit_share[] = {
+        // a channel message
+        0x00, 0x80, 0x1a, 0x18, 0x00, 0x00,
+        // channel 7, sequence 3, job 42, nonce, ntime, version
+        0x07, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00,
+        0x78, 0x56, 0x34, 0x12, 0x00, 0x00, 0x00, 0x65, 0x00, 0x20, 0x00, 0x20,
+    };
+    static const uint8_t setup_success[] = {0x00, 0x00, 0x01, 0x06, 0x00, 0x00, 0x02, 0x00, 0x04, 0x00, 0x00, 0x00};
+
+    connect_pool();
+    TEST_ASSERT_EQUAL(sizeof(setup_connection), STRATUM_V2_setup_connection(&connection, "pool.example", 3336, "BM1366", "v2.4.0"));
+    TEST_ASSERT_EQUAL(sizeof(open_channel), STRATUM_V2_open_standard_channel(&connection, 1, "bc1q.worker", 1099511627776.0f));
+    TEST_ASSERT_EQUAL(sizeof(submit_share), STRATUM_V2_submit_share(&connection, 7, 3, 42, 0x12345678, 0x65000000, 0x20002000));
+
+    // the device writes what's queued while it waits for the pool
+    StratumApiV2Message message;
+    TEST_ASSERT_EQUAL(6, receive(setup_success, sizeof(setup_success), &message));
+    TEST_ASSERT_EQUAL(STRATUM_V2_SETUP_SUCCESS, message.method);
+
+    uint8_t written[sizeof(setup_connection) + sizeof(open_channel) + sizeof(submit_share)];
+    loopback_recv(pool_sock, written, sizeof(written));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(setup_connection, written, sizeof(setup_connection));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(open_channel, written + sizeof(setup_connection), sizeof(open_channel));
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(submit_share, written + sizeof(setup_connection) + sizeof(open_channel), sizeof(submit_share));
+
+    disconnect_pool();
+}
+
+TEST_CASE("SV2 decodes the connection and channel replies", "[stratum_v2]")
+{
+    static const uint8_t setup_error[] = {
+        0x00, 0x00, 0x02, 0x19, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        0x14, 'u', 'n', 's', 'u', 'p', 'p', 'o', 'r', 't', 'e', 'd', '-', 'p', 'r', 'o', 't', 'o', 'c', 'o', 'l',
+    };
+    static const uint8_t channel_opened[] = {
+        0x00, 0x80, 0x11, 0x31, 0x00, 0x00,
+        // request 1, channel 7
+        0x01, 0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00,
+        // the difficulty 1 target, 0xffff << 208
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+        // extranonce prefix and group channel, not used by a standard channel
+        0x04, 0xaa, 0xbb, 0xcc, 0xdd,
+        0x01, 0x00, 0x00, 0x00,
+    };
+    static const uint8_t set_target[] = {
+        0x00, 0x80, 0x21, 0x24, 0x00, 0x00,
+        0x07, 0x00, 0x00, 0x00,
+        // difficulty 256
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    static const uint8_t shares_accepted[] = {
+        0x00, 0x80, 0x1c, 0x14, 0x00, 0x00,
+        0x07, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+        // new_shares_sum U64
+        0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    static const uint8_t share_rejected[] = {
+        0x00, 0x80, 0x1d, 0x14, 0x00, 0x00,
+        0x07, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00,
+        0x0b, 's', 't', 'a', 'l', 'e', '-', 's', 'h', 'a', 'r', 'e',
+    };
+    StratumApiV2Message message;
+
+    connect_pool();
+
+    TEST_ASSERT_EQUAL(sizeof(setup_error) - SV2_HEADER_SIZE, receive(setup_error, sizeof(setup_error), &message));
+    TEST_ASSERT_EQUAL(STRATUM_V2_SETUP_ERROR, message.method);
+    TEST_ASSERT_EQUAL_STRING("unsupported-protocol", message.error_code);
+
+    receive(channel_opened, sizeof(channel_opened), &message);
+    TEST_ASSERT_EQUAL(STRATUM_V2_CHANNEL_OPENED, message.method);
+    TEST_ASSERT_EQUAL(7, message.channel_id);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(channel_opened + SV2_HEADER_SIZE + 8, message.target, 32);
+    TEST_ASSERT_EQUAL_FLOAT(1.0, STRATUM_V2_target_to_difficulty(message.target));
+
+    receive(set_target, sizeof(set_target), &message);
+    TEST_ASSERT_EQUAL(STRATUM_V2_SET_TARGET, message.method);
+    TEST_ASSERT_EQUAL(7, message.channel_id);
+    TEST_ASSERT_EQUAL_FLOAT(256.0, STRATUM_V2_target_to_difficulty(message.target));
+
+    receive(shares_accepted, sizeof(shares_accepted), &message);
+    TEST_ASSERT_EQUAL(STRATUM_V2_SHARES_ACCEPTED, message.method);
+    TEST_ASSERT_EQUAL(3, message.sequence_number);
+    TEST_ASSERT_EQUAL(2, message.accepted_count);
+
+    receive(share_rejected, sizeof(share_rejected), &message);
+    TEST_ASSERT_EQUAL(STRATUM_V2_SHARE_REJECTED, message.method);
+    TEST_ASSERT_EQUAL(4, message.sequence_number);
+    TEST_ASSERT_EQUAL_STRING("stale-share", message.error_code);
+
+    disconnect_pool();
+}
+
+TEST_CASE("SV2 decodes jobs and the previous hash, swapping its words for the job factory", "[stratum_v2]")
+{
+    uint8_t future_job[SV2_HEADER_SIZE + 46] = {
+        0x00, 0x80, 0x15, 0x2e, 0x00, 0x00,
+        // channel 7, job 42, no min_ntime, version 0x20000000, then the merkle root's B0_32 length
+        0x07, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x20,
+    };
+    uint8_t job[SV2_HEADER_SIZE + 50] = {
+        0x00, 0x80, 0x15, 0x32, 0x00, 0x00,
+        // channel 7, job 43, min_ntime 0x65000000, version 0x20000000
+        0x07, 0x00, 0x00, 0x00, 0x2b, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x65, 0x00, 0x00, 0x00, 0x20, 0x20,
+    };
+    uint8_t prev_hash[SV2_HEADER_SIZE + 48] = {
+        0x00, 0x80, 0x20, 0x30, 0x00, 0x00,
+        0x07, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00,
+    };
+    // then min_ntime 0x65000001 and nbits 0x1703a30c
+    static const uint8_t prev_hash_tail[] = {0x01, 0x00, 0x00, 0x65, 0x0c, 0xa3, 0x03, 0x17};
+    StratumApiV2Message future, current, prev;
+
+    // merkle roots 0x20.., the previous hash 0x00.. in header byte order
+    fill_sequence(future_job + sizeof(future_job) - 32, 0x20, 32);
+    fill_sequence(job + sizeof(job) - 32, 0x20, 32);
+    fill_sequence(prev_hash + 14, 0x00, 32);
+    memcpy(prev_hash + 46, prev_hash_tail, sizeof(prev_hash_tail));
+
+    connect_pool();
+
+    receive(future_job, sizeof(future_job), &future);
+    TEST_ASSERT_EQUAL(STRATUM_V2_NEW_JOB, future.method);
+    TEST_ASSERT_TRUE(future.future_job);
+    TEST_ASSERT_EQUAL(42, future.job_id);
+    TEST_ASSERT_EQUAL_HEX32(0x20000000, future.version);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(future_job + sizeof(future_job) - 32, future.merkle_root, 32);
+
+    receive(prev_hash, sizeof(prev_hash), &prev);
+    TEST_ASSERT_EQUAL(STRATUM_V2_NEW_PREV_HASH, prev.method);
+    TEST_ASSERT_EQUAL(42, prev.job_id);
+    TEST_ASSERT_EQUAL_HEX32(0x65000001, prev.min_ntime);
+    TEST_ASSERT_EQUAL_HEX32(0x1703a30c, prev.nbits);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(prev_hash + 14, prev.prev_hash, 32);
+
+    receive(job, sizeof(job), &current);
+    TEST_ASSERT_EQUAL(STRATUM_V2_NEW_JOB, current.method);
+    TEST_ASSERT_FALSE(current.future_job);
+    TEST_ASSERT_EQUAL(43, current.job_id);
+    TEST_ASSERT_EQUAL_HEX32(0x65000000, current.min_ntime);
+
+    // the future job goes live on the previous hash's min_ntime
+    mining_notify * notify = STRATUM_V2_job_to_notify(&future, &prev, prev.min_ntime);
+    TEST_ASSERT_EQUAL_STRING("42", notify->job_id);
+    TEST_ASSERT_EQUAL_STRING("03020100070605040b0a09080f0e0d0c13121110171615141b1a19181f1e1d1c", notify->prev_block_hash);
+    TEST_ASSERT_EQUAL_STRING("202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f", notify->merkle_root);
+    TEST_ASSERT_EQUAL_HEX32(0x20000000, notify->version);
+    TEST_ASSERT_EQUAL_HEX32(0x1703a30c, notify->target);
+    TEST_ASSERT_EQUAL_HEX32(0x65000001, notify->ntime);
+    STRATUM_V1_free_mining_notify(notify);
+
+    disconnect_pool();
+}
+
+TEST_CASE("SV2 skips frames it can't use and stays in step", "[stratum_v2]")
+{
+    // a job cut short, its length covers only part of the merkle root
+    static const uint8_t truncated_job[] = {
+        0x00, 0x80, 0x15, 0x10, 0x00, 0x00,
+        0x07, 0x00, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x20, 0x00, 0x01,
+    };
+    static const uint8_t unknown[] = {0x00, 0x00, 0x7f, 0x02, 0x00, 0x00, 0xaa, 0xbb};
+    static const uint8_t reconnect_header[] = {0x00, 0x00, 0x25, 0x00, 0x00, 0x00};
+    StratumApiV2Message message;
+
+    connect_pool();
+
+    TEST_ASSERT_EQUAL(0x10, receive(truncated_job, sizeof(truncated_job), &message));
+    TEST_ASSERT_EQUAL(STRATUM_V2_UNKNOWN, message.method);
+
+    TEST_ASSERT_EQUAL(2, receive(unknown, sizeof(unknown), &message));
+    TEST_ASSERT_EQUAL(STRATUM_V2_UNKNOWN, message.method);
+
+    // larger than anything handled, it's read off the socket in pieces
+    size_t large_len = SV2_MAX_PAYLOAD * 2 + 10;
+    uint8_t * large = calloc(1, SV2_HEADER_SIZE + large_len);
+    large[2] = SV2_NEW_MINING_JOB;
+    large[3] = large_len & 0xff;
+    large[4] = large_len >> 8;
+    TEST_ASSERT_EQUAL(large_len, receive(large, SV2_HEADER_SIZE + large_len, &message));
+    TEST_ASSERT_EQUAL(STRATUM_V2_UNKNOWN, message.method);
+    free(large);
+
+    TEST_ASSERT_EQUAL(0, receive(reconnect_header, sizeof(reconnect_header), &message));
+    TEST_ASSERT_EQUAL(STRATUM_V2_RECONNECT, message.method);
+
+    // the pool going away ends the session
+    close(pool_sock);
+    TEST_ASSERT_EQUAL(-1, STRATUM_V2_receive_message(&connection, &message));
+    close(connection.sock);
+    STRATUM_V1_reset_connection(&connection, -1);
+}
@@ -100,6 +100,18 @@ size_t bin2hex(const uint8_t *buf, size_t buflen, char *hex, size_t hexlen)
     return 2 * buflen;
 }
 
+// Writes word as 8 lower case hex digits, most significant first, without a terminator
+void word2hex(uint32_t word, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (int i = 7; i >= 0; i--)
+    {
+        hex[i] = digits[word & 0xf];
+        word >>= 4;
+    }
+}
+
 uint8_t hex2val(char c)
 {
     if (c >= '0' && c <= '9')
@@ -0,0 +1,121 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+
+#include "boot.h"
+
+#define BOOT_STAGE_STACK 8192
+#define BOOT_STAGE_PRIORITY 5
+
+static const char * TAG = "boot";
+
+static const char * state_names[] = {"pending", "running", "done", "failed", "skipped"};
+
+typedef struct
+{
+    boot_stage_info info;
+    boot_stage_fn fn;
+    void * ctx;
+} boot_stage;
+
+static boot_stage stages[BOOT_MAX_STAGES];
+static uint8_t stage_count = 0;
+
+// a stage's bit is set once it is done, failed or skipped
+static EventGroupHandle_t finished = NULL;
+
+void BOOT_add_stage(uint8_t id, const char * name, uint32_t depends_on, boot_stage_fn fn, void * ctx)
+{
+    if (id >= BOOT_MAX_STAGES) {
+        ESP_LOGE(TAG, "Boot stage %s has id %u, only %d stages fit", name, id, BOOT_MAX_STAGES);
+        return;
+    }
+
+    stages[id].info.name = name;
+    stages[id].info.depends_on = depends_on;
+    stages[id].info.state = BOOT_STAGE_PENDING;
+    stages[id].fn = fn;
+    stages[id].ctx = ctx;
+    if (id >= stage_count) {
+        stage_count = id + 1;
+    }
+}
+
+static bool _dependencies_done(const boot_stage * stage)
+{
+    for (uint8_t i = 0; i < stage_count; i++) {
+        if ((stage->info.depends_on & BOOT_DEPENDS(i)) && stages[i].info.state != BOOT_STAGE_DONE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Each stage gets its own short lived task that sleeps until everything it depends on has
+// finished, so independent stages like ASIC bring-up and WiFi association overlap.
+static void _stage_task(void * pvParameters)
+{
+    uint8_t id = (uintptr_t) pvParameters;
+    boot_stage * stage = &stages[id];
+
+    if (stage->info.depends_on != 0) {
+        xEventGroupWaitBits(finished, stage->info.depends_on, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+
+    if (!_dependencies_done(stage)) {
+        stage->info.state = BOOT_STAGE_SKIPPED;
+        ESP_LOGW(TAG, "Skipping boot stage %s, a dependency did not complete", stage->info.name);
+    } else {
+        stage->info.start_us = esp_timer_get_time();
+        stage->info.state = BOOT_STAGE_RUNNING;
+        bool ok = stage->fn(stage->ctx);
+        stage->info.end_us = esp_timer_get_time();
+        stage->info.state = ok ? BOOT_STAGE_DONE : BOOT_STAGE_FAILED;
+        ESP_LOGI(TAG, "Boot stage %s %s in %lld ms (at %lld ms)", stage->info.name, state_names[stage->info.state],
+                 (stage->info.end_us - stage->info.start_us) / 1000, stage->info.end_us / 1000);
+    }
+
+    xEventGroupSetBits(finished, BOOT_DEPENDS(id));
+    vTaskDelete(NULL);
+}
+
+void BOOT_start(void)
+{
+    finished = xEventGroupCreate();
+
+    for (uint8_t i = 0; i < stage_count; i++) {
+        if (stages[i].fn == NULL) {
+            // unused id, let anything depending on it go ahead
+            stages[i].info.state = BOOT_STAGE_DONE;
+            xEventGroupSetBits(finished, BOOT_DEPENDS(i));
+        }
+    }
+
+    for (uint8_t i = 0; i < stage_count; i++) {
+        if (stages[i].fn != NULL) {
+            xTaskCreate(_stage_task, stages[i].info.name, BOOT_STAGE_STACK, (void *) (uintptr_t) i, BOOT_STAGE_PRIORITY, NULL);
+        }
+    }
+}
+
+bool BOOT_get_stage(uint8_t id, boot_stage_info * info)
+{
+    if (id >= stage_count || stages[id].fn == NULL) {
+        return false;
+    }
+
+    *info = stages[id].info;
+    return true;
+}
+
+uint8_t BOOT_get_stage_count(void)
+{
+    return stage_count;
+}
+
+const char * BOOT_state_name(boot_stage_state state)
+{
+    return state_names[state];
+}
@@ -0,0 +1,41 @@
+#ifndef BOOT_H_
+#define BOOT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// event group bits, one per stage
+#define BOOT_MAX_STAGES 24
+
+#define BOOT_DEPENDS(stage) (1UL << (stage))
+
+typedef enum
+{
+    BOOT_STAGE_PENDING,
+    BOOT_STAGE_RUNNING,
+    BOOT_STAGE_DONE,
+    BOOT_STAGE_FAILED,
+    // a dependency failed, never ran
+    BOOT_STAGE_SKIPPED
+} boot_stage_state;
+
+typedef bool (*boot_stage_fn)(void * ctx);
+
+typedef struct
+{
+    const char * name;
+    // bitmask of BOOT_DEPENDS(id) for every stage that has to be done first
+    uint32_t depends_on;
+    boot_stage_state state;
+    // time since boot, 0 until the stage starts / finishes
+    int64_t start_us;
+    int64_t end_us;
+} boot_stage_info;
+
+void BOOT_add_stage(uint8_t id, const char * name, uint32_t depends_on, boot_stage_fn fn, void * ctx);
+void BOOT_start(void);
+bool BOOT_get_stage(uint8_t id, boot_stage_info * info);
+uint8_t BOOT_get_stage_count(void);
+const char * BOOT_state_name(boot_stage_state state);
+
+#endif /* BOOT_H_ */
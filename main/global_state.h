@@ -29,14 +29,75 @@ typedef enum
     ASIC_BM1366
 } AsicModel;
 
+typedef enum
+{
+    STRATUM_PROTOCOL_V1 = 1,
+    STRATUM_PROTOCOL_V2 = 2,
+    // getblocktemplate against a node, the url, port, user and password are its RPC endpoint
+    STRATUM_PROTOCOL_SOLO = 3
+} StratumProtocol;
+
+typedef enum
+{
+    POOL_SELECTION_PRIMARY = 0,
+    // needs both pools connected, so only applies with a Stratum V1 fallback on hot standby
+    POOL_SELECTION_LATENCY = 1
+} PoolSelection;
+
+// Latency to one pool in ms, each smoothed over recent samples
+typedef struct
+{
+    // TCP connect, measured on every (re)connect and probe
+    float connect_ms;
+    // how far this pool's new blocks trail the other pool's, 0 when it is first
+    float notify_delay_ms;
+    // mining.submit to its result
+    float ack_ms;
+    // from losing the connection to the first job on the next one
+    uint32_t reconnect_ms;
+    // the last TLS handshake, much shorter when the pool resumed the session
+    uint32_t tls_handshake_ms;
+    uint32_t connect_samples;
+    uint32_t notify_samples;
+    uint32_t ack_samples;
+} PoolLatency;
+
+// submit to result latency, bucket i holds acks up to ACK_LATENCY_FIRST_BUCKET_MS << i,
+// the last one everything slower
+#define ACK_LATENCY_BUCKETS 8
+#define ACK_LATENCY_FIRST_BUCKET_MS 25
+
+// distinct reasons pools rejected shares for, once full the rest are counted under the last
+#define REJECT_REASON_SLOTS 8
+#define REJECT_REASON_SIZE 48
+
+typedef struct
+{
+    char reason[REJECT_REASON_SIZE];
+    uint32_t count;
+} RejectReason;
+
 typedef struct
 {
-    uint8_t (*init_fn)(uint64_t, uint16_t);
-    task_result * (*receive_result_fn)(void * GLOBAL_STATE);
-    int (*set_max_baud_fn)(void);
-    void (*set_difficulty_mask_fn)(int);
-    void (*send_work_fn)(void * GLOBAL_STATE, bm_job * next_bm_job);
+    uint8_t (*init_fn)(uint8_t, uint64_t, uint16_t);
+    int (*receive_results_fn)(void * chain, task_result * results, int max_results);
+    int (*set_max_baud_fn)(uint8_t);
+    int (*step_down_baud_fn)(uint8_t);
+    void (*get_rx_stats_fn)(uint8_t, asic_rx_stats *);
+    void (*poll_registers_fn)(uint8_t);
+    bool (*get_chip_telemetry_fn)(uint8_t, uint16_t, asic_chip_telemetry *);
+    bool (*set_chip_frequency_fn)(uint8_t, uint16_t, float);
+    float (*get_chip_frequency_fn)(uint8_t, uint16_t);
+    float (*get_actual_frequency_fn)(uint8_t, uint16_t);
+    uint32_t (*set_difficulty_mask_fn)(uint8_t, uint32_t);
+    uint32_t (*get_difficulty_mask_fn)(uint8_t);
+    void (*prepare_work_fn)(bm_job * next_bm_job);
+    void (*send_work_fn)(void * chain, bm_job * next_bm_job);
     bool (*send_hash_frequency_fn)(float);
+    bool (*set_frequency_fn)(float);
+    bool (*run_frequency_ramp_fn)(uint8_t, SemaphoreHandle_t);
+    void (*cancel_frequency_ramp_fn)(void);
+    void (*get_frequency_ramp_fn)(uint8_t, asic_frequency_ramp *);
 } AsicFunctions;
 
 typedef struct
@@ -51,6 +112,8 @@ typedef struct
     int64_t start_time;
     uint64_t shares_accepted;
     uint64_t shares_rejected;
+    uint32_t ack_latency_histogram[ACK_LATENCY_BUCKETS];
+    RejectReason reject_reasons[REJECT_REASON_SLOTS];
     int screen_page;
     char oled_buf[20];
     uint64_t best_nonce_diff;
@@ -65,13 +128,47 @@ typedef struct
     char * fallback_pool_url;
     uint16_t pool_port;
     uint16_t fallback_pool_port;
+    uint16_t pool_protocol;
+    uint16_t fallback_pool_protocol;
+    // the url was stratum+ssl://, only Stratum V1 pools are run over TLS
+    bool pool_tls;
+    bool fallback_pool_tls;
     bool is_using_fallback;
+    PoolSelection pool_selection;
+    // primary then fallback
+    PoolLatency pool_latency[2];
+    // moves onto another pool after the active one dropped, and how long the last one left the chains without work
+    uint32_t failover_count;
+    uint32_t last_failover_ms;
     uint16_t overheat_mode;
 
     uint32_t lastClockSync;
 } SystemModule;
 
+// One string of ASICs on its own UART. Each chain has its own job ids, ticket mask and baud,
+// and is driven by its own ASIC_task / ASIC_result_task pair pulling from the shared job queue.
 typedef struct
+{
+    uint8_t id;
+    uint8_t chip_count;
+    AsicTaskModule ASIC_TASK_MODULE;
+    uint32_t current_ASIC_difficulty;
+    // mask before the last retune, nonces still in flight may have been found against it
+    uint32_t previous_ASIC_difficulty;
+    int asic_baud;
+    // GH/s from the nonces this chain returned over the last rx window
+    double hashrate;
+    // time spent bringing the chain up, and time since boot of its first nonce (0 until one arrives)
+    uint32_t init_ms;
+    int64_t first_nonce_us;
+
+    uint8_t * valid_jobs;
+    pthread_mutex_t valid_jobs_lock;
+
+    struct GlobalState * GLOBAL_STATE;
+} AsicChain;
+
+typedef struct GlobalState
 {
     DeviceModel device_model;
     char * device_model_str;
@@ -79,6 +176,7 @@ typedef struct
     AsicModel asic_model;
     char * asic_model_str;
     uint16_t asic_count;
+    uint16_t asic_core_count;
     uint16_t voltage_domain;
     AsicFunctions ASIC_functions;
     double asic_job_frequency_ms;
@@ -88,20 +186,24 @@ typedef struct
     work_queue ASIC_jobs_queue;
 
     SystemModule SYSTEM_MODULE;
-    AsicTaskModule ASIC_TASK_MODULE;
     PowerManagementModule POWER_MANAGEMENT_MODULE;
 
+    AsicChain chains[ASIC_MAX_CHAINS];
+    uint8_t chain_count;
+
     char * extranonce_str;
     int extranonce_2_len;
     int abandon_work;
 
-    uint8_t * valid_jobs;
-    pthread_mutex_t valid_jobs_lock;
-
     uint32_t stratum_difficulty;
     uint32_t version_mask;
 
-    int sock;
+    // the active pool's connection, shares are written to it
+    StratumConnection * connection;
+    // protocol of the current pool connection, and the Stratum V2 channel shares go to
+    StratumProtocol stratum_protocol;
+    uint32_t stratum_v2_channel_id;
+    uint32_t stratum_v2_sequence;
 
 } GlobalState;
 
@@ -1,4 +1,5 @@
 #include "http_server.h"
+#include "boot.h"
 #include "cJSON.h"
 #include "esp_chip_info.h"
 #include "esp_http_server.h"
@@ -13,6 +14,8 @@
 #include "global_state.h"
 #include "nvs_config.h"
 #include "recovery_page.h"
+#include "serial.h"
+#include "stratum_proxy_task.h"
 #include "vcore.h"
 #include <fcntl.h>
 #include <string.h>
@@ -59,6 +62,8 @@ static int fd = -1;
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + 128)
 #define SCRATCH_BUFSIZE (10240)
 #define MESSAGE_QUEUE_SIZE (128)
+// how often the per chip summary is pushed to the websocket
+#define ASIC_STATS_PUSH_MS (5000)
 
 typedef struct rest_server_context
 {
@@ -324,6 +329,21 @@ static esp_err_t PATCH_update_settings(httpd_req_t *req)
     if ((item = cJSON_GetObjectItem(root, "fallbackStratumPort")) != NULL) {
         nvs_config_set_u16(NVS_CONFIG_FALLBACK_STRATUM_PORT, item->valueint);
     }
+    if ((item = cJSON_GetObjectItem(root, "stratumProtocol")) != NULL) {
+        nvs_config_set_u16(NVS_CONFIG_STRATUM_PROTOCOL, item->valueint);
+    }
+    if ((item = cJSON_GetObjectItem(root, "fallbackStratumProtocol")) != NULL) {
+        nvs_config_set_u16(NVS_CONFIG_FALLBACK_STRATUM_PROTOCOL, item->valueint);
+    }
+    if ((item = cJSON_GetObjectItem(root, "soloAddress")) != NULL) {
+        nvs_config_set_string(NVS_CONFIG_SOLO_ADDRESS, item->valuestring);
+    }
+    if ((item = cJSON_GetObjectItem(root, "proxyPort")) != NULL) {
+        nvs_config_set_u16(NVS_CONFIG_PROXY_PORT, item->valueint);
+    }
+    if ((item = cJSON_GetObjectItem(root, "poolSelection")) != NULL) {
+        nvs_config_set_u16(NVS_CONFIG_POOL_SELECTION, item->valueint);
+    }
     if ((item = cJSON_GetObjectItem(root, "ssid")) != NULL) {
         nvs_config_set_string(NVS_CONFIG_WIFI_SSID, item->valuestring);
     }
@@ -357,6 +377,19 @@ static esp_err_t PATCH_update_settings(httpd_req_t *req)
     if ((item = cJSON_GetObjectItem(root, "fanspeed")) != NULL) {
         nvs_config_set_u16(NVS_CONFIG_FAN_SPEED, item->valueint);
     }
+    if ((item = cJSON_GetObjectItem(root, "chipAutotune")) != NULL) {
+        nvs_config_set_u16(NVS_CONFIG_CHIP_AUTOTUNE, item->valueint);
+    }
+    // one array of MHz per chain, 0 puts the chip back on the chain frequency
+    if ((item = cJSON_GetObjectItem(root, "chipFrequencies")) != NULL && cJSON_IsArray(item)) {
+        for (uint8_t i = 0; i < GLOBAL_STATE->chain_count && i < cJSON_GetArraySize(item); i++) {
+            cJSON *chips = cJSON_GetArrayItem(item, i);
+            for (uint16_t c = 0; c < cJSON_GetArraySize(chips); c++) {
+                ASIC_set_chip_frequency(GLOBAL_STATE, i, c, cJSON_GetArrayItem(chips, c)->valuedouble);
+            }
+        }
+        ASIC_save_chip_frequencies(GLOBAL_STATE);
+    }
     
     cJSON_Delete(root);
     httpd_resp_send_chunk(req, NULL, 0);
@@ -381,6 +414,25 @@ static esp_err_t POST_restart(httpd_req_t *req)
     return ESP_OK;
 }
 
+static esp_err_t POST_cancel_frequency_ramp(httpd_req_t *req)
+{
+    // Set CORS headers
+    if (set_cors_headers(req) != ESP_OK) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    if (GLOBAL_STATE->ASIC_functions.cancel_frequency_ramp_fn == NULL) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No ASIC");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Cancelling frequency ramp because of API Request");
+    (*GLOBAL_STATE->ASIC_functions.cancel_frequency_ramp_fn)();
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
 static esp_err_t GET_swarm(httpd_req_t *req)
 {
     httpd_resp_set_type(req, "application/json");
@@ -397,6 +449,66 @@ static esp_err_t GET_swarm(httpd_req_t *req)
 }
 
 /* Simple handler for getting system handler */
+static esp_err_t GET_system_boot(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+
+    // Set CORS headers
+    if (set_cors_headers(req) != ESP_OK) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON *stages = cJSON_CreateArray();
+    int64_t boot_done_us = 0;
+    boot_stage_info info;
+    for (uint8_t i = 0; i < BOOT_get_stage_count(); i++) {
+        if (!BOOT_get_stage(i, &info)) {
+            continue;
+        }
+
+        // stage times are since boot
+        cJSON *stage = cJSON_CreateObject();
+        cJSON_AddStringToObject(stage, "name", info.name);
+        cJSON_AddStringToObject(stage, "state", BOOT_state_name(info.state));
+        cJSON *depends_on = cJSON_CreateArray();
+        boot_stage_info dependency;
+        for (uint8_t d = 0; d < BOOT_get_stage_count(); d++) {
+            if ((info.depends_on & BOOT_DEPENDS(d)) && BOOT_get_stage(d, &dependency)) {
+                cJSON_AddItemToArray(depends_on, cJSON_CreateString(dependency.name));
+            }
+        }
+        cJSON_AddItemToObject(stage, "dependsOn", depends_on);
+        cJSON_AddNumberToObject(stage, "startMs", info.start_us / 1000);
+        cJSON_AddNumberToObject(stage, "endMs", info.end_us / 1000);
+        cJSON_AddNumberToObject(stage, "durationMs", info.end_us > info.start_us ? (info.end_us - info.start_us) / 1000 : 0);
+        cJSON_AddItemToArray(stages, stage);
+
+        if (info.end_us > boot_done_us) {
+            boot_done_us = info.end_us;
+        }
+    }
+    cJSON_AddItemToObject(root, "stages", stages);
+    cJSON_AddNumberToObject(root, "bootMs", boot_done_us / 1000);
+
+    // first nonce on any chain, 0 until one arrives
+    int64_t first_nonce_us = 0;
+    for (uint8_t i = 0; i < GLOBAL_STATE->chain_count; i++) {
+        int64_t chain_first = GLOBAL_STATE->chains[i].first_nonce_us;
+        if (chain_first != 0 && (first_nonce_us == 0 || chain_first < first_nonce_us)) {
+            first_nonce_us = chain_first;
+        }
+    }
+    cJSON_AddNumberToObject(root, "firstNonceMs", first_nonce_us / 1000);
+
+    const char *boot = cJSON_Print(root);
+    httpd_resp_sendstr(req, boot);
+    free((char *)boot);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
 static esp_err_t GET_system_info(httpd_req_t *req)
 {
     httpd_resp_set_type(req, "application/json");
@@ -428,6 +540,7 @@ static esp_err_t GET_system_info(httpd_req_t *req)
     char *fallbackStratumURL = nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_URL, CONFIG_FALLBACK_STRATUM_URL);
     char *stratumUser = nvs_config_get_string(NVS_CONFIG_STRATUM_USER, CONFIG_STRATUM_USER);
     char *fallbackStratumUser = nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_USER, CONFIG_FALLBACK_STRATUM_USER);
+    char *soloAddress = nvs_config_get_string(NVS_CONFIG_SOLO_ADDRESS, "");
     char *board_version = nvs_config_get_string(NVS_CONFIG_BOARD_VERSION, "unknown");
 
     cJSON *root = cJSON_CreateObject();
@@ -450,13 +563,122 @@ static esp_err_t GET_system_info(httpd_req_t *req)
     cJSON_AddNumberToObject(root, "coreVoltage", nvs_config_get_u16(NVS_CONFIG_ASIC_VOLTAGE, CONFIG_ASIC_VOLTAGE));
     cJSON_AddNumberToObject(root, "coreVoltageActual", VCORE_get_voltage_mv(GLOBAL_STATE));
     cJSON_AddNumberToObject(root, "frequency", nvs_config_get_u16(NVS_CONFIG_ASIC_FREQ, CONFIG_ASIC_FREQUENCY));
+    // the PLL can't hit every requested frequency, this is the nearest one it produces
+    if (GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn != NULL) {
+        cJSON_AddNumberToObject(root, "actualFrequency", (*GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn)(0, ASIC_MAX_CHIPS));
+    }
     cJSON_AddStringToObject(root, "ssid", ssid);
     cJSON_AddStringToObject(root, "hostname", hostname);
     cJSON_AddStringToObject(root, "wifiStatus", GLOBAL_STATE->SYSTEM_MODULE.wifi_status);
     cJSON_AddNumberToObject(root, "sharesAccepted", GLOBAL_STATE->SYSTEM_MODULE.shares_accepted);
     cJSON_AddNumberToObject(root, "sharesRejected", GLOBAL_STATE->SYSTEM_MODULE.shares_rejected);
+    // maxMs is -1 for the last bucket, it has no upper bound
+    cJSON *ack_histogram = cJSON_CreateArray();
+    for (int i = 0; i < ACK_LATENCY_BUCKETS; i++) {
+        cJSON *bucket = cJSON_CreateObject();
+        cJSON_AddNumberToObject(bucket, "maxMs", i < ACK_LATENCY_BUCKETS - 1 ? ACK_LATENCY_FIRST_BUCKET_MS << i : -1);
+        cJSON_AddNumberToObject(bucket, "count", GLOBAL_STATE->SYSTEM_MODULE.ack_latency_histogram[i]);
+        cJSON_AddItemToArray(ack_histogram, bucket);
+    }
+    cJSON_AddItemToObject(root, "ackLatencyHistogram", ack_histogram);
+    cJSON *reject_reasons = cJSON_CreateArray();
+    for (int i = 0; i < REJECT_REASON_SLOTS && GLOBAL_STATE->SYSTEM_MODULE.reject_reasons[i].count > 0; i++) {
+        cJSON *reason = cJSON_CreateObject();
+        cJSON_AddStringToObject(reason, "reason", GLOBAL_STATE->SYSTEM_MODULE.reject_reasons[i].reason);
+        cJSON_AddNumberToObject(reason, "count", GLOBAL_STATE->SYSTEM_MODULE.reject_reasons[i].count);
+        cJSON_AddItemToArray(reject_reasons, reason);
+    }
+    cJSON_AddItemToObject(root, "rejectReasons", reject_reasons);
+    // the active pool's share queue, and how long shares wait in it before being written
+    StratumConnection *connection = GLOBAL_STATE->connection;
+    cJSON_AddNumberToObject(root, "submitQueueDepth", connection != NULL ? STRATUM_V1_queue_depth(connection) : 0);
+    cJSON_AddNumberToObject(root, "submitQueuePeak", connection != NULL ? connection->tx_queue_peak : 0);
+    cJSON_AddNumberToObject(root, "submitLatencyMs", connection != NULL ? connection->submit_latency_ms : 0);
     cJSON_AddNumberToObject(root, "uptimeSeconds", (esp_timer_get_time() - GLOBAL_STATE->SYSTEM_MODULE.start_time) / 1000000);
     cJSON_AddNumberToObject(root, "asicCount", GLOBAL_STATE->asic_count);
+    cJSON_AddNumberToObject(root, "asicDifficulty", GLOBAL_STATE->chains[0].current_ASIC_difficulty);
+
+    // top level link figures are totals over every chain, per chain figures are in "chains"
+    double frames_per_sec = 0;
+    int64_t first_nonce_us = 0;
+    serial_rx_stats rx_total = {0};
+    asic_rx_stats asic_total = {0};
+    cJSON * chains = cJSON_CreateArray();
+    for (uint8_t i = 0; i < GLOBAL_STATE->chain_count; i++) {
+        AsicChain * chain = &GLOBAL_STATE->chains[i];
+
+        serial_rx_stats rx_stats;
+        SERIAL_get_rx_stats(i, &rx_stats);
+        asic_rx_stats asic_stats = {0};
+        if (GLOBAL_STATE->ASIC_functions.get_rx_stats_fn != NULL) {
+            (*GLOBAL_STATE->ASIC_functions.get_rx_stats_fn)(i, &asic_stats);
+        }
+
+        frames_per_sec += chain->ASIC_TASK_MODULE.rx_frames_per_sec;
+        if (rx_stats.high_water > rx_total.high_water) {
+            rx_total.high_water = rx_stats.high_water;
+        }
+        rx_total.overflows += rx_stats.overflows;
+        asic_total.resyncs += asic_stats.resyncs;
+        asic_total.crc_errors += asic_stats.crc_errors;
+        asic_total.bytes_discarded += asic_stats.bytes_discarded;
+        if (chain->first_nonce_us != 0 && (first_nonce_us == 0 || chain->first_nonce_us < first_nonce_us)) {
+            first_nonce_us = chain->first_nonce_us;
+        }
+
+        cJSON * entry = cJSON_CreateObject();
+        cJSON_AddNumberToObject(entry, "id", chain->id);
+        cJSON_AddNumberToObject(entry, "chipCount", chain->chip_count);
+        if (GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn != NULL) {
+            cJSON_AddNumberToObject(entry, "frequency", (*GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn)(i, ASIC_MAX_CHIPS));
+        }
+        cJSON_AddNumberToObject(entry, "hashRate", chain->hashrate);
+        cJSON_AddNumberToObject(entry, "initMs", chain->init_ms);
+        cJSON_AddNumberToObject(entry, "firstNonceMs", chain->first_nonce_us / 1000);
+
+        if (GLOBAL_STATE->ASIC_functions.get_frequency_ramp_fn != NULL) {
+            asic_frequency_ramp ramp;
+            (*GLOBAL_STATE->ASIC_functions.get_frequency_ramp_fn)(i, &ramp);
+            cJSON *json_ramp = cJSON_CreateObject();
+            cJSON_AddBoolToObject(json_ramp, "active", ramp.active);
+            cJSON_AddNumberToObject(json_ramp, "current", ramp.current);
+            cJSON_AddNumberToObject(json_ramp, "target", ramp.target);
+            cJSON_AddItemToObject(entry, "frequencyRamp", json_ramp);
+        }
+
+        // same figure from the chips' own hash counters, free of ticket sampling noise
+        double counter_hashrate = 0;
+        asic_chip_telemetry telemetry;
+        if (GLOBAL_STATE->ASIC_functions.get_chip_telemetry_fn != NULL) {
+            for (uint16_t c = 0; c < chain->chip_count; c++) {
+                if ((*GLOBAL_STATE->ASIC_functions.get_chip_telemetry_fn)(i, c, &telemetry)) {
+                    counter_hashrate += telemetry.hashrate;
+                }
+            }
+        }
+        cJSON_AddNumberToObject(entry, "counterHashRate", counter_hashrate);
+        cJSON_AddNumberToObject(entry, "asicDifficulty", chain->current_ASIC_difficulty);
+        cJSON_AddNumberToObject(entry, "asicBaud", chain->asic_baud);
+        cJSON_AddNumberToObject(entry, "asicFramesPerSec", chain->ASIC_TASK_MODULE.rx_frames_per_sec);
+        cJSON_AddNumberToObject(entry, "uartRxHighWater", rx_stats.high_water);
+        cJSON_AddNumberToObject(entry, "uartRxOverflows", rx_stats.overflows);
+        cJSON_AddNumberToObject(entry, "asicRxResyncs", asic_stats.resyncs);
+        cJSON_AddNumberToObject(entry, "asicRxCrcErrors", asic_stats.crc_errors);
+        cJSON_AddNumberToObject(entry, "asicRxBytesDiscarded", asic_stats.bytes_discarded);
+        cJSON_AddItemToArray(chains, entry);
+    }
+
+    cJSON_AddNumberToObject(root, "asicFramesPerSec", frames_per_sec);
+    cJSON_AddNumberToObject(root, "uartRxHighWater", rx_total.high_water);
+    cJSON_AddNumberToObject(root, "uartRxOverflows", rx_total.overflows);
+    cJSON_AddNumberToObject(root, "asicRxResyncs", asic_total.resyncs);
+    cJSON_AddNumberToObject(root, "asicRxCrcErrors", asic_total.crc_errors);
+    cJSON_AddNumberToObject(root, "asicRxBytesDiscarded", asic_total.bytes_discarded);
+    cJSON_AddNumberToObject(root, "asicBaud", GLOBAL_STATE->chains[0].asic_baud);
+    // boot to first nonce on any chain, 0 while still waiting for one
+    cJSON_AddNumberToObject(root, "firstNonceMs", first_nonce_us / 1000);
+    cJSON_AddNumberToObject(root, "chainCount", GLOBAL_STATE->chain_count);
+    cJSON_AddItemToObject(root, "chains", chains);
     uint16_t small_core_count = 0;
     switch (GLOBAL_STATE->asic_model) {
     case ASIC_BM1366:
@@ -473,8 +695,28 @@ static esp_err_t GET_system_info(httpd_req_t *req)
     cJSON_AddStringToObject(root, "fallbackStratumURL", fallbackStratumURL);
     cJSON_AddNumberToObject(root, "stratumPort", nvs_config_get_u16(NVS_CONFIG_STRATUM_PORT, CONFIG_STRATUM_PORT));
     cJSON_AddNumberToObject(root, "fallbackStratumPort", nvs_config_get_u16(NVS_CONFIG_FALLBACK_STRATUM_PORT, CONFIG_FALLBACK_STRATUM_PORT));
+    cJSON_AddNumberToObject(root, "stratumProtocol", nvs_config_get_u16(NVS_CONFIG_STRATUM_PROTOCOL, STRATUM_PROTOCOL_V1));
+    cJSON_AddNumberToObject(root, "fallbackStratumProtocol", nvs_config_get_u16(NVS_CONFIG_FALLBACK_STRATUM_PROTOCOL, STRATUM_PROTOCOL_V1));
+    cJSON_AddNumberToObject(root, "isUsingFallbackStratum", GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback);
+    cJSON_AddNumberToObject(root, "failovers", GLOBAL_STATE->SYSTEM_MODULE.failover_count);
+    cJSON_AddNumberToObject(root, "lastFailoverMs", GLOBAL_STATE->SYSTEM_MODULE.last_failover_ms);
+    cJSON_AddNumberToObject(root, "poolSelection", GLOBAL_STATE->SYSTEM_MODULE.pool_selection);
+    PoolLatency * latency = GLOBAL_STATE->SYSTEM_MODULE.pool_latency;
+    cJSON_AddNumberToObject(root, "connectRttMs", latency[0].connect_ms);
+    cJSON_AddNumberToObject(root, "fallbackConnectRttMs", latency[1].connect_ms);
+    cJSON_AddNumberToObject(root, "notifyDelayMs", latency[0].notify_delay_ms);
+    cJSON_AddNumberToObject(root, "fallbackNotifyDelayMs", latency[1].notify_delay_ms);
+    cJSON_AddNumberToObject(root, "ackLatencyMs", latency[0].ack_ms);
+    cJSON_AddNumberToObject(root, "fallbackAckLatencyMs", latency[1].ack_ms);
+    cJSON_AddNumberToObject(root, "reconnectMs", latency[0].reconnect_ms);
+    cJSON_AddNumberToObject(root, "fallbackReconnectMs", latency[1].reconnect_ms);
+    cJSON_AddNumberToObject(root, "tlsHandshakeMs", latency[0].tls_handshake_ms);
+    cJSON_AddNumberToObject(root, "fallbackTlsHandshakeMs", latency[1].tls_handshake_ms);
     cJSON_AddStringToObject(root, "stratumUser", stratumUser);
     cJSON_AddStringToObject(root, "fallbackStratumUser", fallbackStratumUser);
+    cJSON_AddStringToObject(root, "soloAddress", soloAddress);
+    cJSON_AddNumberToObject(root, "proxyPort", nvs_config_get_u16(NVS_CONFIG_PROXY_PORT, 0));
+    cJSON_AddNumberToObject(root, "proxyClients", stratum_proxy_client_count());
     cJSON_AddStringToObject(root, "version", esp_ota_get_app_description()->version);
     cJSON_AddStringToObject(root, "boardVersion", board_version);
     cJSON_AddStringToObject(root, "runningPartition", esp_ota_get_running_partition()->label);
@@ -497,6 +739,7 @@ static esp_err_t GET_system_info(httpd_req_t *req)
     free(stratumURL);
     free(fallbackStratumURL);
     free(stratumUser);
+    free(soloAddress);
     free(board_version);
 
     const char *sys_info = cJSON_Print(root);
@@ -506,6 +749,100 @@ static esp_err_t GET_system_info(httpd_req_t *req)
     return ESP_OK;
 }
 
+static void add_nonce_stats(cJSON *obj, const asic_nonce_stats *stats, int64_t now)
+{
+    cJSON_AddNumberToObject(obj, "nonces", stats->nonces);
+    cJSON_AddNumberToObject(obj, "hwErrors", stats->hw_errors);
+    // -1 when nothing has been seen yet
+    cJSON_AddNumberToObject(obj, "lastSeenMs", stats->last_seen ? (now - stats->last_seen) / 1000 : -1);
+}
+
+// Per chip counters for every chain, with the per core breakdown as parallel arrays when asked for
+static cJSON *get_asic_stats(bool include_cores)
+{
+    int64_t now = esp_timer_get_time();
+    cJSON *root = cJSON_CreateObject();
+    cJSON *chains = cJSON_CreateArray();
+
+    for (uint8_t i = 0; i < GLOBAL_STATE->chain_count; i++) {
+        AsicTaskModule *module = &GLOBAL_STATE->chains[i].ASIC_TASK_MODULE;
+
+        cJSON *chain = cJSON_CreateObject();
+        cJSON_AddNumberToObject(chain, "id", i);
+        cJSON *unattributed = cJSON_CreateObject();
+        add_nonce_stats(unattributed, &module->unattributed, now);
+        cJSON_AddItemToObject(chain, "unattributed", unattributed);
+
+        cJSON *chips = cJSON_CreateArray();
+        for (uint16_t c = 0; c < module->chip_stats_len; c++) {
+            asic_chip_stats *stats = &module->chip_stats[c];
+
+            cJSON *chip = cJSON_CreateObject();
+            cJSON_AddNumberToObject(chip, "chip", c);
+            add_nonce_stats(chip, &stats->total, now);
+            cJSON_AddNumberToObject(chip, "sharesAccepted", stats->shares_accepted);
+            cJSON_AddNumberToObject(chip, "sharesRejected", stats->shares_rejected);
+
+            if (GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn != NULL) {
+                cJSON_AddNumberToObject(chip, "frequency", (*GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn)(i, c));
+            }
+            cJSON_AddNumberToObject(chip, "targetFrequency", module->chip_tuning[c].target_frequency);
+            cJSON_AddBoolToObject(chip, "tuned", module->chip_tuning[c].tuned);
+
+            asic_chip_telemetry telemetry;
+            if (GLOBAL_STATE->ASIC_functions.get_chip_telemetry_fn != NULL &&
+                (*GLOBAL_STATE->ASIC_functions.get_chip_telemetry_fn)(i, c, &telemetry)) {
+                cJSON_AddNumberToObject(chip, "counterHashRate", telemetry.hashrate);
+                cJSON_AddNumberToObject(chip, "hashCounter", telemetry.hash_counter);
+                cJSON_AddNumberToObject(chip, "errorCounter", telemetry.error_counter);
+                cJSON_AddNumberToObject(chip, "pllParameter", telemetry.pll_parameter);
+                cJSON_AddBoolToObject(chip, "pllMatch", telemetry.pll_match);
+            }
+
+            if (include_cores) {
+                cJSON *nonces = cJSON_CreateArray();
+                cJSON *hw_errors = cJSON_CreateArray();
+                cJSON *last_seen = cJSON_CreateArray();
+                for (uint16_t core = 0; core < GLOBAL_STATE->asic_core_count && core < ASIC_MAX_CORES; core++) {
+                    asic_nonce_stats *core_stats = &stats->cores[core];
+                    cJSON_AddItemToArray(nonces, cJSON_CreateNumber(core_stats->nonces));
+                    cJSON_AddItemToArray(hw_errors, cJSON_CreateNumber(core_stats->hw_errors));
+                    cJSON_AddItemToArray(last_seen, cJSON_CreateNumber(core_stats->last_seen ? (now - core_stats->last_seen) / 1000 : -1));
+                }
+                cJSON_AddItemToObject(chip, "coreNonces", nonces);
+                cJSON_AddItemToObject(chip, "coreHwErrors", hw_errors);
+                cJSON_AddItemToObject(chip, "coreLastSeenMs", last_seen);
+            }
+
+            cJSON_AddItemToArray(chips, chip);
+        }
+        cJSON_AddItemToObject(chain, "chips", chips);
+        cJSON_AddItemToArray(chains, chain);
+    }
+
+    cJSON_AddItemToObject(root, "chains", chains);
+    cJSON_AddNumberToObject(root, "chipAutotune", nvs_config_get_u16(NVS_CONFIG_CHIP_AUTOTUNE, 0));
+    return root;
+}
+
+static esp_err_t GET_asic_stats(httpd_req_t *req)
+{
+    httpd_resp_set_type(req, "application/json");
+
+    // Set CORS headers
+    if (set_cors_headers(req) != ESP_OK) {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    cJSON *root = get_asic_stats(true);
+    const char *stats = cJSON_Print(root);
+    httpd_resp_sendstr(req, stats);
+    free((char *)stats);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
 static cJSON *get_history_data(uint64_t start_timestamp, uint64_t end_timestamp)
 {
     // Ensure consistency
@@ -852,6 +1189,28 @@ static void websocket_log_handler()
     }
 }
 
+// Queues the per chip summary behind the log lines so the websocket sees one writer
+static void websocket_asic_stats_handler()
+{
+    while (true)
+    {
+        vTaskDelay(ASIC_STATS_PUSH_MS / portTICK_PERIOD_MS);
+
+        if (fd == -1 || GLOBAL_STATE->chain_count == 0) {
+            continue;
+        }
+
+        cJSON *root = get_asic_stats(false);
+        cJSON_AddStringToObject(root, "type", "asicStats");
+        char *message = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+
+        if (message != NULL && xQueueSendToBack(log_queue, (void*)&message, (TickType_t) 0) != pdPASS) {
+            free((void*)message);
+        }
+    }
+}
+
 esp_err_t start_rest_server(void *pvParameters)
 {
     configure_cjson_for_psram();
@@ -875,7 +1234,7 @@ esp_err_t start_rest_server(void *pvParameters)
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
-    config.max_uri_handlers = 20;
+    config.max_uri_handlers = 24;
 
     ESP_LOGI(TAG, "Starting HTTP Server");
     REST_CHECK(httpd_start(&server, &config) == ESP_OK, "Start server failed", err_start);
@@ -889,6 +1248,14 @@ esp_err_t start_rest_server(void *pvParameters)
         .uri = "/api/system/info", .method = HTTP_GET, .handler = GET_system_info, .user_ctx = rest_context};
     httpd_register_uri_handler(server, &system_info_get_uri);
 
+    httpd_uri_t system_boot_get_uri = {
+        .uri = "/api/system/boot", .method = HTTP_GET, .handler = GET_system_boot, .user_ctx = rest_context};
+    httpd_register_uri_handler(server, &system_boot_get_uri);
+
+    httpd_uri_t asic_stats_get_uri = {
+        .uri = "/api/asic/stats", .method = HTTP_GET, .handler = GET_asic_stats, .user_ctx = rest_context};
+    httpd_register_uri_handler(server, &asic_stats_get_uri);
+
     /* URI handler for fetching system info */
 
     httpd_uri_t swarm_get_uri = {.uri = "/api/swarm/info", .method = HTTP_GET, .handler = GET_swarm, .user_ctx = rest_context};
@@ -918,6 +1285,10 @@ esp_err_t start_rest_server(void *pvParameters)
         .uri = "/api/system/restart", .method = HTTP_POST, .handler = POST_restart, .user_ctx = rest_context};
     httpd_register_uri_handler(server, &system_restart_uri);
 
+    httpd_uri_t frequency_ramp_cancel_uri = {
+        .uri = "/api/system/frequency/cancel", .method = HTTP_POST, .handler = POST_cancel_frequency_ramp, .user_ctx = rest_context};
+    httpd_register_uri_handler(server, &frequency_ramp_cancel_uri);
+
     httpd_uri_t update_system_settings_uri = {
         .uri = "/api/system", .method = HTTP_PATCH, .handler = PATCH_update_settings, .user_ctx = rest_context};
     httpd_register_uri_handler(server, &update_system_settings_uri);
@@ -958,6 +1329,7 @@ esp_err_t start_rest_server(void *pvParameters)
 
     // Start websocket log handler thread
     xTaskCreate(&websocket_log_handler, "websocket_log_handler", 4096, NULL, 2, NULL);
+    xTaskCreate(&websocket_asic_stats_handler, "websocket_asic_stats", 4096, NULL, 2, NULL);
 
     // Start the DNS server that will redirect all queries to the softAP IP
     dns_server_config_t dns_config = DNS_SERVER_CONFIG_SINGLE("*" /* all A queries */, "WIFI_AP_DEF" /* softAP netif ID */);
@@ -1,19 +1,23 @@
 
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 
 // #include "protocol_examples_common.h"
 #include "main.h"
 
 #include "asic_result_task.h"
+#include "boot.h"
 #include "asic_task.h"
 #include "create_jobs_task.h"
 #include "esp_netif.h"
 #include "system.h"
 #include "http_server.h"
 #include "nvs_config.h"
+#include "pool_connect.h"
 #include "serial.h"
+#include "stratum_proxy_task.h"
 #include "stratum_task.h"
 #include "user_input_task.h"
 #include "history.h"
@@ -23,6 +27,146 @@ static GlobalState GLOBAL_STATE = {.extranonce_str = NULL, .extranonce_2_len = 0
 static const char * TAG = "bitaxe";
 // static const double NONCE_SPACE = 4294967296.0; //  2^32
 
+// boot stages, see BOOT_add_stage in app_main for how they depend on each other
+enum
+{
+    BOOT_WIFI_INIT,
+    BOOT_HTTP_SERVER,
+    BOOT_WIFI_CONNECT,
+    BOOT_POOL_DNS,
+    BOOT_ASIC_INIT,
+    BOOT_MINING
+};
+
+static char * wifi_ssid;
+static char * wifi_pass;
+static char * hostname;
+
+static bool _boot_wifi_init(void * ctx)
+{
+    wifi_init(wifi_ssid, wifi_pass, hostname);
+    return true;
+}
+
+static bool _boot_http_server(void * ctx)
+{
+    return start_rest_server(ctx) == ESP_OK;
+}
+
+static bool _boot_wifi_connect(void * ctx)
+{
+    GlobalState * GLOBAL_STATE = (GlobalState *) ctx;
+    EventBits_t result_bits = wifi_connect();
+
+    if (result_bits & WIFI_CONNECTED_BIT) {
+        ESP_LOGI(TAG, "Connected to SSID: %s", wifi_ssid);
+        strncpy(GLOBAL_STATE->SYSTEM_MODULE.wifi_status, "Connected!", 20);
+    } else if (result_bits & WIFI_FAIL_BIT) {
+        ESP_LOGE(TAG, "Failed to connect to SSID: %s", wifi_ssid);
+        strncpy(GLOBAL_STATE->SYSTEM_MODULE.wifi_status, "Failed to connect", 20);
+    } else {
+        ESP_LOGE(TAG, "UNEXPECTED EVENT");
+        strncpy(GLOBAL_STATE->SYSTEM_MODULE.wifi_status, "unexpected error", 20);
+    }
+
+    if (!(result_bits & WIFI_CONNECTED_BIT)) {
+        // User might be trying to configure with AP, just chill here
+        ESP_LOGI(TAG, "Finished, waiting for user input.");
+        return false;
+    }
+
+    free(wifi_ssid);
+    free(wifi_pass);
+    free(hostname);
+
+    // set the startup_done flag
+    GLOBAL_STATE->SYSTEM_MODULE.startup_done = true;
+
+    xTaskCreate(USER_INPUT_task, "user input", 8192, (void *) GLOBAL_STATE, 5, NULL);
+    return true;
+}
+
+// Warms the pool address cache so the stratum task's lookup returns right away. Best effort,
+// the stratum task resolves on its own and retries if this failed.
+static bool _boot_pool_dns(void * ctx)
+{
+    struct sockaddr_storage addrs[POOL_MAX_ADDRESSES];
+    char * pool_url = nvs_config_get_string(NVS_CONFIG_STRATUM_URL, CONFIG_STRATUM_URL);
+    // a stratum+ssl:// or stratum+tcp:// prefix isn't part of the host
+    char * scheme_end = strstr(pool_url, "://");
+    const char * host = scheme_end != NULL ? scheme_end + 3 : pool_url;
+    if (POOL_resolve(host, 0, addrs, POOL_MAX_ADDRESSES) == 0) {
+        ESP_LOGW(TAG, "Unable to resolve %s ahead of the pool connection", host);
+    }
+    free(pool_url);
+    return true;
+}
+
+// Enumerates the chains and sets up their links. They stay at the reset frequency, the ramp to
+// the configured one only runs on ASIC_task, so a unit left waiting in AP mode doesn't heat up.
+// Fails if a chain didn't answer, mining is skipped then
+static bool _boot_asic_init(void * ctx)
+{
+    GlobalState * GLOBAL_STATE = (GlobalState *) ctx;
+    uint8_t active = 0;
+
+    // every chain sits on its own UART, asic_count is per chain
+    GLOBAL_STATE->chain_count = CONFIG_ASIC_CHAIN_COUNT;
+    for (uint8_t i = 0; i < GLOBAL_STATE->chain_count; i++) {
+        AsicChain * chain = &GLOBAL_STATE->chains[i];
+        ASIC_init_chain(GLOBAL_STATE, i);
+
+        SERIAL_init(i);
+        int64_t init_start = esp_timer_get_time();
+        chain->chip_count = (*GLOBAL_STATE->ASIC_functions.init_fn)(i, GLOBAL_STATE->POWER_MANAGEMENT_MODULE.frequency_value, GLOBAL_STATE->asic_count);
+        // the other chains still mine, this one stays out of the mining stage
+        if (chain->chip_count == 0) {
+            ESP_LOGE(TAG, "Chain %u: no chips found, disabled", i);
+            continue;
+        }
+        chain->asic_baud = (*GLOBAL_STATE->ASIC_functions.set_max_baud_fn)(i);
+        SERIAL_set_baud(i, chain->asic_baud);
+        SERIAL_clear_buffer(i);
+        // a chain resumed after a restart keeps its ticket mask
+        uint32_t difficulty = (*GLOBAL_STATE->ASIC_functions.get_difficulty_mask_fn)(i);
+        if (difficulty != 0) {
+            chain->current_ASIC_difficulty = difficulty;
+            chain->previous_ASIC_difficulty = difficulty;
+        }
+        chain->init_ms = (esp_timer_get_time() - init_start) / 1000;
+        ESP_LOGI(TAG, "Chain %u up in %" PRIu32 " ms", i, chain->init_ms);
+        active++;
+    }
+    return active > 0;
+}
+
+static bool _boot_mining(void * ctx)
+{
+    GlobalState * GLOBAL_STATE = (GlobalState *) ctx;
+
+    wifi_softap_off();
+
+    queue_init(&GLOBAL_STATE->stratum_queue);
+    queue_init(&GLOBAL_STATE->ASIC_jobs_queue);
+
+    xTaskCreate(stratum_task, "stratum admin", 8192, (void *) GLOBAL_STATE, 5, NULL);
+    if (nvs_config_get_u16(NVS_CONFIG_PROXY_PORT, 0) != 0) {
+        xTaskCreate(stratum_proxy_task, "stratum proxy", 8192, (void *) GLOBAL_STATE, 5, NULL);
+    }
+    xTaskCreate(create_jobs_task, "stratum miner", 8192, (void *) GLOBAL_STATE, 10, NULL);
+    for (uint8_t i = 0; i < GLOBAL_STATE->chain_count; i++) {
+        if (GLOBAL_STATE->chains[i].chip_count == 0) {
+            continue;
+        }
+        char name[16];
+        snprintf(name, sizeof(name), "asic%u", i);
+        xTaskCreate(ASIC_task, name, 8192, (void *) &GLOBAL_STATE->chains[i], 10, NULL);
+        snprintf(name, sizeof(name), "asic result%u", i);
+        xTaskCreate(ASIC_result_task, name, 8192, (void *) &GLOBAL_STATE->chains[i], 15, NULL);
+    }
+    return true;
+}
+
 void app_main(void)
 {
     ESP_LOGI(TAG, "Welcome to the bitaxe - hack the planet!");
@@ -66,12 +210,26 @@ void app_main(void)
     if (strcmp(GLOBAL_STATE.asic_model_str, "BM1366") == 0) {
         ESP_LOGI(TAG, "ASIC: %dx BM1366 (%" PRIu64 " cores)", GLOBAL_STATE.asic_count, BM1366_CORE_COUNT);
         GLOBAL_STATE.asic_model = ASIC_BM1366;
+        GLOBAL_STATE.asic_core_count = BM1366_CORE_COUNT;
         AsicFunctions ASIC_functions = {.init_fn = BM1366_init,
-                                        .receive_result_fn = BM1366_proccess_work,
+                                        .receive_results_fn = BM1366_proccess_work,
                                         .set_max_baud_fn = BM1366_set_max_baud,
+                                        .step_down_baud_fn = BM1366_step_down_baud,
+                                        .get_rx_stats_fn = BM1366_get_rx_stats,
+                                        .poll_registers_fn = BM1366_poll_registers,
+                                        .get_chip_telemetry_fn = BM1366_get_chip_telemetry,
+                                        .set_chip_frequency_fn = BM1366_set_chip_frequency,
+                                        .get_chip_frequency_fn = BM1366_get_chip_frequency,
+                                        .get_actual_frequency_fn = BM1366_get_actual_frequency,
                                         .set_difficulty_mask_fn = BM1366_set_job_difficulty_mask,
+                                        .get_difficulty_mask_fn = BM1366_get_job_difficulty_mask,
+                                        .prepare_work_fn = BM1366_prepare_work,
                                         .send_work_fn = BM1366_send_work,
-                                        .send_hash_frequency_fn = BM1366_send_hash_frequency};
+                                        .send_hash_frequency_fn = BM1366_send_hash_frequency,
+                                        .set_frequency_fn = BM1366_set_frequency,
+                                        .run_frequency_ramp_fn = BM1366_run_frequency_ramp,
+                                        .cancel_frequency_ramp_fn = BM1366_cancel_frequency_ramp,
+                                        .get_frequency_ramp_fn = BM1366_get_frequency_ramp};
         //GLOBAL_STATE.asic_job_frequency_ms = (NONCE_SPACE / (double) (GLOBAL_STATE.POWER_MANAGEMENT_MODULE.frequency_value * BM1366_CORE_COUNT * 1000)) / (double) GLOBAL_STATE.asic_count; // version-rolling so Small Cores have different Nonce Space
         GLOBAL_STATE.asic_job_frequency_ms = 2000 / (double) GLOBAL_STATE.asic_count; //ms
         GLOBAL_STATE.initial_ASIC_difficulty = BM1366_INITIAL_DIFFICULTY;
@@ -80,10 +238,24 @@ void app_main(void)
     } else {
         ESP_LOGE(TAG, "Invalid ASIC model");
         AsicFunctions ASIC_functions = {.init_fn = NULL,
-                                        .receive_result_fn = NULL,
+                                        .receive_results_fn = NULL,
                                         .set_max_baud_fn = NULL,
+                                        .step_down_baud_fn = NULL,
+                                        .get_rx_stats_fn = NULL,
+                                        .poll_registers_fn = NULL,
+                                        .get_chip_telemetry_fn = NULL,
+                                        .set_chip_frequency_fn = NULL,
+                                        .get_chip_frequency_fn = NULL,
+                                        .get_actual_frequency_fn = NULL,
                                         .set_difficulty_mask_fn = NULL,
-                                        .send_work_fn = NULL};
+                                        .get_difficulty_mask_fn = NULL,
+                                        .prepare_work_fn = NULL,
+                                        .send_work_fn = NULL,
+                                        .send_hash_frequency_fn = NULL,
+                                        .set_frequency_fn = NULL,
+                                        .run_frequency_ramp_fn = NULL,
+                                        .cancel_frequency_ramp_fn = NULL,
+                                        .get_frequency_ramp_fn = NULL};
         GLOBAL_STATE.ASIC_functions = ASIC_functions;
         // maybe should return here to now execute anything with a faulty device parameter !
     }
@@ -99,9 +271,9 @@ void app_main(void)
     xTaskCreate(POWER_MANAGEMENT_task, "power mangement", 8192, (void *) &GLOBAL_STATE, 10, NULL);
 
     // pull the wifi credentials and hostname out of NVS
-    char * wifi_ssid = nvs_config_get_string(NVS_CONFIG_WIFI_SSID, WIFI_SSID);
-    char * wifi_pass = nvs_config_get_string(NVS_CONFIG_WIFI_PASS, WIFI_PASS);
-    char * hostname  = nvs_config_get_string(NVS_CONFIG_HOSTNAME, HOSTNAME);
+    wifi_ssid = nvs_config_get_string(NVS_CONFIG_WIFI_SSID, WIFI_SSID);
+    wifi_pass = nvs_config_get_string(NVS_CONFIG_WIFI_PASS, WIFI_PASS);
+    hostname  = nvs_config_get_string(NVS_CONFIG_HOSTNAME, HOSTNAME);
 
     // copy the wifi ssid to the global state
     strncpy(GLOBAL_STATE.SYSTEM_MODULE.ssid,
@@ -109,59 +281,17 @@ void app_main(void)
             sizeof(GLOBAL_STATE.SYSTEM_MODULE.ssid));
     GLOBAL_STATE.SYSTEM_MODULE.ssid[sizeof(GLOBAL_STATE.SYSTEM_MODULE.ssid)-1] = 0;
 
-    // init and connect to wifi
-    wifi_init(wifi_ssid, wifi_pass, hostname);
-    start_rest_server((void *) &GLOBAL_STATE);
-    EventBits_t result_bits = wifi_connect();
-
-    if (result_bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "Connected to SSID: %s", wifi_ssid);
-        strncpy(GLOBAL_STATE.SYSTEM_MODULE.wifi_status, "Connected!", 20);
-    } else if (result_bits & WIFI_FAIL_BIT) {
-        ESP_LOGE(TAG, "Failed to connect to SSID: %s", wifi_ssid);
-
-        strncpy(GLOBAL_STATE.SYSTEM_MODULE.wifi_status, "Failed to connect", 20);
-        // User might be trying to configure with AP, just chill here
-        ESP_LOGI(TAG, "Finished, waiting for user input.");
-        while (1) {
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
-        }
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-        strncpy(GLOBAL_STATE.SYSTEM_MODULE.wifi_status, "unexpected error", 20);
-        // User might be trying to configure with AP, just chill here
-        ESP_LOGI(TAG, "Finished, waiting for user input.");
-        while (1) {
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
-        }
-    }
-
-    free(wifi_ssid);
-    free(wifi_pass);
-    free(hostname);
-
-    // set the startup_done flag
-    GLOBAL_STATE.SYSTEM_MODULE.startup_done = true;
-
-    xTaskCreate(USER_INPUT_task, "user input", 8192, (void *) &GLOBAL_STATE, 5, NULL);
-
-
+    // the ASIC chains don't need the network, bring them up while WiFi associates
+    BOOT_add_stage(BOOT_WIFI_INIT, "wifi init", 0, _boot_wifi_init, &GLOBAL_STATE);
+    BOOT_add_stage(BOOT_HTTP_SERVER, "http server", BOOT_DEPENDS(BOOT_WIFI_INIT), _boot_http_server, &GLOBAL_STATE);
+    BOOT_add_stage(BOOT_WIFI_CONNECT, "wifi connect", BOOT_DEPENDS(BOOT_WIFI_INIT), _boot_wifi_connect, &GLOBAL_STATE);
+    BOOT_add_stage(BOOT_POOL_DNS, "pool dns", BOOT_DEPENDS(BOOT_WIFI_CONNECT), _boot_pool_dns, &GLOBAL_STATE);
     if (GLOBAL_STATE.ASIC_functions.init_fn != NULL) {
-        wifi_softap_off();
-
-        queue_init(&GLOBAL_STATE.stratum_queue);
-        queue_init(&GLOBAL_STATE.ASIC_jobs_queue);
-
-        SERIAL_init();
-        (*GLOBAL_STATE.ASIC_functions.init_fn)(GLOBAL_STATE.POWER_MANAGEMENT_MODULE.frequency_value, GLOBAL_STATE.asic_count);
-        SERIAL_set_baud((*GLOBAL_STATE.ASIC_functions.set_max_baud_fn)());
-        SERIAL_clear_buffer();
-
-        xTaskCreate(stratum_task, "stratum admin", 8192, (void *) &GLOBAL_STATE, 5, NULL);
-        xTaskCreate(create_jobs_task, "stratum miner", 8192, (void *) &GLOBAL_STATE, 10, NULL);
-        xTaskCreate(ASIC_task, "asic", 8192, (void *) &GLOBAL_STATE, 10, NULL);
-        xTaskCreate(ASIC_result_task, "asic result", 8192, (void *) &GLOBAL_STATE, 15, NULL);
+        BOOT_add_stage(BOOT_ASIC_INIT, "asic init", 0, _boot_asic_init, &GLOBAL_STATE);
+        BOOT_add_stage(BOOT_MINING, "mining", BOOT_DEPENDS(BOOT_ASIC_INIT) | BOOT_DEPENDS(BOOT_POOL_DNS), _boot_mining,
+                       &GLOBAL_STATE);
     }
+    BOOT_start();
 }
 
 void MINER_set_wifi_status(wifi_status_t status, uint16_t retry_count)
@@ -16,6 +16,15 @@
 #define NVS_CONFIG_STRATUM_PASS "stratumpass"
 #define NVS_CONFIG_FALLBACK_STRATUM_USER "fbstratumuser"
 #define NVS_CONFIG_FALLBACK_STRATUM_PASS "fbstratumpass"
+// 1 for Stratum V1, 2 for plaintext Stratum V2, 3 for solo mining on a node
+#define NVS_CONFIG_STRATUM_PROTOCOL "stratumproto"
+#define NVS_CONFIG_FALLBACK_STRATUM_PROTOCOL "fbstratumproto"
+// where solo mined blocks pay out
+#define NVS_CONFIG_SOLO_ADDRESS "soloaddress"
+// port the stratum proxy for the swarm listens on, 0 keeps it off
+#define NVS_CONFIG_PROXY_PORT "proxyport"
+// 0 mines on the primary whenever it has work, 1 on whichever pool has the lower latency
+#define NVS_CONFIG_POOL_SELECTION "poolselect"
 #define NVS_CONFIG_ASIC_FREQ "asicfrequency"
 #define NVS_CONFIG_ASIC_VOLTAGE "asicvoltage"
 #define NVS_CONFIG_ASIC_MODEL "asicmodel"
@@ -29,6 +38,9 @@
 #define NVS_CONFIG_BEST_DIFF "bestdiff"
 #define NVS_CONFIG_SELF_TEST "selftest"
 #define NVS_CONFIG_OVERHEAT_MODE "overheat_mode"
+// per chip MHz, chips separated by ',' and chains by ';', 0 follows the chain frequency
+#define NVS_CONFIG_CHIP_FREQ "chipfreq"
+#define NVS_CONFIG_CHIP_AUTOTUNE "chipautotune"
 
 #define NVS_CONFIG_SWARM "swarmconfig"
 
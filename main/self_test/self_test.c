@@ -42,6 +42,22 @@ static bool power_consumption_pass()
     return false;
 }
 
+// Walks the chain up to the configured frequency. Init leaves the chips at their reset
+// frequency and ASIC_task, which runs the ramp when mining, doesn't run here
+static void ramp_to_frequency(GlobalState * GLOBAL_STATE, AsicChain * chain)
+{
+    if (GLOBAL_STATE->ASIC_functions.run_frequency_ramp_fn == NULL || GLOBAL_STATE->ASIC_functions.get_frequency_ramp_fn == NULL) {
+        return;
+    }
+
+    asic_frequency_ramp ramp;
+    do {
+        (*GLOBAL_STATE->ASIC_functions.run_frequency_ramp_fn)(chain->id, chain->ASIC_TASK_MODULE.semaphore);
+        (*GLOBAL_STATE->ASIC_functions.get_frequency_ramp_fn)(chain->id, &ramp);
+    } while (ramp.active && xSemaphoreTake(chain->ASIC_TASK_MODULE.semaphore, 1000 / portTICK_PERIOD_MS) == pdTRUE);
+    ESP_LOGI(TAG, "Frequency: %.2f MHz", ramp.current);
+}
+
 static bool core_voltage_pass(GlobalState * GLOBAL_STATE)
 {
     uint16_t core_voltage = VCORE_get_voltage_mv(GLOBAL_STATE);
@@ -58,14 +74,9 @@ void self_test(void * pvParameters)
 
     GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
 
-    GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs = malloc(sizeof(bm_job *) * 128);
-    GLOBAL_STATE->valid_jobs = malloc(sizeof(uint8_t) * 128);
-
-    for (int i = 0; i < 128; i++) {
-
-        GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[i] = NULL;
-        GLOBAL_STATE->valid_jobs[i] = 0;
-    }
+    // the self test only exercises the first chain
+    AsicChain * chain = &GLOBAL_STATE->chains[0];
+    ASIC_init_chain(GLOBAL_STATE, 0);
 
     // Init I2C
     ESP_ERROR_CHECK(i2c_master_init());
@@ -99,13 +110,16 @@ void self_test(void * pvParameters)
         default:
     }
 
-    SERIAL_init();
-    uint8_t chips_detected = (GLOBAL_STATE->ASIC_functions.init_fn)(GLOBAL_STATE->POWER_MANAGEMENT_MODULE.frequency_value, GLOBAL_STATE->asic_count);
+    SERIAL_init(chain->id);
+    uint8_t chips_detected = (GLOBAL_STATE->ASIC_functions.init_fn)(chain->id, GLOBAL_STATE->POWER_MANAGEMENT_MODULE.frequency_value, GLOBAL_STATE->asic_count);
     ESP_LOGI(TAG, "%u chips detected, %u expected", chips_detected, GLOBAL_STATE->asic_count);
 
-    int baud = (*GLOBAL_STATE->ASIC_functions.set_max_baud_fn)();
+    int baud = (*GLOBAL_STATE->ASIC_functions.set_max_baud_fn)(chain->id);
     vTaskDelay(10 / portTICK_PERIOD_MS);
-    SERIAL_set_baud(baud);
+    SERIAL_set_baud(chain->id, baud);
+
+    // the power check needs the chips at full speed
+    ramp_to_frequency(GLOBAL_STATE, chain);
 
     vTaskDelay(1000 / portTICK_PERIOD_MS);
 
@@ -148,11 +162,11 @@ void self_test(void * pvParameters)
 
     bm_job job = construct_bm_job(&notify_message, merkle_root, 0x1fffe000);
 
-    (*GLOBAL_STATE->ASIC_functions.set_difficulty_mask_fn)(32);
+    (*GLOBAL_STATE->ASIC_functions.set_difficulty_mask_fn)(chain->id, 32);
 
     ESP_LOGI(TAG, "Sending work");
 
-    (*GLOBAL_STATE->ASIC_functions.send_work_fn)(GLOBAL_STATE, &job);
+    (*GLOBAL_STATE->ASIC_functions.send_work_fn)(chain, &job);
     // vTaskDelay((GLOBAL_STATE->asic_job_frequency_ms - 0.3) / portTICK_PERIOD_MS);
 
     // ESP_LOGI(TAG, "Receiving work");
@@ -174,8 +188,8 @@ void self_test(void * pvParameters)
         return;
     }
 
-    free(GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs);
-    free(GLOBAL_STATE->valid_jobs);
+    free(chain->ASIC_TASK_MODULE.active_jobs);
+    free(chain->valid_jobs);
 
     if (!core_voltage_pass(GLOBAL_STATE)) {
         ESP_LOGE(TAG, "SELF TEST FAIL, NO CHIPS DETECTED");
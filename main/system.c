@@ -56,6 +56,18 @@ static esp_err_t ensure_overheat_mode_config() {
     return ESP_OK;
 }
 
+// Takes the scheme off a pool url, stratum+ssl:// asks for TLS. A bare host is plaintext
+static bool _strip_pool_scheme(char * url)
+{
+    static const char ssl_scheme[] = "stratum+ssl://";
+    static const char tcp_scheme[] = "stratum+tcp://";
+
+    bool tls = strncmp(url, ssl_scheme, strlen(ssl_scheme)) == 0;
+    size_t scheme_len = tls ? strlen(ssl_scheme) : (strncmp(url, tcp_scheme, strlen(tcp_scheme)) == 0 ? strlen(tcp_scheme) : 0);
+    memmove(url, url + scheme_len, strlen(url + scheme_len) + 1);
+    return tls;
+}
+
 static void _init_system(GlobalState * GLOBAL_STATE)
 {
     SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
@@ -78,10 +90,15 @@ static void _init_system(GlobalState * GLOBAL_STATE)
     // set the pool url
     module->pool_url = nvs_config_get_string(NVS_CONFIG_STRATUM_URL, CONFIG_STRATUM_URL);
     module->fallback_pool_url = nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_URL, CONFIG_FALLBACK_STRATUM_URL);
+    module->pool_tls = _strip_pool_scheme(module->pool_url);
+    module->fallback_pool_tls = _strip_pool_scheme(module->fallback_pool_url);
 
     //set the pool port
     module->pool_port = nvs_config_get_u16(NVS_CONFIG_STRATUM_PORT, CONFIG_STRATUM_PORT);
     module->fallback_pool_port = nvs_config_get_u16(NVS_CONFIG_FALLBACK_STRATUM_PORT, CONFIG_FALLBACK_STRATUM_PORT);
+    module->pool_protocol = nvs_config_get_u16(NVS_CONFIG_STRATUM_PROTOCOL, STRATUM_PROTOCOL_V1);
+    module->fallback_pool_protocol = nvs_config_get_u16(NVS_CONFIG_FALLBACK_STRATUM_PROTOCOL, STRATUM_PROTOCOL_V1);
+    module->pool_selection = nvs_config_get_u16(NVS_CONFIG_POOL_SELECTION, POOL_SELECTION_PRIMARY);
 
     // set fallback to false.
     module->is_using_fallback = false;
@@ -403,17 +420,26 @@ static double _calculate_network_difficulty(uint32_t nBits)
     return difficulty;
 }
 
-static void _check_for_best_diff(GlobalState * GLOBAL_STATE, double diff, uint8_t job_id)
+// returns true for a nonce that solves the block
+static bool _check_for_best_diff(GlobalState * GLOBAL_STATE, double diff, uint32_t nbits)
 {
     SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
 
+    // checked before the best diff, a low difficulty chain can be solved below an old best
+    double network_diff = _calculate_network_difficulty(nbits);
+    bool found_block = diff > network_diff;
+    if (found_block) {
+        module->FOUND_BLOCK = true;
+        ESP_LOGI(TAG, "FOUND BLOCK!!!!!!!!!!!!!!!!!!!!!! %f > %f", diff, network_diff);
+    }
+
     if ((uint64_t) diff > module->best_session_nonce_diff) {
         module->best_session_nonce_diff = (uint64_t) diff;
         _suffix_string((uint64_t) diff, module->best_session_diff_string, DIFF_STRING_SIZE, 0);
     }
 
     if ((uint64_t) diff <= module->best_nonce_diff) {
-        return;
+        return found_block;
     }
     module->best_nonce_diff = (uint64_t) diff;
 
@@ -422,12 +448,8 @@ static void _check_for_best_diff(GlobalState * GLOBAL_STATE, double diff, uint8_
     // make the best_nonce_diff into a string
     _suffix_string((uint64_t) diff, module->best_diff_string, DIFF_STRING_SIZE, 0);
 
-    double network_diff = _calculate_network_difficulty(GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->target);
-    if (diff > network_diff) {
-        module->FOUND_BLOCK = true;
-        ESP_LOGI(TAG, "FOUND BLOCK!!!!!!!!!!!!!!!!!!!!!! %f > %f", diff, network_diff);
-    }
     ESP_LOGI(TAG, "Network diff: %f", network_diff);
+    return found_block;
 }
 
 /* Convert a uint64_t value into a truncated string for displaying with its
@@ -562,12 +584,38 @@ void SYSTEM_notify_accepted_share(GlobalState * GLOBAL_STATE)
     module->shares_accepted++;
     _update_shares(GLOBAL_STATE);
 }
-void SYSTEM_notify_rejected_share(GlobalState * GLOBAL_STATE)
+void SYSTEM_notify_rejected_share(GlobalState * GLOBAL_STATE, const char * reason)
 {
     SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
 
     module->shares_rejected++;
     _update_shares(GLOBAL_STATE);
+
+    if (reason == NULL || reason[0] == '\0') {
+        reason = "unknown";
+    }
+    RejectReason * slot = &module->reject_reasons[REJECT_REASON_SLOTS - 1];
+    for (int i = 0; i < REJECT_REASON_SLOTS - 1; i++) {
+        if (module->reject_reasons[i].count == 0 || strcmp(module->reject_reasons[i].reason, reason) == 0) {
+            slot = &module->reject_reasons[i];
+            break;
+        }
+    }
+    if (slot->count == 0) {
+        snprintf(slot->reason, sizeof(slot->reason), "%s", slot == &module->reject_reasons[REJECT_REASON_SLOTS - 1] ? "other" : reason);
+    }
+    slot->count++;
+}
+
+void SYSTEM_notify_share_ack(GlobalState * GLOBAL_STATE, uint32_t latency_ms)
+{
+    SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
+
+    int bucket = 0;
+    while (bucket < ACK_LATENCY_BUCKETS - 1 && latency_ms > (uint32_t) ACK_LATENCY_FIRST_BUCKET_MS << bucket) {
+        bucket++;
+    }
+    module->ack_latency_histogram[bucket]++;
 }
 
 void SYSTEM_notify_mining_started(GlobalState * GLOBAL_STATE)
@@ -591,11 +639,11 @@ void SYSTEM_notify_new_ntime(GlobalState * GLOBAL_STATE, uint32_t ntime)
     settimeofday(&tv, NULL);
 }
 
-void SYSTEM_check_for_best_diff(GlobalState * GLOBAL_STATE, double found_diff, uint8_t job_id) {
-    _check_for_best_diff(GLOBAL_STATE, found_diff, job_id);
+bool SYSTEM_check_for_best_diff(GlobalState * GLOBAL_STATE, double found_diff, uint32_t nbits) {
+    return _check_for_best_diff(GLOBAL_STATE, found_diff, nbits);
 }
 
-void SYSTEM_notify_found_nonce(GlobalState * GLOBAL_STATE)
+void SYSTEM_notify_found_nonce(GlobalState * GLOBAL_STATE, uint32_t asic_difficulty)
 {
     SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
 
@@ -607,7 +655,7 @@ void SYSTEM_notify_found_nonce(GlobalState * GLOBAL_STATE)
 
     int index = module->historical_hashrate_rolling_index;
 
-    module->historical_hashrate[index] = BM1366_INITIAL_DIFFICULTY;
+    module->historical_hashrate[index] = asic_difficulty;
     module->historical_hashrate_time_stamps[index] = current_time;
 
 
@@ -662,7 +710,7 @@ void SYSTEM_notify_found_nonce(GlobalState * GLOBAL_STATE)
 
     uint64_t timestamp = (uint64_t)now.tv_sec * 1000llu + (uint64_t)now.tv_usec / 1000llu;
 
-    history_push_share(BM1366_INITIAL_DIFFICULTY, timestamp);
+    history_push_share(asic_difficulty, timestamp);
 
     module->current_hashrate_10m = history_get_current_10m();
 }
@@ -3,73 +3,169 @@
 #include "serial.h"
 #include <string.h>
 #include "esp_log.h"
-#include "nvs_config.h"
 #include "utils.h"
 #include "stratum_task.h"
+#include "stratum_v2.h"
+#include "esp_timer.h"
 #include <lwip/tcpip.h>
 
+#define RX_RATE_WINDOW_MS 5000
+
 static const char *TAG = "asic_result";
 
-void ASIC_result_task(void *pvParameters)
+static void _update_rx_rate(AsicChain *chain, int received)
 {
-    GlobalState *GLOBAL_STATE = (GlobalState *)pvParameters;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+    module->rx_frame_count += received;
+    module->rx_window_frames += received;
 
-    char *user = nvs_config_get_string(NVS_CONFIG_STRATUM_USER, STRATUM_USER);
+    int64_t now = esp_timer_get_time();
+    if (module->rx_window_start == 0) {
+        module->rx_window_start = now;
+    } else if (now - module->rx_window_start >= RX_RATE_WINDOW_MS * 1000LL) {
+        double elapsed = (now - module->rx_window_start) / 1e6;
+        module->rx_frames_per_sec = module->rx_window_frames / elapsed;
+        // each nonce at difficulty d stands for d * 2^32 hashes
+        chain->hashrate = module->rx_window_diff * 4294967296.0 / elapsed / 1e9;
+        module->rx_window_start = now;
+        module->rx_window_frames = 0;
+        module->rx_window_diff = 0;
+    }
+}
 
-    while (1)
+static void _count_nonce(asic_nonce_stats *stats, bool hw_error, int64_t now)
+{
+    stats->nonces++;
+    if (hw_error) {
+        stats->hw_errors++;
+    }
+    stats->last_seen = now;
+}
+
+static void _update_chip_stats(AsicChain *chain, task_result *asic_result, bool hw_error)
+{
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+    int64_t now = esp_timer_get_time();
+
+    if (asic_result->chip >= module->chip_stats_len) {
+        _count_nonce(&module->unattributed, hw_error, now);
+        return;
+    }
+
+    asic_chip_stats *chip = &module->chip_stats[asic_result->chip];
+    _count_nonce(&chip->total, hw_error, now);
+    if (asic_result->core_id < ASIC_MAX_CORES) {
+        _count_nonce(&chip->cores[asic_result->core_id], hw_error, now);
+    }
+}
+
+static void _process_result(AsicChain *chain, task_result *asic_result)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+    uint8_t job_id = asic_result->job_id;
+
+    if (chain->valid_jobs[job_id] == 0)
     {
+        ESP_LOGI(TAG, "Invalid job nonce found, 0x%02X", job_id);
+        return;
+    }
 
-        task_result *asic_result = (*GLOBAL_STATE->ASIC_functions.receive_result_fn)(GLOBAL_STATE);
+    if (chain->first_nonce_us == 0) {
+        chain->first_nonce_us = esp_timer_get_time();
+        ESP_LOGI(TAG, "Chain %u first nonce %lld ms after boot", chain->id, chain->first_nonce_us / 1000);
+    }
 
-        if (asic_result == NULL)
-        {
-            continue;
-        }
+    // check the nonce difficulty
+    double nonce_diff = test_nonce_value(
+        module->active_jobs[job_id],
+        asic_result->nonce,
+        asic_result->rolled_version);
 
-        uint8_t job_id = asic_result->job_id;
+    uint32_t pool_difficulty = module->active_jobs[job_id]->pool_diff;
 
-        if (GLOBAL_STATE->valid_jobs[job_id] == 0)
-        {
-            ESP_LOGI(TAG, "Invalid job nonce found, 0x%02X", job_id);
-            continue;
-        }
+    //log the ASIC response
+    ESP_LOGI(TAG, "Chain: %u AsicNr: %d Ver: %08" PRIX32 " Nonce %08" PRIX32 " diff %.1f of %ld.", chain->id, asic_result->asic_nr,asic_result->rolled_version, asic_result->nonce, nonce_diff, pool_difficulty);
 
-        // check the nonce difficulty
-        double nonce_diff = test_nonce_value(
-            GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id],
-            asic_result->nonce,
-            asic_result->rolled_version);
+    // the ticket mask is retuned at runtime, read it once so the checks below agree
+    uint32_t asic_difficulty = chain->current_ASIC_difficulty;
 
-        uint32_t pool_difficulty = GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->pool_diff;
+    // warn if pool diff lower than chip diff
+    if (pool_difficulty<asic_difficulty) {
+        ESP_LOGI(TAG, "Warning chip diff %i lower than pool diff %i, hashrate will be under reported",
+        (int)pool_difficulty,(int)asic_difficulty);
+    }
 
-        //log the ASIC response
-        ESP_LOGI(TAG, "AsicNr: %d Ver: %08" PRIX32 " Nonce %08" PRIX32 " diff %.1f of %ld.", asic_result->asic_nr,asic_result->rolled_version, asic_result->nonce, nonce_diff, pool_difficulty);
 
-        // warn if pool diff lower than chip diff
-        if (pool_difficulty<GLOBAL_STATE->initial_ASIC_difficulty) {
-            ESP_LOGI(TAG, "Warning chip diff %i lower than pool diff %i, hashrate will be under reported",
-            (int)pool_difficulty,(int)GLOBAL_STATE->initial_ASIC_difficulty);
+    // solo mining has no shares, only a solved block goes out
+    if (GLOBAL_STATE->stratum_protocol != STRATUM_PROTOCOL_SOLO && nonce_diff > module->active_jobs[job_id]->pool_diff)
+    {
+        int ret;
+        if (GLOBAL_STATE->stratum_protocol == STRATUM_PROTOCOL_V2) {
+            // standard channels take the full rolled version, job ids are the pool's numbers
+            ret = STRATUM_V2_submit_share(
+                GLOBAL_STATE->connection,
+                GLOBAL_STATE->stratum_v2_channel_id,
+                __atomic_fetch_add(&GLOBAL_STATE->stratum_v2_sequence, 1, __ATOMIC_RELAXED),
+                strtoul(module->active_jobs[job_id]->jobid, NULL, 10),
+                asic_result->nonce,
+                module->active_jobs[job_id]->ntime,
+                asic_result->rolled_version);
+        } else {
+            // the connection submits as its own worker, queued for the stratum task to write
+            ret = STRATUM_V1_submit_share(
+                GLOBAL_STATE->connection,
+                module->active_jobs[job_id]->jobid,
+                module->active_jobs[job_id]->extranonce2,
+                module->active_jobs[job_id]->ntime,
+                asic_result->nonce,
+                asic_result->rolled_version ^ module->active_jobs[job_id]->version,
+                pool_difficulty,
+                chain->id,
+                asic_result->chip);
         }
+      
+        if (ret < 0) {
+            // the stratum task owns the socket, it tears the connection down when woken
+            ESP_LOGI(TAG, "Unable to queue share for the pool. Closing connection. Ret: %d", ret);
+            STRATUM_V1_request_close(GLOBAL_STATE->connection);
+        }
+    }
+
+    // the chip only returns nonces under its mask, one that fails even the looser of the last two masks was hashed wrong
+    uint32_t lowest_mask = asic_difficulty < chain->previous_ASIC_difficulty ? asic_difficulty : chain->previous_ASIC_difficulty;
+    _update_chip_stats(chain, asic_result, nonce_diff + 1 < lowest_mask);
+
+    // nonces still in flight from before a mask raise don't meet the new difficulty, skip them for the hashrate.
+    // the mask only tests zero bits so an eligible nonce can land just under the nominal value
+    if (nonce_diff + 1 >= asic_difficulty) {
+        module->nonce_count++;
+        module->rx_window_diff += asic_difficulty;
+        SYSTEM_notify_found_nonce(GLOBAL_STATE, asic_difficulty);
+    }
+    if (SYSTEM_check_for_best_diff(GLOBAL_STATE, nonce_diff, module->active_jobs[job_id]->target) &&
+        GLOBAL_STATE->stratum_protocol == STRATUM_PROTOCOL_SOLO) {
+        stratum_submit_block(GLOBAL_STATE, module->active_jobs[job_id], asic_result->nonce, asic_result->rolled_version);
+    }
+}
+
+void ASIC_result_task(void *pvParameters)
+{
+    AsicChain *chain = (AsicChain *)pvParameters;
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+
+    task_result results[BM1366_RX_BATCH_SIZE];
 
+    while (1)
+    {
+
+        // returns every complete response the UART had buffered, or nothing after a timeout
+        int received = (*GLOBAL_STATE->ASIC_functions.receive_results_fn)(chain, results, BM1366_RX_BATCH_SIZE);
+        _update_rx_rate(chain, received);
 
-        if (nonce_diff > GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->pool_diff)
+        for (int i = 0; i < received; i++)
         {
-            int ret = STRATUM_V1_submit_share(
-                GLOBAL_STATE->sock,
-                user,
-                GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->jobid,
-                GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->extranonce2,
-                GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->ntime,
-                asic_result->nonce,
-                asic_result->rolled_version ^ GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[job_id]->version);
-          
-            if (ret < 0) {
-                ESP_LOGI(TAG, "Unable to write share to socket. Closing connection. Ret: %d (errno %d: %s)", ret, errno, strerror(errno));
-                stratum_close_connection(GLOBAL_STATE);
-            }
+            _process_result(chain, &results[i]);
         }
-        SYSTEM_notify_found_nonce(GLOBAL_STATE);
-        SYSTEM_check_for_best_diff(GLOBAL_STATE, nonce_diff, job_id);
-
     }
 }
\ No newline at end of file
@@ -1,34 +1,427 @@
 #include "system.h"
 #include "work_queue.h"
 #include "serial.h"
+#include "nvs_config.h"
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+// window over which the nonce rate is measured before the ticket mask is retuned
+#define NONCE_RATE_WINDOW_MS 10000
+#define ASIC_DIFFICULTY_MIN 256
+
+// runtime link check, step the baud down when too many responses arrive corrupted
+#define LINK_CHECK_WINDOW_MS 10000
+#define LINK_CHECK_MIN_FRAMES 50
+#define LINK_MAX_ERROR_RATE 0.05
+
+// one register read between jobs this often, each polled register comes around every few polls
+#define REGISTER_POLL_MS 2000
+
+// per chip frequency changes are walked one PLL step at a time
+#define CHIP_TUNE_INTERVAL_MS 1000
+#define CHIP_FREQUENCY_STEP 6.25
+
+// autotune raises each chip by one step per window until its hardware error rate climbs
+#define AUTOTUNE_WINDOW_MS 120000
+#define AUTOTUNE_MIN_NONCES 100
+#define AUTOTUNE_MAX_HW_ERROR_RATE 0.01
+#define AUTOTUNE_MAX_OFFSET 100
+
 static const char *TAG = "ASIC_task";
 
+// chip targets are written by each chain's task and the http server, saving them walks every chain
+static pthread_mutex_t tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _apply_asic_difficulty(AsicChain *chain, uint32_t difficulty)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
+    chain->previous_ASIC_difficulty = chain->current_ASIC_difficulty;
+    chain->current_ASIC_difficulty = (*GLOBAL_STATE->ASIC_functions.set_difficulty_mask_fn)(chain->id, difficulty);
+
+    // nonces found under the previous mask don't describe the new one, start a fresh window
+    module->nonce_window_start = esp_timer_get_time();
+    module->nonce_window_count = module->nonce_count;
+}
+
+// Keep the chain close to CONFIG_ASIC_TARGET_NONCE_RATE by doubling or halving the ticket difficulty.
+// Each step changes the rate by 2x, so anything within [target / 2, target * 2] is left alone.
+// The difficulty never exceeds the pool difficulty, otherwise shares would be filtered by the chip.
+static void _retune_asic_difficulty(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
+    uint32_t current = chain->current_ASIC_difficulty;
+    uint32_t ceiling = _largest_power_of_two(GLOBAL_STATE->stratum_difficulty);
+    if (ceiling < ASIC_DIFFICULTY_MIN) {
+        ceiling = ASIC_DIFFICULTY_MIN;
+    }
+
+    if (current > ceiling) {
+        ESP_LOGI(TAG, "Chain %u ASIC difficulty %lu above pool difficulty %lu, lowering", chain->id, current, GLOBAL_STATE->stratum_difficulty);
+        _apply_asic_difficulty(chain, ceiling);
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    int64_t elapsed_us = now - module->nonce_window_start;
+    if (elapsed_us < NONCE_RATE_WINDOW_MS * 1000LL) {
+        return;
+    }
+
+    uint32_t nonces = module->nonce_count - module->nonce_window_count;
+    double rate = nonces / (elapsed_us / 1e6);
+    double target = CONFIG_ASIC_TARGET_NONCE_RATE;
+
+    uint32_t next = current;
+    if (rate > target * 2 && current < ceiling) {
+        next = current * 2;
+    } else if (rate < target / 2 && current > ASIC_DIFFICULTY_MIN) {
+        next = current / 2;
+    }
+
+    if (next != current) {
+        ESP_LOGI(TAG, "Chain %u nonce rate %.2f/s (target %d/s), ASIC difficulty %lu -> %lu", chain->id, rate, CONFIG_ASIC_TARGET_NONCE_RATE, current, next);
+        _apply_asic_difficulty(chain, next);
+        return;
+    }
+
+    module->nonce_window_start = now;
+    module->nonce_window_count = module->nonce_count;
+}
+
+// Compares corrupted responses against good ones over a window and drops to a slower
+// baud when the error rate climbs, e.g. from a marginal link warming up.
+static void _check_link_quality(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
+    if (GLOBAL_STATE->ASIC_functions.get_rx_stats_fn == NULL || GLOBAL_STATE->ASIC_functions.step_down_baud_fn == NULL) {
+        return;
+    }
+
+    asic_rx_stats stats;
+    (*GLOBAL_STATE->ASIC_functions.get_rx_stats_fn)(chain->id, &stats);
+    uint32_t errors = stats.crc_errors + stats.resyncs;
+    uint32_t frames = module->rx_frame_count;
+
+    int64_t now = esp_timer_get_time();
+    if (module->link_window_start != 0) {
+        if (now - module->link_window_start < LINK_CHECK_WINDOW_MS * 1000LL) {
+            return;
+        }
+
+        uint32_t window_bad = errors - module->link_window_errors;
+        uint32_t total = (frames - module->link_window_frames) + window_bad;
+        if (total >= LINK_CHECK_MIN_FRAMES && window_bad > total * LINK_MAX_ERROR_RATE) {
+            ESP_LOGW(TAG, "Chain %u: %lu of %lu responses corrupted", chain->id, window_bad, total);
+            int baud = (*GLOBAL_STATE->ASIC_functions.step_down_baud_fn)(chain->id);
+            if (baud > 0) {
+                chain->asic_baud = baud;
+            }
+        }
+    }
+
+    module->link_window_start = now;
+    module->link_window_frames = frames;
+    module->link_window_errors = errors;
+}
+
+// Register reads share the UART with jobs, so they are issued from here at a low rate
+static void _poll_registers(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
+    if (GLOBAL_STATE->ASIC_functions.poll_registers_fn == NULL) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now - module->register_poll_time < REGISTER_POLL_MS * 1000LL) {
+        return;
+    }
+
+    (*GLOBAL_STATE->ASIC_functions.poll_registers_fn)(chain->id);
+    module->register_poll_time = now;
+}
+
+// Takes a frequency ramp step if one is due, the ramp timer gives the semaphore when it is.
+// Returns whether one was
+static bool _run_frequency_ramp(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+
+    if (GLOBAL_STATE->ASIC_functions.run_frequency_ramp_fn == NULL) {
+        return false;
+    }
+    return (*GLOBAL_STATE->ASIC_functions.run_frequency_ramp_fn)(chain->id, chain->ASIC_TASK_MODULE.semaphore);
+}
+
+// Per chip tuning waits for the chain ramp, its broadcasts would move the chips underneath it
+static bool _frequency_ramp_active(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+
+    if (GLOBAL_STATE->ASIC_functions.get_frequency_ramp_fn == NULL) {
+        return false;
+    }
+
+    asic_frequency_ramp ramp;
+    (*GLOBAL_STATE->ASIC_functions.get_frequency_ramp_fn)(chain->id, &ramp);
+    return ramp.active;
+}
+
+// What the chain's PLL runs at, chips out of range report the chain's frequency
+static float _chain_frequency(AsicChain *chain)
+{
+    return (*chain->GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn)(chain->id, UINT16_MAX);
+}
+
+// Walks every chip towards its target frequency. Chips without a target only need
+// attention when they still carry an override from before.
+static void _tune_chip_frequencies(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
+    if (GLOBAL_STATE->ASIC_functions.set_chip_frequency_fn == NULL || module->chip_tuning == NULL ||
+        _frequency_ramp_active(chain)) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now - module->chip_tune_time < CHIP_TUNE_INTERVAL_MS * 1000LL) {
+        return;
+    }
+    module->chip_tune_time = now;
+
+    for (uint16_t c = 0; c < module->chip_stats_len; c++) {
+        pthread_mutex_lock(&tuning_lock);
+        float target = module->chip_tuning[c].target_frequency;
+        pthread_mutex_unlock(&tuning_lock);
+        float current = (*GLOBAL_STATE->ASIC_functions.get_chip_frequency_fn)(chain->id, c);
+        if (target == 0 && current == 0) {
+            continue;
+        }
+
+        float chain_frequency = _chain_frequency(chain);
+        if (target == 0) {
+            target = chain_frequency;
+        }
+        if (current == 0) {
+            current = chain_frequency;
+        }
+
+        float diff = target - current;
+        if (fabs(diff) < 0.01) {
+            continue;
+        }
+        float next = fabs(diff) > CHIP_FREQUENCY_STEP ? current + copysign(CHIP_FREQUENCY_STEP, diff) : target;
+        (*GLOBAL_STATE->ASIC_functions.set_chip_frequency_fn)(chain->id, c, next);
+    }
+}
+
+// Each window every chip that isn't settled yet gets one step more, or one step back
+// and settles when its hardware errors exceed AUTOTUNE_MAX_HW_ERROR_RATE
+static void _autotune_chips(AsicChain *chain)
+{
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
+    if (module->chip_tuning == NULL || GLOBAL_STATE->ASIC_functions.get_actual_frequency_fn == NULL) {
+        return;
+    }
+
+    // hardware errors mid ramp say nothing about the chip at its target
+    if (_frequency_ramp_active(chain)) {
+        module->autotune_paused = true;
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (module->autotune_paused) {
+        module->autotune_paused = false;
+        module->autotune_window_start = now;
+        for (uint16_t c = 0; c < module->chip_stats_len; c++) {
+            module->chip_tuning[c].window_nonces = module->chip_stats[c].total.nonces;
+            module->chip_tuning[c].window_hw_errors = module->chip_stats[c].total.hw_errors;
+        }
+        return;
+    }
+
+    if (now - module->autotune_window_start < AUTOTUNE_WINDOW_MS * 1000LL) {
+        return;
+    }
+    module->autotune_window_start = now;
+
+    if (nvs_config_get_u16(NVS_CONFIG_CHIP_AUTOTUNE, 0) == 0) {
+        return;
+    }
+
+    float chain_frequency = _chain_frequency(chain);
+    bool changed = false;
+
+    pthread_mutex_lock(&tuning_lock);
+    for (uint16_t c = 0; c < module->chip_stats_len; c++) {
+        asic_chip_tuning *tuning = &module->chip_tuning[c];
+        asic_nonce_stats *stats = &module->chip_stats[c].total;
+
+        uint32_t nonces = stats->nonces - tuning->window_nonces;
+        uint32_t hw_errors = stats->hw_errors - tuning->window_hw_errors;
+        if (tuning->tuned || nonces < AUTOTUNE_MIN_NONCES) {
+            continue;
+        }
+
+        float current = tuning->target_frequency != 0 ? tuning->target_frequency : chain_frequency;
+        double error_rate = (double)hw_errors / nonces;
+
+        if (error_rate > AUTOTUNE_MAX_HW_ERROR_RATE) {
+            tuning->target_frequency = current - CHIP_FREQUENCY_STEP;
+            tuning->tuned = true;
+            changed = true;
+            ESP_LOGI(TAG, "Chain %u chip %u: %.1f%% hw errors, settling at %.2f MHz", chain->id, c, error_rate * 100, tuning->target_frequency);
+        } else if (current + CHIP_FREQUENCY_STEP <= chain_frequency + AUTOTUNE_MAX_OFFSET) {
+            tuning->target_frequency = current + CHIP_FREQUENCY_STEP;
+            ESP_LOGI(TAG, "Chain %u chip %u: %.1f%% hw errors, raising to %.2f MHz", chain->id, c, error_rate * 100, tuning->target_frequency);
+        } else {
+            tuning->tuned = true;
+            changed = true;
+        }
+
+        tuning->window_nonces = stats->nonces;
+        tuning->window_hw_errors = stats->hw_errors;
+    }
+    pthread_mutex_unlock(&tuning_lock);
+
+    if (changed) {
+        ASIC_save_chip_frequencies(GLOBAL_STATE);
+    }
+}
+
+// Reads this chain's section of NVS_CONFIG_CHIP_FREQ into the chip targets
+static void _load_chip_frequencies(AsicChain *chain)
+{
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+    char *config = nvs_config_get_string(NVS_CONFIG_CHIP_FREQ, "");
+
+    const char *p = config;
+    for (int i = 0; i < chain->id && p != NULL; i++) {
+        p = strchr(p, ';');
+        if (p != NULL) {
+            p++;
+        }
+    }
+
+    pthread_mutex_lock(&tuning_lock);
+    for (uint16_t c = 0; c < module->chip_stats_len; c++) {
+        float frequency = 0;
+        if (p != NULL && *p != '\0' && *p != ';') {
+            char *end;
+            frequency = strtof(p, &end);
+            p = *end == ',' ? end + 1 : end;
+        }
+        module->chip_tuning[c].target_frequency = frequency;
+    }
+    pthread_mutex_unlock(&tuning_lock);
+
+    free(config);
+}
+
+/// @brief sets one chip's target, 0 puts it back on the chain frequency. Not saved until ASIC_save_chip_frequencies
+void ASIC_set_chip_frequency(struct GlobalState *GLOBAL_STATE, uint8_t chain, uint16_t chip, float frequency)
+{
+    if (chain >= GLOBAL_STATE->chain_count || chip >= GLOBAL_STATE->chains[chain].ASIC_TASK_MODULE.chip_stats_len) {
+        return;
+    }
+    AsicTaskModule *module = &GLOBAL_STATE->chains[chain].ASIC_TASK_MODULE;
+    pthread_mutex_lock(&tuning_lock);
+    module->chip_tuning[chip].target_frequency = frequency;
+    pthread_mutex_unlock(&tuning_lock);
+}
+
+/// @brief writes every chain's chip targets to NVS_CONFIG_CHIP_FREQ
+void ASIC_save_chip_frequencies(struct GlobalState *GLOBAL_STATE)
+{
+    char config[512] = "";
+    size_t len = 0;
+
+    // held through the write too, so an older snapshot can't land after a newer one
+    pthread_mutex_lock(&tuning_lock);
+    for (uint8_t i = 0; i < GLOBAL_STATE->chain_count; i++) {
+        AsicTaskModule *module = &GLOBAL_STATE->chains[i].ASIC_TASK_MODULE;
+        for (uint16_t c = 0; c < module->chip_stats_len && len < sizeof(config); c++) {
+            len += snprintf(config + len, sizeof(config) - len, c == 0 ? "%g" : ",%g", module->chip_tuning[c].target_frequency);
+        }
+        if (i + 1 < GLOBAL_STATE->chain_count && len < sizeof(config)) {
+            len += snprintf(config + len, sizeof(config) - len, ";");
+        }
+    }
+
+    if (len >= sizeof(config)) {
+        ESP_LOGE(TAG, "Chip frequencies don't fit in NVS, not saved");
+    } else {
+        nvs_config_set_string(NVS_CONFIG_CHIP_FREQ, config);
+    }
+    pthread_mutex_unlock(&tuning_lock);
+}
+
 // static bm_job ** active_jobs; is required to keep track of the active jobs since the
 
-void ASIC_task(void *pvParameters)
+// The job tables and semaphore are set up before any task starts, stratum and the
+// job factory touch every chain as soon as they run
+void ASIC_init_chain(struct GlobalState *GLOBAL_STATE, uint8_t id)
 {
-    GlobalState *GLOBAL_STATE = (GlobalState *)pvParameters;
+    AsicChain *chain = &GLOBAL_STATE->chains[id];
+
+    chain->id = id;
+    chain->GLOBAL_STATE = GLOBAL_STATE;
+    chain->current_ASIC_difficulty = GLOBAL_STATE->initial_ASIC_difficulty;
+    chain->previous_ASIC_difficulty = GLOBAL_STATE->initial_ASIC_difficulty;
+    pthread_mutex_init(&chain->valid_jobs_lock, NULL);
 
     //initialize the semaphore
-    GLOBAL_STATE->ASIC_TASK_MODULE.semaphore = xSemaphoreCreateBinary();
+    chain->ASIC_TASK_MODULE.semaphore = xSemaphoreCreateBinary();
 
-    GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs = malloc(sizeof(bm_job *) * 128);
-    GLOBAL_STATE->valid_jobs = malloc(sizeof(uint8_t) * 128);
+    chain->ASIC_TASK_MODULE.active_jobs = malloc(sizeof(bm_job *) * 128);
+    chain->valid_jobs = malloc(sizeof(uint8_t) * 128);
     for (int i = 0; i < 128; i++)
     {
-        GLOBAL_STATE->ASIC_TASK_MODULE.active_jobs[i] = NULL;
-        GLOBAL_STATE->valid_jobs[i] = 0;
+        chain->ASIC_TASK_MODULE.active_jobs[i] = NULL;
+        chain->valid_jobs[i] = 0;
     }
 
+    // kept in PSRAM, a full chain is a few kB per chip
+    uint16_t chips = GLOBAL_STATE->asic_count < ASIC_MAX_CHIPS ? GLOBAL_STATE->asic_count : ASIC_MAX_CHIPS;
+    chain->ASIC_TASK_MODULE.chip_stats = heap_caps_calloc(chips, sizeof(asic_chip_stats), MALLOC_CAP_SPIRAM);
+    chain->ASIC_TASK_MODULE.chip_tuning = calloc(chips, sizeof(asic_chip_tuning));
+    chain->ASIC_TASK_MODULE.chip_stats_len = chain->ASIC_TASK_MODULE.chip_stats != NULL && chain->ASIC_TASK_MODULE.chip_tuning != NULL ? chips : 0;
+    _load_chip_frequencies(chain);
+}
+
+void ASIC_task(void *pvParameters)
+{
+    AsicChain *chain = (AsicChain *)pvParameters;
+    GlobalState *GLOBAL_STATE = chain->GLOBAL_STATE;
+    AsicTaskModule *module = &chain->ASIC_TASK_MODULE;
+
     ESP_LOGI(TAG, "ASIC Job Interval: %.2f ms", GLOBAL_STATE->asic_job_frequency_ms);
     SYSTEM_notify_mining_started(GLOBAL_STATE);
-    ESP_LOGI(TAG, "ASIC Ready!");
+    ESP_LOGI(TAG, "ASIC chain %u Ready!", chain->id);
+
+    module->nonce_window_start = esp_timer_get_time();
+    module->nonce_window_count = module->nonce_count;
+    module->autotune_window_start = esp_timer_get_time();
 
     while (1)
     {
@@ -41,11 +434,29 @@ void ASIC_task(void *pvParameters)
             GLOBAL_STATE->stratum_difficulty = next_bm_job->pool_diff;
         }
 
-        (*GLOBAL_STATE->ASIC_functions.send_work_fn)(GLOBAL_STATE, next_bm_job); // send the job to the ASIC
+        // retune between jobs, this task is the only writer on the UART
+        _run_frequency_ramp(chain);
+        _retune_asic_difficulty(chain);
+        _check_link_quality(chain);
+        _poll_registers(chain);
+        _tune_chip_frequencies(chain);
+        _autotune_chips(chain);
+
+        (*GLOBAL_STATE->ASIC_functions.send_work_fn)(chain, next_bm_job); // send the job to the ASIC
 
         // Time to execute the above code is ~0.3ms
         // Delay for ASIC(s) to finish the job
         //vTaskDelay((GLOBAL_STATE->asic_job_frequency_ms - 0.3) / portTICK_PERIOD_MS);
-        xSemaphoreTake(GLOBAL_STATE->ASIC_TASK_MODULE.semaphore, (GLOBAL_STATE->asic_job_frequency_ms / portTICK_PERIOD_MS));
+        TickType_t job_start = xTaskGetTickCount();
+        TickType_t job_ticks = GLOBAL_STATE->asic_job_frequency_ms / portTICK_PERIOD_MS;
+        TickType_t elapsed = 0;
+        while (xSemaphoreTake(module->semaphore, job_ticks - elapsed) == pdTRUE) {
+            // the ramp timer wakes the task for its steps, the job keeps running through them.
+            // Any other wake is new work
+            elapsed = xTaskGetTickCount() - job_start;
+            if (!_run_frequency_ramp(chain) || elapsed >= job_ticks) {
+                break;
+            }
+        }
     }
 }
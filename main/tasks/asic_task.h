@@ -4,6 +4,36 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "mining.h"
+#include "common.h"
+
+typedef struct
+{
+    uint32_t nonces;
+    // nonces that don't meet the ticket mask the chip was given
+    uint32_t hw_errors;
+    // esp_timer_get_time() of the last nonce, 0 if none yet
+    int64_t last_seen;
+} asic_nonce_stats;
+
+typedef struct
+{
+    asic_nonce_stats total;
+    asic_nonce_stats cores[ASIC_MAX_CORES];
+    // pool results for the shares this chip found
+    uint32_t shares_accepted;
+    uint32_t shares_rejected;
+} asic_chip_stats;
+
+typedef struct
+{
+    // MHz requested for this chip, 0 to follow the chain frequency
+    float target_frequency;
+    // autotune: chip counters at the start of the window, and whether the chip found its limit
+    uint32_t window_nonces;
+    uint32_t window_hw_errors;
+    bool tuned;
+} asic_chip_tuning;
+
 typedef struct
 {
     // ASIC may not return the nonce in the same order as the jobs were sent
@@ -12,8 +42,44 @@ typedef struct
     bm_job **active_jobs;
     //semaphone
     SemaphoreHandle_t semaphore;
+    // nonces counted towards the hashrate, used to retune the ticket mask
+    uint32_t nonce_count;
+    // raw responses received from the chain and their rate over the last window
+    uint32_t rx_frame_count;
+    double rx_frames_per_sec;
+
+    // measurement windows for the ticket mask, the link check and the rx rate
+    int64_t nonce_window_start;
+    uint32_t nonce_window_count;
+    int64_t link_window_start;
+    uint32_t link_window_frames;
+    uint32_t link_window_errors;
+    int64_t rx_window_start;
+    uint32_t rx_window_frames;
+    // last register read request, see REGISTER_POLL_MS
+    int64_t register_poll_time;
+    // sum of the ASIC difficulty of every counted nonce in the current rx window
+    double rx_window_diff;
+
+    // per chip and per core counters, chip_stats_len entries
+    asic_chip_stats *chip_stats;
+    uint16_t chip_stats_len;
+    // nonces whose chip address didn't match an enumerated chip
+    asic_nonce_stats unattributed;
+
+    // per chip frequency targets, chip_stats_len entries
+    asic_chip_tuning *chip_tuning;
+    int64_t chip_tune_time;
+    int64_t autotune_window_start;
+    // set while the chain frequency ramp runs, autotune starts its window over once it's done
+    bool autotune_paused;
 } AsicTaskModule;
 
+struct GlobalState;
+
+void ASIC_init_chain(struct GlobalState *GLOBAL_STATE, uint8_t id);
+void ASIC_set_chip_frequency(struct GlobalState *GLOBAL_STATE, uint8_t chain, uint16_t chip, float frequency);
+void ASIC_save_chip_frequencies(struct GlobalState *GLOBAL_STATE);
 void ASIC_task(void *pvParameters);
 
 #endif
@@ -2,6 +2,7 @@
 #include "global_state.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "mining.h"
 #include <limits.h>
 #include "string.h"
@@ -15,6 +16,7 @@ static const char *TAG = "create_jobs_task";
 #define QUEUE_LOW_WATER_MARK 10 // Adjust based on your requirements
 
 static void process_mining_job(GlobalState *GLOBAL_STATE, mining_notify *notification);
+static void process_header_only_job(GlobalState *GLOBAL_STATE, mining_notify *notification, uint32_t ntime);
 static bool should_generate_more_work(GlobalState *GLOBAL_STATE);
 static void generate_additional_work(GlobalState *GLOBAL_STATE, mining_notify *notification);
 
@@ -33,14 +35,34 @@ void create_jobs_task(void *pvParameters)
         ESP_LOGI(TAG, "New Work Dequeued %s", mining_notification->job_id);
 
         // Process this job immediately
-        process_mining_job(GLOBAL_STATE, mining_notification);
+        int64_t dequeued = esp_timer_get_time();
+        uint32_t ntime = mining_notification->ntime;
+        if (mining_notification->merkle_root != NULL) {
+            process_header_only_job(GLOBAL_STATE, mining_notification, ntime);
+        } else {
+            process_mining_job(GLOBAL_STATE, mining_notification);
+        }
 
         // Now wait for more work or process additional jobs if needed
         uint32_t iteration_count = 0;
         while (GLOBAL_STATE->stratum_queue.count < 1 && GLOBAL_STATE->abandon_work == 0)
         {
+            if (mining_notification->merkle_root != NULL)
+            {
+                // header-only work has no extranonce, only nTime moves on, by at most a second per second
+                uint32_t rolled_ntime = mining_notification->ntime + (esp_timer_get_time() - dequeued) / 1000000;
+                if (rolled_ntime != ntime && should_generate_more_work(GLOBAL_STATE))
+                {
+                    ntime = rolled_ntime;
+                    process_header_only_job(GLOBAL_STATE, mining_notification, ntime);
+                }
+                else
+                {
+                    vTaskDelay(pdMS_TO_TICKS(100));
+                }
+            }
             // Check if we need to generate more work based on the current job
-            if (should_generate_more_work(GLOBAL_STATE))
+            else if (should_generate_more_work(GLOBAL_STATE))
             {
                 generate_additional_work(GLOBAL_STATE, mining_notification);
             }
@@ -61,7 +83,10 @@ void create_jobs_task(void *pvParameters)
         {
             GLOBAL_STATE->abandon_work = 0;
             ASIC_jobs_queue_clear(&GLOBAL_STATE->ASIC_jobs_queue);
-            xSemaphoreGive(GLOBAL_STATE->ASIC_TASK_MODULE.semaphore);
+            // wake every chain so none keeps hashing the stale job
+            for (int c = 0; c < GLOBAL_STATE->chain_count; c++) {
+                xSemaphoreGive(GLOBAL_STATE->chains[c].ASIC_TASK_MODULE.semaphore);
+            }
         }
 
         STRATUM_V1_free_mining_notify(mining_notification);
@@ -107,6 +132,11 @@ static void process_mining_job(GlobalState *GLOBAL_STATE, mining_notify *notific
     queued_next_job->jobid = strdup(notification->job_id);
     queued_next_job->version_mask = GLOBAL_STATE->version_mask;
 
+    // serialize the ASIC packet here so the ASIC task only has to patch the job id
+    if (GLOBAL_STATE->ASIC_functions.prepare_work_fn != NULL) {
+        (*GLOBAL_STATE->ASIC_functions.prepare_work_fn)(queued_next_job);
+    }
+
     queue_enqueue(&GLOBAL_STATE->ASIC_jobs_queue, queued_next_job);
 
     free(coinbase_tx);
@@ -115,6 +145,31 @@ static void process_mining_job(GlobalState *GLOBAL_STATE, mining_notify *notific
     ESP_LOGI(TAG, "Job processed and queued: %s", notification->job_id);
 }
 
+// The pool already built the merkle root, only the midstates are computed here
+static void process_header_only_job(GlobalState *GLOBAL_STATE, mining_notify *notification, uint32_t ntime)
+{
+    bm_job next_job = construct_bm_job(notification, notification->merkle_root, GLOBAL_STATE->version_mask);
+    next_job.ntime = ntime;
+
+    bm_job *queued_next_job = malloc(sizeof(bm_job));
+    if (queued_next_job == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for queued_next_job");
+        return;
+    }
+
+    memcpy(queued_next_job, &next_job, sizeof(bm_job));
+    queued_next_job->extranonce2 = strdup("");
+    queued_next_job->jobid = strdup(notification->job_id);
+    queued_next_job->version_mask = GLOBAL_STATE->version_mask;
+
+    // serialize the ASIC packet here so the ASIC task only has to patch the job id
+    if (GLOBAL_STATE->ASIC_functions.prepare_work_fn != NULL) {
+        (*GLOBAL_STATE->ASIC_functions.prepare_work_fn)(queued_next_job);
+    }
+
+    queue_enqueue(&GLOBAL_STATE->ASIC_jobs_queue, queued_next_job);
+}
+
 static bool should_generate_more_work(GlobalState *GLOBAL_STATE)
 {
     return GLOBAL_STATE->ASIC_jobs_queue.count < QUEUE_LOW_WATER_MARK;
@@ -161,6 +216,11 @@ static void generate_additional_work(GlobalState *GLOBAL_STATE, mining_notify *n
     queued_next_job->jobid = strdup(notification->job_id);
     queued_next_job->version_mask = GLOBAL_STATE->version_mask;
 
+    // serialize the ASIC packet here so the ASIC task only has to patch the job id
+    if (GLOBAL_STATE->ASIC_functions.prepare_work_fn != NULL) {
+        (*GLOBAL_STATE->ASIC_functions.prepare_work_fn)(queued_next_job);
+    }
+
     queue_enqueue(&GLOBAL_STATE->ASIC_jobs_queue, queued_next_job);
 
     free(coinbase_tx);
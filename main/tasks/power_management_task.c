@@ -169,9 +169,11 @@ void POWER_MANAGEMENT_task(void * pvParameters)
         
         if (asic_frequency != last_asic_frequency) {
             ESP_LOGI(TAG, "New ASIC frequency requested: %uMHz (current: %uMHz)", asic_frequency, last_asic_frequency);
-            if (do_frequency_transition((float)asic_frequency)) {
+            // the ramp runs from a timer, this task keeps servicing temperatures and fans meanwhile
+            if (GLOBAL_STATE->ASIC_functions.set_frequency_fn != NULL &&
+                (*GLOBAL_STATE->ASIC_functions.set_frequency_fn)((float)asic_frequency)) {
                 power_management->frequency_value = (float)asic_frequency;
-                ESP_LOGI(TAG, "Successfully transitioned to new ASIC frequency: %uMHz", asic_frequency);
+                ESP_LOGI(TAG, "Ramping to new ASIC frequency: %uMHz", asic_frequency);
             } else {
                 ESP_LOGE(TAG, "Failed to transition to new ASIC frequency: %uMHz", asic_frequency);
             }
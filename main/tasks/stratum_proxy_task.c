@@ -0,0 +1,495 @@
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_vfs_eventfd.h"
+#include "global_state.h"
+#include "lwip/sockets.h"
+#include "nvs_config.h"
+#include "stratum_proxy_task.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// Stratum V1 server for the rest of a swarm. Every downstream miner gets the upstream
+// extranonce1 plus one byte of its own, its shares go upstream under this unit's user.
+
+#define PROXY_MAX_CLIENTS 16
+#define PROXY_MAX_PENDING 32
+#define PROXY_LINE_SIZE 1024
+// extranonce1 byte appended for each miner, slice 0 is what this unit mines itself
+#define PROXY_SLICE_LEN 1
+#define PROXY_EXTRANONCE_SIZE 64
+// what may wait for a miner to read it, one that falls further behind is dropped
+#define PROXY_OUT_SIZE 8192
+
+static const char *TAG = "stratum_proxy";
+
+typedef struct
+{
+    // -1 when the slot is free
+    int sock;
+    bool subscribed;
+    char ip[INET_ADDRSTRLEN];
+    char buf[PROXY_LINE_SIZE];
+    int len;
+    // lines waiting for the proxy task to write them, allocated while connected
+    char *out;
+    int out_len;
+    // set when the miner can't keep up, the proxy task closes it
+    bool dropped;
+} proxy_client;
+
+// a share sent upstream, its result goes back to the miner that found it
+typedef struct
+{
+    int upstream_id;
+    int client;
+    int sock;
+    int64_t downstream_id;
+} proxy_pending;
+
+// set once the server is up, the hooks do nothing before that
+static GlobalState *PROXY_GLOBAL_STATE;
+static proxy_client clients[PROXY_MAX_CLIENTS];
+static proxy_pending pending[PROXY_MAX_PENDING];
+static int pending_next;
+
+// empty until the upstream subscription is in
+static char upstream_extranonce[PROXY_EXTRANONCE_SIZE];
+static int upstream_extranonce_2_len;
+static char local_extranonce[PROXY_EXTRANONCE_SIZE + PROXY_SLICE_LEN * 2];
+// replayed to a miner when it subscribes
+static char *last_difficulty;
+static char *last_notify;
+static char *username;
+
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+// wakes the proxy task when a line is queued for a miner, or one is dropped
+static int wake_fd = -1;
+
+static void _wake(void)
+{
+    uint64_t wake = 1;
+    write(wake_fd, &wake, sizeof(wake));
+}
+
+// Only from the proxy task, everyone else drops the miner with _drop_client
+static void _close_client(int index)
+{
+    proxy_client *client = &clients[index];
+    if (client->sock < 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "Miner %s disconnected", client->ip);
+    shutdown(client->sock, SHUT_RDWR);
+    close(client->sock);
+    client->sock = -1;
+    client->subscribed = false;
+    client->dropped = false;
+    client->len = 0;
+    free(client->out);
+    client->out = NULL;
+    client->out_len = 0;
+}
+
+// Stops sending to a miner straight away, its socket is closed by the proxy task
+static void _drop_client(int index)
+{
+    clients[index].subscribed = false;
+    clients[index].dropped = true;
+    _wake();
+}
+
+// Queues msg for the proxy task to write, nothing here touches the socket
+static void _send(int index, const char *msg)
+{
+    proxy_client *client = &clients[index];
+    if (client->sock < 0 || client->dropped) {
+        return;
+    }
+    int len = strlen(msg);
+    if (client->out_len + len > PROXY_OUT_SIZE) {
+        ESP_LOGW(TAG, "Miner %s isn't reading, dropping it", client->ip);
+        _drop_client(index);
+        return;
+    }
+    memcpy(client->out + client->out_len, msg, len);
+    client->out_len += len;
+    _wake();
+}
+
+// Writes as much of a miner's queued lines as its socket takes
+static void _flush_client(int index)
+{
+    proxy_client *client = &clients[index];
+    if (client->out_len == 0) {
+        return;
+    }
+    int ret = send(client->sock, client->out, client->out_len, 0);
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            _close_client(index);
+        }
+        return;
+    }
+    client->out_len -= ret;
+    memmove(client->out, client->out + ret, client->out_len);
+}
+
+static void _send_result(int index, int64_t id, const char *result)
+{
+    char msg[256];
+    snprintf(msg, sizeof(msg), "{\"id\":%lld,\"result\":%s,\"error\":null}\n", id, result);
+    _send(index, msg);
+}
+
+static void _send_error(int index, int64_t id, int code, const char *reason)
+{
+    char msg[256];
+    snprintf(msg, sizeof(msg), "{\"id\":%lld,\"result\":null,\"error\":[%d,\"%s\",null]}\n", id, code, reason);
+    _send(index, msg);
+}
+
+static void _subscribe(int index, int64_t id)
+{
+    if (upstream_extranonce[0] == '\0') {
+        _send_error(index, id, 20, "Upstream not connected");
+        return;
+    }
+
+    char result[192];
+    snprintf(result, sizeof(result), "[[[\"mining.set_difficulty\",\"%d\"],[\"mining.notify\",\"%d\"]],\"%s%02x\",%d]", index + 1,
+             index + 1, upstream_extranonce, index + 1, upstream_extranonce_2_len - PROXY_SLICE_LEN);
+    _send_result(index, id, result);
+    if (clients[index].dropped) {
+        return;
+    }
+
+    clients[index].subscribed = true;
+    ESP_LOGI(TAG, "Miner %s subscribed on extranonce slice %02x", clients[index].ip, index + 1);
+    if (last_difficulty != NULL) {
+        _send(index, last_difficulty);
+    }
+    if (last_notify != NULL) {
+        _send(index, last_notify);
+    }
+}
+
+static void _submit(int index, int64_t id, cJSON *params)
+{
+    cJSON *job_id = cJSON_GetArrayItem(params, 1);
+    cJSON *extranonce_2 = cJSON_GetArrayItem(params, 2);
+    cJSON *ntime = cJSON_GetArrayItem(params, 3);
+    cJSON *nonce = cJSON_GetArrayItem(params, 4);
+    cJSON *version = cJSON_GetArrayItem(params, 5);
+
+    if (!clients[index].subscribed || !cJSON_IsString(job_id) || !cJSON_IsString(extranonce_2) || !cJSON_IsString(ntime) ||
+        !cJSON_IsString(nonce)) {
+        _send_error(index, id, 20, "Malformed share");
+        return;
+    }
+
+    // the slice byte moves from the miner's extranonce1 to the front of the upstream extranonce2
+    char full_extranonce_2[PROXY_EXTRANONCE_SIZE];
+    snprintf(full_extranonce_2, sizeof(full_extranonce_2), "%02x%s", index + 1, extranonce_2->valuestring);
+
+    int upstream_id = STRATUM_V1_forward_share(PROXY_GLOBAL_STATE->connection, username, job_id->valuestring, full_extranonce_2,
+                                               ntime->valuestring, nonce->valuestring,
+                                               cJSON_IsString(version) ? version->valuestring : NULL);
+    if (upstream_id < 0) {
+        _send_error(index, id, 20, "Upstream not connected");
+        return;
+    }
+
+    pending[pending_next] = (proxy_pending){.upstream_id = upstream_id, .client = index, .sock = clients[index].sock, .downstream_id = id};
+    pending_next = (pending_next + 1) % PROXY_MAX_PENDING;
+}
+
+static void _handle_line(int index, const char *line)
+{
+    cJSON *json = cJSON_Parse(line);
+    cJSON *method = cJSON_GetObjectItem(json, "method");
+    cJSON *id_json = cJSON_GetObjectItem(json, "id");
+    int64_t id = cJSON_IsNumber(id_json) ? id_json->valueint : 0;
+
+    if (!cJSON_IsString(method)) {
+        ESP_LOGW(TAG, "Unhandled message from %s: %s", clients[index].ip, line);
+    } else if (strcmp(method->valuestring, "mining.subscribe") == 0) {
+        _subscribe(index, id);
+    } else if (strcmp(method->valuestring, "mining.submit") == 0) {
+        _submit(index, id, cJSON_GetObjectItem(json, "params"));
+    } else if (strcmp(method->valuestring, "mining.configure") == 0) {
+        char result[96];
+        snprintf(result, sizeof(result), "{\"version-rolling\":true,\"version-rolling.mask\":\"%08lx\"}",
+                 PROXY_GLOBAL_STATE->version_mask);
+        _send_result(index, id, result);
+    } else if (strcmp(method->valuestring, "mining.authorize") == 0 || strcmp(method->valuestring, "mining.suggest_difficulty") == 0) {
+        // every share goes upstream under this unit's user at the upstream difficulty
+        _send_result(index, id, "true");
+    } else {
+        _send_error(index, id, 20, "Unsupported method");
+    }
+
+    cJSON_Delete(json);
+}
+
+static void _read_client(int index)
+{
+    proxy_client *client = &clients[index];
+    int ret = recv(client->sock, client->buf + client->len, sizeof(client->buf) - client->len - 1, 0);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (ret <= 0) {
+        _close_client(index);
+        return;
+    }
+    client->len += ret;
+    client->buf[client->len] = '\0';
+
+    char *newline;
+    while ((newline = strchr(client->buf, '\n')) != NULL) {
+        *newline = '\0';
+        _handle_line(index, client->buf);
+        if (client->dropped) {
+            return;
+        }
+        client->len -= newline + 1 - client->buf;
+        memmove(client->buf, newline + 1, client->len + 1);
+    }
+
+    // no line fits the buffer, this isn't a miner
+    if (client->len == sizeof(client->buf) - 1) {
+        _close_client(index);
+    }
+}
+
+static void _accept_client(int listen_sock)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int sock = accept(listen_sock, (struct sockaddr *) &addr, &addr_len);
+    if (sock < 0) {
+        return;
+    }
+    // a stalled miner must never hold up the proxy task
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+        if (clients[i].sock < 0) {
+            clients[i].out = malloc(PROXY_OUT_SIZE);
+            if (clients[i].out == NULL) {
+                break;
+            }
+            clients[i].sock = sock;
+            clients[i].len = 0;
+            inet_ntop(AF_INET, &addr.sin_addr, clients[i].ip, sizeof(clients[i].ip));
+            ESP_LOGI(TAG, "Miner %s connected", clients[i].ip);
+            return;
+        }
+    }
+
+    ESP_LOGW(TAG, "Turning away a miner, no free slot");
+    close(sock);
+}
+
+void stratum_proxy_task(void *pvParameters)
+{
+    uint16_t port = nvs_config_get_u16(NVS_CONFIG_PROXY_PORT, 0);
+    username = nvs_config_get_string(NVS_CONFIG_STRATUM_USER, STRATUM_USER);
+
+    // already registered if a pool connection got there first
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_vfs_eventfd_register(&eventfd_config);
+    wake_fd = eventfd(0, 0);
+
+    pthread_mutex_lock(&proxy_lock);
+    for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+        clients[i].sock = -1;
+    }
+    PROXY_GLOBAL_STATE = (GlobalState *) pvParameters;
+    pthread_mutex_unlock(&proxy_lock);
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(port),
+    };
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock < 0 || bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listen_sock, 4) != 0) {
+        ESP_LOGE(TAG, "Unable to listen on port %u (errno %d: %s)", port, errno, strerror(errno));
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "Stratum proxy listening on port %u", port);
+
+    // the only task that touches miners' sockets. The upstream hooks queue lines and wake it
+    while (1) {
+        fd_set read_fds, write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        FD_SET(listen_sock, &read_fds);
+        FD_SET(wake_fd, &read_fds);
+        int max_fd = listen_sock > wake_fd ? listen_sock : wake_fd;
+
+        pthread_mutex_lock(&proxy_lock);
+        for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+            if (clients[i].dropped) {
+                _close_client(i);
+            }
+            if (clients[i].sock >= 0) {
+                FD_SET(clients[i].sock, &read_fds);
+                if (clients[i].out_len > 0) {
+                    FD_SET(clients[i].sock, &write_fds);
+                }
+                max_fd = clients[i].sock > max_fd ? clients[i].sock : max_fd;
+            }
+        }
+        pthread_mutex_unlock(&proxy_lock);
+
+        if (select(max_fd + 1, &read_fds, &write_fds, NULL, NULL) <= 0) {
+            continue;
+        }
+        if (FD_ISSET(wake_fd, &read_fds)) {
+            uint64_t wakes;
+            read(wake_fd, &wakes, sizeof(wakes));
+        }
+
+        pthread_mutex_lock(&proxy_lock);
+        if (FD_ISSET(listen_sock, &read_fds)) {
+            _accept_client(listen_sock);
+        }
+        for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+            if (clients[i].sock >= 0 && !clients[i].dropped && FD_ISSET(clients[i].sock, &read_fds)) {
+                _read_client(i);
+            }
+            // lines queued since select started go out too, a full socket waits for the next round
+            if (clients[i].sock >= 0 && !clients[i].dropped) {
+                _flush_client(i);
+            }
+        }
+        pthread_mutex_unlock(&proxy_lock);
+    }
+}
+
+/// @brief takes the extranonce from a fresh upstream subscription and moves this unit's own
+/// mining onto slice 0 of it. Leaves it alone when the proxy is off
+void stratum_proxy_upstream_subscribed(GlobalState *GLOBAL_STATE)
+{
+    if (nvs_config_get_u16(NVS_CONFIG_PROXY_PORT, 0) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&proxy_lock);
+    if (GLOBAL_STATE->extranonce_2_len <= PROXY_SLICE_LEN || strlen(GLOBAL_STATE->extranonce_str) >= sizeof(upstream_extranonce)) {
+        ESP_LOGE(TAG, "Upstream extranonce2 of %d bytes is too small to share", GLOBAL_STATE->extranonce_2_len);
+        upstream_extranonce[0] = '\0';
+        pthread_mutex_unlock(&proxy_lock);
+        return;
+    }
+
+    strcpy(upstream_extranonce, GLOBAL_STATE->extranonce_str);
+    upstream_extranonce_2_len = GLOBAL_STATE->extranonce_2_len;
+    snprintf(local_extranonce, sizeof(local_extranonce), "%s00", upstream_extranonce);
+    GLOBAL_STATE->extranonce_str = local_extranonce;
+    GLOBAL_STATE->extranonce_2_len = upstream_extranonce_2_len - PROXY_SLICE_LEN;
+    pthread_mutex_unlock(&proxy_lock);
+}
+
+/// @brief drops every miner, their extranonce slices died with the upstream connection
+void stratum_proxy_upstream_lost(void)
+{
+    if (PROXY_GLOBAL_STATE == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&proxy_lock);
+    upstream_extranonce[0] = '\0';
+    free(last_notify);
+    free(last_difficulty);
+    last_notify = NULL;
+    last_difficulty = NULL;
+    memset(pending, 0, sizeof(pending));
+    for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+        if (clients[i].sock >= 0) {
+            _drop_client(i);
+        }
+    }
+    pthread_mutex_unlock(&proxy_lock);
+}
+
+/// @brief queues an upstream line for every subscribed miner as it came in
+void stratum_proxy_relay(const char *line, stratum_method method)
+{
+    if (PROXY_GLOBAL_STATE == NULL) {
+        return;
+    }
+
+    char *copy = malloc(strlen(line) + 2);
+    sprintf(copy, "%s\n", line);
+
+    pthread_mutex_lock(&proxy_lock);
+    for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+        if (clients[i].sock >= 0 && clients[i].subscribed) {
+            _send(i, copy);
+        }
+    }
+
+    if (method == MINING_NOTIFY) {
+        free(last_notify);
+        last_notify = copy;
+    } else if (method == MINING_SET_DIFFICULTY) {
+        free(last_difficulty);
+        last_difficulty = copy;
+    } else {
+        free(copy);
+    }
+    pthread_mutex_unlock(&proxy_lock);
+}
+
+/// @brief hands an upstream share result to the miner it belongs to
+/// @return false if the result is for one of this unit's own shares
+bool stratum_proxy_result(int64_t message_id, bool accepted)
+{
+    bool found = false;
+    if (PROXY_GLOBAL_STATE == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&proxy_lock);
+    for (int i = 0; i < PROXY_MAX_PENDING; i++) {
+        proxy_pending *share = &pending[i];
+        if (share->upstream_id == 0 || share->upstream_id != message_id) {
+            continue;
+        }
+        found = true;
+        // the slot may have gone to another miner since
+        if (clients[share->client].sock == share->sock) {
+            if (accepted) {
+                _send_result(share->client, share->downstream_id, "true");
+            } else {
+                _send_error(share->client, share->downstream_id, 23, "Rejected upstream");
+            }
+        }
+        share->upstream_id = 0;
+        break;
+    }
+    pthread_mutex_unlock(&proxy_lock);
+    return found;
+}
+
+int stratum_proxy_client_count(void)
+{
+    int count = 0;
+    if (PROXY_GLOBAL_STATE == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&proxy_lock);
+    for (int i = 0; i < PROXY_MAX_CLIENTS; i++) {
+        if (clients[i].sock >= 0 && clients[i].subscribed) {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&proxy_lock);
+    return count;
+}
@@ -0,0 +1,13 @@
+#ifndef STRATUM_PROXY_TASK_H_
+#define STRATUM_PROXY_TASK_H_
+
+void stratum_proxy_task(void *pvParameters);
+
+// hooks for the upstream Stratum V1 connection in stratum_task
+void stratum_proxy_upstream_subscribed(GlobalState *GLOBAL_STATE);
+void stratum_proxy_upstream_lost(void);
+void stratum_proxy_relay(const char *line, stratum_method method);
+bool stratum_proxy_result(int64_t message_id, bool accepted);
+int stratum_proxy_client_count(void);
+
+#endif
@@ -1,15 +1,25 @@
 #include "esp_log.h"
 // #include "addr_from_stdin.h"
+#include "block_template.h"
 #include "connect.h"
 #include "system.h"
 #include "global_state.h"
 #include "lwip/dns.h"
 #include <lwip/tcpip.h>
 #include "nvs_config.h"
+#include "pool_connect.h"
+#include "stratum_proxy_task.h"
 #include "stratum_task.h"
+#include "stratum_tls.h"
+#include "stratum_v2.h"
+#include "utils.h"
 #include "work_queue.h"
+#include "esp_app_desc.h"
+#include "esp_random.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include <esp_sntp.h>
+#include <pthread.h>
 #include <time.h>
 
 #define PORT CONFIG_STRATUM_PORT
@@ -25,14 +35,82 @@
 #define MAX_RETRY_ATTEMPTS 3
 #define MAX_CRITICAL_RETRY_ATTEMPTS 5
 
+// latency samples are smoothed with weight 1/8, like TCP's smoothed RTT
+#define LATENCY_SMOOTHING 8
+// how much lower another pool's latency must be before the chains move to it
+#define LATENCY_MARGIN_MS 20
+
+// reconnects back off exponentially between these, with jitter
+#define RECONNECT_BACKOFF_MIN_MS 500
+#define RECONNECT_BACKOFF_MAX_MS 30000
+
+// future jobs kept until their SetNewPrevHash arrives, pools send one or two
+#define SV2_MAX_FUTURE_JOBS 4
+// BIP320 general purpose bits, the only ones a standard channel or a solo block may roll
+#define BIP320_VERSION_ROLLING_MASK 0x1fffe000
+
+// templates recent jobs were built from, kept until no job can still point at them
+#define SOLO_MAX_TEMPLATES 2
+// found blocks waiting for the submit task, more than one at a time only on regtest
+#define SOLO_BLOCK_QUEUE_SIZE 4
+
 static const char * TAG = "stratum_task";
 
-static StratumApiV1Message stratum_api_v1_message = {};
+// One Stratum V1 pool and what mining needs to move onto it at once. Both pools stay
+// connected when the fallback is kept on hot standby
+typedef struct
+{
+    StratumConnection connection;
+    bool is_fallback;
+    StratumApiV1Message message;
+    char * extranonce_str;
+    int extranonce_2_len;
+    uint32_t difficulty;
+    uint32_t version_mask;
+    // the pool's latest mining.notify, NULL until it has sent work on this connection
+    char * last_notify;
+    // the block its jobs build on, to time it announcing new blocks against the other pool
+    char prev_hash[65];
+    // when its last connection dropped, until the next one brings a job
+    int64_t disconnected_us;
+} stratum_pool;
+
 static SystemTaskModule SYSTEM_TASK_MODULE = {.stratum_difficulty = 8192};
 
+static stratum_pool primary_pool = {.connection.sock = -1, .difficulty = 8192};
+static stratum_pool fallback_pool = {.connection.sock = -1, .is_fallback = true, .difficulty = 8192};
+// the pool the chains are working for, guarded by pool_lock along with both pools' state
+static stratum_pool * active_pool;
+// the pool that last dropped while active, failover time runs from then until another pool has the chains
+static stratum_pool * lost_pool;
+static int64_t pool_lost_us;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// the newest block either pool announced and when it first arrived
+static char newest_prev_hash[65];
+static int64_t newest_prev_hash_us;
+
 static const char * primary_stratum_url;
 static uint16_t primary_stratum_port;
 
+static gbt_node solo_node;
+static block_template * solo_templates[SOLO_MAX_TEMPLATES];
+static uint32_t solo_template_id;
+static char solo_extranonce_1[GBT_EXTRANONCE_1_LEN * 2 + 1];
+static pthread_mutex_t solo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// a solution as the result task found it, everything needed to rebuild the block from its template
+typedef struct
+{
+    uint32_t template_id;
+    char extranonce_2[GBT_EXTRANONCE_2_LEN * 2 + 1];
+    uint32_t ntime;
+    uint32_t nonce;
+    uint32_t version;
+} solo_block;
+
+// created with the first solo session, the submit task sends what's queued to the node
+static QueueHandle_t solo_blocks;
+
 bool is_wifi_connected() {
     wifi_ap_record_t ap_info;
     if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
@@ -47,46 +125,115 @@ void cleanQueue(GlobalState * GLOBAL_STATE) {
     GLOBAL_STATE->abandon_work = 1;
     queue_clear(&GLOBAL_STATE->stratum_queue);
 
-    pthread_mutex_lock(&GLOBAL_STATE->valid_jobs_lock);
     ASIC_jobs_queue_clear(&GLOBAL_STATE->ASIC_jobs_queue);
-    for (int i = 0; i < 128; i = i + 4) {
-        GLOBAL_STATE->valid_jobs[i] = 0;
+    for (int c = 0; c < GLOBAL_STATE->chain_count; c++) {
+        AsicChain * chain = &GLOBAL_STATE->chains[c];
+        pthread_mutex_lock(&chain->valid_jobs_lock);
+        for (int i = 0; i < 128; i = i + 4) {
+            chain->valid_jobs[i] = 0;
+        }
+        pthread_mutex_unlock(&chain->valid_jobs_lock);
     }
-    pthread_mutex_unlock(&GLOBAL_STATE->valid_jobs_lock);
 }
 
 void stratum_close_connection(GlobalState * GLOBAL_STATE)
 {
-    if (GLOBAL_STATE->sock < 0) {
+    // held until the queue is clean so a failover can't queue work that gets wiped here
+    pthread_mutex_lock(&pool_lock);
+    int sock = GLOBAL_STATE->connection->sock;
+    if (sock < 0) {
+        pthread_mutex_unlock(&pool_lock);
         ESP_LOGE(TAG, "Socket already shutdown, not shutting down again..");
         return;
     }
 
     ESP_LOGE(TAG, "Shutting down socket and restarting...");
-    shutdown(GLOBAL_STATE->sock, SHUT_RDWR);
-    close(GLOBAL_STATE->sock);
+    GLOBAL_STATE->connection->sock = -1;
+    if (GLOBAL_STATE->connection->tls != NULL) {
+        STRATUM_TLS_reset(GLOBAL_STATE->connection->tls, false);
+    }
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
     cleanQueue(GLOBAL_STATE);
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    stratum_proxy_upstream_lost();
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// a fallback is kept on hot standby only if both pools speak Stratum V1
+static bool _hot_standby(GlobalState * GLOBAL_STATE)
+{
+    SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
+    return module->fallback_pool_url != NULL && module->fallback_pool_url[0] != '\0' &&
+           module->pool_protocol == STRATUM_PROTOCOL_V1 && module->fallback_pool_protocol == STRATUM_PROTOCOL_V1;
+}
+
+// Exponentially weighted, the first sample is taken as is
+static void _smooth(float * value, uint32_t * samples, float sample)
+{
+    *value = (*samples)++ == 0 ? sample : *value + (sample - *value) / LATENCY_SMOOTHING;
+}
+
+static void _record_connect(GlobalState * GLOBAL_STATE, stratum_pool * pool, int64_t connect_us)
+{
+    PoolLatency * latency = &GLOBAL_STATE->SYSTEM_MODULE.pool_latency[pool->is_fallback];
+    pthread_mutex_lock(&pool_lock);
+    _smooth(&latency->connect_ms, &latency->connect_samples, connect_us / 1000.0f);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Called with pool_lock held once a connection to pool has brought its first job
+static void _record_reconnect(GlobalState * GLOBAL_STATE, stratum_pool * pool)
+{
+    if (pool->disconnected_us == 0) {
+        return;
+    }
+    PoolLatency * latency = &GLOBAL_STATE->SYSTEM_MODULE.pool_latency[pool->is_fallback];
+    latency->reconnect_ms = (esp_timer_get_time() - pool->disconnected_us) / 1000;
+    pool->disconnected_us = 0;
+    ESP_LOGI(TAG, "Work again %lu ms after the %s pool dropped", latency->reconnect_ms, pool->is_fallback ? "fallback" : "primary");
+}
+
+// Exponential with equal jitter, so units that lost the same pool don't all come back at once
+static void _backoff(int * attempt)
+{
+    uint32_t delay_ms = RECONNECT_BACKOFF_MIN_MS << (*attempt < 6 ? *attempt : 6);
+    if (delay_ms > RECONNECT_BACKOFF_MAX_MS) {
+        delay_ms = RECONNECT_BACKOFF_MAX_MS;
+    }
+    delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+    (*attempt)++;
+    ESP_LOGI(TAG, "Reconnecting in %lu ms", delay_ms);
+    vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+}
+
+// Times a TCP connect to a pool and hangs straight up. Returns false if it couldn't be reached
+static bool _probe_pool(GlobalState * GLOBAL_STATE, stratum_pool * pool, const char * url, uint16_t port)
+{
+    int64_t connect_us;
+    int sock = POOL_connect(url, port, POOL_CONNECT_TIMEOUT_MS, &connect_us);
+    if (sock < 0) {
+        ESP_LOGD(TAG, "Heartbeat. Failed connect check: %s:%d (%d)", url, port, sock);
+        return false;
+    }
+    _record_connect(GLOBAL_STATE, pool, connect_us);
+    shutdown(sock, SHUT_RDWR);
+    close(sock);
+    return true;
 }
 
+// Times a connect to both pools every minute, and moves back to the primary once it is
+// reachable again unless the fallback is on hot standby, which handles that by itself
 void stratum_primary_heartbeat(void * pvParameters)
 {
     GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
+    SystemModule * module = &GLOBAL_STATE->SYSTEM_MODULE;
+    bool hot_standby = _hot_standby(GLOBAL_STATE);
 
     ESP_LOGI(TAG, "Starting heartbeat thread for primary endpoint: %s", primary_stratum_url);
     vTaskDelay(10000 / portTICK_PERIOD_MS);
 
-    int addr_family = AF_INET;
-    int ip_protocol = IPPROTO_IP;
-
     while (1)
     {
-        if (GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback == false) {
-            vTaskDelay(10000 / portTICK_PERIOD_MS);
-            continue;
-        }
-
-        char host_ip[INET_ADDRSTRLEN];
         ESP_LOGD(TAG, "Running Heartbeat on: %s!", primary_stratum_url);
 
         if (!is_wifi_connected()) {
@@ -95,49 +242,677 @@ void stratum_primary_heartbeat(void * pvParameters)
             continue;
         }
 
-        struct hostent *primary_dns_addr = gethostbyname(primary_stratum_url);
-        if (primary_dns_addr == NULL) {
-            ESP_LOGD(TAG, "Heartbeat. Failed DNS check for: %s!", primary_stratum_url);
-            vTaskDelay(60000 / portTICK_PERIOD_MS);
-            continue;
+        bool primary_up = _probe_pool(GLOBAL_STATE, &primary_pool, primary_stratum_url, primary_stratum_port);
+        if (module->fallback_pool_url != NULL && module->fallback_pool_url[0] != '\0') {
+            _probe_pool(GLOBAL_STATE, &fallback_pool, module->fallback_pool_url, module->fallback_pool_port);
+        }
+
+        if (!hot_standby && primary_up && module->is_using_fallback) {
+            ESP_LOGI(TAG, "Heartbeat successful and in fallback mode. Switching back to primary.");
+            module->is_using_fallback = false;
+            STRATUM_V1_request_close(GLOBAL_STATE->connection);
         }
-        inet_ntop(AF_INET, (void *)primary_dns_addr->h_addr_list[0], host_ip, sizeof(host_ip));
+        vTaskDelay(60000 / portTICK_PERIOD_MS);
+    }
+}
 
-        struct sockaddr_in dest_addr;
-        dest_addr.sin_addr.s_addr = inet_addr(host_ip);
-        dest_addr.sin_family = AF_INET;
-        dest_addr.sin_port = htons(primary_stratum_port);
+// Queues a job for the job factory, dropping the oldest one if the queue is full
+static void _enqueue_notify(GlobalState * GLOBAL_STATE, mining_notify * notify)
+{
+    if (GLOBAL_STATE->stratum_queue.count == QUEUE_SIZE) {
+        mining_notify * next_notify_json_str = (mining_notify *) queue_dequeue(&GLOBAL_STATE->stratum_queue);
+        STRATUM_V1_free_mining_notify(next_notify_json_str);
+    }
 
-        int sock = socket(addr_family, SOCK_STREAM, ip_protocol);
-        if (sock < 0) {
-            ESP_LOGD(TAG, "Heartbeat. Failed socket create check!");
-            vTaskDelay(60000 / portTICK_PERIOD_MS);
-            close(sock);
-            continue;
+    notify->difficulty = SYSTEM_TASK_MODULE.stratum_difficulty;
+    queue_enqueue(&GLOBAL_STATE->stratum_queue, notify);
+}
+
+static void _set_v2_difficulty(const uint8_t * target)
+{
+    double difficulty = STRATUM_V2_target_to_difficulty(target);
+    SYSTEM_TASK_MODULE.stratum_difficulty = difficulty < 1 ? 1 : (difficulty > UINT32_MAX ? UINT32_MAX : difficulty);
+    ESP_LOGI(TAG, "Set stratum difficulty: %ld", SYSTEM_TASK_MODULE.stratum_difficulty);
+}
+
+// what the chains should do, the pool sizes the channel target from it
+static float _nominal_hashrate(GlobalState * GLOBAL_STATE)
+{
+    if (GLOBAL_STATE->SYSTEM_MODULE.current_hashrate > 0) {
+        return GLOBAL_STATE->SYSTEM_MODULE.current_hashrate * 1e9;
+    }
+    // a chain without chips isn't mining
+    uint32_t chips = 0;
+    for (uint8_t c = 0; c < GLOBAL_STATE->chain_count; c++) {
+        chips += GLOBAL_STATE->chains[c].chip_count;
+    }
+    return GLOBAL_STATE->POWER_MANAGEMENT_MODULE.frequency_value * 1e6 * BM1366_SMALL_CORE_COUNT * chips;
+}
+
+// Runs a plaintext Stratum V2 session on pool's open connection with one standard channel,
+// returns once the connection has been closed. Returns false if the pool never sent work
+static bool _stratum_v2_session(GlobalState * GLOBAL_STATE, stratum_pool * pool, const char * host, uint16_t port, const char * username)
+{
+    StratumApiV2Message message;
+    StratumApiV2Message prev_hash = {};
+    StratumApiV2Message future_jobs[SV2_MAX_FUTURE_JOBS] = {};
+    bool have_prev_hash = false;
+
+    GLOBAL_STATE->stratum_protocol = STRATUM_PROTOCOL_V2;
+    GLOBAL_STATE->stratum_v2_sequence = 0;
+    GLOBAL_STATE->version_mask = BIP320_VERSION_ROLLING_MASK;
+
+    STRATUM_V2_setup_connection(GLOBAL_STATE->connection, host, port, GLOBAL_STATE->asic_model_str, esp_app_get_description()->version);
+
+    while (1) {
+        if (STRATUM_V2_receive_message(GLOBAL_STATE->connection, &message) < 0) {
+            ESP_LOGE(TAG, "Failed to receive Stratum V2 message, reconnecting...");
+            stratum_close_connection(GLOBAL_STATE);
+            return have_prev_hash;
         }
 
-        int err = connect(sock, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in6));
-        if (err != 0)
-        {
-            ESP_LOGD(TAG, "Heartbeat. Failed connect check: %s:%d (errno %d: %s)", host_ip, primary_stratum_port, errno, strerror(errno));
+        switch (message.method) {
+            case STRATUM_V2_SETUP_SUCCESS:
+                ESP_LOGI(TAG, "Stratum V2 connection set up, opening channel for %s", username);
+                STRATUM_V2_open_standard_channel(GLOBAL_STATE->connection, 1, username, _nominal_hashrate(GLOBAL_STATE));
+                break;
+            case STRATUM_V2_CHANNEL_OPENED:
+                ESP_LOGI(TAG, "Stratum V2 channel %lu opened", message.channel_id);
+                GLOBAL_STATE->stratum_v2_channel_id = message.channel_id;
+                _set_v2_difficulty(message.target);
+                break;
+            case STRATUM_V2_SETUP_ERROR:
+            case STRATUM_V2_CHANNEL_ERROR:
+                ESP_LOGE(TAG, "Stratum V2 setup rejected: %s", message.error_code);
+                stratum_close_connection(GLOBAL_STATE);
+                return have_prev_hash;
+            case STRATUM_V2_NEW_JOB:
+                if (message.future_job) {
+                    future_jobs[message.job_id % SV2_MAX_FUTURE_JOBS] = message;
+                } else if (have_prev_hash) {
+                    _enqueue_notify(GLOBAL_STATE, STRATUM_V2_job_to_notify(&message, &prev_hash, message.min_ntime));
+                }
+                break;
+            case STRATUM_V2_NEW_PREV_HASH: {
+                prev_hash = message;
+                if (!have_prev_hash) {
+                    pthread_mutex_lock(&pool_lock);
+                    _record_reconnect(GLOBAL_STATE, pool);
+                    pthread_mutex_unlock(&pool_lock);
+                }
+                have_prev_hash = true;
+                SYSTEM_notify_new_ntime(GLOBAL_STATE, message.min_ntime);
+
+                // work on the old block is worthless from here on
+                cleanQueue(GLOBAL_STATE);
+                StratumApiV2Message * job = &future_jobs[message.job_id % SV2_MAX_FUTURE_JOBS];
+                if (job->method == STRATUM_V2_NEW_JOB && job->job_id == message.job_id) {
+                    _enqueue_notify(GLOBAL_STATE, STRATUM_V2_job_to_notify(job, &prev_hash, message.min_ntime));
+                }
+                memset(future_jobs, 0, sizeof(future_jobs));
+                break;
+            }
+            case STRATUM_V2_SET_TARGET:
+                _set_v2_difficulty(message.target);
+                break;
+            case STRATUM_V2_SHARES_ACCEPTED:
+                ESP_LOGI(TAG, "%lu share(s) accepted", message.accepted_count);
+                for (uint32_t i = 0; i < message.accepted_count; i++) {
+                    SYSTEM_notify_accepted_share(GLOBAL_STATE);
+                }
+                break;
+            case STRATUM_V2_SHARE_REJECTED:
+                ESP_LOGW(TAG, "share %lu rejected: %s", message.sequence_number, message.error_code);
+                SYSTEM_notify_rejected_share(GLOBAL_STATE, message.error_code);
+                break;
+            case STRATUM_V2_RECONNECT:
+                ESP_LOGE(TAG, "Pool requested client reconnect...");
+                stratum_close_connection(GLOBAL_STATE);
+                return have_prev_hash;
+            default:
+                break;
+        }
+    }
+}
+
+// Keeps a new template for submitblock in place of the oldest and queues its job.
+// Work on the old tip is dropped, a template for the same tip only adds transactions
+static void _publish_template(GlobalState * GLOBAL_STATE, block_template * tmpl)
+{
+    pthread_mutex_lock(&solo_lock);
+    bool new_block = solo_templates[0] == NULL || memcmp(solo_templates[0]->prev_hash, tmpl->prev_hash, 32) != 0;
+    if (solo_templates[SOLO_MAX_TEMPLATES - 1] != NULL) {
+        GBT_free_template(solo_templates[SOLO_MAX_TEMPLATES - 1]);
+    }
+    memmove(&solo_templates[1], &solo_templates[0], (SOLO_MAX_TEMPLATES - 1) * sizeof(block_template *));
+    solo_templates[0] = tmpl;
+    pthread_mutex_unlock(&solo_lock);
+
+    if (new_block) {
+        ESP_LOGI(TAG, "New block template at height %lu, %u transactions", tmpl->height, (unsigned) tmpl->tx_count);
+        cleanQueue(GLOBAL_STATE);
+    }
+    SYSTEM_notify_new_ntime(GLOBAL_STATE, tmpl->curtime);
+    _enqueue_notify(GLOBAL_STATE, GBT_template_to_notify(tmpl));
+}
+
+static void _clear_templates(void)
+{
+    pthread_mutex_lock(&solo_lock);
+    for (int i = 0; i < SOLO_MAX_TEMPLATES; i++) {
+        if (solo_templates[i] != NULL) {
+            GBT_free_template(solo_templates[i]);
+            solo_templates[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&solo_lock);
+}
+
+/// @brief hands a block found on job to the solo submit task, never waiting on the node
+void stratum_submit_block(GlobalState * GLOBAL_STATE, const bm_job * job, uint32_t nonce, uint32_t version)
+{
+    solo_block block = {.template_id = strtoul(job->jobid, NULL, 10), .ntime = job->ntime, .nonce = nonce, .version = version};
+    snprintf(block.extranonce_2, sizeof(block.extranonce_2), "%s", job->extranonce2);
+
+    if (solo_blocks == NULL || xQueueSend(solo_blocks, &block, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Unable to queue the block found on template %lu", block.template_id);
+        SYSTEM_notify_rejected_share(GLOBAL_STATE, "block not submitted");
+    }
+}
+
+// Submits found blocks to the node. The RPC can take GBT_RPC_TIMEOUT_S, long enough to back
+// the chains' results up if the result task made it
+static void _solo_submit_task(void * pvParameters)
+{
+    GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
+    solo_block block;
+
+    while (1) {
+        xQueueReceive(solo_blocks, &block, portMAX_DELAY);
+
+        bool accepted = false;
+        pthread_mutex_lock(&solo_lock);
+        block_template * tmpl = NULL;
+        for (int i = 0; i < SOLO_MAX_TEMPLATES; i++) {
+            if (solo_templates[i] != NULL && solo_templates[i]->id == block.template_id) {
+                tmpl = solo_templates[i];
+            }
+        }
+        if (tmpl != NULL) {
+            accepted = GBT_submit_block(&solo_node, tmpl, block.extranonce_2, block.version, block.ntime, block.nonce);
+        } else {
+            ESP_LOGE(TAG, "Block found on template %lu, which has already been dropped", block.template_id);
+        }
+        pthread_mutex_unlock(&solo_lock);
+
+        if (accepted) {
+            SYSTEM_notify_accepted_share(GLOBAL_STATE);
+        } else {
+            SYSTEM_notify_rejected_share(GLOBAL_STATE, "block rejected");
+        }
+    }
+}
+
+// Mines solo on a node's getblocktemplate, long polling for every template change.
+// Returns false if the node never handed out work
+static bool _solo_session(GlobalState * GLOBAL_STATE, const char * host, uint16_t port)
+{
+    bool fallback = GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback;
+    char * user = fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_USER, FALLBACK_STRATUM_USER) : nvs_config_get_string(NVS_CONFIG_STRATUM_USER, STRATUM_USER);
+    char * password = fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_PASS, FALLBACK_STRATUM_PW) : nvs_config_get_string(NVS_CONFIG_STRATUM_PASS, STRATUM_PW);
+    char * address = nvs_config_get_string(NVS_CONFIG_SOLO_ADDRESS, "");
+    uint8_t payout_script[GBT_MAX_SCRIPT_SIZE];
+    size_t payout_script_len;
+    char longpollid[GBT_LONGPOLL_ID_SIZE] = "";
+    char params[GBT_LONGPOLL_ID_SIZE + 48];
+    bool got_work = false;
+
+    pthread_mutex_lock(&solo_lock);
+    solo_node.host = host;
+    solo_node.port = port;
+    GBT_set_auth(&solo_node, user, password);
+    pthread_mutex_unlock(&solo_lock);
+    free(user);
+    free(password);
+
+    if (solo_blocks == NULL) {
+        solo_blocks = xQueueCreate(SOLO_BLOCK_QUEUE_SIZE, sizeof(solo_block));
+        xTaskCreate(_solo_submit_task, "solo submit", 8192, (void *) GLOBAL_STATE, 5, NULL);
+    }
+
+    ESP_LOGI(TAG, "Solo mining on http://%s:%d to %s", host, port, address);
+    bool have_script = GBT_get_payout_script(&solo_node, address, payout_script, &payout_script_len);
+    free(address);
+    if (!have_script) {
+        return false;
+    }
+
+    // the random extranonce_1 keeps units paying to the same address off each other's work
+    uint32_t extranonce_1 = esp_random();
+    bin2hex((uint8_t *) &extranonce_1, sizeof(extranonce_1), solo_extranonce_1, sizeof(solo_extranonce_1));
+    GLOBAL_STATE->stratum_protocol = STRATUM_PROTOCOL_SOLO;
+    GLOBAL_STATE->extranonce_str = solo_extranonce_1;
+    GLOBAL_STATE->extranonce_2_len = GBT_EXTRANONCE_2_LEN;
+    GLOBAL_STATE->version_mask = BIP320_VERSION_ROLLING_MASK;
+
+    while (fallback == GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback) {
+        if (longpollid[0] == '\0') {
+            snprintf(params, sizeof(params), "[{\"rules\":[\"segwit\"]}]");
+        } else {
+            snprintf(params, sizeof(params), "[{\"rules\":[\"segwit\"],\"longpollid\":\"%s\"}]", longpollid);
+        }
+
+        cJSON * root = GBT_rpc(&solo_node, "getblocktemplate", params, longpollid[0] != '\0' ? GBT_LONGPOLL_TIMEOUT_S : GBT_RPC_TIMEOUT_S);
+        if (root == NULL) {
+            if (longpollid[0] != '\0') {
+                // a long poll can outlast a quiet chain, fetch the template straight away to see if the node is there
+                longpollid[0] = '\0';
+                continue;
+            }
+            break;
+        }
+
+        block_template * tmpl = calloc(1, sizeof(block_template));
+        tmpl->id = ++solo_template_id;
+        bool parsed = GBT_parse_template(cJSON_GetObjectItem(root, "result"), payout_script, payout_script_len, solo_extranonce_1, tmpl);
+        cJSON_Delete(root);
+        if (!parsed) {
+            GBT_free_template(tmpl);
+            break;
+        }
+
+        got_work = true;
+        strcpy(longpollid, tmpl->longpollid);
+        _publish_template(GLOBAL_STATE, tmpl);
+    }
+
+    ESP_LOGE(TAG, "Solo mining session on %s ended", host);
+    cleanQueue(GLOBAL_STATE);
+    _clear_templates();
+    return got_work;
+}
+
+// Moves the chains onto pool and queues its latest job straight away. Called with pool_lock held
+static void _activate_pool(GlobalState * GLOBAL_STATE, stratum_pool * pool)
+{
+    char difficulty[80];
+
+    active_pool = pool;
+    GLOBAL_STATE->connection = &pool->connection;
+    GLOBAL_STATE->stratum_protocol = STRATUM_PROTOCOL_V1;
+    GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback = pool->is_fallback;
+    GLOBAL_STATE->extranonce_str = pool->extranonce_str;
+    GLOBAL_STATE->extranonce_2_len = pool->extranonce_2_len;
+    GLOBAL_STATE->version_mask = pool->version_mask;
+    SYSTEM_TASK_MODULE.stratum_difficulty = pool->difficulty;
+    ESP_LOGI(TAG, "Mining on the %s pool", pool->is_fallback ? "fallback" : "primary");
+
+    // the swarm's extranonce slices belonged to the other pool
+    stratum_proxy_upstream_lost();
+    stratum_proxy_upstream_subscribed(GLOBAL_STATE);
+    snprintf(difficulty, sizeof(difficulty), "{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[%lu]}", pool->difficulty);
+    stratum_proxy_relay(difficulty, MINING_SET_DIFFICULTY);
+
+    cleanQueue(GLOBAL_STATE);
+    StratumApiV1Message message = {};
+    STRATUM_V1_parse(&message, pool->last_notify);
+    if (message.method == MINING_NOTIFY) {
+        SYSTEM_notify_new_ntime(GLOBAL_STATE, message.mining_notification->ntime);
+        _enqueue_notify(GLOBAL_STATE, message.mining_notification);
+        stratum_proxy_relay(pool->last_notify, MINING_NOTIFY);
+    }
+
+    if (lost_pool != NULL && lost_pool != pool) {
+        GLOBAL_STATE->SYSTEM_MODULE.failover_count++;
+        GLOBAL_STATE->SYSTEM_MODULE.last_failover_ms = (esp_timer_get_time() - pool_lost_us) / 1000;
+        ESP_LOGW(TAG, "Failover took %lu ms", GLOBAL_STATE->SYSTEM_MODULE.last_failover_ms);
+    }
+    lost_pool = NULL;
+}
+
+// Called with pool_lock held once pool's connection is gone. If it was the active pool the
+// other one takes over with its cached job, or the chains stop until either has work again
+static void _pool_lost(GlobalState * GLOBAL_STATE, stratum_pool * pool)
+{
+    free(pool->last_notify);
+    pool->last_notify = NULL;
+    if (pool != active_pool) {
+        return;
+    }
+
+    lost_pool = pool;
+    pool_lost_us = esp_timer_get_time();
+    stratum_pool * other = pool->is_fallback ? &primary_pool : &fallback_pool;
+    if (other->last_notify != NULL) {
+        _activate_pool(GLOBAL_STATE, other);
+    } else {
+        // whichever pool sends work first takes over
+        active_pool = NULL;
+        cleanQueue(GLOBAL_STATE);
+        stratum_proxy_upstream_lost();
+    }
+}
+
+// Times pool announcing a new block against the other pool. Called with pool_lock held
+static void _time_new_block(GlobalState * GLOBAL_STATE, stratum_pool * pool, const char * prev_block_hash)
+{
+    if (strcmp(pool->prev_hash, prev_block_hash) == 0) {
+        return;
+    }
+    // the first job after connecting may build on a block the other pool announced long ago
+    bool timed = pool->prev_hash[0] != '\0';
+    snprintf(pool->prev_hash, sizeof(pool->prev_hash), "%s", prev_block_hash);
+
+    PoolLatency * latency = &GLOBAL_STATE->SYSTEM_MODULE.pool_latency[pool->is_fallback];
+    int64_t now_us = esp_timer_get_time();
+    if (strcmp(newest_prev_hash, prev_block_hash) != 0) {
+        snprintf(newest_prev_hash, sizeof(newest_prev_hash), "%s", prev_block_hash);
+        newest_prev_hash_us = now_us;
+        if (timed) {
+            _smooth(&latency->notify_delay_ms, &latency->notify_samples, 0);
+        }
+    } else if (timed) {
+        _smooth(&latency->notify_delay_ms, &latency->notify_samples, (now_us - newest_prev_hash_us) / 1000.0f);
+    }
+}
+
+// What a pool costs in stale work: how late its new blocks arrive plus the trip a share takes
+// to it, half the ack latency or half the connect RTT until a share has been acked. Returns
+// -1 if the pool hasn't been measured yet
+static float _effective_latency(GlobalState * GLOBAL_STATE, stratum_pool * pool)
+{
+    PoolLatency * latency = &GLOBAL_STATE->SYSTEM_MODULE.pool_latency[pool->is_fallback];
+    if (latency->ack_samples > 0) {
+        return latency->notify_delay_ms + latency->ack_ms / 2;
+    }
+    if (latency->connect_samples > 0) {
+        return latency->notify_delay_ms + latency->connect_ms / 2;
+    }
+    return -1;
+}
+
+// Whether pool, which just sent a job, should take the chains. Called with pool_lock held
+static bool _should_activate(GlobalState * GLOBAL_STATE, stratum_pool * pool, bool new_block)
+{
+    if (active_pool == NULL || active_pool->last_notify == NULL) {
+        return true;
+    }
+    if (GLOBAL_STATE->SYSTEM_MODULE.pool_selection != POOL_SELECTION_LATENCY) {
+        // the primary takes the chains back as soon as it has work, the fallback only when nothing else does
+        return !pool->is_fallback;
+    }
+
+    // moving drops the work in flight, so only on a new block and only for a clear gain
+    float latency = _effective_latency(GLOBAL_STATE, pool);
+    float active_latency = _effective_latency(GLOBAL_STATE, active_pool);
+    return new_block && latency >= 0 && active_latency >= 0 && latency + LATENCY_MARGIN_MS < active_latency;
+}
+
+// Counts a share's result against the chip that found it
+static void _count_chip_share(GlobalState * GLOBAL_STATE, const StratumPendingRequest * request, bool accepted)
+{
+    if (request->chain >= GLOBAL_STATE->chain_count) {
+        return;
+    }
+    AsicTaskModule * module = &GLOBAL_STATE->chains[request->chain].ASIC_TASK_MODULE;
+    if (request->chip >= module->chip_stats_len) {
+        return;
+    }
+    if (accepted) {
+        module->chip_stats[request->chip].shares_accepted++;
+    } else {
+        module->chip_stats[request->chip].shares_rejected++;
+    }
+}
+
+// Accounts for a result by the request it answers, NULL if that was given up on. Called with pool_lock held
+static void _resolve_result(GlobalState * GLOBAL_STATE, stratum_pool * pool, StratumApiV1Message * message,
+                            const StratumPendingRequest * request)
+{
+    if (request == NULL) {
+        // a request given up on, only shares are left unanswered that long
+        ESP_LOGW(TAG, "result %s for unknown request %lld", message->response_success ? "accepted" : "rejected", message->message_id);
+        if (stratum_proxy_result(message->message_id, message->response_success)) {
+            // a swarm miner's share, answered on its own connection
+        } else if (message->response_success) {
+            SYSTEM_notify_accepted_share(GLOBAL_STATE);
+        } else {
+            SYSTEM_notify_rejected_share(GLOBAL_STATE, message->error_message);
+        }
+        return;
+    }
+
+    int64_t ack_us = esp_timer_get_time() - request->sent_us;
+    if (request->type == STRATUM_REQUEST_SUBMIT || request->type == STRATUM_REQUEST_FORWARD) {
+        PoolLatency * latency = &GLOBAL_STATE->SYSTEM_MODULE.pool_latency[pool->is_fallback];
+        _smooth(&latency->ack_ms, &latency->ack_samples, ack_us / 1000.0f);
+        SYSTEM_notify_share_ack(GLOBAL_STATE, ack_us / 1000);
+    }
+
+    if (request->type == STRATUM_REQUEST_FORWARD) {
+        // a swarm miner's share, answered on its own connection
+        stratum_proxy_result(message->message_id, message->response_success);
+    } else if (request->type == STRATUM_REQUEST_SUBMIT) {
+        if (message->response_success) {
+            ESP_LOGI(TAG, "share accepted in %lld ms: job %s nonce %08lx diff %lu, chain %u chip %u", ack_us / 1000, request->job_id,
+                     request->nonce, request->difficulty, request->chain, request->chip);
+            SYSTEM_notify_accepted_share(GLOBAL_STATE);
+        } else {
+            ESP_LOGW(TAG, "share rejected in %lld ms (%s): job %s nonce %08lx diff %lu, chain %u chip %u", ack_us / 1000,
+                     message->error_message[0] != '\0' ? message->error_message : "no reason given", request->job_id, request->nonce,
+                     request->difficulty, request->chain, request->chip);
+            SYSTEM_notify_rejected_share(GLOBAL_STATE, message->error_message);
+        }
+        _count_chip_share(GLOBAL_STATE, request, message->response_success);
+    } else if (message->response_success) {
+        ESP_LOGI(TAG, "%s accepted", STRATUM_V1_request_name(request->type));
+    } else {
+        ESP_LOGE(TAG, "%s rejected: %s", STRATUM_V1_request_name(request->type), message->error_message);
+    }
+}
+
+// Handles one line from a pool. Everything is cached on the pool, only the active pool's
+// messages reach the chains and the swarm. Returns false if the pool asked for a reconnect
+static bool _process_v1_line(GlobalState * GLOBAL_STATE, stratum_pool * pool, const char * line)
+{
+    StratumApiV1Message * message = &pool->message;
+    bool keep_going = true;
+
+    STRATUM_V1_parse(message, line);
+
+    // a result is read by the request it answers, the id only says which one while it's pending
+    StratumPendingRequest request;
+    bool pending = message->method == STRATUM_RESULT && STRATUM_V1_take_pending(&pool->connection, message->message_id, &request);
+    if (pending && message->response_success) {
+        STRATUM_V1_parse_result(message, line, request.type);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    bool active = pool == active_pool;
+    if (message->method == MINING_NOTIFY) {
+        free(pool->last_notify);
+        pool->last_notify = strdup(line);
+        _record_reconnect(GLOBAL_STATE, pool);
+        _time_new_block(GLOBAL_STATE, pool, message->mining_notification->prev_block_hash);
+        if (active) {
+            SYSTEM_notify_new_ntime(GLOBAL_STATE, message->mining_notification->ntime);
+            if (message->should_abandon_work &&
+                (GLOBAL_STATE->stratum_queue.count > 0 || GLOBAL_STATE->ASIC_jobs_queue.count > 0)) {
+                cleanQueue(GLOBAL_STATE);
+            }
+            _enqueue_notify(GLOBAL_STATE, message->mining_notification);
+            stratum_proxy_relay(line, message->method);
+        } else {
+            STRATUM_V1_free_mining_notify(message->mining_notification);
+            if (_should_activate(GLOBAL_STATE, pool, message->should_abandon_work)) {
+                _activate_pool(GLOBAL_STATE, pool);
+            }
+        }
+    } else if (message->method == MINING_SET_DIFFICULTY) {
+        if (message->new_difficulty != pool->difficulty) {
+            pool->difficulty = message->new_difficulty;
+            ESP_LOGI(TAG, "Set %s stratum difficulty: %ld", pool->is_fallback ? "fallback" : "primary", pool->difficulty);
+        }
+        if (active) {
+            SYSTEM_TASK_MODULE.stratum_difficulty = pool->difficulty;
+            stratum_proxy_relay(line, message->method);
+        }
+    } else if (message->method == MINING_SET_VERSION_MASK || message->method == STRATUM_RESULT_VERSION_MASK) {
+        // 1fffe000
+        ESP_LOGI(TAG, "Set version mask: %08lx", message->version_mask);
+        pool->version_mask = message->version_mask;
+        if (active) {
+            GLOBAL_STATE->version_mask = pool->version_mask;
+            if (message->method == MINING_SET_VERSION_MASK) {
+                stratum_proxy_relay(line, message->method);
+            }
+        }
+    } else if (message->method == STRATUM_RESULT_SUBSCRIBE) {
+        pool->extranonce_str = message->extranonce_str;
+        pool->extranonce_2_len = message->extranonce_2_len;
+        if (active) {
+            GLOBAL_STATE->extranonce_str = pool->extranonce_str;
+            GLOBAL_STATE->extranonce_2_len = pool->extranonce_2_len;
+            stratum_proxy_upstream_subscribed(GLOBAL_STATE);
+        }
+    } else if (message->method == CLIENT_RECONNECT) {
+        ESP_LOGE(TAG, "Pool requested client reconnect...");
+        keep_going = false;
+    } else if (message->method == STRATUM_RESULT) {
+        _resolve_result(GLOBAL_STATE, pool, message, pending ? &request : NULL);
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    return keep_going;
+}
+
+// Subscribes and authorizes on pool's open socket, then works its messages until the
+// connection drops. The pool only gets the chains once it has sent a job. Returns false
+// if it never did
+static bool _stratum_v1_session(GlobalState * GLOBAL_STATE, stratum_pool * pool, int sock)
+{
+    pthread_mutex_lock(&pool_lock);
+    STRATUM_V1_reset_connection(&pool->connection, sock);
+    pool->version_mask = 0;
+    pool->prev_hash[0] = '\0';
+    pthread_mutex_unlock(&pool_lock);
+
+    ///// Start Stratum Action
+    // mining.subscribe - ID: 1
+    STRATUM_V1_subscribe(&pool->connection, GLOBAL_STATE->asic_model_str);
+
+    // mining.configure - ID: 2
+    STRATUM_V1_configure_version_rolling(&pool->connection, &pool->version_mask);
+
+    //mining.suggest_difficulty - ID: 3
+    STRATUM_V1_suggest_difficulty(&pool->connection, STRATUM_DIFFICULTY);
+
+    char * username = pool->is_fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_USER, FALLBACK_STRATUM_USER) : nvs_config_get_string(NVS_CONFIG_STRATUM_USER, STRATUM_USER);
+    char * password = pool->is_fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_PASS, FALLBACK_STRATUM_PW) : nvs_config_get_string(NVS_CONFIG_STRATUM_PASS, STRATUM_PW);
+
+    //mining.authorize - ID: 4
+    STRATUM_V1_authenticate(&pool->connection, username, password);
+    STRATUM_V1_set_worker(&pool->connection, username);
+    free(password);
+    free(username);
+
+    while (1) {
+        char * line = STRATUM_V1_receive_jsonrpc_line(&pool->connection);
+        if (!line) {
+            ESP_LOGE(TAG, "Failed to receive JSON-RPC line from the %s pool, reconnecting...", pool->is_fallback ? "fallback" : "primary");
+            break;
+        }
+        ESP_LOGI(TAG, "rx: %s", line); // debug incoming stratum messages
+        bool keep_going = _process_v1_line(GLOBAL_STATE, pool, line);
+        free(line);
+        if (!keep_going) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    // stratum_close_connection may already have closed it
+    if (pool->connection.tls != NULL) {
+        STRATUM_TLS_reset(pool->connection.tls, pool->connection.sock >= 0);
+    }
+    if (pool->connection.sock >= 0) {
+        shutdown(pool->connection.sock, SHUT_RDWR);
+        close(pool->connection.sock);
+        pool->connection.sock = -1;
+    }
+    bool got_work = pool->last_notify != NULL;
+    pool->disconnected_us = esp_timer_get_time();
+    _pool_lost(GLOBAL_STATE, pool);
+    pthread_mutex_unlock(&pool_lock);
+    return got_work;
+}
+
+// Connects to a pool, timing the connect and any TLS handshake on top of it. Returns the
+// socket, or one of the POOL_CONNECT_ errors
+static int _connect_pool(GlobalState * GLOBAL_STATE, stratum_pool * pool, const char * url, uint16_t port, bool tls)
+{
+    ESP_LOGI(TAG, "Connecting to: %s://%s:%d", tls ? "stratum+ssl" : "stratum+tcp", url, port);
+    int64_t connect_us;
+    int sock = POOL_connect(url, port, POOL_CONNECT_TIMEOUT_MS, &connect_us);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Socket unable to connect to %s:%d (%s)", url, port, sock == POOL_CONNECT_DNS_FAILED ? "DNS lookup failed" : "connect failed");
+        return sock;
+    }
+    _record_connect(GLOBAL_STATE, pool, connect_us);
+
+    if (tls) {
+        if (pool->connection.tls == NULL) {
+            pool->connection.tls = STRATUM_TLS_create();
+        }
+        int64_t handshake_us;
+        if (pool->connection.tls == NULL || !STRATUM_TLS_handshake(pool->connection.tls, sock, url, port, &handshake_us)) {
             close(sock);
-            vTaskDelay(60000 / portTICK_PERIOD_MS);
-            continue;
+            return POOL_CONNECT_FAILED;
         }
-        shutdown(sock, SHUT_RDWR);
-        close(sock);
+        pthread_mutex_lock(&pool_lock);
+        GLOBAL_STATE->SYSTEM_MODULE.pool_latency[pool->is_fallback].tls_handshake_ms = handshake_us / 1000;
+        pthread_mutex_unlock(&pool_lock);
+    }
 
-        if (GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback) {
-            ESP_LOGI(TAG, "Heartbeat successful and in fallback mode. Switching back to primary.");
-            GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback = false;
-            stratum_close_connection(GLOBAL_STATE);
-            vTaskDelay(60000 / portTICK_PERIOD_MS);
+    // no timeouts on the socket, sessions go non-blocking and time their own writes
+    return sock;
+}
+
+// Keeps the fallback pool subscribed and authorized next to the primary, with its
+// latest job cached, so the chains can move over the moment the primary drops
+static void stratum_standby_task(void * pvParameters)
+{
+    GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
+
+    int backoff_attempt = 0;
+
+    ESP_LOGI(TAG, "Keeping fallback pool %s on hot standby", GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_url);
+    while (1) {
+        if (!is_wifi_connected()) {
+            vTaskDelay(10000 / portTICK_PERIOD_MS);
             continue;
         }
-        vTaskDelay(60000 / portTICK_PERIOD_MS);
+
+        int sock = _connect_pool(GLOBAL_STATE, &fallback_pool, GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_url,
+                                 GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_port, GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_tls);
+        if (sock >= 0 && _stratum_v1_session(GLOBAL_STATE, &fallback_pool, sock)) {
+            backoff_attempt = 0;
+        }
+        _backoff(&backoff_attempt);
     }
 }
 
+// Points the chains at a pool that isn't Stratum V1, it only has work once its session sends some
+static void _use_pool(GlobalState * GLOBAL_STATE, stratum_pool * pool, int sock)
+{
+    pthread_mutex_lock(&pool_lock);
+    active_pool = pool;
+    STRATUM_V1_reset_connection(&pool->connection, sock);
+    GLOBAL_STATE->connection = &pool->connection;
+    pthread_mutex_unlock(&pool_lock);
+    cleanQueue(GLOBAL_STATE);
+}
+
 void stratum_task(void * pvParameters)
 {
     GlobalState * GLOBAL_STATE = (GlobalState *) pvParameters;
@@ -147,16 +922,15 @@ void stratum_task(void * pvParameters)
     char * stratum_url = GLOBAL_STATE->SYSTEM_MODULE.pool_url;
     uint16_t port = GLOBAL_STATE->SYSTEM_MODULE.pool_port;
 
-    STRATUM_V1_initialize_buffer();
-    char host_ip[INET_ADDRSTRLEN];
-    int addr_family = AF_INET;
-    int ip_protocol = IPPROTO_IP;
     int retry_attempts = 0;
     int retry_critical_attempts = 0;
-    struct timeval timeout = {};
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
+    int backoff_attempt = 0;
+    GLOBAL_STATE->connection = &primary_pool.connection;
 
+    bool hot_standby = _hot_standby(GLOBAL_STATE);
+    if (hot_standby) {
+        xTaskCreate(stratum_standby_task, "stratum standby", 8192, pvParameters, 5, NULL);
+    }
     xTaskCreate(stratum_primary_heartbeat, "stratum primary heartbeat", 4096, pvParameters, 1, NULL);
 
     ESP_LOGI(TAG, "Trying to get IP for URL: %s", stratum_url);
@@ -168,7 +942,7 @@ void stratum_task(void * pvParameters)
             continue;
         }
 
-        if (retry_attempts >= MAX_RETRY_ATTEMPTS)
+        if (!hot_standby && retry_attempts >= MAX_RETRY_ATTEMPTS)
         {
             if (GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_url == NULL || GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_url[0] == '\0') {
                 ESP_LOGI(TAG, "Unable to switch to fallback. No url configured. (retries: %d)...", retry_attempts);
@@ -182,133 +956,67 @@ void stratum_task(void * pvParameters)
             retry_attempts = 0;
         }
 
-        stratum_url = GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback ? GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_url : GLOBAL_STATE->SYSTEM_MODULE.pool_url;
-        port = GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback ? GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_port : GLOBAL_STATE->SYSTEM_MODULE.pool_port;
-
-        struct hostent *dns_addr = gethostbyname(stratum_url);
-        if (dns_addr == NULL) {
-            retry_attempts++;
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
+        // with a standby fallback this task only ever runs the primary
+        bool fallback = !hot_standby && GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback;
+        stratum_pool * pool = fallback ? &fallback_pool : &primary_pool;
+        stratum_url = fallback ? GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_url : GLOBAL_STATE->SYSTEM_MODULE.pool_url;
+        port = fallback ? GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_port : GLOBAL_STATE->SYSTEM_MODULE.pool_port;
+        uint16_t protocol = fallback ? GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_protocol : GLOBAL_STATE->SYSTEM_MODULE.pool_protocol;
+
+        // a node speaks JSON-RPC over HTTP, a connection per call rather than one held open
+        if (protocol == STRATUM_PROTOCOL_SOLO) {
+            _use_pool(GLOBAL_STATE, pool, -1);
+            if (_solo_session(GLOBAL_STATE, stratum_url, port)) {
+                retry_attempts = 0;
+                backoff_attempt = 0;
+            } else {
+                retry_attempts++;
+            }
+            _backoff(&backoff_attempt);
             continue;
         }
-        inet_ntop(AF_INET, (void *)dns_addr->h_addr_list[0], host_ip, sizeof(host_ip));
-
-        ESP_LOGI(TAG, "Connecting to: stratum+tcp://%s:%d (%s)", stratum_url, port, host_ip);
 
-        struct sockaddr_in dest_addr;
-        dest_addr.sin_addr.s_addr = inet_addr(host_ip);
-        dest_addr.sin_family = AF_INET;
-        dest_addr.sin_port = htons(port);
-
-        GLOBAL_STATE->sock = socket(addr_family, SOCK_STREAM, ip_protocol);
-        if (GLOBAL_STATE->sock < 0) {
-            ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        // only Stratum V1 runs over TLS, V2 has its own encryption
+        bool tls = fallback ? GLOBAL_STATE->SYSTEM_MODULE.fallback_pool_tls : GLOBAL_STATE->SYSTEM_MODULE.pool_tls;
+        if (tls && protocol != STRATUM_PROTOCOL_V1) {
+            ESP_LOGW(TAG, "stratum+ssl is only used with Stratum V1, connecting to %s without it", stratum_url);
+            tls = false;
+        }
+        int sock = _connect_pool(GLOBAL_STATE, pool, stratum_url, port, tls);
+        if (sock == POOL_CONNECT_SOCKET_FAILED) {
             if (++retry_critical_attempts > MAX_CRITICAL_RETRY_ATTEMPTS) {
                 ESP_LOGE(TAG, "Max retry attempts reached, restarting...");
                 esp_restart();
             }
-            vTaskDelay(5000 / portTICK_PERIOD_MS);
+            _backoff(&backoff_attempt);
             continue;
         }
-        retry_critical_attempts = 0;
-
-        ESP_LOGI(TAG, "Socket created, connecting to %s:%d", host_ip, port);
-        int err = connect(GLOBAL_STATE->sock, (struct sockaddr *)&dest_addr, sizeof(struct sockaddr_in6));
-        if (err != 0)
-        {
+        if (sock < 0) {
             retry_attempts++;
-            ESP_LOGE(TAG, "Socket unable to connect to %s:%d (errno %d: %s)", stratum_url, port, errno, strerror(errno));
-            // close the socket
-            shutdown(GLOBAL_STATE->sock, SHUT_RDWR);
-            close(GLOBAL_STATE->sock);
-            // instead of restarting, retry this every 5 seconds
-            vTaskDelay(5000 / portTICK_PERIOD_MS);
+            _backoff(&backoff_attempt);
             continue;
         }
+        retry_critical_attempts = 0;
         retry_attempts = 0;
 
-        if (setsockopt(GLOBAL_STATE->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) != 0) {
-            ESP_LOGE(TAG, "Fail to setsockopt SO_SNDTIMEO");
+        bool got_work;
+        if (protocol == STRATUM_PROTOCOL_V2) {
+            _use_pool(GLOBAL_STATE, pool, sock);
+            char * username = fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_USER, FALLBACK_STRATUM_USER) : nvs_config_get_string(NVS_CONFIG_STRATUM_USER, STRATUM_USER);
+            got_work = _stratum_v2_session(GLOBAL_STATE, pool, stratum_url, port, username);
+            free(username);
+            pthread_mutex_lock(&pool_lock);
+            pool->disconnected_us = esp_timer_get_time();
+            pthread_mutex_unlock(&pool_lock);
+        } else {
+            got_work = _stratum_v1_session(GLOBAL_STATE, pool, sock);
         }
 
-        STRATUM_V1_reset_uid();
-        cleanQueue(GLOBAL_STATE);
-
-        ///// Start Stratum Action
-        // mining.subscribe - ID: 1
-        STRATUM_V1_subscribe(GLOBAL_STATE->sock, GLOBAL_STATE->asic_model_str);
-
-        // mining.configure - ID: 2
-        STRATUM_V1_configure_version_rolling(GLOBAL_STATE->sock, &GLOBAL_STATE->version_mask);
-
-        //mining.suggest_difficulty - ID: 3
-        STRATUM_V1_suggest_difficulty(GLOBAL_STATE->sock, STRATUM_DIFFICULTY);
-
-        char * username = GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_USER, FALLBACK_STRATUM_USER) : nvs_config_get_string(NVS_CONFIG_STRATUM_USER, STRATUM_USER);
-        char * password = GLOBAL_STATE->SYSTEM_MODULE.is_using_fallback ? nvs_config_get_string(NVS_CONFIG_FALLBACK_STRATUM_PASS, FALLBACK_STRATUM_PW) : nvs_config_get_string(NVS_CONFIG_STRATUM_PASS, STRATUM_PW);
-
-        //mining.authorize - ID: 4
-        STRATUM_V1_authenticate(GLOBAL_STATE->sock, username, password);
-        free(password);
-        free(username);
-
-        while (1) {
-            char * line = STRATUM_V1_receive_jsonrpc_line(GLOBAL_STATE->sock);
-            if (!line) {
-                ESP_LOGE(TAG, "Failed to receive JSON-RPC line, reconnecting...");
-                stratum_close_connection(GLOBAL_STATE);
-                break;
-            }
-            ESP_LOGI(TAG, "rx: %s", line); // debug incoming stratum messages
-            STRATUM_V1_parse(&stratum_api_v1_message, line);
-            free(line);
-
-            if (stratum_api_v1_message.method == MINING_NOTIFY) {
-                SYSTEM_notify_new_ntime(GLOBAL_STATE, stratum_api_v1_message.mining_notification->ntime);
-                if (stratum_api_v1_message.should_abandon_work &&
-                    (GLOBAL_STATE->stratum_queue.count > 0 || GLOBAL_STATE->ASIC_jobs_queue.count > 0)) {
-                    cleanQueue(GLOBAL_STATE);
-                }
-                if (GLOBAL_STATE->stratum_queue.count == QUEUE_SIZE) {
-                    mining_notify * next_notify_json_str = (mining_notify *) queue_dequeue(&GLOBAL_STATE->stratum_queue);
-                    STRATUM_V1_free_mining_notify(next_notify_json_str);
-                }
-
-                stratum_api_v1_message.mining_notification->difficulty = SYSTEM_TASK_MODULE.stratum_difficulty;
-                queue_enqueue(&GLOBAL_STATE->stratum_queue, stratum_api_v1_message.mining_notification);
-            } else if (stratum_api_v1_message.method == MINING_SET_DIFFICULTY) {
-                if (stratum_api_v1_message.new_difficulty != SYSTEM_TASK_MODULE.stratum_difficulty) {
-                    SYSTEM_TASK_MODULE.stratum_difficulty = stratum_api_v1_message.new_difficulty;
-                    ESP_LOGI(TAG, "Set stratum difficulty: %ld", SYSTEM_TASK_MODULE.stratum_difficulty);
-                }
-            } else if (stratum_api_v1_message.method == MINING_SET_VERSION_MASK ||
-                    stratum_api_v1_message.method == STRATUM_RESULT_VERSION_MASK) {
-                // 1fffe000
-                ESP_LOGI(TAG, "Set version mask: %08lx", stratum_api_v1_message.version_mask);
-                GLOBAL_STATE->version_mask = stratum_api_v1_message.version_mask;
-            } else if (stratum_api_v1_message.method == STRATUM_RESULT_SUBSCRIBE) {
-                GLOBAL_STATE->extranonce_str = stratum_api_v1_message.extranonce_str;
-                GLOBAL_STATE->extranonce_2_len = stratum_api_v1_message.extranonce_2_len;
-            } else if (stratum_api_v1_message.method == CLIENT_RECONNECT) {
-                ESP_LOGE(TAG, "Pool requested client reconnect...");
-                stratum_close_connection(GLOBAL_STATE);
-                break;
-            } else if (stratum_api_v1_message.method == STRATUM_RESULT) {
-                if (stratum_api_v1_message.response_success) {
-                    ESP_LOGI(TAG, "message result accepted");
-                    SYSTEM_notify_accepted_share(GLOBAL_STATE);
-                } else {
-                    ESP_LOGW(TAG, "message result rejected");
-                    SYSTEM_notify_rejected_share(GLOBAL_STATE);
-                }
-            } else if (stratum_api_v1_message.method == STRATUM_RESULT_SETUP) {
-                if (stratum_api_v1_message.response_success) {
-                    ESP_LOGI(TAG, "setup message accepted");
-                } else {
-                    ESP_LOGE(TAG, "setup message rejected");
-                }
-            }
+        // a pool that hangs up before sending work backs off like one that can't be reached
+        if (got_work) {
+            backoff_attempt = 0;
         }
+        _backoff(&backoff_attempt);
     }
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
@@ -8,5 +8,6 @@ typedef struct
 
 void stratum_task(void *pvParameters);
 void stratum_close_connection(GlobalState * GLOBAL_STATE);
+void stratum_submit_block(GlobalState * GLOBAL_STATE, const bm_job * job, uint32_t nonce, uint32_t version);
 
 #endif
\ No newline at end of file